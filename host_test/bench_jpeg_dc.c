@@ -0,0 +1,178 @@
+// DC-only luma decode throughput, in MB/s of JPEG input.
+//
+//   bench_jpeg_dc [DIR] [--min-ms N]
+//
+// Decodes every .jpg/.jpeg in DIR, or a generated set at the camera's
+// frame sizes without one, repeating each file for at least min-ms.
+// Generated frames have random coefficients, so their entropy-coded data
+// is only roughly like a sensor's; point DIR at frames saved by the camera
+// for real numbers, and configure with -DHOST_TEST_SANITIZE=OFF. Files
+// the decoder does not support, e.g. progressive ones, are reported and
+// skipped.
+#include "esp_timer.h"
+#include "jpeg_dc.h"
+#include "jpeg_gen.h"
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define DEFAULT_MIN_MS 500
+#define MAX_FILES 256
+
+typedef struct {
+    char name[256];
+    uint8_t *data;
+    size_t len;
+} sample_t;
+
+static sample_t samples[MAX_FILES];
+static size_t sample_count = 0;
+
+static bool is_jpeg_name(const char *name) {
+    const char *ext = strrchr(name, '.');
+    return ext && (strcasecmp(ext, ".jpg") == 0 ||
+                   strcasecmp(ext, ".jpeg") == 0);
+}
+
+static int compare_samples(const void *a, const void *b) {
+    return strcmp(((const sample_t *)a)->name, ((const sample_t *)b)->name);
+}
+
+static int load_dir(const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        perror(dir_path);
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && sample_count < MAX_FILES) {
+        if (!is_jpeg_name(entry->d_name))
+            continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        FILE *f = fopen(path, "rb");
+        if (!f)
+            continue;
+        fseek(f, 0, SEEK_END);
+        long len = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        sample_t *s = &samples[sample_count];
+        s->data = len > 0 ? malloc(len) : NULL;
+        if (s->data && fread(s->data, 1, len, f) == (size_t)len) {
+            snprintf(s->name, sizeof(s->name), "%s", entry->d_name);
+            s->len = len;
+            sample_count++;
+        } else {
+            free(s->data);
+        }
+        fclose(f);
+    }
+    closedir(dir);
+    qsort(samples, sample_count, sizeof(samples[0]), compare_samples);
+    return 0;
+}
+
+static int generate(void) {
+    static const struct {
+        const char *name;
+        uint16_t width;
+        uint16_t height;
+        uint16_t restart_interval;
+    } sizes[] = {
+        {"vga", 640, 480, 0},
+        {"svga", 800, 600, 0},
+        {"hd", 1280, 720, 0},
+        {"uxga", 1600, 1200, 0},
+        {"uxga-dri", 1600, 1200, 100},
+    };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        jpeg_gen_config_t config = {.width = sizes[i].width,
+                                    .height = sizes[i].height,
+                                    .ncomp = 3,
+                                    .restart_interval =
+                                        sizes[i].restart_interval,
+                                    .ac_density = 1,
+                                    .seed = i + 1};
+        jpeg_gen_t gen;
+        if (jpeg_gen(&config, &gen) != 0)
+            return -1;
+        sample_t *s = &samples[sample_count++];
+        snprintf(s->name, sizeof(s->name), "%s.jpg", sizes[i].name);
+        s->data = gen.data;
+        s->len = gen.len;
+        free(gen.luma);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *dir = NULL;
+    uint32_t min_ms = DEFAULT_MIN_MS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--min-ms") == 0 && i + 1 < argc) {
+            min_ms = strtoul(argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-' && !dir) {
+            dir = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [DIR] [--min-ms N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (dir ? load_dir(dir) != 0 : generate() != 0)
+        return 1;
+    if (sample_count == 0) {
+        fprintf(stderr, "No JPEGs in %s\n", dir);
+        return 1;
+    }
+
+    printf("%-24s %8s %9s %9s %8s %8s\n", "file", "KB", "luma", "us/frame",
+           "MB/s", "fps");
+    uint64_t total_bytes = 0;
+    int64_t total_us = 0;
+    size_t skipped = 0;
+    for (size_t i = 0; i < sample_count; i++) {
+        sample_t *s = &samples[i];
+        uint16_t w, h;
+        esp_err_t err = jpeg_dc_get_size(s->data, s->len, &w, &h);
+        uint8_t *out = err == ESP_OK ? malloc((size_t)w * h) : NULL;
+        if (err == ESP_OK && !out)
+            err = ESP_ERR_NO_MEM;
+        if (err == ESP_OK)
+            err = jpeg_dc_luma(s->data, s->len, out, (size_t)w * h, &w, &h);
+        if (err != ESP_OK) {
+            printf("%-24s skipped: %s\n", s->name, esp_err_to_name(err));
+            free(out);
+            skipped++;
+            continue;
+        }
+
+        uint32_t frames = 0;
+        int64_t start = esp_timer_get_time();
+        int64_t elapsed;
+        do {
+            jpeg_dc_luma(s->data, s->len, out, (size_t)w * h, &w, &h);
+            frames++;
+            elapsed = esp_timer_get_time() - start;
+        } while (elapsed < (int64_t)min_ms * 1000);
+        free(out);
+
+        double us = (double)elapsed / frames;
+        char luma[16];
+        snprintf(luma, sizeof(luma), "%ux%u", w, h);
+        printf("%-24.24s %8.1f %9s %9.0f %8.1f %8.1f\n", s->name,
+               s->len / 1024.0, luma, us, s->len / us, 1e6 / us);
+        total_bytes += (uint64_t)s->len * frames;
+        total_us += elapsed;
+    }
+    if (total_us > 0)
+        printf("overall %.1f MB/s over %zu files\n",
+               (double)total_bytes / total_us, sample_count - skipped);
+
+    for (size_t i = 0; i < sample_count; i++)
+        free(samples[i].data);
+    // Generated frames are all baseline, so any skip is a decoder bug
+    return !dir && skipped ? 1 : 0;
+}
@@ -0,0 +1,207 @@
+// Per-save latency against the number of images already on the card, for
+// the flat and sharded layouts, through the real sd_card code on a FAT
+// image. One row per SD_CARD_SHARD_SIZE images, so every sharded row
+// starts on an empty shard and rows compare like for like. Images past
+// the last full row are saved but not reported.
+//
+//   bench_save_latency IMAGE [--images N] [--size-mb N]
+//
+// IMAGE is replaced for each layout. The flat layout searches one growing
+// directory on every save and is slow to run past 20000 or so images; FAT
+// also caps a directory at 65536 entries. Exits non-zero if sharded saves
+// read noticeably more sectors in the last row than in the first.
+#include "esp_timer.h"
+#include "host_sd.h"
+#include "nvs_flash.h"
+#include "nvs_storage.h"
+#include "sd_bench.h"
+#include "sd_card.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_IMAGES 20000
+#define MIN_SIZE_MB 512
+
+typedef struct {
+    uint32_t *lat;
+    uint64_t *read_sectors; // Cumulative, after each save
+    uint64_t *write_sectors;
+    uint32_t done;
+    uint32_t failed;
+    int64_t last_us;
+} progress_t;
+
+typedef struct {
+    uint32_t p50_us;
+    uint32_t p99_us;
+    double reads; // Sectors per save
+    double writes;
+} row_t;
+
+static uint8_t image[SD_BENCH_SMALL_FILE_SIZE];
+
+// Runs on the writer task, like the on-device save benchmark
+static void save_done(const uint8_t *data, size_t len, esp_err_t result,
+                      void *ctx) {
+    progress_t *progress = ctx;
+    int64_t now = esp_timer_get_time();
+    host_sd_stats_t stats;
+    host_sd_get_stats(&stats);
+    if (result != ESP_OK)
+        progress->failed++;
+    progress->lat[progress->done] = now - progress->last_us;
+    progress->read_sectors[progress->done] = stats.read_sectors;
+    progress->write_sectors[progress->done] = stats.write_sectors;
+    progress->done++;
+    progress->last_us = now;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void summarize(progress_t *progress, uint32_t from, uint32_t to,
+                      row_t *row) {
+    uint32_t n = to - from;
+    uint64_t reads_before = from ? progress->read_sectors[from - 1] : 0;
+    uint64_t writes_before = from ? progress->write_sectors[from - 1] : 0;
+    row->reads = (double)(progress->read_sectors[to - 1] - reads_before) / n;
+    row->writes =
+        (double)(progress->write_sectors[to - 1] - writes_before) / n;
+    qsort(progress->lat + from, n, sizeof(uint32_t), compare_u32);
+    row->p50_us = progress->lat[from + n / 2];
+    row->p99_us = progress->lat[from + (uint32_t)((uint64_t)n * 99 / 100)];
+}
+
+// Saves count images on a fresh card, first at image number 1
+static esp_err_t run_layout(const char *path, uint32_t size_mb,
+                            sd_card_layout_t layout, uint32_t count,
+                            row_t *rows) {
+    sd_card_config_t config = {.layout = layout};
+    unlink(path);
+    nvs_flash_erase();
+    esp_err_t err = host_sd_attach(path, size_mb);
+    if (err == ESP_OK)
+        err = sd_card_init(&config);
+    if (err == ESP_OK)
+        err = sd_card_flush(30000);
+    if (err != ESP_OK)
+        return err;
+
+    progress_t progress = {
+        .lat = malloc(count * sizeof(uint32_t)),
+        .read_sectors = malloc(count * sizeof(uint64_t)),
+        .write_sectors = malloc(count * sizeof(uint64_t))};
+    if (!progress.lat || !progress.read_sectors || !progress.write_sectors) {
+        err = ESP_ERR_NO_MEM;
+        goto done;
+    }
+    // Numbering starts at 1, so the first shard holds one image fewer
+    uint32_t first_row = SD_CARD_SHARD_SIZE - 1;
+    host_sd_reset_stats();
+    progress.last_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        if (sd_card_queue_image(image, sizeof(image), save_done, &progress,
+                                10000) != ESP_OK)
+            err = ESP_ERR_TIMEOUT;
+    }
+    // progress is on this stack, so wait out every queued save
+    while (sd_card_flush(30000) != ESP_OK)
+        ;
+    if (err == ESP_OK && progress.failed)
+        err = ESP_FAIL;
+    if (err == ESP_OK) {
+        summarize(&progress, 0, first_row, &rows[0]);
+        for (uint32_t from = first_row, r = 1;
+             from + SD_CARD_SHARD_SIZE <= count;
+             from += SD_CARD_SHARD_SIZE, r++)
+            summarize(&progress, from, from + SD_CARD_SHARD_SIZE, &rows[r]);
+    }
+
+done:
+    free(progress.lat);
+    free(progress.read_sectors);
+    free(progress.write_sectors);
+    sd_card_deinit();
+    host_sd_detach();
+    unlink(path);
+    return err;
+}
+
+static int usage(const char *prog) {
+    fprintf(stderr, "usage: %s IMAGE [--images N] [--size-mb N]\n", prog);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2)
+        return usage(argv[0]);
+    const char *path = argv[1];
+    uint32_t count = DEFAULT_IMAGES;
+    uint32_t size_mb = 0;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--images") == 0)
+            count = strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--size-mb") == 0)
+            size_mb = strtoul(argv[i + 1], NULL, 10);
+        else
+            return usage(argv[0]);
+    }
+    if (argc % 2 != 0 || count < SD_CARD_SHARD_SIZE)
+        return usage(argv[0]);
+    if (size_mb == 0) {
+        size_mb = (uint64_t)count * sizeof(image) * 3 / 2 / (1024 * 1024);
+        if (size_mb < MIN_SIZE_MB)
+            size_mb = MIN_SIZE_MB;
+    }
+
+    for (size_t i = 0; i < sizeof(image); i++)
+        image[i] = i * 31;
+    image[0] = 0xFF;
+    image[1] = 0xD8;
+    if (nvs_storage_init() != ESP_OK)
+        return 1;
+
+    uint32_t row_count = (count + 1) / SD_CARD_SHARD_SIZE;
+    row_t *flat = calloc(row_count, sizeof(row_t));
+    row_t *sharded = calloc(row_count, sizeof(row_t));
+    if (!flat || !sharded)
+        return 1;
+    esp_err_t err =
+        run_layout(path, size_mb, SD_CARD_LAYOUT_FLAT, count, flat);
+    if (err == ESP_OK)
+        err = run_layout(path, size_mb, SD_CARD_LAYOUT_SHARDED, count,
+                         sharded);
+    if (err != ESP_OK) {
+        fprintf(stderr, "Saving failed: %s\n", esp_err_to_name(err));
+        return 1;
+    }
+
+    printf("%" PRIu32 " images of %zu bytes, %" PRIu32 " MB image\n", count,
+           sizeof(image), size_mb);
+    printf("%-8s %26s   %26s\n", "", "flat", "sharded");
+    printf("%-8s %6s %6s %6s %6s   %6s %6s %6s %6s\n", "images", "p50us",
+           "p99us", "rd/sv", "wr/sv", "p50us", "p99us", "rd/sv", "wr/sv");
+    for (uint32_t r = 0; r < row_count; r++) {
+        uint32_t from = r ? r * SD_CARD_SHARD_SIZE : 1;
+        printf("%-8" PRIu32 " %6" PRIu32 " %6" PRIu32 " %6.0f %6.0f   %6" PRIu32
+               " %6" PRIu32 " %6.0f %6.0f\n",
+               from, flat[r].p50_us, flat[r].p99_us, flat[r].reads,
+               flat[r].writes, sharded[r].p50_us, sharded[r].p99_us,
+               sharded[r].reads, sharded[r].writes);
+    }
+
+    // The root directory gains an entry per shard, so allow a little
+    bool ok = sharded[row_count - 1].reads <= sharded[0].reads * 1.1 + 1;
+    free(flat);
+    free(sharded);
+    if (!ok) {
+        fprintf(stderr, "Sharded saves slow down as the card fills\n");
+        return 1;
+    }
+    return 0;
+}
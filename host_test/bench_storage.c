@@ -0,0 +1,121 @@
+// Runs the sd_bench_storage workloads (save, remount with counter restore
+// and catalog rebuild, list, read and remove) through the real sd_card
+// code against a FAT image in a regular file.
+//
+//   bench_storage IMAGE [--images N] [--layout flat|sharded]
+//                 [--engine files|log] [--size-mb N] [--fresh]
+//
+// IMAGE is created sparse if missing and formatted on first mount. With
+// --fresh any existing image is replaced. Timings are host timings; the
+// sector counts are what a card would have seen.
+#include "esp_log.h"
+#include "host_sd.h"
+#include "nvs_storage.h"
+#include "sd_bench.h"
+#include "sd_card.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_IMAGES 50000
+#define MIN_SIZE_MB 2048
+
+static int usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s IMAGE [--images N] [--layout flat|sharded]\n"
+            "       [--engine files|log] [--size-mb N] [--fresh]\n",
+            prog);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2)
+        return usage(argv[0]);
+    const char *image = argv[1];
+    uint32_t count = DEFAULT_IMAGES;
+    uint32_t size_mb = 0;
+    bool fresh = false;
+    sd_card_config_t config = {.layout = SD_CARD_LAYOUT_SHARDED};
+
+    for (int i = 2; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--fresh") == 0) {
+            fresh = true;
+            continue;
+        }
+        if (!val)
+            return usage(argv[0]);
+        i++;
+        if (strcmp(arg, "--images") == 0) {
+            count = strtoul(val, NULL, 10);
+        } else if (strcmp(arg, "--size-mb") == 0) {
+            size_mb = strtoul(val, NULL, 10);
+        } else if (strcmp(arg, "--layout") == 0 &&
+                   strcmp(val, "flat") == 0) {
+            config.layout = SD_CARD_LAYOUT_FLAT;
+        } else if (strcmp(arg, "--layout") == 0 &&
+                   strcmp(val, "sharded") == 0) {
+            config.layout = SD_CARD_LAYOUT_SHARDED;
+        } else if (strcmp(arg, "--engine") == 0 &&
+                   strcmp(val, "files") == 0) {
+            config.engine = SD_CARD_ENGINE_FILES;
+        } else if (strcmp(arg, "--engine") == 0 &&
+                   strcmp(val, "log") == 0) {
+            config.engine = SD_CARD_ENGINE_LOG;
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (count == 0)
+        return usage(argv[0]);
+
+    // Room for every image plus FAT and directory overhead
+    uint32_t data_mb =
+        (uint64_t)count * SD_BENCH_SMALL_FILE_SIZE / (1024 * 1024) + 1;
+    if (size_mb == 0) {
+        size_mb = data_mb + data_mb / 2;
+        if (size_mb < MIN_SIZE_MB)
+            size_mb = MIN_SIZE_MB;
+    }
+    if (config.engine == SD_CARD_ENGINE_LOG)
+        config.log_size_mb = data_mb + data_mb / 4 + 1;
+
+    if (fresh)
+        unlink(image);
+    if (host_sd_attach(image, size_mb) != ESP_OK) {
+        fprintf(stderr, "Cannot attach %s\n", image);
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0); // Keep order with the log on stderr
+    esp_log_level_set("sd_bench", ESP_LOG_INFO);
+    if (nvs_storage_init() != ESP_OK || sd_card_init(&config) != ESP_OK) {
+        fprintf(stderr, "Cannot mount %s\n", image);
+        return 1;
+    }
+
+    printf("%" PRIu32 " images, %s layout, %s engine, %" PRIu32
+           " MB image\n",
+           count, config.layout == SD_CARD_LAYOUT_FLAT ? "flat" : "sharded",
+           config.engine == SD_CARD_ENGINE_LOG ? "log" : "files", size_mb);
+    host_sd_reset_stats();
+    sd_bench_storage_result_t result;
+    esp_err_t err = sd_bench_storage(&config, count, &result);
+
+    host_sd_stats_t stats;
+    host_sd_get_stats(&stats);
+    printf("card I/O: %" PRIu64 " reads (%" PRIu64 " sectors), %" PRIu64
+           " writes (%" PRIu64 " sectors), %" PRIu64 " syncs\n",
+           stats.read_ops, stats.read_sectors, stats.write_ops,
+           stats.write_sectors, stats.syncs);
+
+    sd_card_deinit();
+    host_sd_detach();
+    if (err != ESP_OK) {
+        fprintf(stderr, "Benchmark failed: %s\n", esp_err_to_name(err));
+        return 1;
+    }
+    return 0;
+}
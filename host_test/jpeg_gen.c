@@ -0,0 +1,255 @@
+#include "jpeg_gen.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Annex K.3 luminance tables, used for every component
+static const uint8_t dc_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1,
+                                    1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const uint8_t ac_bits[16] = {0, 2, 1, 3, 3, 2, 4,    3,
+                                    5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t ac_vals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+    0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+    0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+typedef struct {
+    uint16_t code[256];
+    uint8_t size[256];
+} enc_table_t;
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    uint32_t acc;
+    int nbits;
+} writer_t;
+
+static void build_enc(enc_table_t *t, const uint8_t *bits,
+                      const uint8_t *vals) {
+    int code = 0, k = 0;
+    for (int len = 1; len <= 16; len++) {
+        for (int i = 0; i < bits[len - 1]; i++, k++, code++) {
+            t->code[vals[k]] = code;
+            t->size[vals[k]] = len;
+        }
+        code <<= 1;
+    }
+}
+
+static void put_byte(writer_t *w, uint8_t b) {
+    if (w->len == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 4096;
+        w->buf = realloc(w->buf, w->cap);
+    }
+    w->buf[w->len++] = b;
+}
+
+static void put_u16(writer_t *w, uint16_t v) {
+    put_byte(w, v >> 8);
+    put_byte(w, v & 0xFF);
+}
+
+static void put_bits(writer_t *w, uint32_t v, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        w->acc = (w->acc << 1) | ((v >> i) & 1);
+        if (++w->nbits == 8) {
+            put_byte(w, w->acc);
+            if (w->acc == 0xFF)
+                put_byte(w, 0x00);
+            w->acc = 0;
+            w->nbits = 0;
+        }
+    }
+}
+
+// Pads the last byte with ones, as the standard asks before a marker
+static void flush_bits(writer_t *w) {
+    while (w->nbits)
+        put_bits(w, 1, 1);
+}
+
+static int bit_size(int v) {
+    int n = 0;
+    for (int a = v < 0 ? -v : v; a; a >>= 1)
+        n++;
+    return n;
+}
+
+static void put_value(writer_t *w, const enc_table_t *t, int symbol_base,
+                      int v) {
+    int s = bit_size(v);
+    put_bits(w, t->code[symbol_base | s], t->size[symbol_base | s]);
+    if (s)
+        put_bits(w, v < 0 ? v + (1 << s) - 1 : v, s);
+}
+
+static uint32_t next_rand(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+static void put_block(writer_t *w, const enc_table_t *dc,
+                      const enc_table_t *ac, int diff, uint8_t density,
+                      uint32_t *rng) {
+    put_value(w, dc, 0, diff);
+
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        if (next_rand(rng) % 64 >= density) {
+            run++;
+            continue;
+        }
+        int v = (int)(next_rand(rng) % 1023) + 1;
+        if (next_rand(rng) & 1)
+            v = -v;
+        for (; run > 15; run -= 16)
+            put_bits(w, ac->code[0xF0], ac->size[0xF0]);
+        put_value(w, ac, run << 4, v);
+        run = 0;
+    }
+    if (run)
+        put_bits(w, ac->code[0x00], ac->size[0x00]); // EOB
+}
+
+static void put_dht(writer_t *w, uint8_t class_id, const uint8_t *bits,
+                    const uint8_t *vals, int nvals) {
+    put_byte(w, class_id);
+    for (int i = 0; i < 16; i++)
+        put_byte(w, bits[i]);
+    for (int i = 0; i < nvals; i++)
+        put_byte(w, vals[i]);
+}
+
+static uint8_t dc_pixel(int pred, int q) {
+    int v = ((pred * q + 4) >> 3) + 128;
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+int jpeg_gen(const jpeg_gen_config_t *config, jpeg_gen_t *out) {
+    if (config->ncomp != 1 && config->ncomp != 3)
+        return -1;
+
+    enc_table_t dc, ac;
+    memset(&dc, 0, sizeof(dc));
+    memset(&ac, 0, sizeof(ac));
+    build_enc(&dc, dc_bits, dc_vals);
+    build_enc(&ac, ac_bits, ac_vals);
+
+    int q = config->dc_quant ? config->dc_quant : 8;
+    uint16_t bw = (config->width + 7) / 8;
+    uint16_t bh = (config->height + 7) / 8;
+    out->luma_width = bw;
+    out->luma_height = bh;
+    out->luma = malloc((size_t)bw * bh);
+
+    writer_t w = {0};
+    put_u16(&w, 0xFFD8);
+
+    put_u16(&w, 0xFFDB);
+    put_u16(&w, 67);
+    put_byte(&w, 0x00);
+    put_byte(&w, q);
+    for (int i = 1; i < 64; i++)
+        put_byte(&w, 1);
+
+    put_u16(&w, 0xFFC0);
+    put_u16(&w, 8 + 3 * config->ncomp);
+    put_byte(&w, 8);
+    put_u16(&w, config->height);
+    put_u16(&w, config->width);
+    put_byte(&w, config->ncomp);
+    for (int i = 0; i < config->ncomp; i++) {
+        put_byte(&w, i + 1);
+        put_byte(&w, i == 0 && config->ncomp == 3 ? 0x22 : 0x11);
+        put_byte(&w, 0);
+    }
+
+    put_u16(&w, 0xFFC4);
+    put_u16(&w, 2 + 17 + sizeof(dc_vals) + 17 + sizeof(ac_vals));
+    put_dht(&w, 0x00, dc_bits, dc_vals, sizeof(dc_vals));
+    put_dht(&w, 0x10, ac_bits, ac_vals, sizeof(ac_vals));
+
+    if (config->restart_interval) {
+        put_u16(&w, 0xFFDD);
+        put_u16(&w, 4);
+        put_u16(&w, config->restart_interval);
+    }
+
+    put_u16(&w, 0xFFDA);
+    put_u16(&w, 6 + 2 * config->ncomp);
+    put_byte(&w, config->ncomp);
+    for (int i = 0; i < config->ncomp; i++) {
+        put_byte(&w, i + 1);
+        put_byte(&w, 0x00);
+    }
+    put_byte(&w, 0);
+    put_byte(&w, 63);
+    put_byte(&w, 0);
+
+    // Grayscale scans code blocks in raster order; 4:2:0 MCUs hold four
+    // luma blocks then one of each chroma
+    bool interleaved = config->ncomp == 3;
+    uint32_t mcus_x = interleaved ? (config->width + 15) / 16 : bw;
+    uint32_t mcus_y = interleaved ? (config->height + 15) / 16 : bh;
+    uint32_t mcus = mcus_x * mcus_y;
+    uint32_t rng = config->seed;
+    int pred[3] = {0};
+    uint32_t restarts = 0;
+
+    for (uint32_t m = 0; m < mcus; m++) {
+        if (config->restart_interval && m > 0 &&
+            m % config->restart_interval == 0) {
+            flush_bits(&w);
+            put_byte(&w, 0xFF);
+            put_byte(&w, 0xD0 + (restarts++ & 7));
+            memset(pred, 0, sizeof(pred));
+        }
+        uint32_t mx = m % mcus_x;
+        uint32_t my = m / mcus_x;
+        for (int c = 0; c < config->ncomp; c++) {
+            int blocks = interleaved && c == 0 ? 4 : 1;
+            for (int b = 0; b < blocks; b++) {
+                // Stays well inside the 11-bit DC range and 8-bit output
+                int value = (int)(next_rand(&rng) % 31) - 15;
+                if (config->dc_step && c == 0)
+                    value = pred[c] + config->dc_step;
+                int diff = value - pred[c];
+                pred[c] = value;
+                put_block(&w, &dc, &ac, diff, config->ac_density, &rng);
+                if (c != 0)
+                    continue;
+                uint32_t x = interleaved ? mx * 2 + (b & 1) : mx;
+                uint32_t y = interleaved ? my * 2 + (b >> 1) : my;
+                if (x < bw && y < bh)
+                    out->luma[y * bw + x] = dc_pixel(value, q);
+            }
+        }
+    }
+    flush_bits(&w);
+    put_u16(&w, 0xFFD9);
+
+    out->data = realloc(w.buf, w.len);
+    out->len = w.len;
+    return 0;
+}
+
+void jpeg_gen_free(jpeg_gen_t *gen) {
+    free(gen->data);
+    free(gen->luma);
+    gen->data = NULL;
+    gen->luma = NULL;
+}
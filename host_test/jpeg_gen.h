@@ -0,0 +1,32 @@
+#ifndef JPEG_GEN_H
+#define JPEG_GEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal baseline JPEG encoder for tests. Coefficients are random rather
+// than transformed pixels, so the luma DC of every block is known exactly.
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint8_t ncomp;            // 1 for grayscale, 3 for 4:2:0 YCbCr
+    uint16_t restart_interval;
+    uint8_t ac_density;       // Chance in 64 of each AC coefficient being set
+    uint8_t dc_quant;
+    int16_t dc_step;          // Nonzero codes every luma DC difference as this
+    uint32_t seed;
+} jpeg_gen_config_t;
+
+typedef struct {
+    uint8_t *data; // malloc'd, exactly len bytes
+    size_t len;
+    // What jpeg_dc_luma should produce, one pixel per luma block
+    uint8_t *luma;
+    uint16_t luma_width;
+    uint16_t luma_height;
+} jpeg_gen_t;
+
+int jpeg_gen(const jpeg_gen_config_t *config, jpeg_gen_t *out);
+void jpeg_gen_free(jpeg_gen_t *gen);
+
+#endif
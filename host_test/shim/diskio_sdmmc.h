@@ -0,0 +1,10 @@
+#ifndef DISKIO_SDMMC_H
+#define DISKIO_SDMMC_H
+
+#include "driver/sdmmc_host.h"
+#include <stdint.h>
+
+// FatFs drive number the card is registered as
+uint8_t ff_diskio_get_pdrv_card(const sdmmc_card_t *card);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef SDMMC_HOST_H
+#define SDMMC_HOST_H
+
+// Host stand-in for the SDMMC host driver and card types. Nothing here
+// touches hardware; the card is the image attached with host_sd_attach.
+
+#include "esp_err.h"
+#include <stdint.h>
+
+#define SDMMC_HOST_FLAG_1BIT (1 << 0)
+#define SDMMC_HOST_FLAG_4BIT (1 << 1)
+#define SDMMC_HOST_FLAG_8BIT (1 << 2)
+#define SDMMC_HOST_FLAG_DDR (1 << 4)
+
+#define SDMMC_FREQ_DEFAULT 20000
+#define SDMMC_FREQ_HIGHSPEED 40000
+#define SDMMC_FREQ_PROBING 400
+#define SDMMC_FREQ_52M 52000
+#define SDMMC_FREQ_26M 26000
+
+#define SDMMC_HOST_SLOT_1 1
+#define SDMMC_SLOT_NO_CD (-1)
+#define SDMMC_SLOT_NO_WP (-1)
+#define SDMMC_SLOT_WIDTH_DEFAULT 0
+
+typedef struct {
+    uint32_t flags;
+    int slot;
+    int max_freq_khz;
+} sdmmc_host_t;
+
+typedef struct {
+    int clk;
+    int cmd;
+    int d0;
+    int d1;
+    int d2;
+    int d3;
+    int cd;
+    int wp;
+    uint8_t width;
+    uint32_t flags;
+} sdmmc_slot_config_t;
+
+typedef struct {
+    sdmmc_host_t host;
+    uint32_t max_freq_khz;
+    int real_freq_khz;
+    uint32_t log_bus_width;
+} sdmmc_card_t;
+
+#define SDMMC_HOST_DEFAULT()                                                   \
+    {                                                                          \
+        .flags = SDMMC_HOST_FLAG_8BIT | SDMMC_HOST_FLAG_4BIT |                 \
+                 SDMMC_HOST_FLAG_1BIT | SDMMC_HOST_FLAG_DDR,                   \
+        .slot = SDMMC_HOST_SLOT_1, .max_freq_khz = SDMMC_FREQ_DEFAULT,         \
+    }
+
+#define SDMMC_SLOT_CONFIG_DEFAULT()                                            \
+    {                                                                          \
+        .cd = SDMMC_SLOT_NO_CD, .wp = SDMMC_SLOT_NO_WP,                        \
+        .width = SDMMC_SLOT_WIDTH_DEFAULT,                                     \
+    }
+
+#endif
@@ -0,0 +1,56 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+
+#define MAX_TAGS 16
+
+static struct {
+    const char *tag;
+    esp_log_level_t level;
+} tags[MAX_TAGS];
+static int tag_count = 0;
+static esp_log_level_t default_level = ESP_LOG_WARN;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+    pthread_mutex_lock(&log_lock);
+    if (strcmp(tag, "*") == 0) {
+        default_level = level;
+        tag_count = 0;
+    } else {
+        int i = 0;
+        while (i < tag_count && strcmp(tags[i].tag, tag) != 0)
+            i++;
+        if (i < MAX_TAGS) {
+            tags[i].tag = tag;
+            tags[i].level = level;
+            if (i == tag_count)
+                tag_count++;
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format,
+                   ...) {
+    static const char letters[] = "-EWIDV";
+
+    pthread_mutex_lock(&log_lock);
+    esp_log_level_t limit = default_level;
+    for (int i = 0; i < tag_count; i++) {
+        if (strcmp(tags[i].tag, tag) == 0)
+            limit = tags[i].level;
+    }
+    if (level <= limit) {
+        va_list args;
+        va_start(args, format);
+        fprintf(stderr, "%c (%lld) %s: ", letters[level],
+                (long long)(esp_timer_get_time() / 1000), tag);
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+        va_end(args);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,22 @@
+#include "esp_rom_crc.h"
+#include <pthread.h>
+
+static uint32_t table[256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void build_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c >> 1) ^ (0xEDB88320u & -(c & 1));
+        table[i] = c;
+    }
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len) {
+    pthread_once(&table_once, build_table);
+    crc = ~crc;
+    while (len--)
+        crc = (crc >> 8) ^ table[(crc ^ *buf++) & 0xFF];
+    return ~crc;
+}
@@ -0,0 +1,37 @@
+#ifndef ESP_VFS_FAT_H
+#define ESP_VFS_FAT_H
+
+// Host stand-in for the IDF FAT VFS. Mounting puts the FatFs stand-in over
+// the image attached with host_sd_attach and registers base_path with the
+// POSIX routing in host_vfs.h.
+
+#include "driver/sdmmc_host.h"
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    bool format_if_mount_failed;
+    int max_files; // Files open at once, further opens fail with ENFILE
+    size_t allocation_unit_size;
+    bool disk_status_check_enable;
+    bool use_one_fat;
+} esp_vfs_fat_mount_config_t;
+
+typedef esp_vfs_fat_mount_config_t esp_vfs_fat_sdmmc_mount_config_t;
+
+esp_err_t esp_vfs_fat_sdmmc_mount(
+    const char *base_path, const sdmmc_host_t *host_config,
+    const void *slot_config,
+    const esp_vfs_fat_sdmmc_mount_config_t *mount_config,
+    sdmmc_card_t **out_card);
+esp_err_t esp_vfs_fat_sdcard_unmount(const char *base_path,
+                                     sdmmc_card_t *card);
+esp_err_t esp_vfs_fat_info(const char *base_path, uint64_t *out_total_bytes,
+                           uint64_t *out_free_bytes);
+esp_err_t esp_vfs_fat_create_contiguous_file(const char *base_path,
+                                             const char *full_path,
+                                             uint64_t size, bool alloc_now);
+
+#endif
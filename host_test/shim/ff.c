@@ -0,0 +1,1434 @@
+#include "ff.h"
+#include "diskio.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define SS FF_MAX_SS
+#define DIR_ENTRY_SIZE 32
+#define MAX_DIR (65536 * DIR_ENTRY_SIZE) // Entries FAT allows in a directory
+#define MAX_FAT16 0xFFF5
+#define MAX_FAT32 0x0FFFFFF5
+#define END_OF_CHAIN 0x0FFFFFFF
+#define DELETED 0xE5
+#define AM_VOL 0x08
+#define AM_MASK 0x3F
+
+// Directory entry fields
+#define DIR_Name 0
+#define DIR_Attr 11
+#define DIR_CrtTime 14
+#define DIR_FstClusHI 20
+#define DIR_ModTime 22
+#define DIR_FstClusLO 26
+#define DIR_FileSize 28
+
+// Boot sector and FSInfo fields
+#define BPB_BytsPerSec 11
+#define BPB_SecPerClus 13
+#define BPB_RsvdSecCnt 14
+#define BPB_NumFATs 16
+#define BPB_TotSec32 32
+#define BPB_FATSz32 36
+#define BPB_RootClus32 44
+#define BPB_FSInfo32 48
+#define BS_FilSysType32 82
+#define FSI_StrucSig 484
+#define FSI_Free_Count 488
+#define FSI_Nxt_Free 492
+#define BS_55AA 510
+
+// fn[11] flags
+#define NS_LAST 0x04   // Last segment of the path
+#define NS_NONAME 0x80 // Path named the root directory itself
+
+// FIL flags beyond the FA_ mode bits
+#define FA_SEEKEND 0x20
+#define FA_MODIFIED 0x40
+#define FA_DIRTY 0x80
+
+#define LEAVE_FF(res)                                                          \
+    do {                                                                       \
+        pthread_mutex_unlock(&ff_lock);                                        \
+        return res;                                                            \
+    } while (0)
+
+static FATFS *volumes[FF_VOLUMES];
+static WORD mount_id = 0;
+// FF_FS_REENTRANT: one lock serialises every call, as a single volume does
+static pthread_mutex_t ff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static WORD ld_word(const BYTE *p) { return p[0] | p[1] << 8; }
+
+static DWORD ld_dword(const BYTE *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (DWORD)p[3] << 24;
+}
+
+static void st_word(BYTE *p, WORD v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void st_dword(BYTE *p, DWORD v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static FRESULT sync_window(FATFS *fs) {
+    if (!fs->wflag)
+        return FR_OK;
+    if (disk_write(fs->pdrv, fs->win, fs->winsect, 1) != RES_OK)
+        return FR_DISK_ERR;
+    // Mirror FAT sectors into the second FAT
+    if (fs->n_fats == 2 && fs->winsect - fs->fatbase < fs->fsize &&
+        disk_write(fs->pdrv, fs->win, fs->winsect + fs->fsize, 1) != RES_OK)
+        return FR_DISK_ERR;
+    fs->wflag = 0;
+    return FR_OK;
+}
+
+static FRESULT move_window(FATFS *fs, LBA_t sect) {
+    if (sect == fs->winsect)
+        return FR_OK;
+    FRESULT res = sync_window(fs);
+    if (res != FR_OK)
+        return res;
+    if (disk_read(fs->pdrv, fs->win, sect, 1) != RES_OK) {
+        fs->winsect = (LBA_t)-1;
+        return FR_DISK_ERR;
+    }
+    fs->winsect = sect;
+    return FR_OK;
+}
+
+static FRESULT sync_fs(FATFS *fs) {
+    FRESULT res = sync_window(fs);
+    if (res != FR_OK)
+        return res;
+    if (fs->fsi_flag & 1) {
+        memset(fs->win, 0, SS);
+        st_dword(fs->win, 0x41615252);
+        st_dword(fs->win + FSI_StrucSig, 0x61417272);
+        st_dword(fs->win + FSI_Free_Count, fs->free_clst);
+        st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);
+        st_word(fs->win + BS_55AA, 0xAA55);
+        fs->winsect = fs->volbase + 1;
+        if (disk_write(fs->pdrv, fs->win, fs->winsect, 1) != RES_OK)
+            return FR_DISK_ERR;
+        fs->fsi_flag = 0;
+    }
+    return disk_ioctl(fs->pdrv, CTRL_SYNC, NULL) == RES_OK ? FR_OK
+                                                           : FR_DISK_ERR;
+}
+
+static LBA_t clst2sect(const FATFS *fs, DWORD clst) {
+    clst -= 2;
+    if (clst >= fs->n_fatent - 2)
+        return 0;
+    return fs->database + (LBA_t)fs->csize * clst;
+}
+
+// Returns the next cluster, 1 for a bad argument or 0xFFFFFFFF on a disk
+// error
+static DWORD get_fat(FATFS *fs, DWORD clst) {
+    if (clst < 2 || clst >= fs->n_fatent)
+        return 1;
+    if (move_window(fs, fs->fatbase + clst / (SS / 4)) != FR_OK)
+        return 0xFFFFFFFF;
+    return ld_dword(fs->win + clst % (SS / 4) * 4) & 0x0FFFFFFF;
+}
+
+static FRESULT put_fat(FATFS *fs, DWORD clst, DWORD val) {
+    if (clst < 2 || clst >= fs->n_fatent)
+        return FR_INT_ERR;
+    FRESULT res = move_window(fs, fs->fatbase + clst / (SS / 4));
+    if (res != FR_OK)
+        return res;
+    BYTE *p = fs->win + clst % (SS / 4) * 4;
+    st_dword(p, (val & 0x0FFFFFFF) | (ld_dword(p) & 0xF0000000));
+    fs->wflag = 1;
+    return FR_OK;
+}
+
+// Frees the chain from clst on, ending the chain at pclst if given
+static FRESULT remove_chain(FATFS *fs, DWORD clst, DWORD pclst) {
+    if (clst < 2 || clst >= fs->n_fatent)
+        return FR_INT_ERR;
+    if (pclst != 0) {
+        FRESULT res = put_fat(fs, pclst, END_OF_CHAIN);
+        if (res != FR_OK)
+            return res;
+    }
+    do {
+        DWORD nxt = get_fat(fs, clst);
+        if (nxt == 0)
+            break;
+        if (nxt == 1)
+            return FR_INT_ERR;
+        if (nxt == 0xFFFFFFFF)
+            return FR_DISK_ERR;
+        FRESULT res = put_fat(fs, clst, 0);
+        if (res != FR_OK)
+            return res;
+        if (fs->free_clst < fs->n_fatent - 2) {
+            fs->free_clst++;
+            fs->fsi_flag |= 1;
+        }
+        clst = nxt;
+    } while (clst < fs->n_fatent);
+    return FR_OK;
+}
+
+// Follows clst if it already has a successor, otherwise links a new
+// cluster after it (or starts a new chain for 0). Returns 0 when the
+// volume is full, 1 or 0xFFFFFFFF on errors.
+static DWORD create_chain(FATFS *fs, DWORD clst) {
+    DWORD scl;
+    if (clst == 0) {
+        scl = fs->last_clst;
+        if (scl == 0 || scl >= fs->n_fatent)
+            scl = 1;
+    } else {
+        DWORD cs = get_fat(fs, clst);
+        if (cs < 2)
+            return 1;
+        if (cs == 0xFFFFFFFF || cs < fs->n_fatent)
+            return cs;
+        scl = clst;
+    }
+    if (fs->free_clst == 0)
+        return 0;
+
+    DWORD ncl = scl;
+    while (true) {
+        if (++ncl >= fs->n_fatent) {
+            ncl = 2;
+            if (ncl > scl)
+                return 0;
+        }
+        DWORD cs = get_fat(fs, ncl);
+        if (cs == 0)
+            break;
+        if (cs == 1 || cs == 0xFFFFFFFF)
+            return cs;
+        if (ncl == scl)
+            return 0;
+    }
+
+    if (put_fat(fs, ncl, END_OF_CHAIN) != FR_OK ||
+        (clst != 0 && put_fat(fs, clst, ncl) != FR_OK))
+        return 0xFFFFFFFF;
+    fs->last_clst = ncl;
+    if (fs->free_clst <= fs->n_fatent - 2)
+        fs->free_clst--;
+    fs->fsi_flag |= 1;
+    return ncl;
+}
+
+static DWORD ld_clust(const BYTE *dir) {
+    return ld_word(dir + DIR_FstClusLO) |
+           (DWORD)ld_word(dir + DIR_FstClusHI) << 16;
+}
+
+static void st_clust(BYTE *dir, DWORD clst) {
+    st_word(dir + DIR_FstClusLO, clst);
+    st_word(dir + DIR_FstClusHI, clst >> 16);
+}
+
+// Zeroes a new directory cluster through the window
+static FRESULT dir_clear(FATFS *fs, DWORD clst) {
+    FRESULT res = sync_window(fs);
+    if (res != FR_OK)
+        return res;
+    LBA_t sect = clst2sect(fs, clst);
+    memset(fs->win, 0, SS);
+    for (UINT i = 0; i < fs->csize; i++) {
+        if (disk_write(fs->pdrv, fs->win, sect + i, 1) != RES_OK)
+            return FR_DISK_ERR;
+    }
+    fs->winsect = sect;
+    return FR_OK;
+}
+
+static FRESULT dir_sdi(FF_DIR *dp, DWORD ofs) {
+    FATFS *fs = dp->obj.fs;
+    if (ofs >= MAX_DIR || ofs % DIR_ENTRY_SIZE)
+        return FR_INT_ERR;
+    dp->dptr = ofs;
+    DWORD clst = dp->obj.sclust;
+    DWORD csz = (DWORD)fs->csize * SS;
+    while (ofs >= csz) {
+        clst = get_fat(fs, clst);
+        if (clst == 0xFFFFFFFF)
+            return FR_DISK_ERR;
+        if (clst < 2 || clst >= fs->n_fatent)
+            return FR_INT_ERR;
+        ofs -= csz;
+    }
+    dp->clust = clst;
+    dp->sect = clst2sect(fs, clst);
+    if (dp->sect == 0)
+        return FR_INT_ERR;
+    dp->sect += ofs / SS;
+    dp->ofs = ofs % SS;
+    return FR_OK;
+}
+
+// Moves to the next entry, growing the directory by a cluster when
+// stretch is set. FR_NO_FILE at the end, FR_DENIED when it cannot grow.
+static FRESULT dir_next(FF_DIR *dp, bool stretch) {
+    FATFS *fs = dp->obj.fs;
+    DWORD ofs = dp->dptr + DIR_ENTRY_SIZE;
+    if (ofs >= MAX_DIR)
+        dp->sect = 0;
+    if (dp->sect == 0)
+        return FR_NO_FILE;
+
+    if (ofs % SS == 0) {
+        dp->sect++;
+        if ((ofs / SS) % fs->csize == 0) {
+            DWORD clst = get_fat(fs, dp->clust);
+            if (clst <= 1)
+                return FR_INT_ERR;
+            if (clst == 0xFFFFFFFF)
+                return FR_DISK_ERR;
+            if (clst >= fs->n_fatent) {
+                if (!stretch) {
+                    dp->sect = 0;
+                    return FR_NO_FILE;
+                }
+                clst = create_chain(fs, dp->clust);
+                if (clst == 0)
+                    return FR_DENIED;
+                if (clst == 1)
+                    return FR_INT_ERR;
+                if (clst == 0xFFFFFFFF)
+                    return FR_DISK_ERR;
+                FRESULT res = dir_clear(fs, clst);
+                if (res != FR_OK)
+                    return res;
+            }
+            dp->clust = clst;
+            dp->sect = clst2sect(fs, clst);
+        }
+    }
+    dp->dptr = ofs;
+    dp->ofs = ofs % SS;
+    return FR_OK;
+}
+
+static BYTE *dir_entry(FF_DIR *dp) { return dp->obj.fs->win + dp->ofs; }
+
+// First free entry from the start, the way FatFs looks for one
+static FRESULT dir_alloc(FF_DIR *dp) {
+    FRESULT res = dir_sdi(dp, 0);
+    while (res == FR_OK) {
+        res = move_window(dp->obj.fs, dp->sect);
+        if (res != FR_OK)
+            break;
+        BYTE c = dir_entry(dp)[DIR_Name];
+        if (c == DELETED || c == 0)
+            return FR_OK;
+        res = dir_next(dp, true);
+    }
+    return res == FR_NO_FILE ? FR_DENIED : res;
+}
+
+// Next visible entry, skipping deleted, dot, volume label and LFN entries
+static FRESULT dir_read(FF_DIR *dp) {
+    FRESULT res = FR_NO_FILE;
+    while (dp->sect) {
+        res = move_window(dp->obj.fs, dp->sect);
+        if (res != FR_OK)
+            break;
+        const BYTE *dir = dir_entry(dp);
+        BYTE c = dir[DIR_Name];
+        if (c == 0) {
+            res = FR_NO_FILE;
+            break;
+        }
+        BYTE a = dir[DIR_Attr] & AM_MASK;
+        if (c != DELETED && c != '.' && !(a & AM_VOL))
+            return FR_OK;
+        res = dir_next(dp, false);
+        if (res != FR_OK)
+            break;
+    }
+    if (res != FR_OK)
+        dp->sect = 0;
+    return res;
+}
+
+static FRESULT dir_find(FF_DIR *dp) {
+    FRESULT res = dir_sdi(dp, 0);
+    while (res == FR_OK) {
+        res = move_window(dp->obj.fs, dp->sect);
+        if (res != FR_OK)
+            break;
+        const BYTE *dir = dir_entry(dp);
+        BYTE c = dir[DIR_Name];
+        if (c == 0)
+            return FR_NO_FILE;
+        BYTE a = dir[DIR_Attr] & AM_MASK;
+        if (c != DELETED && !(a & AM_VOL) &&
+            memcmp(dir, dp->fn, 11) == 0)
+            return FR_OK;
+        res = dir_next(dp, false);
+    }
+    return res;
+}
+
+static FRESULT dir_register(FF_DIR *dp) {
+    FRESULT res = dir_alloc(dp);
+    if (res == FR_OK)
+        res = move_window(dp->obj.fs, dp->sect);
+    if (res != FR_OK)
+        return res;
+    BYTE *dir = dir_entry(dp);
+    memset(dir, 0, DIR_ENTRY_SIZE);
+    memcpy(dir + DIR_Name, dp->fn, 11);
+    dp->obj.fs->wflag = 1;
+    return FR_OK;
+}
+
+static FRESULT dir_remove(FF_DIR *dp) {
+    FRESULT res = move_window(dp->obj.fs, dp->sect);
+    if (res != FR_OK)
+        return res;
+    dir_entry(dp)[DIR_Name] = DELETED;
+    dp->obj.fs->wflag = 1;
+    return FR_OK;
+}
+
+static void get_fileinfo(FF_DIR *dp, FILINFO *fno) {
+    const BYTE *dir = dir_entry(dp);
+    UINT j = 0;
+    for (UINT i = 0; i < 11; i++) {
+        BYTE c = dir[i];
+        if (c == ' ')
+            continue;
+        if (i == 8)
+            fno->fname[j++] = '.';
+        fno->fname[j++] = i == 0 && c == 0x05 ? (char)DELETED : (char)c;
+    }
+    fno->fname[j] = '\0';
+    fno->fattrib = dir[DIR_Attr] & AM_MASK;
+    fno->fsize = ld_dword(dir + DIR_FileSize);
+    fno->ftime = ld_word(dir + DIR_ModTime);
+    fno->fdate = ld_word(dir + DIR_ModTime + 2);
+}
+
+// Parses one path segment into dp->fn as a space padded 8.3 name
+static FRESULT create_name(FF_DIR *dp, const TCHAR **path) {
+    const char *p = *path;
+    BYTE *sfn = dp->fn;
+    memset(sfn, ' ', 11);
+    UINT i = 0, ni = 8;
+    while (true) {
+        BYTE c = (BYTE)*p;
+        if (c == '\0' || c == '/' || c == '\\')
+            break;
+        p++;
+        if (c == '.' && ni == 8 && i > 0) {
+            i = 8;
+            ni = 11;
+            continue;
+        }
+        if (c <= ' ' || c >= 0x7F || strchr("\"*+,.:;<=>?[]|", c) ||
+            i >= ni)
+            return FR_INVALID_NAME;
+        if (c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+        sfn[i++] = c;
+    }
+    if (sfn[0] == ' ' || (ni == 11 && i == 8))
+        return FR_INVALID_NAME;
+    if (sfn[0] == DELETED)
+        sfn[0] = 0x05;
+
+    while (*p == '/' || *p == '\\')
+        p++;
+    sfn[11] = *p == '\0' ? NS_LAST : 0;
+    *path = p;
+    return FR_OK;
+}
+
+// Leaves dp on the entry the path names, or on the root with NS_NONAME
+static FRESULT follow_path(FF_DIR *dp, const TCHAR *path) {
+    FATFS *fs = dp->obj.fs;
+    while (*path == '/' || *path == '\\')
+        path++;
+    dp->obj.sclust = fs->dirbase;
+    if (*path == '\0') {
+        dp->fn[11] = NS_NONAME;
+        return dir_sdi(dp, 0);
+    }
+    while (true) {
+        FRESULT res = create_name(dp, &path);
+        if (res == FR_OK)
+            res = dir_find(dp);
+        BYTE ns = dp->fn[11];
+        if (res != FR_OK) {
+            if (res == FR_NO_FILE && !(ns & NS_LAST))
+                res = FR_NO_PATH;
+            return res;
+        }
+        if (ns & NS_LAST)
+            return FR_OK;
+        const BYTE *dir = dir_entry(dp);
+        if (!(dir[DIR_Attr] & AM_DIR))
+            return FR_NO_PATH;
+        dp->obj.sclust = ld_clust(dir);
+        // ".." back to the root is stored as cluster 0
+        if (dp->obj.sclust == 0)
+            dp->obj.sclust = fs->dirbase;
+    }
+}
+
+static int get_ldnumber(const TCHAR **path) {
+    const TCHAR *p = *path;
+    if (p[0] >= '0' && p[0] <= '9' && p[1] == ':') {
+        int vol = p[0] - '0';
+        *path = p + 2;
+        return vol < FF_VOLUMES ? vol : -1;
+    }
+    return 0;
+}
+
+static bool check_fs(const BYTE *bs) {
+    return ld_word(bs + BS_55AA) == 0xAA55 &&
+           memcmp(bs + BS_FilSysType32, "FAT32   ", 8) == 0 &&
+           ld_word(bs + BPB_BytsPerSec) == SS;
+}
+
+// Finds the volume the path names, mounting it on first use
+static FRESULT mount_volume(const TCHAR **path, FATFS **rfs) {
+    int vol = get_ldnumber(path);
+    if (vol < 0)
+        return FR_INVALID_DRIVE;
+    FATFS *fs = volumes[vol];
+    if (!fs)
+        return FR_NOT_ENABLED;
+    *rfs = fs;
+    if (fs->fs_type && !(disk_status(fs->pdrv) & STA_NOINIT))
+        return FR_OK;
+
+    fs->fs_type = 0;
+    fs->pdrv = vol;
+    if (disk_initialize(fs->pdrv) & STA_NOINIT)
+        return FR_NOT_READY;
+    fs->winsect = (LBA_t)-1;
+    fs->wflag = 0;
+    fs->volbase = 0;
+    if (move_window(fs, 0) != FR_OK)
+        return FR_DISK_ERR;
+    const BYTE *bs = fs->win;
+    if (!check_fs(bs))
+        return FR_NO_FILESYSTEM;
+
+    fs->csize = bs[BPB_SecPerClus];
+    fs->n_fats = bs[BPB_NumFATs];
+    fs->fsize = ld_dword(bs + BPB_FATSz32);
+    DWORD tsect = ld_dword(bs + BPB_TotSec32);
+    WORD nrsv = ld_word(bs + BPB_RsvdSecCnt);
+    if (fs->csize == 0 || (fs->csize & (fs->csize - 1)) ||
+        (fs->n_fats != 1 && fs->n_fats != 2) || nrsv == 0 ||
+        fs->fsize == 0)
+        return FR_NO_FILESYSTEM;
+    DWORD sysect = nrsv + fs->n_fats * fs->fsize;
+    if (tsect < sysect)
+        return FR_NO_FILESYSTEM;
+    DWORD nclst = (tsect - sysect) / fs->csize;
+    if (nclst <= MAX_FAT16 || nclst > MAX_FAT32 ||
+        fs->fsize < (nclst + 2 + SS / 4 - 1) / (SS / 4))
+        return FR_NO_FILESYSTEM;
+    fs->n_fatent = nclst + 2;
+    fs->fatbase = fs->volbase + nrsv;
+    fs->database = fs->volbase + sysect;
+    fs->dirbase = ld_dword(bs + BPB_RootClus32);
+
+    fs->last_clst = fs->free_clst = 0xFFFFFFFF;
+    fs->fsi_flag = 0;
+    WORD fsinfo = ld_word(bs + BPB_FSInfo32);
+    if (fsinfo == 1 && move_window(fs, fs->volbase + 1) == FR_OK &&
+        ld_dword(fs->win) == 0x41615252 &&
+        ld_dword(fs->win + FSI_StrucSig) == 0x61417272) {
+        fs->free_clst = ld_dword(fs->win + FSI_Free_Count);
+        fs->last_clst = ld_dword(fs->win + FSI_Nxt_Free);
+    }
+    fs->fs_type = FS_FAT32;
+    fs->id = ++mount_id;
+    return FR_OK;
+}
+
+static FRESULT validate(FFOBJID *obj, FATFS **rfs) {
+    if (!obj || !obj->fs || !obj->fs->fs_type || obj->id != obj->fs->id ||
+        (disk_status(obj->fs->pdrv) & STA_NOINIT)) {
+        *rfs = NULL;
+        return FR_INVALID_OBJECT;
+    }
+    *rfs = obj->fs;
+    return FR_OK;
+}
+
+FRESULT f_mount(FATFS *fs, const TCHAR *path, BYTE opt) {
+    pthread_mutex_lock(&ff_lock);
+    const TCHAR *rp = path;
+    int vol = get_ldnumber(&rp);
+    if (vol < 0)
+        LEAVE_FF(FR_INVALID_DRIVE);
+    if (volumes[vol])
+        volumes[vol]->fs_type = 0;
+    if (fs)
+        fs->fs_type = 0;
+    volumes[vol] = fs;
+    if (!fs || opt != 1)
+        LEAVE_FF(FR_OK);
+    FATFS *mfs;
+    LEAVE_FF(mount_volume(&path, &mfs));
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode) {
+    if (!fp)
+        return FR_INVALID_OBJECT;
+    pthread_mutex_lock(&ff_lock);
+    fp->obj.fs = NULL;
+    mode &= FA_READ | FA_WRITE | FA_CREATE_ALWAYS | FA_CREATE_NEW |
+            FA_OPEN_ALWAYS | FA_OPEN_APPEND;
+
+    FATFS *fs;
+    FF_DIR dj;
+    FRESULT res = mount_volume(&path, &fs);
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    dj.obj.fs = fs;
+    res = follow_path(&dj, path);
+    if (res == FR_OK && (dj.fn[11] & NS_NONAME))
+        res = FR_INVALID_NAME;
+
+    if (mode & (FA_CREATE_ALWAYS | FA_OPEN_ALWAYS | FA_CREATE_NEW)) {
+        if (res != FR_OK) {
+            if (res == FR_NO_FILE)
+                res = dir_register(&dj);
+            mode |= FA_CREATE_ALWAYS;
+        } else if (dir_entry(&dj)[DIR_Attr] & (AM_RDO | AM_DIR)) {
+            res = FR_DENIED;
+        } else if (mode & FA_CREATE_NEW) {
+            res = FR_EXIST;
+        }
+        if (res == FR_OK && (mode & FA_CREATE_ALWAYS)) {
+            // Truncate: a fresh entry, with any old chain freed
+            BYTE *dir = dir_entry(&dj);
+            DWORD tm = get_fattime();
+            DWORD cl = ld_clust(dir);
+            st_dword(dir + DIR_CrtTime, tm);
+            st_dword(dir + DIR_ModTime, tm);
+            dir[DIR_Attr] = AM_ARC;
+            st_clust(dir, 0);
+            st_dword(dir + DIR_FileSize, 0);
+            fs->wflag = 1;
+            if (cl != 0) {
+                LBA_t sect = fs->winsect;
+                res = remove_chain(fs, cl, 0);
+                if (res == FR_OK) {
+                    res = move_window(fs, sect);
+                    fs->last_clst = cl - 1;
+                }
+            }
+        }
+    } else if (res == FR_OK) {
+        BYTE attr = dir_entry(&dj)[DIR_Attr];
+        if (attr & AM_DIR)
+            res = FR_NO_FILE;
+        else if ((mode & FA_WRITE) && (attr & AM_RDO))
+            res = FR_DENIED;
+    }
+    if (res != FR_OK)
+        LEAVE_FF(res);
+
+    if (mode & FA_CREATE_ALWAYS)
+        mode |= FA_MODIFIED;
+    const BYTE *dir = dir_entry(&dj);
+    fp->dir_sect = dj.sect;
+    fp->dir_ofs = dj.ofs;
+    fp->obj.fs = fs;
+    fp->obj.id = fs->id;
+    fp->obj.attr = dir[DIR_Attr];
+    fp->obj.sclust = ld_clust(dir);
+    fp->obj.objsize = ld_dword(dir + DIR_FileSize);
+    fp->flag = mode;
+    fp->err = 0;
+    fp->sect = 0;
+    fp->fptr = 0;
+    fp->clust = 0;
+    memset(fp->buf, 0, SS);
+    pthread_mutex_unlock(&ff_lock);
+
+    if ((mode & FA_SEEKEND) && fp->obj.objsize > 0) {
+        res = f_lseek(fp, fp->obj.objsize);
+        if (res != FR_OK)
+            fp->obj.fs = NULL;
+    }
+    return res;
+}
+
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br) {
+    BYTE *rbuff = buff;
+    *br = 0;
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = validate(&fp->obj, &fs);
+    if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK)
+        LEAVE_FF(res);
+    if (!(fp->flag & FA_READ))
+        LEAVE_FF(FR_DENIED);
+    FSIZE_t remain = fp->obj.objsize - fp->fptr;
+    if (btr > remain)
+        btr = remain;
+
+    while (btr > 0) {
+        UINT rcnt;
+        if (fp->fptr % SS == 0) {
+            UINT csect = (fp->fptr / SS) & (fs->csize - 1);
+            if (csect == 0) {
+                DWORD clst = fp->fptr == 0 ? fp->obj.sclust
+                                           : get_fat(fs, fp->clust);
+                if (clst < 2) {
+                    fp->err = FR_INT_ERR;
+                    LEAVE_FF(FR_INT_ERR);
+                }
+                if (clst == 0xFFFFFFFF) {
+                    fp->err = FR_DISK_ERR;
+                    LEAVE_FF(FR_DISK_ERR);
+                }
+                fp->clust = clst;
+            }
+            LBA_t sect = clst2sect(fs, fp->clust);
+            if (sect == 0) {
+                fp->err = FR_INT_ERR;
+                LEAVE_FF(FR_INT_ERR);
+            }
+            sect += csect;
+            UINT cc = btr / SS;
+            if (cc > 0) {
+                // Whole sectors go straight into the caller's buffer
+                if (csect + cc > fs->csize)
+                    cc = fs->csize - csect;
+                if (disk_read(fs->pdrv, rbuff, sect, cc) != RES_OK) {
+                    fp->err = FR_DISK_ERR;
+                    LEAVE_FF(FR_DISK_ERR);
+                }
+                if ((fp->flag & FA_DIRTY) && fp->sect - sect < cc)
+                    memcpy(rbuff + (fp->sect - sect) * SS, fp->buf, SS);
+                rcnt = SS * cc;
+                goto advance;
+            }
+            if (fp->sect != sect) {
+                if (fp->flag & FA_DIRTY) {
+                    if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) !=
+                        RES_OK) {
+                        fp->err = FR_DISK_ERR;
+                        LEAVE_FF(FR_DISK_ERR);
+                    }
+                    fp->flag &= ~FA_DIRTY;
+                }
+                if (disk_read(fs->pdrv, fp->buf, sect, 1) != RES_OK) {
+                    fp->err = FR_DISK_ERR;
+                    LEAVE_FF(FR_DISK_ERR);
+                }
+            }
+            fp->sect = sect;
+        }
+        rcnt = SS - fp->fptr % SS;
+        if (rcnt > btr)
+            rcnt = btr;
+        memcpy(rbuff, fp->buf + fp->fptr % SS, rcnt);
+    advance:
+        rbuff += rcnt;
+        fp->fptr += rcnt;
+        *br += rcnt;
+        btr -= rcnt;
+    }
+    LEAVE_FF(FR_OK);
+}
+
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw) {
+    const BYTE *wbuff = buff;
+    *bw = 0;
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = validate(&fp->obj, &fs);
+    if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK)
+        LEAVE_FF(res);
+    if (!(fp->flag & FA_WRITE))
+        LEAVE_FF(FR_DENIED);
+    if ((FSIZE_t)(fp->fptr + btw) < fp->fptr)
+        btw = (UINT)(0xFFFFFFFF - fp->fptr);
+
+    while (btw > 0) {
+        UINT wcnt;
+        if (fp->fptr % SS == 0) {
+            UINT csect = (fp->fptr / SS) & (fs->csize - 1);
+            if (csect == 0) {
+                DWORD clst;
+                if (fp->fptr == 0) {
+                    clst = fp->obj.sclust;
+                    if (clst == 0)
+                        clst = create_chain(fs, 0);
+                } else {
+                    clst = create_chain(fs, fp->clust);
+                }
+                if (clst == 0)
+                    break; // Volume full
+                if (clst == 1) {
+                    fp->err = FR_INT_ERR;
+                    LEAVE_FF(FR_INT_ERR);
+                }
+                if (clst == 0xFFFFFFFF) {
+                    fp->err = FR_DISK_ERR;
+                    LEAVE_FF(FR_DISK_ERR);
+                }
+                fp->clust = clst;
+                if (fp->obj.sclust == 0)
+                    fp->obj.sclust = clst;
+            }
+            if (fp->flag & FA_DIRTY) {
+                if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) {
+                    fp->err = FR_DISK_ERR;
+                    LEAVE_FF(FR_DISK_ERR);
+                }
+                fp->flag &= ~FA_DIRTY;
+            }
+            LBA_t sect = clst2sect(fs, fp->clust);
+            if (sect == 0) {
+                fp->err = FR_INT_ERR;
+                LEAVE_FF(FR_INT_ERR);
+            }
+            sect += csect;
+            UINT cc = btw / SS;
+            if (cc > 0) {
+                if (csect + cc > fs->csize)
+                    cc = fs->csize - csect;
+                if (disk_write(fs->pdrv, wbuff, sect, cc) != RES_OK) {
+                    fp->err = FR_DISK_ERR;
+                    LEAVE_FF(FR_DISK_ERR);
+                }
+                // Keep the sector buffer in step with what was written
+                if (fp->sect - sect < cc) {
+                    memcpy(fp->buf, wbuff + (fp->sect - sect) * SS, SS);
+                    fp->flag &= ~FA_DIRTY;
+                }
+                wcnt = SS * cc;
+                goto advance;
+            }
+            // A partial sector inside the file is read first
+            if (fp->sect != sect && fp->fptr < fp->obj.objsize &&
+                disk_read(fs->pdrv, fp->buf, sect, 1) != RES_OK) {
+                fp->err = FR_DISK_ERR;
+                LEAVE_FF(FR_DISK_ERR);
+            }
+            fp->sect = sect;
+        }
+        wcnt = SS - fp->fptr % SS;
+        if (wcnt > btw)
+            wcnt = btw;
+        memcpy(fp->buf + fp->fptr % SS, wbuff, wcnt);
+        fp->flag |= FA_DIRTY;
+    advance:
+        wbuff += wcnt;
+        fp->fptr += wcnt;
+        if (fp->fptr > fp->obj.objsize)
+            fp->obj.objsize = fp->fptr;
+        *bw += wcnt;
+        btw -= wcnt;
+    }
+    fp->flag |= FA_MODIFIED;
+    LEAVE_FF(FR_OK);
+}
+
+// Caller holds ff_lock
+static FRESULT sync_file(FATFS *fs, FIL *fp) {
+    if (!(fp->flag & FA_MODIFIED))
+        return FR_OK;
+    if (fp->flag & FA_DIRTY) {
+        if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK)
+            return FR_DISK_ERR;
+        fp->flag &= ~FA_DIRTY;
+    }
+    FRESULT res = move_window(fs, fp->dir_sect);
+    if (res != FR_OK)
+        return res;
+    BYTE *dir = fs->win + fp->dir_ofs;
+    dir[DIR_Attr] |= AM_ARC;
+    st_clust(dir, fp->obj.sclust);
+    st_dword(dir + DIR_FileSize, fp->obj.objsize);
+    st_dword(dir + DIR_ModTime, get_fattime());
+    fs->wflag = 1;
+    res = sync_fs(fs);
+    fp->flag &= ~FA_MODIFIED;
+    return res;
+}
+
+FRESULT f_sync(FIL *fp) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = validate(&fp->obj, &fs);
+    if (res == FR_OK)
+        res = sync_file(fs, fp);
+    LEAVE_FF(res);
+}
+
+FRESULT f_close(FIL *fp) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = validate(&fp->obj, &fs);
+    if (res == FR_OK)
+        res = sync_file(fs, fp);
+    if (res == FR_OK)
+        fp->obj.fs = NULL;
+    LEAVE_FF(res);
+}
+
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = validate(&fp->obj, &fs);
+    if (res == FR_OK)
+        res = (FRESULT)fp->err;
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    bool write = fp->flag & FA_WRITE;
+    if (ofs > fp->obj.objsize && !write)
+        ofs = fp->obj.objsize;
+
+    DWORD bcs = (DWORD)fs->csize * SS;
+    LBA_t nsect = 0;
+    FSIZE_t ifptr = fp->fptr;
+    fp->fptr = 0;
+    if (ofs > 0) {
+        // Walk to the cluster holding byte ofs - 1, from the current one
+        // when seeking forward
+        DWORD target = (ofs - 1) / bcs;
+        DWORD i = 0;
+        DWORD clst;
+        if (ifptr > 0 && (ifptr - 1) / bcs <= target) {
+            i = (ifptr - 1) / bcs;
+            clst = fp->clust;
+        } else {
+            clst = fp->obj.sclust;
+            if (clst == 0 && write) {
+                clst = create_chain(fs, 0);
+                if (clst == 1 || clst == 0xFFFFFFFF) {
+                    fp->err = clst == 1 ? FR_INT_ERR : FR_DISK_ERR;
+                    LEAVE_FF((FRESULT)fp->err);
+                }
+                fp->obj.sclust = clst;
+            }
+        }
+        if (clst != 0) {
+            while (i < target) {
+                DWORD next = write ? create_chain(fs, clst)
+                                   : get_fat(fs, clst);
+                if (next == 0) {
+                    ofs = (FSIZE_t)(i + 1) * bcs; // Volume full
+                    break;
+                }
+                if (next <= 1 || next == 0xFFFFFFFF) {
+                    fp->err = next == 0xFFFFFFFF ? FR_DISK_ERR : FR_INT_ERR;
+                    LEAVE_FF((FRESULT)fp->err);
+                }
+                clst = next;
+                i++;
+            }
+            fp->clust = clst;
+            fp->fptr = ofs;
+            if (ofs % SS)
+                nsect = clst2sect(fs, clst) + (ofs % bcs) / SS;
+        }
+    }
+    if (fp->fptr > fp->obj.objsize) {
+        fp->obj.objsize = fp->fptr;
+        fp->flag |= FA_MODIFIED;
+    }
+    if (fp->fptr % SS && nsect != fp->sect) {
+        if (fp->flag & FA_DIRTY) {
+            if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) {
+                fp->err = FR_DISK_ERR;
+                LEAVE_FF(FR_DISK_ERR);
+            }
+            fp->flag &= ~FA_DIRTY;
+        }
+        if (disk_read(fs->pdrv, fp->buf, nsect, 1) != RES_OK) {
+            fp->err = FR_DISK_ERR;
+            LEAVE_FF(FR_DISK_ERR);
+        }
+        fp->sect = nsect;
+    }
+    LEAVE_FF(FR_OK);
+}
+
+FRESULT f_truncate(FIL *fp) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = validate(&fp->obj, &fs);
+    if (res == FR_OK)
+        res = (FRESULT)fp->err;
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    if (!(fp->flag & FA_WRITE))
+        LEAVE_FF(FR_DENIED);
+    if (fp->fptr >= fp->obj.objsize)
+        LEAVE_FF(FR_OK);
+
+    if (fp->fptr == 0) {
+        res = remove_chain(fs, fp->obj.sclust, 0);
+        fp->obj.sclust = 0;
+    } else {
+        DWORD ncl = get_fat(fs, fp->clust);
+        if (ncl == 0xFFFFFFFF)
+            res = FR_DISK_ERR;
+        else if (ncl == 1)
+            res = FR_INT_ERR;
+        else if (ncl < fs->n_fatent)
+            res = remove_chain(fs, ncl, fp->clust);
+    }
+    fp->obj.objsize = fp->fptr;
+    fp->flag |= FA_MODIFIED;
+    if (res != FR_OK)
+        fp->err = res;
+    LEAVE_FF(res);
+}
+
+FRESULT f_expand(FIL *fp, FSIZE_t fsz, BYTE opt) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = validate(&fp->obj, &fs);
+    if (res == FR_OK)
+        res = (FRESULT)fp->err;
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    if (fsz == 0 || fp->obj.objsize != 0 || !(fp->flag & FA_WRITE))
+        LEAVE_FF(FR_DENIED);
+
+    // First run of tcl free clusters at or after the allocation hint
+    DWORD bcs = (DWORD)fs->csize * SS;
+    DWORD tcl = (DWORD)((fsz - 1) / bcs + 1);
+    DWORD stcl = fs->last_clst;
+    if (stcl < 2 || stcl >= fs->n_fatent)
+        stcl = 2;
+    DWORD scl = stcl, clst = stcl, ncl = 0;
+    while (true) {
+        DWORD n = get_fat(fs, clst);
+        if (n == 1)
+            LEAVE_FF(FR_INT_ERR);
+        if (n == 0xFFFFFFFF)
+            LEAVE_FF(FR_DISK_ERR);
+        if (n == 0) {
+            if (++ncl == tcl)
+                break;
+        }
+        if (++clst >= fs->n_fatent)
+            clst = 2;
+        // A run cannot wrap past the end of the volume
+        if (n != 0 || clst == 2) {
+            scl = clst;
+            ncl = 0;
+        }
+        if (clst == stcl)
+            LEAVE_FF(FR_DENIED);
+    }
+
+    DWORD lclst = scl - 1;
+    if (opt) {
+        for (DWORD c = scl, n = tcl; n; c++, n--) {
+            res = put_fat(fs, c, n == 1 ? END_OF_CHAIN : c + 1);
+            if (res != FR_OK)
+                LEAVE_FF(res);
+            lclst = c;
+        }
+        fp->obj.sclust = scl;
+        fp->obj.objsize = fsz;
+        fp->flag |= FA_MODIFIED;
+        if (fs->free_clst <= fs->n_fatent - 2)
+            fs->free_clst -= tcl;
+    }
+    fs->last_clst = lclst;
+    fs->fsi_flag |= 1;
+    LEAVE_FF(FR_OK);
+}
+
+FRESULT f_opendir(FF_DIR *dp, const TCHAR *path) {
+    if (!dp)
+        return FR_INVALID_OBJECT;
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = mount_volume(&path, &fs);
+    if (res == FR_OK) {
+        dp->obj.fs = fs;
+        res = follow_path(dp, path);
+        if (res == FR_OK && !(dp->fn[11] & NS_NONAME)) {
+            const BYTE *dir = dir_entry(dp);
+            if (dir[DIR_Attr] & AM_DIR) {
+                dp->obj.sclust = ld_clust(dir);
+                if (dp->obj.sclust == 0)
+                    dp->obj.sclust = fs->dirbase;
+            } else {
+                res = FR_NO_PATH;
+            }
+        }
+        if (res == FR_OK) {
+            dp->obj.id = fs->id;
+            res = dir_sdi(dp, 0);
+        }
+        if (res == FR_NO_FILE)
+            res = FR_NO_PATH;
+    }
+    if (res != FR_OK)
+        dp->obj.fs = NULL;
+    LEAVE_FF(res);
+}
+
+FRESULT f_closedir(FF_DIR *dp) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = validate(&dp->obj, &fs);
+    if (res == FR_OK)
+        dp->obj.fs = NULL;
+    LEAVE_FF(res);
+}
+
+FRESULT f_readdir(FF_DIR *dp, FILINFO *fno) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = validate(&dp->obj, &fs);
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    if (!fno)
+        LEAVE_FF(dir_sdi(dp, 0));
+    res = dir_read(dp);
+    if (res == FR_NO_FILE) {
+        fno->fname[0] = '\0';
+        LEAVE_FF(FR_OK);
+    }
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    get_fileinfo(dp, fno);
+    res = dir_next(dp, false);
+    LEAVE_FF(res == FR_NO_FILE ? FR_OK : res);
+}
+
+FRESULT f_stat(const TCHAR *path, FILINFO *fno) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FF_DIR dj;
+    FRESULT res = mount_volume(&path, &fs);
+    if (res == FR_OK) {
+        dj.obj.fs = fs;
+        res = follow_path(&dj, path);
+        if (res == FR_OK) {
+            if (dj.fn[11] & NS_NONAME)
+                res = FR_INVALID_NAME;
+            else if (fno)
+                get_fileinfo(&dj, fno);
+        }
+    }
+    LEAVE_FF(res);
+}
+
+FRESULT f_unlink(const TCHAR *path) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FF_DIR dj;
+    FRESULT res = mount_volume(&path, &fs);
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    dj.obj.fs = fs;
+    res = follow_path(&dj, path);
+    if (res == FR_OK && (dj.fn[11] & NS_NONAME))
+        res = FR_INVALID_NAME;
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    const BYTE *dir = dir_entry(&dj);
+    if (dir[DIR_Attr] & AM_RDO)
+        LEAVE_FF(FR_DENIED);
+    DWORD dclst = ld_clust(dir);
+
+    if (dir[DIR_Attr] & AM_DIR) {
+        // Only an empty directory can go
+        FF_DIR sdj = {.obj = {.fs = fs, .sclust = dclst}};
+        res = dir_sdi(&sdj, 0);
+        if (res == FR_OK) {
+            res = dir_read(&sdj);
+            if (res == FR_OK)
+                res = FR_DENIED;
+            else if (res == FR_NO_FILE)
+                res = FR_OK;
+        }
+        if (res != FR_OK)
+            LEAVE_FF(res);
+    }
+    res = dir_remove(&dj);
+    if (res == FR_OK && dclst != 0)
+        res = remove_chain(fs, dclst, 0);
+    if (res == FR_OK)
+        res = sync_fs(fs);
+    LEAVE_FF(res);
+}
+
+FRESULT f_mkdir(const TCHAR *path) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FF_DIR dj;
+    FRESULT res = mount_volume(&path, &fs);
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    dj.obj.fs = fs;
+    res = follow_path(&dj, path);
+    if (res == FR_OK)
+        LEAVE_FF(FR_EXIST);
+    if (res != FR_NO_FILE)
+        LEAVE_FF(res);
+
+    DWORD pcl = dj.obj.sclust;
+    DWORD dcl = create_chain(fs, 0);
+    if (dcl == 0)
+        LEAVE_FF(FR_DENIED);
+    if (dcl == 1)
+        LEAVE_FF(FR_INT_ERR);
+    if (dcl == 0xFFFFFFFF)
+        LEAVE_FF(FR_DISK_ERR);
+    DWORD tm = get_fattime();
+    res = dir_clear(fs, dcl);
+    if (res == FR_OK) {
+        // The window now holds the first sector of the new directory
+        BYTE *dot = fs->win;
+        memset(dot, ' ', 11);
+        dot[0] = '.';
+        dot[DIR_Attr] = AM_DIR;
+        st_dword(dot + DIR_ModTime, tm);
+        st_clust(dot, dcl);
+        memcpy(dot + DIR_ENTRY_SIZE, dot, DIR_ENTRY_SIZE);
+        dot[DIR_ENTRY_SIZE + 1] = '.';
+        st_clust(dot + DIR_ENTRY_SIZE, pcl == fs->dirbase ? 0 : pcl);
+        fs->wflag = 1;
+        res = dir_register(&dj);
+    }
+    if (res == FR_OK) {
+        BYTE *dir = dir_entry(&dj);
+        st_dword(dir + DIR_CrtTime, tm);
+        st_dword(dir + DIR_ModTime, tm);
+        st_clust(dir, dcl);
+        dir[DIR_Attr] = AM_DIR;
+        fs->wflag = 1;
+        res = sync_fs(fs);
+    } else {
+        remove_chain(fs, dcl, 0);
+    }
+    LEAVE_FF(res);
+}
+
+FRESULT f_rename(const TCHAR *path_old, const TCHAR *path_new) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FF_DIR djo, djn;
+    get_ldnumber(&path_new);
+    FRESULT res = mount_volume(&path_old, &fs);
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    djo.obj.fs = fs;
+    res = follow_path(&djo, path_old);
+    if (res == FR_OK && (djo.fn[11] & NS_NONAME))
+        res = FR_INVALID_NAME;
+    if (res != FR_OK)
+        LEAVE_FF(res);
+
+    BYTE buf[DIR_ENTRY_SIZE];
+    memcpy(buf, dir_entry(&djo), DIR_ENTRY_SIZE);
+    djn = djo;
+    res = follow_path(&djn, path_new);
+    if (res == FR_OK) {
+        // Renaming onto itself is allowed, onto anything else is not
+        res = djn.obj.sclust == djo.obj.sclust && djn.dptr == djo.dptr
+                  ? FR_NO_FILE
+                  : FR_EXIST;
+    }
+    if (res != FR_NO_FILE)
+        LEAVE_FF(res);
+
+    res = dir_register(&djn);
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    BYTE *dir = dir_entry(&djn);
+    memcpy(dir + 13, buf + 13, DIR_ENTRY_SIZE - 13);
+    dir[DIR_Attr] = buf[DIR_Attr];
+    if (!(dir[DIR_Attr] & AM_DIR))
+        dir[DIR_Attr] |= AM_ARC;
+    fs->wflag = 1;
+
+    // A directory moved to another parent has its ".." repointed
+    if ((dir[DIR_Attr] & AM_DIR) && djo.obj.sclust != djn.obj.sclust) {
+        LBA_t sect = clst2sect(fs, ld_clust(dir));
+        if (sect == 0)
+            LEAVE_FF(FR_INT_ERR);
+        res = move_window(fs, sect);
+        if (res != FR_OK)
+            LEAVE_FF(res);
+        BYTE *dotdot = fs->win + DIR_ENTRY_SIZE;
+        if (dotdot[1] == '.') {
+            st_clust(dotdot,
+                     djn.obj.sclust == fs->dirbase ? 0 : djn.obj.sclust);
+            fs->wflag = 1;
+        }
+    }
+
+    res = dir_sdi(&djo, djo.dptr);
+    if (res == FR_OK)
+        res = dir_remove(&djo);
+    if (res == FR_OK)
+        res = sync_fs(fs);
+    LEAVE_FF(res);
+}
+
+FRESULT f_getfree(const TCHAR *path, DWORD *nclst, FATFS **fatfs) {
+    pthread_mutex_lock(&ff_lock);
+    FATFS *fs;
+    FRESULT res = mount_volume(&path, &fs);
+    if (res != FR_OK)
+        LEAVE_FF(res);
+    *fatfs = fs;
+    if (fs->free_clst > fs->n_fatent - 2) {
+        // Unknown, count every free entry in the FAT
+        DWORD nfree = 0;
+        for (DWORD clst = 2; clst < fs->n_fatent; clst++) {
+            DWORD stat = get_fat(fs, clst);
+            if (stat == 0xFFFFFFFF)
+                LEAVE_FF(FR_DISK_ERR);
+            if (stat == 1)
+                LEAVE_FF(FR_INT_ERR);
+            if (stat == 0)
+                nfree++;
+        }
+        fs->free_clst = nfree;
+        fs->fsi_flag |= 1;
+    }
+    *nclst = fs->free_clst;
+    LEAVE_FF(FR_OK);
+}
+
+// Builds a single FAT32 volume over the whole drive, with no partition
+// table, as IDF does with FM_SFD. Clusters are halved from au_size until
+// there are enough of them for FAT32, so volumes under about 33 MB are
+// refused.
+FRESULT f_mkfs(const TCHAR *path, const MKFS_PARM *opt, void *work,
+               UINT len) {
+    static const MKFS_PARM defopt = {FM_ANY, 0, 0, 0, 0};
+    int vol = get_ldnumber(&path);
+    if (vol < 0)
+        return FR_INVALID_DRIVE;
+    if (!opt)
+        opt = &defopt;
+    if (!(opt->fmt & FM_FAT32))
+        return FR_MKFS_ABORTED;
+    BYTE pdrv = vol;
+    BYTE *buf = work;
+    UINT sz_buf = len / SS;
+    if (!buf || sz_buf == 0)
+        return FR_NOT_ENOUGH_CORE;
+
+    pthread_mutex_lock(&ff_lock);
+    if (volumes[vol])
+        volumes[vol]->fs_type = 0;
+    if (disk_initialize(pdrv) & STA_NOINIT)
+        LEAVE_FF(FR_NOT_READY);
+    LBA_t sz_vol;
+    if (disk_ioctl(pdrv, GET_SECTOR_COUNT, &sz_vol) != RES_OK)
+        LEAVE_FF(FR_DISK_ERR);
+
+    BYTE n_fat = opt->n_fat >= 1 && opt->n_fat <= 2 ? opt->n_fat : 1;
+    DWORD pau = opt->au_size / SS;
+    if (pau == 0 || (pau & (pau - 1)) || pau > 128)
+        pau = sz_vol >= 0x4000000 ? 64 : sz_vol >= 0x1000000 ? 32 : 8;
+    DWORD sz_rsv, sz_fat, n_clst;
+    while (true) {
+        sz_rsv = 32;
+        n_clst = (sz_vol - sz_rsv) / pau;
+        sz_fat = ((n_clst + 2) * 4 + SS - 1) / SS;
+        // Start the data area on a cluster boundary
+        DWORD b_data = sz_rsv + n_fat * sz_fat;
+        if (b_data % pau)
+            sz_rsv += pau - b_data % pau;
+        if (sz_vol < sz_rsv + n_fat * sz_fat + pau)
+            LEAVE_FF(FR_MKFS_ABORTED);
+        n_clst = (sz_vol - sz_rsv - n_fat * sz_fat) / pau;
+        if (n_clst > MAX_FAT32)
+            LEAVE_FF(FR_MKFS_ABORTED);
+        if (n_clst > MAX_FAT16)
+            break;
+        if (pau == 1)
+            LEAVE_FF(FR_MKFS_ABORTED);
+        pau /= 2;
+    }
+
+    // Reserved area and FATs start out zeroed
+    memset(buf, 0, (size_t)sz_buf * SS);
+    for (LBA_t sect = 0, n = sz_rsv + n_fat * sz_fat; n > 0;) {
+        UINT cnt = n > sz_buf ? sz_buf : n;
+        if (disk_write(pdrv, buf, sect, cnt) != RES_OK)
+            LEAVE_FF(FR_DISK_ERR);
+        sect += cnt;
+        n -= cnt;
+    }
+
+    memset(buf, 0, SS);
+    memcpy(buf, "\xEB\x58\x90" "MSDOS5.0", 11);
+    st_word(buf + BPB_BytsPerSec, SS);
+    buf[BPB_SecPerClus] = pau;
+    st_word(buf + BPB_RsvdSecCnt, sz_rsv);
+    buf[BPB_NumFATs] = n_fat;
+    buf[21] = 0xF8; // BPB_Media
+    st_word(buf + 24, 63);   // BPB_SecPerTrk
+    st_word(buf + 26, 255);  // BPB_NumHeads
+    st_dword(buf + BPB_TotSec32, sz_vol);
+    st_dword(buf + BPB_FATSz32, sz_fat);
+    st_dword(buf + BPB_RootClus32, 2);
+    st_word(buf + BPB_FSInfo32, 1);
+    st_word(buf + 50, 6); // BPB_BkBootSec
+    buf[64] = 0x80;       // BS_DrvNum
+    buf[66] = 0x29;       // BS_BootSig
+    st_dword(buf + 67, get_fattime()); // BS_VolID
+    memcpy(buf + 71, "NO NAME    ", 11);
+    memcpy(buf + BS_FilSysType32, "FAT32   ", 8);
+    st_word(buf + BS_55AA, 0xAA55);
+    if (disk_write(pdrv, buf, 0, 1) != RES_OK ||
+        disk_write(pdrv, buf, 6, 1) != RES_OK)
+        LEAVE_FF(FR_DISK_ERR);
+
+    memset(buf, 0, SS);
+    st_dword(buf, 0x41615252);
+    st_dword(buf + FSI_StrucSig, 0x61417272);
+    st_dword(buf + FSI_Free_Count, n_clst - 1);
+    st_dword(buf + FSI_Nxt_Free, 2);
+    st_word(buf + BS_55AA, 0xAA55);
+    if (disk_write(pdrv, buf, 1, 1) != RES_OK ||
+        disk_write(pdrv, buf, 7, 1) != RES_OK)
+        LEAVE_FF(FR_DISK_ERR);
+
+    // Media and reserved entries, then the root directory's one cluster
+    memset(buf, 0, SS);
+    st_dword(buf, 0x0FFFFFF8);
+    st_dword(buf + 4, 0x0FFFFFFF);
+    st_dword(buf + 8, END_OF_CHAIN);
+    for (BYTE i = 0; i < n_fat; i++) {
+        if (disk_write(pdrv, buf, sz_rsv + i * sz_fat, 1) != RES_OK)
+            LEAVE_FF(FR_DISK_ERR);
+    }
+    memset(buf, 0, SS);
+    for (DWORD i = 0; i < pau; i++) {
+        if (disk_write(pdrv, buf, sz_rsv + n_fat * sz_fat + i, 1) != RES_OK)
+            LEAVE_FF(FR_DISK_ERR);
+    }
+    LEAVE_FF(disk_ioctl(pdrv, CTRL_SYNC, NULL) == RES_OK ? FR_OK
+                                                         : FR_DISK_ERR);
+}
@@ -0,0 +1,166 @@
+#ifndef FF_H
+#define FF_H
+
+// Host stand-in for the FatFs module bundled with IDF, with the same API
+// and configuration the firmware sees: FF_FS_READONLY 0, FF_USE_EXPAND 1,
+// FF_FS_RPATH 0, FF_FS_REENTRANT 1 and 512-byte sectors. Only FAT32 with
+// 8.3 names is handled, which covers every name the firmware writes; names
+// that do not fit 8.3 fail with FR_INVALID_NAME. Like FatFs it keeps one
+// sector window per volume for FAT and directory access and one sector
+// buffer per open file, and transfers whole sectors straight from the
+// caller's buffer, so the sector traffic it sends to diskio.h matches
+// what a card sees.
+
+#include <stdint.h>
+
+typedef unsigned int UINT;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint64_t QWORD;
+typedef char TCHAR;
+typedef DWORD LBA_t;
+typedef DWORD FSIZE_t;
+
+#define FF_VOLUMES 2
+#define FF_MAX_SS 512
+#define FF_MIN_SS 512
+
+typedef struct {
+    BYTE fs_type;  // 0 until mounted, FS_FAT32 after
+    BYTE pdrv;
+    BYTE n_fats;
+    BYTE wflag;    // win[] is dirty
+    BYTE fsi_flag; // Bit 0: FSInfo is dirty
+    WORD id;       // Bumped on every mount, invalidating open objects
+    WORD csize;    // Sectors per cluster
+    DWORD last_clst;
+    DWORD free_clst; // 0xFFFFFFFF when unknown
+    DWORD n_fatent;  // Clusters + 2
+    DWORD fsize;     // Sectors per FAT
+    LBA_t volbase;
+    LBA_t fatbase;
+    LBA_t dirbase; // Root directory cluster
+    LBA_t database;
+    LBA_t winsect;
+    BYTE win[FF_MAX_SS];
+} FATFS;
+
+typedef struct {
+    FATFS *fs;
+    WORD id;
+    BYTE attr;
+    DWORD sclust;
+    FSIZE_t objsize;
+} FFOBJID;
+
+typedef struct {
+    FFOBJID obj;
+    BYTE flag;
+    BYTE err;
+    FSIZE_t fptr;
+    DWORD clust; // Cluster of fptr, the previous one on a boundary
+    LBA_t sect;  // Sector held in buf, 0 for none
+    LBA_t dir_sect;
+    UINT dir_ofs; // Offset of the directory entry in dir_sect
+    BYTE buf[FF_MAX_SS];
+} FIL;
+
+typedef struct {
+    FFOBJID obj;
+    DWORD dptr; // Offset of the current entry in the directory
+    DWORD clust;
+    LBA_t sect; // 0 once past the end
+    UINT ofs;   // Offset of the current entry in sect
+    BYTE fn[12]; // 8.3 name being looked up, then its status flags
+} FF_DIR;
+
+typedef struct {
+    FSIZE_t fsize;
+    WORD fdate;
+    WORD ftime;
+    BYTE fattrib;
+    TCHAR fname[13];
+} FILINFO;
+
+typedef struct {
+    BYTE fmt;
+    BYTE n_fat;
+    UINT align;
+    UINT n_root;
+    DWORD au_size; // Cluster size in bytes, 0 to pick by volume size
+} MKFS_PARM;
+
+typedef enum {
+    FR_OK = 0,
+    FR_DISK_ERR,
+    FR_INT_ERR,
+    FR_NOT_READY,
+    FR_NO_FILE,
+    FR_NO_PATH,
+    FR_INVALID_NAME,
+    FR_DENIED,
+    FR_EXIST,
+    FR_INVALID_OBJECT,
+    FR_WRITE_PROTECTED,
+    FR_INVALID_DRIVE,
+    FR_NOT_ENABLED,
+    FR_NO_FILESYSTEM,
+    FR_MKFS_ABORTED,
+    FR_TIMEOUT,
+    FR_LOCKED,
+    FR_NOT_ENOUGH_CORE,
+    FR_TOO_MANY_OPEN_FILES,
+    FR_INVALID_PARAMETER,
+} FRESULT;
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode);
+FRESULT f_close(FIL *fp);
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br);
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw);
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs);
+FRESULT f_truncate(FIL *fp);
+FRESULT f_sync(FIL *fp);
+FRESULT f_expand(FIL *fp, FSIZE_t fsz, BYTE opt);
+FRESULT f_opendir(FF_DIR *dp, const TCHAR *path);
+FRESULT f_closedir(FF_DIR *dp);
+FRESULT f_readdir(FF_DIR *dp, FILINFO *fno);
+FRESULT f_stat(const TCHAR *path, FILINFO *fno);
+FRESULT f_unlink(const TCHAR *path);
+FRESULT f_rename(const TCHAR *path_old, const TCHAR *path_new);
+FRESULT f_mkdir(const TCHAR *path);
+FRESULT f_getfree(const TCHAR *path, DWORD *nclst, FATFS **fatfs);
+FRESULT f_mount(FATFS *fs, const TCHAR *path, BYTE opt);
+FRESULT f_mkfs(const TCHAR *path, const MKFS_PARM *opt, void *work,
+               UINT len);
+
+#define f_size(fp) ((fp)->obj.objsize)
+#define f_tell(fp) ((fp)->fptr)
+#define f_eof(fp) ((int)((fp)->fptr == (fp)->obj.objsize))
+#define f_error(fp) ((fp)->err)
+
+#define FA_READ 0x01
+#define FA_WRITE 0x02
+#define FA_OPEN_EXISTING 0x00
+#define FA_CREATE_NEW 0x04
+#define FA_CREATE_ALWAYS 0x08
+#define FA_OPEN_ALWAYS 0x10
+#define FA_OPEN_APPEND 0x30
+
+#define FM_FAT 0x01
+#define FM_FAT32 0x02
+#define FM_EXFAT 0x04
+#define FM_ANY 0x07
+#define FM_SFD 0x08
+
+#define FS_FAT12 1
+#define FS_FAT16 2
+#define FS_FAT32 3
+
+#define AM_RDO 0x01
+#define AM_HID 0x02
+#define AM_SYS 0x04
+#define AM_DIR 0x10
+#define AM_ARC 0x20
+
+#endif
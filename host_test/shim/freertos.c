@@ -0,0 +1,244 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// One lock and one condition variable for every object. Waiters recheck
+// their own condition on each broadcast, which is plenty for the handful
+// of tasks a test runs.
+static pthread_mutex_t kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kernel_cond;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+struct host_task {
+    TaskFunction_t fn;
+    void *arg;
+    pthread_t thread;
+    uint32_t notify;
+};
+
+struct host_queue {
+    uint8_t *items;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+};
+
+static __thread struct host_task *current_task;
+
+static void kernel_init(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&kernel_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void lock(void) {
+    pthread_once(&kernel_once, kernel_init);
+    pthread_mutex_lock(&kernel_lock);
+}
+
+static void unlock(void) { pthread_mutex_unlock(&kernel_lock); }
+
+static struct timespec deadline(TickType_t ticks) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ms = (uint64_t)ticks * 1000 / configTICK_RATE_HZ;
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+// Caller holds kernel_lock. Returns false once the deadline has passed.
+static bool wait(TickType_t ticks, const struct timespec *until) {
+    if (ticks == 0)
+        return false;
+    if (ticks == portMAX_DELAY)
+        return pthread_cond_wait(&kernel_cond, &kernel_lock) == 0;
+    return pthread_cond_timedwait(&kernel_cond, &kernel_lock, until) !=
+           ETIMEDOUT;
+}
+
+TickType_t xTaskGetTickCount(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TickType_t)((uint64_t)ts.tv_sec * configTICK_RATE_HZ +
+                        ts.tv_nsec / (1000000000 / configTICK_RATE_HZ));
+}
+
+static void *task_entry(void *arg) {
+    current_task = arg;
+    current_task->fn(current_task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+                                   uint32_t stack_size, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle,
+                                   BaseType_t core) {
+    struct host_task *task = calloc(1, sizeof(*task));
+    if (!task)
+        return pdFAIL;
+    task->fn = fn;
+    task->arg = arg;
+    // FreeRTOS stacks are sized for the target; the host default is used
+    if (pthread_create(&task->thread, NULL, task_entry, task) != 0) {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    if (handle)
+        *handle = task;
+    return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    // The thread running main() becomes a task the first time it asks
+    if (!current_task) {
+        current_task = calloc(1, sizeof(*current_task));
+        current_task->thread = pthread_self();
+    }
+    return current_task;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task != NULL && task != current_task)
+        abort();
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec ts = {.tv_sec = ticks / configTICK_RATE_HZ,
+                          .tv_nsec = (long)(ticks % configTICK_RATE_HZ) *
+                                     (1000000000 / configTICK_RATE_HZ)};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+BaseType_t xTaskDelayUntil(TickType_t *previous, TickType_t increment) {
+    *previous += increment;
+    TickType_t now = xTaskGetTickCount();
+    if ((int32_t)(*previous - now) <= 0)
+        return pdFALSE;
+    vTaskDelay(*previous - now);
+    return pdTRUE;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    lock();
+    task->notify++;
+    pthread_cond_broadcast(&kernel_cond);
+    unlock();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+    struct host_task *task = xTaskGetCurrentTaskHandle();
+    struct timespec until = deadline(ticks);
+    lock();
+    while (task->notify == 0 && wait(ticks, &until))
+        ;
+    uint32_t value = task->notify;
+    if (value)
+        task->notify = clear ? 0 : value - 1;
+    unlock();
+    return value;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    struct host_queue *queue = calloc(1, sizeof(*queue));
+    if (!queue)
+        return NULL;
+    queue->length = length;
+    queue->item_size = item_size;
+    if (item_size) {
+        queue->items = malloc((size_t)length * item_size);
+        if (!queue->items) {
+            free(queue);
+            return NULL;
+        }
+    }
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    if (!queue)
+        return;
+    free(queue->items);
+    free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item,
+                      TickType_t ticks) {
+    struct timespec until = deadline(ticks);
+    lock();
+    while (queue->count == queue->length && wait(ticks, &until))
+        ;
+    bool sent = queue->count < queue->length;
+    if (sent) {
+        if (queue->item_size) {
+            UBaseType_t tail = (queue->head + queue->count) % queue->length;
+            memcpy(queue->items + (size_t)tail * queue->item_size, item,
+                   queue->item_size);
+        }
+        queue->count++;
+        pthread_cond_broadcast(&kernel_cond);
+    }
+    unlock();
+    return sent ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+    struct timespec until = deadline(ticks);
+    lock();
+    while (queue->count == 0 && wait(ticks, &until))
+        ;
+    bool received = queue->count > 0;
+    if (received) {
+        if (queue->item_size) {
+            memcpy(item, queue->items + (size_t)queue->head * queue->item_size,
+                   queue->item_size);
+        }
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        pthread_cond_broadcast(&kernel_cond);
+    }
+    unlock();
+    return received ? pdTRUE : pdFALSE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    lock();
+    UBaseType_t count = queue->count;
+    unlock();
+    return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    SemaphoreHandle_t sem = xQueueCreate(1, 0);
+    if (sem)
+        xSemaphoreGive(sem);
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max,
+                                           UBaseType_t initial) {
+    SemaphoreHandle_t sem = xQueueCreate(max, 0);
+    if (sem)
+        sem->count = initial;
+    return sem;
+}
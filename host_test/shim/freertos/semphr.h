@@ -0,0 +1,17 @@
+#ifndef SEMPHR_H
+#define SEMPHR_H
+
+#include "queue.h"
+
+// Semaphores are queues of empty items, as in FreeRTOS itself
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max,
+                                           UBaseType_t initial);
+#define xSemaphoreTake(sem, ticks) xQueueReceive(sem, NULL, ticks)
+#define xSemaphoreGive(sem) xQueueSend(sem, NULL, 0)
+#define vSemaphoreDelete(sem) vQueueDelete(sem)
+
+#endif
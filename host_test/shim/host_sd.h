@@ -0,0 +1,28 @@
+#ifndef HOST_SD_H
+#define HOST_SD_H
+
+// Host-only controls for the stand-in SD card: a FAT image in a regular
+// file. The image stays attached across sd_card_deinit and sd_card_init,
+// like a card left in the slot over a reboot, and is formatted on the
+// first mount if it holds no file system.
+
+#include "esp_err.h"
+#include <stdint.h>
+
+// Sector traffic since the last reset, the cost a real card would see
+typedef struct {
+    uint64_t read_ops;
+    uint64_t read_sectors;
+    uint64_t write_ops;
+    uint64_t write_sectors;
+    uint64_t syncs;
+} host_sd_stats_t;
+
+// Opens the image at path, creating it as a sparse file of size_mb if it
+// does not exist. size_mb is ignored for an existing image.
+esp_err_t host_sd_attach(const char *path, uint32_t size_mb);
+void host_sd_detach(void);
+void host_sd_get_stats(host_sd_stats_t *stats);
+void host_sd_reset_stats(void);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef HOST_VFS_H
+#define HOST_VFS_H
+
+// Forced into every firmware source the host build compiles (-include), so
+// POSIX calls on paths under a FAT mount reach the FatFs stand-in the way
+// the IDF VFS routes them on the board. Other paths and descriptors go to
+// the host libc. Streams from fopen are real FILEs, so stdio calls on them
+// need no routing.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+int host_vfs_open(const char *path, int flags, ...);
+int host_vfs_close(int fd);
+ssize_t host_vfs_read(int fd, void *buf, size_t len);
+ssize_t host_vfs_write(int fd, const void *buf, size_t len);
+off_t host_vfs_lseek(int fd, off_t offset, int whence);
+int host_vfs_fsync(int fd);
+int host_vfs_stat(const char *path, struct stat *st);
+int host_vfs_unlink(const char *path);
+int host_vfs_rename(const char *src, const char *dst);
+int host_vfs_mkdir(const char *path, mode_t mode);
+int host_vfs_rmdir(const char *path);
+DIR *host_vfs_opendir(const char *path);
+struct dirent *host_vfs_readdir(DIR *dir);
+int host_vfs_closedir(DIR *dir);
+FILE *host_vfs_fopen(const char *path, const char *mode);
+int host_vfs_fileno(FILE *f);
+int host_vfs_setvbuf(FILE *f, char *buf, int mode, size_t size);
+
+// vfs_fat.c implements these and needs the libc calls underneath
+#ifndef HOST_VFS_IMPL
+#define open(...) host_vfs_open(__VA_ARGS__)
+#define close(fd) host_vfs_close(fd)
+#define read(fd, buf, len) host_vfs_read(fd, buf, len)
+#define write(fd, buf, len) host_vfs_write(fd, buf, len)
+#define lseek(fd, offset, whence) host_vfs_lseek(fd, offset, whence)
+#define fsync(fd) host_vfs_fsync(fd)
+#define stat(path, st) host_vfs_stat(path, st)
+#define unlink(path) host_vfs_unlink(path)
+#define rename(src, dst) host_vfs_rename(src, dst)
+#define mkdir(path, mode) host_vfs_mkdir(path, mode)
+#define rmdir(path) host_vfs_rmdir(path)
+#define opendir(path) host_vfs_opendir(path)
+#define readdir(dir) host_vfs_readdir(dir)
+#define closedir(dir) host_vfs_closedir(dir)
+#define fopen(path, mode) host_vfs_fopen(path, mode)
+#define fileno(f) host_vfs_fileno(f)
+#define setvbuf(f, buf, mode, size) host_vfs_setvbuf(f, buf, mode, size)
+#endif
+
+#endif
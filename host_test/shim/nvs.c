@@ -0,0 +1,197 @@
+#include "nvs_flash.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAMESPACES 16
+#define MAX_ENTRIES 128
+#define READONLY_FLAG 0x80000000u
+
+typedef enum {
+    TYPE_NONE,
+    TYPE_U32,
+    TYPE_STR,
+} entry_type_t;
+
+typedef struct {
+    int ns;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    entry_type_t type;
+    uint32_t u32;
+    char *str;
+} entry_t;
+
+static char namespaces[MAX_NAMESPACES][NVS_KEY_NAME_MAX_SIZE];
+static int namespace_count = 0;
+static entry_t entries[MAX_ENTRIES];
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+esp_err_t nvs_flash_init(void) { return ESP_OK; }
+
+esp_err_t nvs_flash_erase(void) {
+    pthread_mutex_lock(&nvs_lock);
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        free(entries[i].str);
+        entries[i] = (entry_t){0};
+    }
+    namespace_count = 0;
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *namespace_name, nvs_open_mode_t open_mode,
+                   nvs_handle_t *out_handle) {
+    if (strlen(namespace_name) >= NVS_KEY_NAME_MAX_SIZE)
+        return ESP_ERR_NVS_INVALID_NAME;
+
+    pthread_mutex_lock(&nvs_lock);
+    int ns = 0;
+    while (ns < namespace_count && strcmp(namespaces[ns], namespace_name))
+        ns++;
+    esp_err_t err = ESP_OK;
+    if (ns == namespace_count) {
+        // Opening read-only never creates the namespace
+        if (open_mode == NVS_READONLY)
+            err = ESP_ERR_NVS_NOT_FOUND;
+        else if (namespace_count == MAX_NAMESPACES)
+            err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        else
+            strcpy(namespaces[namespace_count++], namespace_name);
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    if (err == ESP_OK)
+        *out_handle =
+            (ns + 1) | (open_mode == NVS_READONLY ? READONLY_FLAG : 0);
+    return err;
+}
+
+void nvs_close(nvs_handle_t handle) {}
+
+esp_err_t nvs_commit(nvs_handle_t handle) { return ESP_OK; }
+
+// Caller holds nvs_lock
+static entry_t *find(nvs_handle_t handle, const char *key, bool create) {
+    int ns = (int)(handle & ~READONLY_FLAG) - 1;
+    entry_t *free_entry = NULL;
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].type == TYPE_NONE) {
+            if (!free_entry)
+                free_entry = &entries[i];
+        } else if (entries[i].ns == ns && strcmp(entries[i].key, key) == 0) {
+            return &entries[i];
+        }
+    }
+    if (!create || !free_entry)
+        return NULL;
+    free_entry->ns = ns;
+    strcpy(free_entry->key, key);
+    return free_entry;
+}
+
+static esp_err_t check_write(nvs_handle_t handle, const char *key) {
+    if (handle & READONLY_FLAG)
+        return ESP_ERR_NVS_READ_ONLY;
+    if (strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+        return ESP_ERR_NVS_INVALID_NAME;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value) {
+    esp_err_t err = check_write(handle, key);
+    if (err != ESP_OK)
+        return err;
+    pthread_mutex_lock(&nvs_lock);
+    entry_t *entry = find(handle, key, true);
+    if (entry) {
+        free(entry->str);
+        entry->str = NULL;
+        entry->type = TYPE_U32;
+        entry->u32 = value;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return entry ? ESP_OK : ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+}
+
+// Like the real store, a key of another type reads as missing
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key,
+                      uint32_t *out_value) {
+    pthread_mutex_lock(&nvs_lock);
+    entry_t *entry = find(handle, key, false);
+    bool found = entry && entry->type == TYPE_U32;
+    if (found)
+        *out_value = entry->u32;
+    pthread_mutex_unlock(&nvs_lock);
+    return found ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key,
+                      const char *value) {
+    esp_err_t err = check_write(handle, key);
+    if (err != ESP_OK)
+        return err;
+    char *copy = strdup(value);
+    if (!copy)
+        return ESP_ERR_NO_MEM;
+    pthread_mutex_lock(&nvs_lock);
+    entry_t *entry = find(handle, key, true);
+    if (entry) {
+        free(entry->str);
+        entry->type = TYPE_STR;
+        entry->str = copy;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    if (!entry) {
+        free(copy);
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out_value,
+                      size_t *length) {
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&nvs_lock);
+    entry_t *entry = find(handle, key, false);
+    if (!entry || entry->type != TYPE_STR) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else {
+        size_t needed = strlen(entry->str) + 1;
+        if (out_value == NULL)
+            *length = needed;
+        else if (*length < needed)
+            err = ESP_ERR_NVS_INVALID_LENGTH;
+        else
+            memcpy(out_value, entry->str, needed);
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+    if (handle & READONLY_FLAG)
+        return ESP_ERR_NVS_READ_ONLY;
+    pthread_mutex_lock(&nvs_lock);
+    entry_t *entry = find(handle, key, false);
+    if (entry) {
+        free(entry->str);
+        *entry = (entry_t){0};
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return entry ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+    if (handle & READONLY_FLAG)
+        return ESP_ERR_NVS_READ_ONLY;
+    int ns = (int)handle - 1;
+    pthread_mutex_lock(&nvs_lock);
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].type != TYPE_NONE && entries[i].ns == ns) {
+            free(entries[i].str);
+            entries[i] = (entry_t){0};
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
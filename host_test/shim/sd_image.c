@@ -0,0 +1,133 @@
+#include "diskio.h"
+#include "host_sd.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// The image is mapped whole, so a sector transfer is a memcpy and the
+// file system code dominates the timings, not system calls
+static BYTE *image = NULL;
+static uint64_t image_size = 0;
+static int image_fd = -1;
+static host_sd_stats_t stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+esp_err_t host_sd_attach(const char *path, uint32_t size_mb) {
+    if (image)
+        return ESP_ERR_INVALID_STATE;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return ESP_FAIL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (st.st_size == 0 &&
+         ftruncate(fd, (off_t)size_mb * 1024 * 1024) != 0) ||
+        fstat(fd, &st) != 0 || st.st_size < 512) {
+        close(fd);
+        return ESP_FAIL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return ESP_FAIL;
+    }
+    image = map;
+    image_size = st.st_size;
+    image_fd = fd;
+    host_sd_reset_stats();
+    return ESP_OK;
+}
+
+void host_sd_detach(void) {
+    if (!image)
+        return;
+    munmap(image, image_size);
+    close(image_fd);
+    image = NULL;
+    image_size = 0;
+    image_fd = -1;
+}
+
+void host_sd_get_stats(host_sd_stats_t *out) {
+    pthread_mutex_lock(&stats_lock);
+    *out = stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void host_sd_reset_stats(void) {
+    pthread_mutex_lock(&stats_lock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static bool in_range(LBA_t sector, UINT count) {
+    return image && ((uint64_t)sector + count) * FF_MAX_SS <= image_size;
+}
+
+DSTATUS disk_initialize(BYTE pdrv) { return disk_status(pdrv); }
+
+DSTATUS disk_status(BYTE pdrv) {
+    return pdrv == 0 && image ? 0 : STA_NOINIT | STA_NODISK;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
+    if (pdrv != 0 || !in_range(sector, count))
+        return RES_PARERR;
+    memcpy(buff, image + (uint64_t)sector * FF_MAX_SS,
+           (size_t)count * FF_MAX_SS);
+    pthread_mutex_lock(&stats_lock);
+    stats.read_ops++;
+    stats.read_sectors += count;
+    pthread_mutex_unlock(&stats_lock);
+    return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
+    if (pdrv != 0 || !in_range(sector, count))
+        return RES_PARERR;
+    memcpy(image + (uint64_t)sector * FF_MAX_SS, buff,
+           (size_t)count * FF_MAX_SS);
+    pthread_mutex_lock(&stats_lock);
+    stats.write_ops++;
+    stats.write_sectors += count;
+    pthread_mutex_unlock(&stats_lock);
+    return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+    if (pdrv != 0 || !image)
+        return RES_NOTRDY;
+    switch (cmd) {
+    case CTRL_SYNC:
+        // Counted only; the page cache keeps the image across mounts
+        pthread_mutex_lock(&stats_lock);
+        stats.syncs++;
+        pthread_mutex_unlock(&stats_lock);
+        return RES_OK;
+    case GET_SECTOR_COUNT:
+        *(LBA_t *)buff = image_size / FF_MAX_SS;
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *(WORD *)buff = FF_MAX_SS;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *(DWORD *)buff = 1;
+        return RES_OK;
+    default:
+        return RES_PARERR;
+    }
+}
+
+DWORD get_fattime(void) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    return (DWORD)(tm.tm_year - 80) << 25 | (DWORD)(tm.tm_mon + 1) << 21 |
+           (DWORD)tm.tm_mday << 16 | (DWORD)tm.tm_hour << 11 |
+           (DWORD)tm.tm_min << 5 | (DWORD)tm.tm_sec >> 1;
+}
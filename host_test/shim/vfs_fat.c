@@ -0,0 +1,652 @@
+#define HOST_VFS_IMPL
+#include "host_vfs.h"
+#include "diskio.h"
+#include "diskio_sdmmc.h"
+#include "esp_log.h"
+#include "esp_vfs_fat.h"
+#include "ff.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define VFS_FD_BASE 1000 // Well clear of the host's own descriptors
+#define VFS_MAX_FILES 16
+#define VFS_MAX_DIRS 8
+#define VFS_PATH_MAX 128
+#define MKFS_WORKBUF_SIZE 4096
+
+typedef struct {
+    FF_DIR dir;
+    struct dirent entry;
+} vfs_dir_t;
+
+static const char *TAG = "vfs_fat";
+static FATFS fatfs;
+static char base_path[16];
+static size_t base_len = 0;
+static bool is_mounted = false;
+static int max_files = 0;
+static FIL *files[VFS_MAX_FILES];
+static int file_flags[VFS_MAX_FILES];
+static FILE *streams[VFS_MAX_FILES]; // Stream wrapping each fd, if any
+static vfs_dir_t *dirs[VFS_MAX_DIRS];
+static pthread_mutex_t vfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Same mapping as the IDF FAT VFS
+static int fresult_to_errno(FRESULT fr) {
+    switch (fr) {
+    case FR_OK:
+        return 0;
+    case FR_NO_FILE:
+    case FR_NO_PATH:
+        return ENOENT;
+    case FR_INVALID_NAME:
+    case FR_INVALID_PARAMETER:
+        return EINVAL;
+    case FR_DENIED:
+    case FR_WRITE_PROTECTED:
+    case FR_LOCKED:
+        return EACCES;
+    case FR_EXIST:
+        return EEXIST;
+    case FR_INVALID_OBJECT:
+        return EBADF;
+    case FR_INVALID_DRIVE:
+        return ENXIO;
+    case FR_NOT_READY:
+    case FR_NOT_ENABLED:
+    case FR_NO_FILESYSTEM:
+        return ENODEV;
+    case FR_MKFS_ABORTED:
+        return EINTR;
+    case FR_TIMEOUT:
+        return ETIMEDOUT;
+    case FR_NOT_ENOUGH_CORE:
+        return ENOMEM;
+    case FR_TOO_MANY_OPEN_FILES:
+        return ENFILE;
+    default:
+        return EIO;
+    }
+}
+
+static bool under_mount(const char *path) {
+    return base_len && strncmp(path, base_path, base_len) == 0 &&
+           (path[base_len] == '/' || path[base_len] == '\0');
+}
+
+// FatFs path for a path under the mount point, prefixed with the drive
+static bool fat_path(const char *path, char *out) {
+    if (!is_mounted) {
+        errno = ENOENT;
+        return false;
+    }
+    const char *rest = path + base_len;
+    if (snprintf(out, VFS_PATH_MAX, "0:%s", *rest ? rest : "/") >=
+        VFS_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+static FIL *get_file(int fd) {
+    int i = fd - VFS_FD_BASE;
+    FIL *fp = i >= 0 && i < VFS_MAX_FILES ? files[i] : NULL;
+    if (!fp)
+        errno = EBADF;
+    return fp;
+}
+
+static bool is_vfs_fd(int fd) {
+    return fd >= VFS_FD_BASE && fd < VFS_FD_BASE + VFS_MAX_FILES;
+}
+
+static BYTE fat_mode(int flags) {
+    BYTE mode = 0;
+    switch (flags & O_ACCMODE) {
+    case O_RDONLY:
+        mode = FA_READ;
+        break;
+    case O_WRONLY:
+        mode = FA_WRITE;
+        break;
+    default:
+        mode = FA_READ | FA_WRITE;
+        break;
+    }
+    if ((flags & O_CREAT) && (flags & O_EXCL))
+        mode |= FA_CREATE_NEW;
+    else if ((flags & O_CREAT) && (flags & O_TRUNC))
+        mode |= FA_CREATE_ALWAYS;
+    else if (flags & (O_CREAT | O_APPEND))
+        mode |= FA_OPEN_ALWAYS;
+    return mode;
+}
+
+int host_vfs_open(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, int);
+        va_end(args);
+    }
+    if (!under_mount(path))
+        return open(path, flags, mode);
+    char fpath[VFS_PATH_MAX];
+    if (!fat_path(path, fpath))
+        return -1;
+
+    FIL *fp = malloc(sizeof(FIL));
+    if (!fp) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_lock(&vfs_lock);
+    int i = 0;
+    while (i < max_files && files[i])
+        i++;
+    if (i == max_files) {
+        pthread_mutex_unlock(&vfs_lock);
+        free(fp);
+        ESP_LOGW(TAG, "All %d files open, refusing %s", max_files, path);
+        errno = ENFILE;
+        return -1;
+    }
+    FRESULT res = f_open(fp, fpath, fat_mode(flags));
+    if (res != FR_OK) {
+        pthread_mutex_unlock(&vfs_lock);
+        free(fp);
+        errno = fresult_to_errno(res);
+        return -1;
+    }
+    files[i] = fp;
+    file_flags[i] = flags;
+    pthread_mutex_unlock(&vfs_lock);
+    return VFS_FD_BASE + i;
+}
+
+int host_vfs_close(int fd) {
+    if (!is_vfs_fd(fd))
+        return close(fd);
+    pthread_mutex_lock(&vfs_lock);
+    FIL *fp = get_file(fd);
+    if (!fp) {
+        pthread_mutex_unlock(&vfs_lock);
+        return -1;
+    }
+    FRESULT res = f_close(fp);
+    files[fd - VFS_FD_BASE] = NULL;
+    pthread_mutex_unlock(&vfs_lock);
+    free(fp);
+    if (res != FR_OK) {
+        errno = fresult_to_errno(res);
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t host_vfs_read(int fd, void *buf, size_t len) {
+    if (!is_vfs_fd(fd))
+        return read(fd, buf, len);
+    FIL *fp = get_file(fd);
+    if (!fp)
+        return -1;
+    UINT n = 0;
+    FRESULT res = f_read(fp, buf, len, &n);
+    if (res != FR_OK) {
+        errno = fresult_to_errno(res);
+        if (n == 0)
+            return -1;
+    }
+    return n;
+}
+
+ssize_t host_vfs_write(int fd, const void *buf, size_t len) {
+    if (!is_vfs_fd(fd))
+        return write(fd, buf, len);
+    FIL *fp = get_file(fd);
+    if (!fp)
+        return -1;
+    if (file_flags[fd - VFS_FD_BASE] & O_APPEND)
+        f_lseek(fp, f_size(fp));
+    UINT n = 0;
+    FRESULT res = f_write(fp, buf, len, &n);
+    // FatFs reports a full volume as a short write
+    if (res == FR_OK && n == 0 && len != 0) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (res != FR_OK) {
+        errno = fresult_to_errno(res);
+        if (n == 0)
+            return -1;
+    }
+    return n;
+}
+
+off_t host_vfs_lseek(int fd, off_t offset, int whence) {
+    if (!is_vfs_fd(fd))
+        return lseek(fd, offset, whence);
+    FIL *fp = get_file(fd);
+    if (!fp)
+        return -1;
+    off_t pos;
+    switch (whence) {
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = (off_t)f_tell(fp) + offset;
+        break;
+    case SEEK_END:
+        pos = (off_t)f_size(fp) + offset;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    if (pos < 0 || pos > (off_t)UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    FRESULT res = f_lseek(fp, pos);
+    if (res != FR_OK) {
+        errno = fresult_to_errno(res);
+        return -1;
+    }
+    return pos;
+}
+
+int host_vfs_fsync(int fd) {
+    if (!is_vfs_fd(fd))
+        return fsync(fd);
+    FIL *fp = get_file(fd);
+    if (!fp)
+        return -1;
+    FRESULT res = f_sync(fp);
+    if (res != FR_OK) {
+        errno = fresult_to_errno(res);
+        return -1;
+    }
+    return 0;
+}
+
+static time_t fat_time(WORD fdate, WORD ftime) {
+    struct tm tm = {.tm_year = (fdate >> 9) + 80,
+                    .tm_mon = ((fdate >> 5) & 0x0F) - 1,
+                    .tm_mday = fdate & 0x1F,
+                    .tm_hour = ftime >> 11,
+                    .tm_min = (ftime >> 5) & 0x3F,
+                    .tm_sec = (ftime & 0x1F) * 2,
+                    .tm_isdst = -1};
+    return mktime(&tm);
+}
+
+int host_vfs_stat(const char *path, struct stat *st) {
+    if (!under_mount(path))
+        return stat(path, st);
+    char fpath[VFS_PATH_MAX];
+    if (!fat_path(path, fpath))
+        return -1;
+    memset(st, 0, sizeof(*st));
+    if (strcmp(fpath, "0:/") == 0) {
+        st->st_mode = S_IFDIR | 0777;
+        return 0;
+    }
+    FILINFO info;
+    FRESULT res = f_stat(fpath, &info);
+    if (res != FR_OK) {
+        errno = fresult_to_errno(res);
+        return -1;
+    }
+    st->st_size = info.fsize;
+    st->st_mode = (info.fattrib & AM_DIR ? S_IFDIR : S_IFREG) |
+                  (info.fattrib & AM_RDO ? 0444 : 0777);
+    st->st_mtime = fat_time(info.fdate, info.ftime);
+    st->st_blksize = fatfs.csize * FF_MAX_SS;
+    return 0;
+}
+
+static int fat_call(const char *path, FRESULT (*fn)(const TCHAR *)) {
+    char fpath[VFS_PATH_MAX];
+    if (!fat_path(path, fpath))
+        return -1;
+    FRESULT res = fn(fpath);
+    if (res != FR_OK) {
+        errno = fresult_to_errno(res);
+        return -1;
+    }
+    return 0;
+}
+
+int host_vfs_unlink(const char *path) {
+    if (!under_mount(path))
+        return unlink(path);
+    return fat_call(path, f_unlink);
+}
+
+int host_vfs_rmdir(const char *path) {
+    if (!under_mount(path))
+        return rmdir(path);
+    return fat_call(path, f_unlink);
+}
+
+int host_vfs_mkdir(const char *path, mode_t mode) {
+    if (!under_mount(path))
+        return mkdir(path, mode);
+    return fat_call(path, f_mkdir);
+}
+
+int host_vfs_rename(const char *src, const char *dst) {
+    if (!under_mount(src) && !under_mount(dst))
+        return rename(src, dst);
+    if (!under_mount(src) || !under_mount(dst)) {
+        errno = EXDEV;
+        return -1;
+    }
+    char fsrc[VFS_PATH_MAX], fdst[VFS_PATH_MAX];
+    if (!fat_path(src, fsrc) || !fat_path(dst, fdst))
+        return -1;
+    FRESULT res = f_rename(fsrc, fdst);
+    if (res != FR_OK) {
+        errno = fresult_to_errno(res);
+        return -1;
+    }
+    return 0;
+}
+
+// Directory streams are told apart from host ones by address
+static int find_dir(DIR *dir) {
+    for (int i = 0; i < VFS_MAX_DIRS; i++) {
+        if (dirs[i] && (DIR *)dirs[i] == dir)
+            return i;
+    }
+    return -1;
+}
+
+DIR *host_vfs_opendir(const char *path) {
+    if (!under_mount(path))
+        return opendir(path);
+    char fpath[VFS_PATH_MAX];
+    if (!fat_path(path, fpath))
+        return NULL;
+    vfs_dir_t *dir = calloc(1, sizeof(*dir));
+    if (!dir) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    FRESULT res = f_opendir(&dir->dir, fpath);
+    if (res != FR_OK) {
+        free(dir);
+        errno = fresult_to_errno(res);
+        return NULL;
+    }
+    pthread_mutex_lock(&vfs_lock);
+    int i = 0;
+    while (i < VFS_MAX_DIRS && dirs[i])
+        i++;
+    if (i < VFS_MAX_DIRS)
+        dirs[i] = dir;
+    pthread_mutex_unlock(&vfs_lock);
+    if (i == VFS_MAX_DIRS) {
+        f_closedir(&dir->dir);
+        free(dir);
+        errno = ENFILE;
+        return NULL;
+    }
+    return (DIR *)dir;
+}
+
+struct dirent *host_vfs_readdir(DIR *dir) {
+    pthread_mutex_lock(&vfs_lock);
+    int i = find_dir(dir);
+    pthread_mutex_unlock(&vfs_lock);
+    if (i < 0)
+        return readdir(dir);
+    vfs_dir_t *vdir = (vfs_dir_t *)dir;
+    FILINFO info;
+    FRESULT res = f_readdir(&vdir->dir, &info);
+    if (res != FR_OK) {
+        errno = fresult_to_errno(res);
+        return NULL;
+    }
+    if (info.fname[0] == '\0')
+        return NULL;
+    vdir->entry.d_ino = 0;
+    vdir->entry.d_type = info.fattrib & AM_DIR ? DT_DIR : DT_REG;
+    snprintf(vdir->entry.d_name, sizeof(vdir->entry.d_name), "%s",
+             info.fname);
+    return &vdir->entry;
+}
+
+int host_vfs_closedir(DIR *dir) {
+    pthread_mutex_lock(&vfs_lock);
+    int i = find_dir(dir);
+    if (i >= 0)
+        dirs[i] = NULL;
+    pthread_mutex_unlock(&vfs_lock);
+    if (i < 0)
+        return closedir(dir);
+    vfs_dir_t *vdir = (vfs_dir_t *)dir;
+    FRESULT res = f_closedir(&vdir->dir);
+    free(vdir);
+    if (res != FR_OK) {
+        errno = fresult_to_errno(res);
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t stream_read(void *cookie, char *buf, size_t len) {
+    return host_vfs_read((int)(intptr_t)cookie, buf, len);
+}
+
+static ssize_t stream_write(void *cookie, const char *buf, size_t len) {
+    ssize_t n = host_vfs_write((int)(intptr_t)cookie, buf, len);
+    return n < 0 ? 0 : n;
+}
+
+static int stream_seek(void *cookie, off64_t *offset, int whence) {
+    off_t pos = host_vfs_lseek((int)(intptr_t)cookie, *offset, whence);
+    if (pos < 0)
+        return -1;
+    *offset = pos;
+    return 0;
+}
+
+static int stream_close(void *cookie) {
+    int fd = (int)(intptr_t)cookie;
+    pthread_mutex_lock(&vfs_lock);
+    streams[fd - VFS_FD_BASE] = NULL;
+    pthread_mutex_unlock(&vfs_lock);
+    return host_vfs_close(fd);
+}
+
+FILE *host_vfs_fopen(const char *path, const char *mode) {
+    if (!under_mount(path))
+        return fopen(path, mode);
+
+    int flags;
+    switch (mode[0]) {
+    case 'r':
+        flags = O_RDONLY;
+        break;
+    case 'w':
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        break;
+    case 'a':
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+        break;
+    default:
+        errno = EINVAL;
+        return NULL;
+    }
+    if (strchr(mode, '+'))
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    int fd = host_vfs_open(path, flags, 0666);
+    if (fd < 0)
+        return NULL;
+
+    cookie_io_functions_t io = {.read = stream_read,
+                                .write = stream_write,
+                                .seek = stream_seek,
+                                .close = stream_close};
+    FILE *f = fopencookie((void *)(intptr_t)fd, mode, io);
+    if (!f) {
+        host_vfs_close(fd);
+        return NULL;
+    }
+    pthread_mutex_lock(&vfs_lock);
+    streams[fd - VFS_FD_BASE] = f;
+    pthread_mutex_unlock(&vfs_lock);
+    return f;
+}
+
+int host_vfs_fileno(FILE *f) {
+    pthread_mutex_lock(&vfs_lock);
+    int fd = -1;
+    for (int i = 0; i < VFS_MAX_FILES; i++) {
+        if (streams[i] == f)
+            fd = VFS_FD_BASE + i;
+    }
+    pthread_mutex_unlock(&vfs_lock);
+    return fd >= 0 ? fd : fileno(f);
+}
+
+// newlib hands an unbuffered fread straight to the VFS in one call, but
+// glibc feeds a cookie stream one byte at a time. Keeping the default
+// buffer gives the same sector traffic as the board.
+int host_vfs_setvbuf(FILE *f, char *buf, int mode, size_t size) {
+    if (mode == _IONBF && host_vfs_fileno(f) >= VFS_FD_BASE)
+        return 0;
+    return setvbuf(f, buf, mode, size);
+}
+
+esp_err_t esp_vfs_fat_sdmmc_mount(
+    const char *path, const sdmmc_host_t *host_config,
+    const void *slot_config,
+    const esp_vfs_fat_sdmmc_mount_config_t *mount_config,
+    sdmmc_card_t **out_card) {
+    if (is_mounted)
+        return ESP_ERR_INVALID_STATE;
+    if (strlen(path) >= sizeof(base_path))
+        return ESP_ERR_INVALID_ARG;
+    if (disk_status(0) & STA_NODISK) {
+        ESP_LOGE(TAG, "No card image attached, see host_sd_attach");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    FRESULT res = f_mount(&fatfs, "0:", 1);
+    if (res == FR_NO_FILESYSTEM && mount_config->format_if_mount_failed) {
+        ESP_LOGW(TAG, "No file system on the card, formatting");
+        size_t au = mount_config->allocation_unit_size;
+        if (au < FF_MAX_SS)
+            au = FF_MAX_SS;
+        if (au > 128 * FF_MAX_SS)
+            au = 128 * FF_MAX_SS;
+        MKFS_PARM opt = {.fmt = FM_ANY | FM_SFD,
+                         .n_fat = mount_config->use_one_fat ? 1 : 2,
+                         .au_size = au};
+        void *work = malloc(MKFS_WORKBUF_SIZE);
+        res = work ? f_mkfs("0:", &opt, work, MKFS_WORKBUF_SIZE)
+                   : FR_NOT_ENOUGH_CORE;
+        free(work);
+        if (res == FR_OK)
+            res = f_mount(&fatfs, "0:", 1);
+    }
+    if (res != FR_OK) {
+        ESP_LOGE(TAG, "Failed to mount FAT file system (%d)", res);
+        f_mount(NULL, "0:", 0);
+        return ESP_FAIL;
+    }
+
+    const sdmmc_slot_config_t *slot = slot_config;
+    sdmmc_card_t *card = calloc(1, sizeof(*card));
+    if (!card) {
+        f_mount(NULL, "0:", 0);
+        return ESP_ERR_NO_MEM;
+    }
+    card->host = *host_config;
+    card->max_freq_khz = host_config->max_freq_khz;
+    card->real_freq_khz = host_config->max_freq_khz;
+    card->log_bus_width =
+        (host_config->flags & SDMMC_HOST_FLAG_4BIT) && slot->width == 4 ? 2
+                                                                        : 0;
+
+    pthread_mutex_lock(&vfs_lock);
+    snprintf(base_path, sizeof(base_path), "%s", path);
+    base_len = strlen(base_path);
+    max_files = mount_config->max_files;
+    if (max_files < 1 || max_files > VFS_MAX_FILES)
+        max_files = VFS_MAX_FILES;
+    is_mounted = true;
+    pthread_mutex_unlock(&vfs_lock);
+    *out_card = card;
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_sdcard_unmount(const char *path, sdmmc_card_t *card) {
+    if (!is_mounted || strcmp(path, base_path) != 0)
+        return ESP_ERR_INVALID_STATE;
+
+    pthread_mutex_lock(&vfs_lock);
+    for (int i = 0; i < VFS_MAX_FILES; i++) {
+        if (files[i]) {
+            ESP_LOGW(TAG, "fd %d still open at unmount", VFS_FD_BASE + i);
+            free(files[i]);
+            files[i] = NULL;
+        }
+    }
+    for (int i = 0; i < VFS_MAX_DIRS; i++) {
+        free(dirs[i]);
+        dirs[i] = NULL;
+    }
+    is_mounted = false;
+    pthread_mutex_unlock(&vfs_lock);
+    f_mount(NULL, "0:", 0);
+    free(card);
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_info(const char *path, uint64_t *out_total_bytes,
+                           uint64_t *out_free_bytes) {
+    if (!is_mounted || strcmp(path, base_path) != 0)
+        return ESP_ERR_INVALID_STATE;
+    FATFS *fs;
+    DWORD free_clusters;
+    if (f_getfree("0:", &free_clusters, &fs) != FR_OK)
+        return ESP_FAIL;
+    uint64_t cluster = (uint64_t)fs->csize * FF_MAX_SS;
+    *out_total_bytes = (fs->n_fatent - 2) * cluster;
+    *out_free_bytes = free_clusters * cluster;
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_create_contiguous_file(const char *base,
+                                             const char *full_path,
+                                             uint64_t size, bool alloc_now) {
+    if (size == 0 || size > UINT32_MAX || !under_mount(full_path) ||
+        strcmp(base, base_path) != 0)
+        return ESP_ERR_INVALID_ARG;
+    char fpath[VFS_PATH_MAX];
+    if (!fat_path(full_path, fpath))
+        return ESP_ERR_INVALID_STATE;
+
+    FIL file;
+    if (f_open(&file, fpath, FA_WRITE | FA_OPEN_ALWAYS) != FR_OK)
+        return ESP_FAIL;
+    if (f_expand(&file, size, alloc_now ? 1 : 0) != FR_OK) {
+        f_close(&file);
+        return ESP_FAIL;
+    }
+    return f_close(&file) == FR_OK ? ESP_OK : ESP_FAIL;
+}
+
+uint8_t ff_diskio_get_pdrv_card(const sdmmc_card_t *card) { return 0; }
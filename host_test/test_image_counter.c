@@ -0,0 +1,152 @@
+// Restores the image counter on a FAT image holding more and more images
+// and checks what that costs at boot. With the sharded layout the sectors
+// read must not grow with the image count; with the flat layout they grow
+// with it, within a bound per image. Also checks the fallback scan when the
+// stored counter cannot be trusted.
+//
+//   test_image_counter [IMAGE]
+#include "esp_timer.h"
+#include "host_sd.h"
+#include "nvs_flash.h"
+#include "nvs_storage.h"
+#include "sd_card.h"
+#include "test_util.h"
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+TEST_DEFINE_FAILURES;
+
+#define IMAGE_SIZE_MB 256
+#define IMAGE_LEN 1024
+// Each count leaves the newest image at the same offset in its shard, so
+// the sharded lookups compare like for like
+static const uint32_t counts[] = {1500, 4500, 13500};
+#define COUNT_STEPS (sizeof(counts) / sizeof(counts[0]))
+
+static uint8_t image[IMAGE_LEN];
+
+static void save_done(const uint8_t *data, size_t len, esp_err_t result,
+                      void *ctx) {
+    if (result != ESP_OK)
+        (*(uint32_t *)ctx)++;
+}
+
+// Saves until the newest image is number last
+static esp_err_t fill_to(uint32_t last) {
+    uint32_t failed = 0;
+    for (uint32_t n = sd_card_next_image_number(); n <= last; n++) {
+        if (sd_card_queue_image(image, sizeof(image), save_done, &failed,
+                                10000) != ESP_OK)
+            return ESP_ERR_TIMEOUT;
+    }
+    // failed is on this stack, so wait out every queued save
+    esp_err_t err;
+    while ((err = sd_card_flush(30000)) != ESP_OK)
+        ;
+    return failed ? ESP_FAIL : err;
+}
+
+typedef struct {
+    uint64_t sectors;
+    int64_t us;
+} restore_cost_t;
+
+// The counter restore sd_card_init runs at every boot, on its own so the
+// catalog build the writer starts after it does not count
+static esp_err_t restore(uint32_t *last, restore_cost_t *cost) {
+    esp_err_t err = sd_card_flush(10000);
+    if (err != ESP_OK)
+        return err;
+    host_sd_reset_stats();
+    int64_t start = esp_timer_get_time();
+    err = sd_card_scan_last_image_number(last);
+    cost->us = esp_timer_get_time() - start;
+    host_sd_stats_t stats;
+    host_sd_get_stats(&stats);
+    cost->sectors = stats.read_sectors;
+    return err;
+}
+
+static esp_err_t reboot(const sd_card_config_t *config) {
+    sd_card_deinit();
+    return sd_card_init(config);
+}
+
+static void test_layout(const char *path, sd_card_layout_t layout) {
+    const char *name = layout == SD_CARD_LAYOUT_FLAT ? "flat" : "sharded";
+    sd_card_config_t config = {.layout = layout};
+    unlink(path);
+    nvs_flash_erase();
+    CHECK_ERR(ESP_OK, host_sd_attach(path, IMAGE_SIZE_MB));
+    CHECK_ERR(ESP_OK, sd_card_init(&config));
+
+    restore_cost_t cost[COUNT_STEPS];
+    for (size_t i = 0; i < COUNT_STEPS; i++) {
+        CHECK_ERR(ESP_OK, fill_to(counts[i]));
+        CHECK_ERR(ESP_OK, reboot(&config));
+        uint32_t last = 0;
+        CHECK_ERR(ESP_OK, restore(&last, &cost[i]));
+        CHECK(last == counts[i]);
+        printf("%-7s %6" PRIu32 " images: %5" PRIu64 " sectors, %6lld us\n",
+               name, counts[i], cost[i].sectors, (long long)cost[i].us);
+    }
+    if (layout == SD_CARD_LAYOUT_SHARDED) {
+        // One more root directory entry per shard, nothing per image
+        CHECK(cost[COUNT_STEPS - 1].sectors <= cost[0].sectors + 2);
+    } else {
+        // The one directory holds every image, so lookups read a share of
+        // it that grows with the count: about 0.23 sectors per image here.
+        // Half a sector per image leaves room, and still catches anything
+        // reading the directory over per probe.
+        for (size_t i = 0; i < COUNT_STEPS; i++) {
+            CHECK(cost[i].sectors <= counts[i] / 2);
+            if (i > 0)
+                CHECK(cost[i].sectors > cost[i - 1].sectors);
+        }
+    }
+
+    // A missing counter (0 here), one too far behind to probe forward from
+    // and one ahead of the newest image all fall back to the directory scan
+    uint32_t newest = counts[COUNT_STEPS - 1];
+    uint32_t stale[] = {0, newest - 100, newest + 10};
+    for (size_t i = 0; i < sizeof(stale) / sizeof(stale[0]); i++) {
+        if (stale[i] == 0)
+            nvs_flash_erase();
+        else
+            nvs_storage_write_u32(NVS_SD_NAMESPACE, NVS_KEY_NEXT_IMAGE,
+                                  stale[i]);
+        CHECK_ERR(ESP_OK, reboot(&config));
+        uint32_t last = 0;
+        restore_cost_t scan;
+        CHECK_ERR(ESP_OK, restore(&last, &scan));
+        CHECK(last == newest);
+        CHECK(sd_card_next_image_number() == newest + 1);
+    }
+
+    // Losing the newest image, e.g. deleted from a PC, fails the check on
+    // the stored counter and the scan goes by the images left
+    CHECK_ERR(ESP_OK, sd_card_delete_image(newest));
+    CHECK_ERR(ESP_OK, reboot(&config));
+    uint32_t last = 0;
+    restore_cost_t scan;
+    CHECK_ERR(ESP_OK, restore(&last, &scan));
+    CHECK(last == newest - 1);
+
+    sd_card_deinit();
+    host_sd_detach();
+    unlink(path);
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "counter.img";
+    for (size_t i = 0; i < sizeof(image); i++)
+        image[i] = i * 31;
+    image[0] = 0xFF;
+    image[1] = 0xD8;
+    CHECK_ERR(ESP_OK, nvs_storage_init());
+
+    test_layout(path, SD_CARD_LAYOUT_SHARDED);
+    test_layout(path, SD_CARD_LAYOUT_FLAT);
+    return TEST_RESULT();
+}
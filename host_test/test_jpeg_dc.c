@@ -0,0 +1,235 @@
+#include "jpeg_dc.h"
+#include "jpeg_gen.h"
+#include "test_util.h"
+#include <string.h>
+
+TEST_DEFINE_FAILURES;
+
+#define OUT_SIZE (256 * 256)
+
+static uint8_t out[OUT_SIZE];
+
+// Decodes from an allocation of exactly len bytes, so the sanitizer
+// catches any read past the end of the input
+static esp_err_t decode(const uint8_t *data, size_t len, uint16_t *w,
+                        uint16_t *h) {
+    uint8_t *copy = malloc(len ? len : 1);
+    memcpy(copy, data, len);
+    esp_err_t err = jpeg_dc_luma(copy, len, out, sizeof(out), w, h);
+    free(copy);
+    return err;
+}
+
+// Offset of the first header segment with the given marker
+static size_t find_segment(const uint8_t *data, size_t len, uint8_t marker) {
+    size_t p = 2;
+    while (p + 4 <= len && data[p] == 0xFF) {
+        if (data[p + 1] == marker)
+            return p;
+        p += 2 + ((data[p + 2] << 8) | data[p + 3]);
+    }
+    return 0;
+}
+
+// Replaces remove bytes at off with the given bytes
+static uint8_t *splice(const jpeg_gen_t *gen, size_t off, size_t remove,
+                       const uint8_t *insert, size_t insert_len,
+                       size_t *len) {
+    *len = gen->len - remove + insert_len;
+    uint8_t *buf = malloc(*len);
+    memcpy(buf, gen->data, off);
+    memcpy(buf + off, insert, insert_len);
+    memcpy(buf + off + insert_len, gen->data + off + remove,
+           gen->len - off - remove);
+    return buf;
+}
+
+static size_t segment_len(const jpeg_gen_t *gen, size_t off) {
+    return 2 + ((gen->data[off + 2] << 8) | gen->data[off + 3]);
+}
+
+// A DHT segment holding one DC table with the given code length counts and
+// all-zero symbols
+static size_t make_dht(uint8_t *seg, const uint8_t counts[16]) {
+    int total = 0;
+    for (int i = 0; i < 16; i++)
+        total += counts[i];
+    size_t len = 4 + 17 + total;
+    seg[0] = 0xFF;
+    seg[1] = 0xC4;
+    seg[2] = (len - 2) >> 8;
+    seg[3] = (len - 2) & 0xFF;
+    seg[4] = 0x00;
+    memcpy(seg + 5, counts, 16);
+    memset(seg + 21, 0, total);
+    return len;
+}
+
+static void test_valid(void) {
+    static const jpeg_gen_config_t configs[] = {
+        {.width = 64, .height = 48, .ncomp = 1, .seed = 1},
+        {.width = 100, .height = 75, .ncomp = 1, .restart_interval = 3,
+         .ac_density = 8, .seed = 2},
+        {.width = 96, .height = 64, .ncomp = 3, .ac_density = 4, .seed = 3},
+        {.width = 81, .height = 47, .ncomp = 3, .restart_interval = 5,
+         .ac_density = 16, .seed = 4},
+        {.width = 320, .height = 240, .ncomp = 3, .restart_interval = 1,
+         .ac_density = 63, .dc_quant = 16, .seed = 5},
+    };
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        jpeg_gen_t gen;
+        jpeg_gen(&configs[i], &gen);
+        uint16_t w = 0, h = 0;
+        CHECK_ERR(ESP_OK, decode(gen.data, gen.len, &w, &h));
+        CHECK(w == gen.luma_width && h == gen.luma_height);
+        CHECK(memcmp(out, gen.luma, (size_t)w * h) == 0);
+        jpeg_gen_free(&gen);
+    }
+}
+
+static void test_bad_dht(void) {
+    jpeg_gen_config_t config = {.width = 32, .height = 32, .ncomp = 1};
+    jpeg_gen_t gen;
+    jpeg_gen(&config, &gen);
+    size_t off = find_segment(gen.data, gen.len, 0xC4);
+    CHECK(off != 0);
+
+    static const uint8_t overfull[][16] = {
+        {200},                       // More 1-bit codes than exist
+        {0, 5},                      // Five 2-bit codes
+        {1, 1, 1, 1, 1, 1, 1, 1, 3}, // One too many within the lookahead
+        {2, 0, 0, 0, 0, 0, 0, 0, 0, 1}, // Past the lookahead
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255},
+    };
+    uint8_t seg[4 + 17 + 256];
+    for (size_t i = 0; i < sizeof(overfull) / sizeof(overfull[0]); i++) {
+        size_t seg_len = make_dht(seg, overfull[i]);
+        size_t len;
+        uint8_t *bad =
+            splice(&gen, off, segment_len(&gen, off), seg, seg_len, &len);
+        uint16_t w, h;
+        // The last table is full but valid, and the scan then finds no AC
+        // table, which fails the same way
+        CHECK_ERR(ESP_ERR_INVALID_RESPONSE, decode(bad, len, &w, &h));
+        free(bad);
+    }
+
+    // Symbols run past the end of the segment
+    uint8_t counts[16] = {0, 2, 2};
+    size_t seg_len = make_dht(seg, counts);
+    seg[3] -= 2;
+    size_t len;
+    uint8_t *bad = splice(&gen, off, segment_len(&gen, off), seg, seg_len - 2,
+                          &len);
+    uint16_t w, h;
+    CHECK(decode(bad, len, &w, &h) != ESP_OK);
+    free(bad);
+    jpeg_gen_free(&gen);
+}
+
+static void test_short_segments(void) {
+    uint16_t w, h;
+
+    // DRI with no room for the interval, ending the input
+    static const uint8_t dri[] = {0xFF, 0xD8, 0xFF, 0xDD, 0x00, 0x02};
+    CHECK_ERR(ESP_ERR_INVALID_SIZE, decode(dri, sizeof(dri), &w, &h));
+
+    jpeg_gen_config_t config = {.width = 32, .height = 32, .ncomp = 3};
+    jpeg_gen_t gen;
+    jpeg_gen(&config, &gen);
+    size_t sos = find_segment(gen.data, gen.len, 0xDA);
+    CHECK(sos != 0);
+
+    // SOS cut off after the component count, then with a length too short
+    // for the components it declares
+    uint8_t buf[1024];
+    memcpy(buf, gen.data, sos);
+    static const uint8_t count_only[] = {0xFF, 0xDA, 0x00, 0x03, 0x03};
+    memcpy(buf + sos, count_only, sizeof(count_only));
+    CHECK_ERR(ESP_ERR_INVALID_SIZE,
+              decode(buf, sos + sizeof(count_only), &w, &h));
+
+    static const uint8_t empty[] = {0xFF, 0xDA, 0x00, 0x02};
+    memcpy(buf + sos, empty, sizeof(empty));
+    CHECK_ERR(ESP_ERR_INVALID_SIZE, decode(buf, sos + sizeof(empty), &w, &h));
+
+    static const uint8_t short_len[] = {0xFF, 0xDA, 0x00, 0x08, 0x03,
+                                        0x01, 0x00, 0x02, 0x00, 0x03};
+    memcpy(buf + sos, short_len, sizeof(short_len));
+    CHECK_ERR(ESP_ERR_INVALID_SIZE,
+              decode(buf, sos + sizeof(short_len), &w, &h));
+    jpeg_gen_free(&gen);
+}
+
+static void test_truncated(void) {
+    jpeg_gen_config_t config = {.width = 48, .height = 40, .ncomp = 3,
+                                .restart_interval = 2, .ac_density = 8,
+                                .seed = 7};
+    jpeg_gen_t gen;
+    jpeg_gen(&config, &gen);
+    uint16_t w, h;
+    for (size_t len = 0; len < gen.len; len++)
+        decode(gen.data, len, &w, &h);
+    jpeg_gen_free(&gen);
+}
+
+// A predictor walked out of the 11-bit DC range is rejected rather than
+// overflowing pred * q
+static void test_dc_range(void) {
+    static const struct {
+        uint16_t width; // One row of 8x8 blocks
+        int16_t step;
+        esp_err_t err;
+        uint8_t pixel;
+    } cases[] = {
+        {8, 2047, ESP_OK, 255},
+        {8, -2047, ESP_OK, 0},
+        {64, 1024, ESP_ERR_INVALID_RESPONSE},
+        {64, -1023, ESP_ERR_INVALID_RESPONSE},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        jpeg_gen_config_t config = {.width = cases[i].width, .height = 8,
+                                    .ncomp = 1, .dc_quant = 255,
+                                    .dc_step = cases[i].step};
+        jpeg_gen_t gen;
+        jpeg_gen(&config, &gen);
+        uint16_t w, h;
+        CHECK_ERR(cases[i].err, decode(gen.data, gen.len, &w, &h));
+        if (cases[i].err == ESP_OK)
+            CHECK(out[0] == cases[i].pixel);
+        jpeg_gen_free(&gen);
+    }
+}
+
+// Random byte damage must never read or write out of bounds
+static void test_corrupt(void) {
+    uint32_t rng = 12345;
+    for (int i = 0; i < 3000; i++) {
+        jpeg_gen_config_t config = {.width = 40, .height = 24,
+                                    .ncomp = i & 1 ? 3 : 1,
+                                    .restart_interval = i % 3,
+                                    .ac_density = 6, .seed = i};
+        jpeg_gen_t gen;
+        jpeg_gen(&config, &gen);
+        int hits = 1 + i % 4;
+        for (int k = 0; k < hits; k++) {
+            rng = rng * 1103515245u + 12345u;
+            // Mostly the headers, which hold the length fields
+            size_t span = k & 1 ? gen.len : 360 < gen.len ? 360 : gen.len;
+            gen.data[(rng >> 8) % span] = rng >> 16;
+        }
+        uint16_t w, h;
+        decode(gen.data, gen.len, &w, &h);
+        jpeg_gen_free(&gen);
+    }
+}
+
+int main(void) {
+    test_valid();
+    test_bad_dht();
+    test_short_segments();
+    test_truncated();
+    test_dc_range();
+    test_corrupt();
+    return TEST_RESULT();
+}
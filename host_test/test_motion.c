@@ -0,0 +1,177 @@
+#include "jpeg_gen.h"
+#include "motion.h"
+#include "test_util.h"
+#include <string.h>
+
+TEST_DEFINE_FAILURES;
+
+#define W 80
+#define H 60
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void) {
+    rng_state = rng_state * 1103515245 + 12345;
+    return rng_state >> 8;
+}
+
+// Every pixel pair at every threshold, alone in each lane position of the
+// word-at-a-time path so no two errors can cancel out
+static void test_block_diff_exhaustive(void) {
+    _Alignas(4) uint8_t cur[4] = {0}, bg[4] = {0};
+    uint32_t mismatches = 0;
+    for (int t = 0; t < 256; t++) {
+        for (int a = 0; a < 256; a++) {
+            for (int b = 0; b < 256; b++) {
+                for (int lane = 0; lane < 4; lane++) {
+                    cur[lane] = a;
+                    bg[lane] = b;
+                    uint32_t fast = motion_block_diff(cur, bg, 4, 4, 1, t);
+                    uint32_t ref = motion_block_diff_ref(cur, bg, 4, 4, 1, t);
+                    cur[lane] = 0;
+                    bg[lane] = 0;
+                    if (fast != ref && mismatches++ < 5)
+                        fprintf(stderr, "t=%d a=%d b=%d lane %d: %u\n", t,
+                                a, b, lane, fast);
+                }
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+// Random blocks of every size up to the maximum, aligned and not, in
+// frames with room around them
+static void test_block_diff_random(void) {
+    static _Alignas(4) uint8_t cur[64 * 32], bg[64 * 32];
+    for (size_t i = 0; i < sizeof(cur); i++) {
+        cur[i] = rng();
+        // Mostly near the frame, so counts are not all or nothing
+        bg[i] = rng() % 4 == 0 ? rng() : cur[i] + (int)(rng() % 61) - 30;
+    }
+    static const uint8_t thresholds[] = {0, 1, 15, 24, 127, 128, 254, 255};
+    for (size_t t = 0; t < sizeof(thresholds); t++) {
+        for (uint16_t bw = 1; bw <= MOTION_MAX_BLOCK_SIZE; bw++) {
+            for (uint16_t bh = 1; bh <= MOTION_MAX_BLOCK_SIZE; bh++) {
+                size_t stride = (rng() % 2) ? 64 : 62;
+                size_t offset = rng() % 8;
+                uint32_t fast = motion_block_diff(cur + offset, bg + offset,
+                                                  stride, bw, bh,
+                                                  thresholds[t]);
+                uint32_t ref = motion_block_diff_ref(
+                    cur + offset, bg + offset, stride, bw, bh, thresholds[t]);
+                CHECK(fast == ref);
+            }
+        }
+    }
+}
+
+// 16-bit lanes must hold the count of a whole maximum-size block
+static void test_block_diff_full_block(void) {
+    static _Alignas(4) uint8_t cur[MOTION_MAX_BLOCK_SIZE * 32];
+    static _Alignas(4) uint8_t bg[MOTION_MAX_BLOCK_SIZE * 32];
+    memset(cur, 255, sizeof(cur));
+    memset(bg, 0, sizeof(bg));
+    uint32_t n = MOTION_MAX_BLOCK_SIZE;
+    CHECK(motion_block_diff(cur, bg, 32, n, n, 0) == n * n);
+    CHECK(motion_block_diff(cur, bg, 32, n, n, 254) == n * n);
+    CHECK(motion_block_diff(cur, bg, 32, n, n, 255) == 0);
+    CHECK(motion_block_diff(bg, cur, 32, n, n, 0) == n * n);
+}
+
+static void noise_frame(uint8_t *frame) {
+    rng_state = 7;
+    for (int i = 0; i < W * H; i++)
+        frame[i] = 64 + rng() % 16;
+}
+
+static void test_process(void) {
+    motion_config_t config = {.width = W,
+                              .height = H,
+                              .block_size = MOTION_DEFAULT_BLOCK_SIZE,
+                              .pixel_threshold =
+                                  MOTION_DEFAULT_PIXEL_THRESHOLD,
+                              .block_threshold =
+                                  MOTION_DEFAULT_BLOCK_THRESHOLD,
+                              .min_blocks = MOTION_DEFAULT_MIN_BLOCKS};
+    motion_detector_t md;
+    CHECK_ERR(ESP_OK, motion_init(&md, &config));
+
+    static _Alignas(4) uint8_t frame[W * H];
+    motion_result_t result;
+    noise_frame(frame);
+    for (int i = 0; i < MOTION_WARMUP_FRAMES + 2; i++) {
+        CHECK_ERR(ESP_OK, motion_process(&md, frame, &result));
+        CHECK(!result.detected);
+    }
+
+    // A bright 16x16 object on block boundaries
+    for (int y = 16; y < 32; y++)
+        memset(frame + y * W + 24, 220, 16);
+    CHECK_ERR(ESP_OK, motion_process(&md, frame, &result));
+    CHECK(result.detected);
+    CHECK(result.changed_blocks == 4);
+    CHECK(result.x == 24 && result.y == 16);
+    CHECK(result.w == 16 && result.h == 16);
+    CHECK(result.score == 16 * 16 * 1000 / (W * H));
+
+    // A lighting jump across the whole frame is not motion
+    for (int i = 0; i < W * H; i++)
+        frame[i] = 200;
+    CHECK_ERR(ESP_OK, motion_process(&md, frame, &result));
+    CHECK(!result.detected && result.changed_blocks == 0);
+
+    motion_deinit(&md);
+}
+
+// Frames bigger than the detector are scaled down, and a change of frame
+// size restarts the model at the new size
+static void test_process_jpeg(void) {
+    motion_config_t config = {.width = MOTION_MAX_WIDTH,
+                              .height = MOTION_MAX_HEIGHT,
+                              .block_size = MOTION_DEFAULT_BLOCK_SIZE,
+                              .pixel_threshold =
+                                  MOTION_DEFAULT_PIXEL_THRESHOLD,
+                              .block_threshold =
+                                  MOTION_DEFAULT_BLOCK_THRESHOLD,
+                              .min_blocks = MOTION_DEFAULT_MIN_BLOCKS};
+    motion_detector_t md;
+    CHECK_ERR(ESP_OK, motion_init(&md, &config));
+
+    jpeg_gen_config_t uxga = {.width = 1600, .height = 1200, .ncomp = 3,
+                              .ac_density = 1, .seed = 3};
+    jpeg_gen_t gen;
+    CHECK(jpeg_gen(&uxga, &gen) == 0);
+    motion_result_t result;
+    for (int i = 0; i < MOTION_WARMUP_FRAMES + 2; i++) {
+        CHECK_ERR(ESP_OK, motion_process_jpeg(&md, gen.data, gen.len,
+                                              &result));
+        CHECK(!result.detected);
+    }
+    CHECK(md.config.width == 100 && md.config.height == 75);
+    CHECK(md.frames == MOTION_WARMUP_FRAMES + 2);
+    jpeg_gen_free(&gen);
+
+    jpeg_gen_config_t vga = {.width = 640, .height = 480, .ncomp = 3,
+                             .ac_density = 1, .seed = 4};
+    CHECK(jpeg_gen(&vga, &gen) == 0);
+    CHECK_ERR(ESP_OK, motion_process_jpeg(&md, gen.data, gen.len, &result));
+    CHECK(md.config.width == 80 && md.config.height == 60);
+    CHECK(md.frames == 1);
+    CHECK(!result.detected);
+
+    // Not a JPEG: reported, and the model is left alone
+    CHECK(motion_process_jpeg(&md, gen.luma, 64, &result) != ESP_OK);
+    CHECK(md.frames == 1);
+    jpeg_gen_free(&gen);
+    motion_deinit(&md);
+}
+
+int main(void) {
+    test_block_diff_exhaustive();
+    test_block_diff_random();
+    test_block_diff_full_block();
+    test_process();
+    test_process_jpeg();
+    return TEST_RESULT();
+}
@@ -0,0 +1,93 @@
+// Holds every reader slot open and checks that saves and thumbnail stores
+// still get a file, for both engines, and that one reader too many waits
+// and times out instead of taking the writer's file.
+//
+//   test_readers [IMAGE]
+#include "host_sd.h"
+#include "nvs_flash.h"
+#include "nvs_storage.h"
+#include "sd_card.h"
+#include "test_util.h"
+#include <string.h>
+#include <unistd.h>
+
+TEST_DEFINE_FAILURES;
+
+#define IMAGE_SIZE_MB 64
+#define IMAGE_LEN 2048
+#define IMAGES (SD_CARD_MAX_READERS + 2)
+
+static uint8_t image[IMAGE_LEN];
+
+static void save_done(const uint8_t *data, size_t len, esp_err_t result,
+                      void *ctx) {
+    if (result != ESP_OK)
+        (*(uint32_t *)ctx)++;
+}
+
+static esp_err_t save(uint32_t count) {
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (sd_card_queue_image(image, sizeof(image), save_done, &failed,
+                                10000) != ESP_OK)
+            return ESP_ERR_TIMEOUT;
+    }
+    // failed is on this stack, so wait out every queued save
+    esp_err_t err;
+    while ((err = sd_card_flush(30000)) != ESP_OK)
+        ;
+    return failed ? ESP_FAIL : err;
+}
+
+static void test_engine(const char *path, sd_card_engine_t engine) {
+    sd_card_config_t config = {.layout = SD_CARD_LAYOUT_SHARDED,
+                               .engine = engine,
+                               .log_size_mb = IMAGE_SIZE_MB / 2};
+    unlink(path);
+    nvs_flash_erase();
+    CHECK_ERR(ESP_OK, host_sd_attach(path, IMAGE_SIZE_MB));
+    CHECK_ERR(ESP_OK, sd_card_init(&config));
+    CHECK_ERR(ESP_OK, save(IMAGES));
+    CHECK_ERR(ESP_OK, sd_card_store_thumb(1, image, 64));
+
+    sd_card_reader_t readers[SD_CARD_MAX_READERS];
+    for (int i = 0; i < SD_CARD_MAX_READERS; i++)
+        CHECK_ERR(ESP_OK, sd_card_open_image(i + 1, &readers[i]));
+    sd_card_reader_t extra = {0};
+    CHECK_ERR(ESP_ERR_TIMEOUT, sd_card_open_image(IMAGES, &extra));
+    CHECK_ERR(ESP_ERR_TIMEOUT, sd_card_open_thumb(1, &extra));
+
+    // The writer and thumbnail stores have files of their own
+    CHECK_ERR(ESP_OK, save(2));
+    CHECK(sd_card_next_image_number() == IMAGES + 3);
+    CHECK_ERR(ESP_OK, sd_card_store_thumb(2, image, 32));
+
+    // Failed opens gave their slot back, so one close frees exactly one
+    sd_card_close_image(&readers[0]);
+    CHECK_ERR(ESP_OK, sd_card_open_thumb(2, &readers[0]));
+    CHECK(readers[0].size == 32);
+    CHECK_ERR(ESP_ERR_TIMEOUT, sd_card_open_image(IMAGES, &extra));
+    sd_card_close_image(&readers[1]);
+    CHECK_ERR(ESP_ERR_NOT_FOUND, sd_card_open_image(IMAGES + 10, &extra));
+    CHECK_ERR(ESP_OK, sd_card_open_image(IMAGES + 2, &readers[1]));
+    CHECK(readers[1].size == IMAGE_LEN);
+
+    for (int i = 0; i < SD_CARD_MAX_READERS; i++)
+        sd_card_close_image(&readers[i]);
+    sd_card_deinit();
+    host_sd_detach();
+    unlink(path);
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "readers.img";
+    for (size_t i = 0; i < sizeof(image); i++)
+        image[i] = i * 31;
+    image[0] = 0xFF;
+    image[1] = 0xD8;
+    CHECK_ERR(ESP_OK, nvs_storage_init());
+
+    test_engine(path, SD_CARD_ENGINE_FILES);
+    test_engine(path, SD_CARD_ENGINE_LOG);
+    return TEST_RESULT();
+}
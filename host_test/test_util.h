@@ -0,0 +1,35 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Failures are counted rather than aborting, so one run reports them all
+extern int test_failures;
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,  \
+                    #cond);                                                    \
+            test_failures++;                                                   \
+        }                                                                      \
+    } while (0)
+
+#define CHECK_ERR(expected, actual)                                            \
+    do {                                                                       \
+        esp_err_t e_ = (expected), a_ = (actual);                              \
+        if (e_ != a_) {                                                        \
+            fprintf(stderr, "%s:%d: expected %s, got %s\n", __FILE__,         \
+                    __LINE__, esp_err_to_name(e_), esp_err_to_name(a_));       \
+            test_failures++;                                                   \
+        }                                                                      \
+    } while (0)
+
+#define TEST_DEFINE_FAILURES int test_failures = 0
+
+#define TEST_RESULT()                                                          \
+    (test_failures ? (fprintf(stderr, "%d failures\n", test_failures), 1)    \
+                   : (printf("OK\n"), 0))
+
+#endif
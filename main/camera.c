@@ -1,9 +1,33 @@
 #include "camera.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sd_card.h"
+#include <inttypes.h>
+#include <string.h>
 
 static const char *TAG = "camera";
 static camera_config_t camera_config = {0};
 static bool is_initialized = false;
+static camera_owner_t sensor_owner = CAMERA_OWNER_NONE;
+static portMUX_TYPE owner_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static camera_pipeline_config_t pipeline_config = {0};
+// Written by both the pipeline task and the SD writer's callback
+static camera_pipeline_stats_t pipeline_stats = {0};
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t pipeline_task = NULL;
+static SemaphoreHandle_t pipeline_done = NULL;
+static volatile bool pipeline_running = false;
+static int pipeline_prev_fb_count = 0; // Put back when the pipeline ends
+static esp_err_t pipeline_result = ESP_OK;
+
+static uint8_t *burst_arena = NULL;
+static portMUX_TYPE burst_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t burst_pending = 0;
+static SemaphoreHandle_t burst_idle = NULL;
 
 static const camera_settings_t default_settings = {
     .pixel_format = DEFAULT_PIXEL_FORMAT,
@@ -62,6 +86,11 @@ esp_err_t camera_init(void) {
         return err;
     }
 
+    sd_card_capture_info_t info = {.frame_size = settings.frame_size,
+                                   .jpeg_quality = settings.jpeg_quality,
+                                   .pixel_format = settings.pixel_format};
+    sd_card_set_capture_info(&info);
+
     is_initialized = true;
     ESP_LOGI(TAG, "Camera initialized successfully");
     return ESP_OK;
@@ -79,38 +108,367 @@ esp_err_t camera_capture(camera_fb_t **fb) {
         return ESP_FAIL;
     }
 
-    ESP_LOGI(TAG, "Picture taken, size: %zu bytes", (*fb)->len);
+    ESP_LOGD(TAG, "Picture taken, size: %zu bytes", (*fb)->len);
     return ESP_OK;
 }
 
-void camera_deinit(void) {
-    if (is_initialized) {
-        esp_camera_deinit();
-        is_initialized = false;
-        ESP_LOGI(TAG, "Camera deinitialized");
+static const char *owner_name(camera_owner_t owner) {
+    switch (owner) {
+    case CAMERA_OWNER_PIPELINE:
+        return "pipeline";
+    case CAMERA_OWNER_BURST:
+        return "burst";
+    case CAMERA_OWNER_PRETRIGGER:
+        return "pre-trigger";
+    case CAMERA_OWNER_STREAM:
+        return "stream";
+    default:
+        return "none";
     }
 }
 
-esp_err_t camera_save_settings(const camera_settings_t *settings) {
-    esp_err_t err;
+esp_err_t camera_claim(camera_owner_t owner) {
+    TickType_t start = xTaskGetTickCount();
+    camera_owner_t current;
+    while (true) {
+        portENTER_CRITICAL(&owner_lock);
+        current = sensor_owner;
+        if (current == CAMERA_OWNER_NONE)
+            sensor_owner = owner;
+        portEXIT_CRITICAL(&owner_lock);
+        if (current != CAMERA_OWNER_STREAM || owner == CAMERA_OWNER_STREAM ||
+            xTaskGetTickCount() - start >= pdMS_TO_TICKS(CAMERA_CLAIM_WAIT_MS))
+            break;
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    if (current != CAMERA_OWNER_NONE) {
+        // The stream tries again on its next frame
+        if (owner != CAMERA_OWNER_STREAM)
+            ESP_LOGW(TAG, "Sensor busy with %s capture", owner_name(current));
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+void camera_release(camera_owner_t owner) {
+    portENTER_CRITICAL(&owner_lock);
+    if (sensor_owner == owner)
+        sensor_owner = CAMERA_OWNER_NONE;
+    portEXIT_CRITICAL(&owner_lock);
+}
+
+static void burst_frame_released(void) {
+    bool idle;
+    portENTER_CRITICAL(&burst_lock);
+    idle = --burst_pending == 0;
+    portEXIT_CRITICAL(&burst_lock);
+    if (idle)
+        xSemaphoreGive(burst_idle);
+}
+
+static void burst_frame_stored(const uint8_t *data, size_t len,
+                               esp_err_t result, void *ctx) {
+    burst_frame_released();
+}
+
+esp_err_t camera_capture_burst(uint32_t count, uint32_t interval_ms,
+                               camera_burst_t *burst) {
+    if (!is_initialized) {
+        ESP_LOGE(TAG, "Camera not initialized");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (count == 0 || count > CAMERA_BURST_MAX_FRAMES)
+        return ESP_ERR_INVALID_ARG;
+
+    if (burst_arena == NULL) {
+        burst_idle = xSemaphoreCreateBinary();
+        burst_arena =
+            heap_caps_malloc(CAMERA_BURST_ARENA_SIZE, MALLOC_CAP_SPIRAM);
+        if (!burst_arena || !burst_idle) {
+            ESP_LOGE(TAG, "Failed to allocate burst arena");
+            heap_caps_free(burst_arena);
+            burst_arena = NULL;
+            return ESP_ERR_NO_MEM;
+        }
+    }
 
-    err = nvs_storage_write_u32(NVS_CAMERA_NAMESPACE, NVS_KEY_PIXEL_FORMAT,
-                                (uint32_t)settings->pixel_format);
+    // The previous burst may still be on its way to the SD card
+    while (burst_pending) {
+        if (xSemaphoreTake(burst_idle, pdMS_TO_TICKS(5000)) != pdTRUE) {
+            ESP_LOGE(TAG, "Previous burst still being saved");
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+
+    esp_err_t err = camera_claim(CAMERA_OWNER_BURST);
     if (err != ESP_OK)
         return err;
 
-    err = nvs_storage_write_u32(NVS_CAMERA_NAMESPACE, NVS_KEY_FRAME_SIZE,
-                                (uint32_t)settings->frame_size);
-    if (err != ESP_OK)
+    burst->arena = burst_arena;
+    burst->used = 0;
+    burst->count = 0;
+
+    TickType_t last_wake = xTaskGetTickCount();
+    for (uint32_t i = 0; i < count; i++) {
+        if (i > 0 && interval_ms)
+            xTaskDelayUntil(&last_wake, pdMS_TO_TICKS(interval_ms));
+
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+            ESP_LOGE(TAG, "Burst capture failed at frame %" PRIu32, i);
+            err = ESP_FAIL;
+            break;
+        }
+
+        if (fb->len > CAMERA_BURST_ARENA_SIZE - burst->used) {
+            esp_camera_fb_return(fb);
+            ESP_LOGW(TAG, "Burst arena full after %" PRIu32 " frames",
+                     burst->count);
+            err = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        camera_burst_frame_t *frame = &burst->frames[burst->count++];
+        frame->offset = burst->used;
+        frame->len = fb->len;
+        frame->timestamp_us =
+            (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+        memcpy(burst_arena + burst->used, fb->buf, fb->len);
+        // Keep every frame 4-byte aligned within the arena
+        burst->used += (fb->len + 3) & ~(size_t)3;
+        esp_camera_fb_return(fb);
+    }
+    camera_release(CAMERA_OWNER_BURST);
+
+    ESP_LOGI(TAG, "Burst captured %" PRIu32 " frames, %zu bytes",
+             burst->count, burst->used);
+    return burst->count > 0 ? ESP_OK : err;
+}
+
+esp_err_t camera_burst_save(const camera_burst_t *burst) {
+    if (burst->arena != burst_arena || burst_arena == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&burst_lock);
+    if (burst_pending) {
+        portEXIT_CRITICAL(&burst_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    // Held until every frame is queued so the count cannot hit zero early
+    burst_pending = 1;
+    portEXIT_CRITICAL(&burst_lock);
+    xSemaphoreTake(burst_idle, 0);
+
+    esp_err_t err = ESP_OK;
+    for (uint32_t i = 0; i < burst->count; i++) {
+        const camera_burst_frame_t *frame = &burst->frames[i];
+        portENTER_CRITICAL(&burst_lock);
+        burst_pending++;
+        portEXIT_CRITICAL(&burst_lock);
+
+        err = sd_card_queue_image(burst->arena + frame->offset, frame->len,
+                                  burst_frame_stored, NULL,
+                                  CAMERA_BURST_SAVE_TIMEOUT_MS);
+        if (err != ESP_OK) {
+            burst_frame_released();
+            ESP_LOGW(TAG, "Queued %" PRIu32 " of %" PRIu32 " burst frames",
+                     i, burst->count);
+            break;
+        }
+    }
+
+    burst_frame_released();
+    return err;
+}
+
+static esp_err_t camera_reinit(int fb_count) {
+    esp_camera_deinit();
+    is_initialized = false;
+
+    camera_config.fb_count = fb_count;
+    esp_err_t err = esp_camera_init(&camera_config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Camera re-init failed with error 0x%x", err);
         return err;
+    }
+
+    is_initialized = true;
+    ESP_LOGI(TAG, "Camera re-initialized with %d frame buffers", fb_count);
+    return ESP_OK;
+}
+
+// Storage stage completion: hands the frame buffer back to the driver so the
+// sensor can fill it again.
+static void pipeline_frame_stored(const uint8_t *data, size_t len,
+                                  esp_err_t result, void *ctx) {
+    portENTER_CRITICAL(&stats_lock);
+    if (result == ESP_OK)
+        pipeline_stats.stored++;
+    else
+        pipeline_stats.failed++;
+    portEXIT_CRITICAL(&stats_lock);
+    esp_camera_fb_return((camera_fb_t *)ctx);
+}
 
-    err = nvs_storage_write_u32(NVS_CAMERA_NAMESPACE, NVS_KEY_JPEG_QUALITY,
-                                (uint32_t)settings->jpeg_quality);
+static void pipeline_task_fn(void *arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+    uint32_t taken = 0;
+
+    while (pipeline_running && (pipeline_config.frame_count == 0 ||
+                                taken < pipeline_config.frame_count)) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+            ESP_LOGW(TAG, "Pipeline capture failed");
+            continue;
+        }
+        taken++;
+
+        bool dropped = false;
+        if (pipeline_config.process &&
+            pipeline_config.process(fb, pipeline_config.process_ctx) !=
+                ESP_OK) {
+            esp_camera_fb_return(fb);
+            dropped = true;
+        } else if (sd_card_queue_image(fb->buf, fb->len, pipeline_frame_stored,
+                                       fb, 0) != ESP_OK) {
+            esp_camera_fb_return(fb);
+            dropped = true;
+        }
+        portENTER_CRITICAL(&stats_lock);
+        pipeline_stats.captured++;
+        if (dropped)
+            pipeline_stats.dropped++;
+        portEXIT_CRITICAL(&stats_lock);
+
+        if (pipeline_config.interval_ms)
+            xTaskDelayUntil(&last_wake,
+                            pdMS_TO_TICKS(pipeline_config.interval_ms));
+    }
+
+    pipeline_running = false;
+    // Frames still queued for storage own driver buffers until written,
+    // and all of them must be back before the driver is set up again.
+    // Still holding the sensor, so nothing grabs from it meanwhile.
+    esp_err_t err = sd_card_flush(CAMERA_PIPELINE_FLUSH_TIMEOUT_MS);
+    if (err != ESP_OK)
+        ESP_LOGW(TAG, "Pipeline frames still queued, keeping its buffers");
+    else if (pipeline_prev_fb_count != camera_config.fb_count)
+        err = camera_reinit(pipeline_prev_fb_count);
+    pipeline_result = err;
+    camera_release(CAMERA_OWNER_PIPELINE);
+    xSemaphoreGive(pipeline_done);
+    vTaskDelete(NULL);
+}
+
+esp_err_t camera_pipeline_start(const camera_pipeline_config_t *config) {
+    if (!is_initialized) {
+        ESP_LOGE(TAG, "Camera not initialized");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (pipeline_running) {
+        ESP_LOGW(TAG, "Pipeline already running");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (pipeline_done == NULL) {
+        pipeline_done = xSemaphoreCreateBinary();
+        if (pipeline_done == NULL)
+            return ESP_ERR_NO_MEM;
+    }
+    // Reap a pipeline that finished on its own since the last stop
+    xSemaphoreTake(pipeline_done, 0);
+
+    esp_err_t err = camera_claim(CAMERA_OWNER_PIPELINE);
     if (err != ESP_OK)
         return err;
 
-    err = nvs_storage_write_u32(NVS_CAMERA_NAMESPACE, NVS_KEY_FB_COUNT,
-                                (uint32_t)settings->fb_count);
+    // With a single buffer the sensor idles while storage holds the frame.
+    // The driver hands out the oldest buffer first, so other modes would
+    // get stale frames: the task puts the old count back when it ends.
+    pipeline_prev_fb_count = camera_config.fb_count;
+    if (camera_config.fb_count < CAMERA_PIPELINE_FB_COUNT) {
+        err = camera_reinit(CAMERA_PIPELINE_FB_COUNT);
+        if (err != ESP_OK) {
+            camera_release(CAMERA_OWNER_PIPELINE);
+            return err;
+        }
+    }
+
+    pipeline_config = *config;
+    portENTER_CRITICAL(&stats_lock);
+    pipeline_stats = (camera_pipeline_stats_t){0};
+    portEXIT_CRITICAL(&stats_lock);
+    pipeline_running = true;
+
+    if (xTaskCreatePinnedToCore(pipeline_task_fn, "cam_pipeline",
+                                CAMERA_PIPELINE_STACK_SIZE, NULL,
+                                CAMERA_PIPELINE_PRIORITY, &pipeline_task,
+                                CAMERA_PIPELINE_CORE) != pdPASS) {
+        pipeline_running = false;
+        pipeline_task = NULL;
+        if (pipeline_prev_fb_count != camera_config.fb_count)
+            camera_reinit(pipeline_prev_fb_count);
+        camera_release(CAMERA_OWNER_PIPELINE);
+        ESP_LOGE(TAG, "Failed to create pipeline task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Capture pipeline started");
+    return ESP_OK;
+}
+
+esp_err_t camera_pipeline_stop(void) {
+    if (pipeline_task == NULL)
+        return ESP_OK;
+
+    pipeline_running = false;
+    if (xSemaphoreTake(pipeline_done,
+                       pdMS_TO_TICKS(CAMERA_PIPELINE_STOP_TIMEOUT_MS)) !=
+        pdTRUE) {
+        ESP_LOGE(TAG, "Pipeline task did not stop");
+        return ESP_ERR_TIMEOUT;
+    }
+    pipeline_task = NULL;
+
+    esp_err_t err = pipeline_result;
+    camera_pipeline_stats_t stats;
+    camera_pipeline_get_stats(&stats);
+    ESP_LOGI(TAG,
+             "Capture pipeline stopped: %" PRIu32 " captured, %" PRIu32
+             " stored, %" PRIu32 " dropped, %" PRIu32 " failed",
+             stats.captured, stats.stored, stats.dropped, stats.failed);
+    return err;
+}
+
+bool camera_pipeline_running(void) { return pipeline_running; }
+
+void camera_pipeline_get_stats(camera_pipeline_stats_t *stats) {
+    portENTER_CRITICAL(&stats_lock);
+    *stats = pipeline_stats;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void camera_deinit(void) {
+    camera_pipeline_stop();
+    if (is_initialized) {
+        esp_camera_deinit();
+        is_initialized = false;
+        ESP_LOGI(TAG, "Camera deinitialized");
+    }
+}
+
+esp_err_t camera_save_settings(const camera_settings_t *settings) {
+    nvs_storage_batch_t batch;
+    nvs_storage_batch_begin(&batch, NVS_CAMERA_NAMESPACE);
+    nvs_storage_batch_set_u32(&batch, NVS_KEY_PIXEL_FORMAT,
+                              (uint32_t)settings->pixel_format);
+    nvs_storage_batch_set_u32(&batch, NVS_KEY_FRAME_SIZE,
+                              (uint32_t)settings->frame_size);
+    nvs_storage_batch_set_u32(&batch, NVS_KEY_JPEG_QUALITY,
+                              (uint32_t)settings->jpeg_quality);
+    nvs_storage_batch_set_u32(&batch, NVS_KEY_FB_COUNT,
+                              (uint32_t)settings->fb_count);
+    esp_err_t err = nvs_storage_batch_end(&batch);
     if (err != ESP_OK)
         return err;
 
@@ -10,6 +10,21 @@
 #define DEFAULT_FRAME_SIZE FRAMESIZE_VGA
 #define DEFAULT_JPEG_QUALITY 10
 #define DEFAULT_FB_COUNT 1
+#define CAMERA_MAX_FB_COUNT 3
+
+#define CAMERA_PIPELINE_FB_COUNT 3
+#define CAMERA_PIPELINE_STACK_SIZE 4096
+#define CAMERA_PIPELINE_PRIORITY 6
+#define CAMERA_PIPELINE_CORE 0
+#define CAMERA_PIPELINE_FLUSH_TIMEOUT_MS 5000
+// Covers the last frame in flight, the flush and the driver reinit
+#define CAMERA_PIPELINE_STOP_TIMEOUT_MS 10000
+
+#define CAMERA_BURST_MAX_FRAMES 10
+#define CAMERA_BURST_ARENA_SIZE (1536 * 1024)
+#define CAMERA_BURST_SAVE_TIMEOUT_MS 2000
+// How long a claim waits out a stream grab before giving up
+#define CAMERA_CLAIM_WAIT_MS 1000
 
 #define CAM_PWDN_GPIO -1
 #define CAM_RESET_GPIO -1
@@ -35,9 +50,63 @@ typedef struct {
     int fb_count;
 } camera_settings_t;
 
+// Processing stage of the capture pipeline, run on every frame before it is
+// handed to storage. Returning anything but ESP_OK drops the frame.
+typedef esp_err_t (*camera_frame_cb_t)(camera_fb_t *fb, void *ctx);
+
+// Capture modes. Only one may drive the sensor at a time.
+typedef enum {
+    CAMERA_OWNER_NONE,
+    CAMERA_OWNER_PIPELINE,
+    CAMERA_OWNER_BURST,
+    CAMERA_OWNER_PRETRIGGER,
+    CAMERA_OWNER_STREAM, // Held for a single grab at a time
+} camera_owner_t;
+
+typedef struct {
+    uint32_t frame_count; // 0 runs until camera_pipeline_stop
+    uint32_t interval_ms; // 0 captures as fast as the sensor delivers
+    camera_frame_cb_t process;
+    void *process_ctx;
+} camera_pipeline_config_t;
+
+typedef struct {
+    uint32_t captured;
+    uint32_t dropped;
+    uint32_t stored;
+    uint32_t failed;
+} camera_pipeline_stats_t;
+
+typedef struct {
+    size_t offset; // Into the burst arena
+    size_t len;
+    int64_t timestamp_us;
+} camera_burst_frame_t;
+
+// Frames point into a single PSRAM arena owned by the camera module. The
+// arena is reused by the next burst, which waits for camera_burst_save to
+// finish writing the previous one.
+typedef struct {
+    const uint8_t *arena;
+    size_t used;
+    uint32_t count;
+    camera_burst_frame_t frames[CAMERA_BURST_MAX_FRAMES];
+} camera_burst_t;
+
 esp_err_t camera_init(void);
 esp_err_t camera_capture(camera_fb_t **fb);
+esp_err_t camera_capture_burst(uint32_t count, uint32_t interval_ms,
+                               camera_burst_t *burst);
+esp_err_t camera_burst_save(const camera_burst_t *burst);
 void camera_deinit(void);
+esp_err_t camera_pipeline_start(const camera_pipeline_config_t *config);
+esp_err_t camera_pipeline_stop(void);
+bool camera_pipeline_running(void);
+void camera_pipeline_get_stats(camera_pipeline_stats_t *stats);
+// ESP_ERR_INVALID_STATE while another mode owns the sensor. Other modes
+// wait up to CAMERA_CLAIM_WAIT_MS for a stream grab to finish first.
+esp_err_t camera_claim(camera_owner_t owner);
+void camera_release(camera_owner_t owner);
 esp_err_t camera_save_settings(const camera_settings_t *settings);
 esp_err_t camera_load_settings(camera_settings_t *settings);
 
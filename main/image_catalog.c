@@ -0,0 +1,238 @@
+#include "image_catalog.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Entries live in one PSRAM array sorted by number. Live entries are
+// [head, len); dropping the oldest only advances head.
+static const char *TAG = "image_catalog";
+static SemaphoreHandle_t catalog_mutex = NULL;
+static image_catalog_entry_t *entries = NULL;
+static size_t capacity = 0;
+static size_t head = 0;
+static size_t len = 0;
+static uint64_t total_size = 0;
+static bool is_ready = false;
+
+static int compare_entries(const void *a, const void *b) {
+    uint32_t na = ((const image_catalog_entry_t *)a)->number;
+    uint32_t nb = ((const image_catalog_entry_t *)b)->number;
+    return na < nb ? -1 : na > nb;
+}
+
+// Index of the first entry numbered >= number
+static size_t lower_bound(uint32_t number) {
+    size_t lo = head, hi = len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].number < number)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static esp_err_t reserve_one(void) {
+    if (len < capacity)
+        return ESP_OK;
+
+    if (head > 0) {
+        memmove(entries, entries + head, (len - head) * sizeof(entries[0]));
+        len -= head;
+        head = 0;
+        return ESP_OK;
+    }
+
+    size_t new_capacity =
+        capacity ? capacity * 2 : IMAGE_CATALOG_INITIAL_CAPACITY;
+    image_catalog_entry_t *grown = heap_caps_realloc(
+        entries, new_capacity * sizeof(entries[0]), MALLOC_CAP_SPIRAM);
+    if (!grown) {
+        ESP_LOGE(TAG, "Failed to grow catalog to %zu entries", new_capacity);
+        return ESP_ERR_NO_MEM;
+    }
+    entries = grown;
+    capacity = new_capacity;
+    return ESP_OK;
+}
+
+esp_err_t image_catalog_init(void) {
+    if (catalog_mutex == NULL) {
+        catalog_mutex = xSemaphoreCreateMutex();
+        if (catalog_mutex == NULL)
+            return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void image_catalog_reset(void) {
+    xSemaphoreTake(catalog_mutex, portMAX_DELAY);
+    head = 0;
+    len = 0;
+    total_size = 0;
+    is_ready = false;
+    xSemaphoreGive(catalog_mutex);
+}
+
+esp_err_t image_catalog_add(const image_catalog_entry_t *entry) {
+    xSemaphoreTake(catalog_mutex, portMAX_DELAY);
+    esp_err_t err = reserve_one();
+    if (err != ESP_OK) {
+        xSemaphoreGive(catalog_mutex);
+        return err;
+    }
+
+    if (!is_ready || len == head || entries[len - 1].number < entry->number) {
+        entries[len++] = *entry;
+    } else {
+        size_t pos = lower_bound(entry->number);
+        if (pos < len && entries[pos].number == entry->number) {
+            total_size -= entries[pos].size;
+            entries[pos] = *entry;
+            total_size += entry->size;
+            xSemaphoreGive(catalog_mutex);
+            return ESP_OK;
+        }
+        memmove(entries + pos + 1, entries + pos,
+                (len - pos) * sizeof(entries[0]));
+        entries[pos] = *entry;
+        len++;
+    }
+    total_size += entry->size;
+    xSemaphoreGive(catalog_mutex);
+    return ESP_OK;
+}
+
+void image_catalog_finish_build(void) {
+    xSemaphoreTake(catalog_mutex, portMAX_DELAY);
+    // entries is still NULL on a card with no images
+    if (len > head)
+        qsort(entries + head, len - head, sizeof(entries[0]),
+              compare_entries);
+
+    // The same number can show up twice, e.g. flat and sharded copies
+    size_t out = head;
+    for (size_t i = head; i < len; i++) {
+        if (out > head && entries[out - 1].number == entries[i].number) {
+            total_size -= entries[out - 1].size;
+            entries[out - 1] = entries[i];
+        } else {
+            entries[out++] = entries[i];
+        }
+    }
+    len = out;
+    is_ready = true;
+    ESP_LOGI(TAG, "Catalog ready: %zu images, %" PRIu64 " bytes", len - head,
+             total_size);
+    xSemaphoreGive(catalog_mutex);
+}
+
+bool image_catalog_ready(void) { return is_ready; }
+
+esp_err_t image_catalog_remove(uint32_t number) {
+    if (!is_ready)
+        return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(catalog_mutex, portMAX_DELAY);
+    size_t pos = lower_bound(number);
+    if (pos == len || entries[pos].number != number) {
+        xSemaphoreGive(catalog_mutex);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    total_size -= entries[pos].size;
+    if (pos == head) {
+        head++;
+    } else {
+        memmove(entries + pos, entries + pos + 1,
+                (len - pos - 1) * sizeof(entries[0]));
+        len--;
+    }
+    if (head == len)
+        head = len = 0;
+    xSemaphoreGive(catalog_mutex);
+    return ESP_OK;
+}
+
+esp_err_t image_catalog_lookup(uint32_t number,
+                               image_catalog_entry_t *entry) {
+    if (!is_ready)
+        return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(catalog_mutex, portMAX_DELAY);
+    size_t pos = lower_bound(number);
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    if (pos < len && entries[pos].number == number) {
+        *entry = entries[pos];
+        err = ESP_OK;
+    }
+    xSemaphoreGive(catalog_mutex);
+    return err;
+}
+
+esp_err_t image_catalog_oldest(image_catalog_entry_t *entry) {
+    if (!is_ready)
+        return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(catalog_mutex, portMAX_DELAY);
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    if (head < len) {
+        *entry = entries[head];
+        err = ESP_OK;
+    }
+    xSemaphoreGive(catalog_mutex);
+    return err;
+}
+
+uint32_t image_catalog_count(void) {
+    if (!is_ready)
+        return 0;
+
+    xSemaphoreTake(catalog_mutex, portMAX_DELAY);
+    uint32_t count = len - head;
+    xSemaphoreGive(catalog_mutex);
+    return count;
+}
+
+uint64_t image_catalog_total_size(void) {
+    if (!is_ready)
+        return 0;
+
+    xSemaphoreTake(catalog_mutex, portMAX_DELAY);
+    uint64_t size = total_size;
+    xSemaphoreGive(catalog_mutex);
+    return size;
+}
+
+size_t image_catalog_newest(uint32_t before, image_catalog_entry_t *out,
+                            size_t max) {
+    if (!is_ready)
+        return 0;
+
+    xSemaphoreTake(catalog_mutex, portMAX_DELAY);
+    size_t end = before ? lower_bound(before) : len;
+    size_t n = 0;
+    while (n < max && end > head)
+        out[n++] = entries[--end];
+    xSemaphoreGive(catalog_mutex);
+    return n;
+}
+
+size_t image_catalog_from(uint32_t first, image_catalog_entry_t *out,
+                          size_t max) {
+    if (!is_ready)
+        return 0;
+
+    xSemaphoreTake(catalog_mutex, portMAX_DELAY);
+    size_t pos = lower_bound(first);
+    size_t n = 0;
+    while (n < max && pos < len)
+        out[n++] = entries[pos++];
+    xSemaphoreGive(catalog_mutex);
+    return n;
+}
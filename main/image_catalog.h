@@ -0,0 +1,42 @@
+#ifndef IMAGE_CATALOG_H
+#define IMAGE_CATALOG_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMAGE_CATALOG_INITIAL_CAPACITY 1024
+
+#define IMAGE_CATALOG_FLAG_FLAT (1 << 0) // In the card root, not in a shard
+
+typedef struct {
+    uint32_t number;
+    uint32_t size;
+    uint32_t timestamp;
+    uint32_t location; // Record offset for the log engine
+    uint16_t flags;
+    uint16_t reserved;
+} image_catalog_entry_t;
+
+esp_err_t image_catalog_init(void);
+// Empties the catalog and marks it as not built
+void image_catalog_reset(void);
+// Entries may arrive in any order until image_catalog_finish_build
+esp_err_t image_catalog_add(const image_catalog_entry_t *entry);
+void image_catalog_finish_build(void);
+bool image_catalog_ready(void);
+esp_err_t image_catalog_remove(uint32_t number);
+esp_err_t image_catalog_lookup(uint32_t number, image_catalog_entry_t *entry);
+esp_err_t image_catalog_oldest(image_catalog_entry_t *entry);
+uint32_t image_catalog_count(void);
+uint64_t image_catalog_total_size(void);
+// Copies up to max entries numbered below before (0 for no bound), newest
+// first. Returns the number of entries copied.
+size_t image_catalog_newest(uint32_t before, image_catalog_entry_t *out,
+                            size_t max);
+// Copies up to max entries numbered first or above, oldest first
+size_t image_catalog_from(uint32_t first, image_catalog_entry_t *out,
+                          size_t max);
+
+#endif
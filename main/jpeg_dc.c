@@ -0,0 +1,436 @@
+#include "jpeg_dc.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JPEG_MAX_COMPONENTS 3
+#define HUFF_LOOKAHEAD 9
+// Baseline DC coefficients are 11 bits signed
+#define JPEG_DC_MAX 2047
+
+typedef struct {
+    // Canonical decoding per code length, index 1..16
+    int32_t maxcode[18];
+    int32_t valoffset[17];
+    uint8_t values[256];
+    // Code length and symbol for every HUFF_LOOKAHEAD-bit prefix, 0 length
+    // when the code is longer than the lookahead
+    uint8_t look_len[1 << HUFF_LOOKAHEAD];
+    uint8_t look_sym[1 << HUFF_LOOKAHEAD];
+    bool valid;
+} huff_table_t;
+
+typedef struct {
+    uint8_t id;
+    uint8_t h;
+    uint8_t v;
+    uint8_t tq;
+    uint8_t td;
+    uint8_t ta;
+    int pred;
+} jpeg_component_t;
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t bits;
+    int count;
+    bool marker; // Hit a marker, the rest of the segment reads as zeros
+} bit_reader_t;
+
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint8_t ncomp;
+    jpeg_component_t comp[JPEG_MAX_COMPONENTS];
+    uint16_t qdc[4]; // DC entry of each quantization table
+    huff_table_t dc[2];
+    huff_table_t ac[2];
+    uint16_t restart_interval;
+    uint8_t scan_ncomp;
+    uint8_t scan_comp[JPEG_MAX_COMPONENTS];
+    const uint8_t *scan_data;
+} jpeg_ctx_t;
+
+static uint16_t read_u16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+static esp_err_t build_huff(huff_table_t *t, const uint8_t *counts,
+                            const uint8_t *symbols, int nsymbols) {
+    t->valid = false;
+    memcpy(t->values, symbols, nsymbols);
+    memset(t->look_len, 0, sizeof(t->look_len));
+
+    int code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        t->valoffset[len] = k - code;
+        // Reject overfull lengths before any of their codes are written
+        int n = counts[len - 1];
+        if (code + n > (1 << len) || k + n > nsymbols)
+            return ESP_ERR_INVALID_RESPONSE;
+        if (n) {
+            for (int i = 0; i < n; i++, k++, code++) {
+                if (len <= HUFF_LOOKAHEAD) {
+                    int shift = HUFF_LOOKAHEAD - len;
+                    for (int j = 0; j < (1 << shift); j++) {
+                        t->look_len[(code << shift) | j] = len;
+                        t->look_sym[(code << shift) | j] = t->values[k];
+                    }
+                }
+            }
+            t->maxcode[len] = code - 1;
+        } else {
+            t->maxcode[len] = -1;
+        }
+        code <<= 1;
+    }
+    t->maxcode[17] = INT32_MAX; // Sentinel for corrupt streams
+    t->valid = true;
+    return ESP_OK;
+}
+
+static void fill_bits(bit_reader_t *br) {
+    while (br->count <= 24) {
+        uint32_t byte = 0;
+        if (!br->marker && br->p < br->end) {
+            byte = *br->p;
+            if (byte == 0xFF) {
+                uint8_t next = br->p + 1 < br->end ? br->p[1] : 0xD9;
+                if (next == 0x00) {
+                    br->p += 2;
+                } else {
+                    br->marker = true;
+                    byte = 0;
+                }
+            } else {
+                br->p++;
+            }
+        }
+        br->bits |= byte << (24 - br->count);
+        br->count += 8;
+    }
+}
+
+static inline uint32_t get_bits(bit_reader_t *br, int n) {
+    if (n == 0)
+        return 0;
+    if (br->count < n)
+        fill_bits(br);
+    uint32_t v = br->bits >> (32 - n);
+    br->bits <<= n;
+    br->count -= n;
+    return v;
+}
+
+static inline int decode_huff(bit_reader_t *br, const huff_table_t *t) {
+    if (br->count < 16)
+        fill_bits(br);
+
+    uint32_t look = br->bits >> (32 - HUFF_LOOKAHEAD);
+    int len = t->look_len[look];
+    if (len) {
+        br->bits <<= len;
+        br->count -= len;
+        return t->look_sym[look];
+    }
+
+    len = HUFF_LOOKAHEAD + 1;
+    int32_t code = br->bits >> (32 - len);
+    while (code > t->maxcode[len]) {
+        len++;
+        if (len > 16)
+            return -1;
+        code = br->bits >> (32 - len);
+    }
+    br->bits <<= len;
+    br->count -= len;
+    return t->values[code + t->valoffset[len]];
+}
+
+static inline int extend(uint32_t v, int s) {
+    return v < (1u << (s - 1)) ? (int)v - (1 << s) + 1 : (int)v;
+}
+
+// Walks the marker segments up to the start of the entropy-coded scan
+static esp_err_t parse_headers(jpeg_ctx_t *ctx, const uint8_t *jpeg,
+                               size_t len) {
+    const uint8_t *p = jpeg;
+    const uint8_t *end = jpeg + len;
+
+    if (len < 4 || p[0] != 0xFF || p[1] != 0xD8)
+        return ESP_ERR_INVALID_ARG;
+    p += 2;
+
+    bool have_frame = false;
+    while (p + 4 <= end) {
+        if (p[0] != 0xFF) {
+            p++;
+            continue;
+        }
+        uint8_t marker = p[1];
+        if (marker == 0xFF) {
+            p++;
+            continue;
+        }
+        uint16_t seg_len = read_u16(p + 2);
+        const uint8_t *seg = p + 4;
+        const uint8_t *seg_end = p + 2 + seg_len;
+        if (seg_len < 2 || seg_end > end)
+            return ESP_ERR_INVALID_SIZE;
+
+        switch (marker) {
+        case 0xC0: // Baseline
+        case 0xC1: // Extended sequential, Huffman
+            if (seg_len < 8)
+                return ESP_ERR_INVALID_SIZE;
+            ctx->height = read_u16(seg + 1);
+            ctx->width = read_u16(seg + 3);
+            ctx->ncomp = seg[5];
+            if (ctx->ncomp == 0 || ctx->ncomp > JPEG_MAX_COMPONENTS ||
+                seg_len < 8 + 3 * ctx->ncomp || ctx->width == 0 ||
+                ctx->height == 0)
+                return ESP_ERR_NOT_SUPPORTED;
+            for (int i = 0; i < ctx->ncomp; i++) {
+                const uint8_t *c = seg + 6 + 3 * i;
+                ctx->comp[i].id = c[0];
+                ctx->comp[i].h = c[1] >> 4;
+                ctx->comp[i].v = c[1] & 0x0F;
+                ctx->comp[i].tq = c[2] & 0x03;
+                if (ctx->comp[i].h == 0 || ctx->comp[i].h > 4 ||
+                    ctx->comp[i].v == 0 || ctx->comp[i].v > 4)
+                    return ESP_ERR_NOT_SUPPORTED;
+            }
+            have_frame = true;
+            break;
+        case 0xC2: // Progressive and arithmetic coding are not handled
+        case 0xC3:
+        case 0xC9:
+        case 0xCA:
+        case 0xCB:
+            return ESP_ERR_NOT_SUPPORTED;
+        case 0xC4:
+            while (seg + 17 <= seg_end) {
+                uint8_t tc = seg[0] >> 4;
+                uint8_t th = seg[0] & 0x0F;
+                int total = 0;
+                for (int i = 0; i < 16; i++)
+                    total += seg[1 + i];
+                if (th > 1 || tc > 1 || total > 256 ||
+                    seg + 17 + total > seg_end)
+                    return ESP_ERR_INVALID_SIZE;
+                huff_table_t *t = tc ? &ctx->ac[th] : &ctx->dc[th];
+                esp_err_t err = build_huff(t, seg + 1, seg + 17, total);
+                if (err != ESP_OK)
+                    return err;
+                seg += 17 + total;
+            }
+            break;
+        case 0xDB:
+            while (seg < seg_end) {
+                uint8_t pq = seg[0] >> 4;
+                uint8_t tq = seg[0] & 0x03;
+                size_t table_len = pq ? 129 : 65;
+                if (seg + table_len > seg_end)
+                    return ESP_ERR_INVALID_SIZE;
+                ctx->qdc[tq] = pq ? read_u16(seg + 1) : seg[1];
+                seg += table_len;
+            }
+            break;
+        case 0xDD:
+            if (seg_len < 4)
+                return ESP_ERR_INVALID_SIZE;
+            ctx->restart_interval = read_u16(seg);
+            break;
+        case 0xDA:
+            if (!have_frame)
+                return ESP_ERR_INVALID_STATE;
+            if (seg_len < 3)
+                return ESP_ERR_INVALID_SIZE;
+            ctx->scan_ncomp = seg[0];
+            if (ctx->scan_ncomp == 0 || ctx->scan_ncomp > ctx->ncomp)
+                return ESP_ERR_NOT_SUPPORTED;
+            // Component selectors, then Ss, Se and Ah/Al
+            if (seg_len < 6 + 2 * ctx->scan_ncomp)
+                return ESP_ERR_INVALID_SIZE;
+            for (int i = 0; i < ctx->scan_ncomp; i++) {
+                const uint8_t *c = seg + 1 + 2 * i;
+                int idx = -1;
+                for (int j = 0; j < ctx->ncomp; j++)
+                    if (ctx->comp[j].id == c[0])
+                        idx = j;
+                if (idx < 0)
+                    return ESP_ERR_INVALID_RESPONSE;
+                ctx->scan_comp[i] = idx;
+                ctx->comp[idx].td = (c[1] >> 4) & 1;
+                ctx->comp[idx].ta = c[1] & 1;
+                if (!ctx->dc[ctx->comp[idx].td].valid ||
+                    !ctx->ac[ctx->comp[idx].ta].valid)
+                    return ESP_ERR_INVALID_RESPONSE;
+            }
+            // Only a scan carrying the luma component is useful here
+            if (ctx->scan_comp[0] != 0)
+                return ESP_ERR_NOT_SUPPORTED;
+            ctx->scan_data = seg_end;
+            return ESP_OK;
+        case 0xD9:
+            return ESP_ERR_INVALID_SIZE;
+        default:
+            break;
+        }
+        p = seg_end;
+    }
+    return have_frame ? ESP_ERR_INVALID_SIZE : ESP_ERR_INVALID_ARG;
+}
+
+// Skips to just past the expected RSTn marker and resets the decoder state
+static void restart(jpeg_ctx_t *ctx, bit_reader_t *br) {
+    const uint8_t *p = br->p;
+    while (p + 1 < br->end &&
+           !(p[0] == 0xFF && p[1] >= 0xD0 && p[1] <= 0xD7))
+        p++;
+    br->p = p + 1 < br->end ? p + 2 : br->end;
+    br->bits = 0;
+    br->count = 0;
+    br->marker = false;
+    for (int i = 0; i < ctx->ncomp; i++)
+        ctx->comp[i].pred = 0;
+}
+
+static inline bool decode_block(bit_reader_t *br, jpeg_component_t *comp,
+                                const huff_table_t *dc,
+                                const huff_table_t *ac) {
+    int s = decode_huff(br, dc);
+    if (s < 0 || s > 11)
+        return false;
+    if (s)
+        comp->pred += extend(get_bits(br, s), s);
+    // Differences can walk the predictor anywhere, and pred * q overflows
+    if (comp->pred > JPEG_DC_MAX || comp->pred < -JPEG_DC_MAX)
+        return false;
+
+    for (int k = 1; k < 64; k++) {
+        int rs = decode_huff(br, ac);
+        if (rs < 0)
+            return false;
+        int r = rs >> 4;
+        s = rs & 0x0F;
+        if (s == 0) {
+            if (r != 15)
+                break;
+            k += 15;
+            continue;
+        }
+        k += r;
+        get_bits(br, s);
+    }
+    return true;
+}
+
+static inline uint8_t dc_to_pixel(int pred, uint16_t q) {
+    // The DC term is eight times the block mean, level shifted by 128
+    int v = ((pred * q + 4) >> 3) + 128;
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+esp_err_t jpeg_dc_get_size(const uint8_t *jpeg, size_t len, uint16_t *width,
+                           uint16_t *height) {
+    jpeg_ctx_t *ctx = calloc(1, sizeof(jpeg_ctx_t));
+    if (!ctx)
+        return ESP_ERR_NO_MEM;
+    esp_err_t err = parse_headers(ctx, jpeg, len);
+    if (err == ESP_OK) {
+        *width = (ctx->width + 7) / 8;
+        *height = (ctx->height + 7) / 8;
+    }
+    free(ctx);
+    return err;
+}
+
+static esp_err_t decode_luma(jpeg_ctx_t *ctx, const uint8_t *jpeg,
+                             size_t len, uint8_t *out, size_t out_size,
+                             uint16_t *width, uint16_t *height) {
+    esp_err_t err = parse_headers(ctx, jpeg, len);
+    if (err != ESP_OK)
+        return err;
+
+    uint16_t out_w = (ctx->width + 7) / 8;
+    uint16_t out_h = (ctx->height + 7) / 8;
+    if ((size_t)out_w * out_h > out_size)
+        return ESP_ERR_INVALID_SIZE;
+
+    uint8_t hmax = 1, vmax = 1;
+    for (int i = 0; i < ctx->ncomp; i++) {
+        if (ctx->comp[i].h > hmax)
+            hmax = ctx->comp[i].h;
+        if (ctx->comp[i].v > vmax)
+            vmax = ctx->comp[i].v;
+    }
+    // Subsampled luma would need scaling, which camera output never has
+    if (ctx->comp[0].h != hmax || ctx->comp[0].v != vmax)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    // A single-component scan is not interleaved and codes its blocks in
+    // plain raster order, one block per MCU
+    bool interleaved = ctx->scan_ncomp > 1;
+    uint32_t mcus_x, mcus_y;
+    if (interleaved) {
+        mcus_x = (ctx->width + 8 * hmax - 1) / (8 * hmax);
+        mcus_y = (ctx->height + 8 * vmax - 1) / (8 * vmax);
+    } else {
+        mcus_x = out_w;
+        mcus_y = out_h;
+    }
+
+    bit_reader_t br = {.p = ctx->scan_data, .end = jpeg + len};
+    uint16_t q = ctx->qdc[ctx->comp[0].tq];
+    uint32_t mcus_left = ctx->restart_interval;
+
+    for (uint32_t my = 0; my < mcus_y; my++) {
+        for (uint32_t mx = 0; mx < mcus_x; mx++) {
+            if (ctx->restart_interval) {
+                if (mcus_left == 0) {
+                    restart(ctx, &br);
+                    mcus_left = ctx->restart_interval;
+                }
+                mcus_left--;
+            }
+
+            for (int s = 0; s < ctx->scan_ncomp; s++) {
+                jpeg_component_t *comp = &ctx->comp[ctx->scan_comp[s]];
+                const huff_table_t *dc = &ctx->dc[comp->td];
+                const huff_table_t *ac = &ctx->ac[comp->ta];
+                uint8_t bh = interleaved ? comp->h : 1;
+                uint8_t bv = interleaved ? comp->v : 1;
+
+                for (uint8_t v = 0; v < bv; v++) {
+                    for (uint8_t h = 0; h < bh; h++) {
+                        if (!decode_block(&br, comp, dc, ac))
+                            return ESP_ERR_INVALID_RESPONSE;
+                        if (s != 0)
+                            continue;
+                        uint32_t x = mx * bh + h;
+                        uint32_t y = my * bv + v;
+                        // MCU padding past the image edge is dropped
+                        if (x < out_w && y < out_h)
+                            out[y * out_w + x] = dc_to_pixel(comp->pred, q);
+                    }
+                }
+            }
+        }
+    }
+
+    *width = out_w;
+    *height = out_h;
+    return ESP_OK;
+}
+
+esp_err_t jpeg_dc_luma(const uint8_t *jpeg, size_t len, uint8_t *out,
+                       size_t out_size, uint16_t *width, uint16_t *height) {
+    // Huffman tables take several KB, too much for small task stacks
+    jpeg_ctx_t *ctx = calloc(1, sizeof(jpeg_ctx_t));
+    if (!ctx)
+        return ESP_ERR_NO_MEM;
+    esp_err_t err = decode_luma(ctx, jpeg, len, out, out_size, width, height);
+    free(ctx);
+    return err;
+}
@@ -0,0 +1,16 @@
+#ifndef JPEG_DC_H
+#define JPEG_DC_H
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of the 1/8 scale luma image of a JPEG, one pixel per 8x8 block
+esp_err_t jpeg_dc_get_size(const uint8_t *jpeg, size_t len, uint16_t *width,
+                           uint16_t *height);
+// Decodes only the DC coefficients of the luma blocks of a baseline JPEG.
+// AC coefficients are entropy-decoded and skipped, no IDCT is done.
+esp_err_t jpeg_dc_luma(const uint8_t *jpeg, size_t len, uint8_t *out,
+                       size_t out_size, uint16_t *width, uint16_t *height);
+
+#endif
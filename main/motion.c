@@ -0,0 +1,255 @@
+#include "motion.h"
+#include "jpeg_dc.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define LANE_LO 0x00FF00FFu
+#define LANE_ONE 0x00010001u
+#define LANE_BIAS 0x01000100u
+
+uint32_t motion_block_diff_ref(const uint8_t *cur, const uint8_t *bg,
+                               size_t stride, uint16_t block_w,
+                               uint16_t block_h, uint8_t threshold) {
+    uint32_t count = 0;
+    for (uint16_t y = 0; y < block_h; y++) {
+        for (uint16_t x = 0; x < block_w; x++) {
+            int diff = (int)cur[x] - (int)bg[x];
+            if (abs(diff) > threshold)
+                count++;
+        }
+        cur += stride;
+        bg += stride;
+    }
+    return count;
+}
+
+// Per-pixel |a - b| > threshold for the two bytes held in the low halves of
+// each 16-bit lane. Biasing a by 0x100 keeps the subtraction from borrowing
+// across lanes, and bit 8 of the result tells whether a >= b.
+static inline uint32_t lane_changed(uint32_t a, uint32_t b, uint32_t bias) {
+    uint32_t d = (a | LANE_BIAS) - b;
+    uint32_t neg = (((d >> 8) & LANE_ONE) ^ LANE_ONE) * 0xFF;
+    uint32_t absdiff = ((d & LANE_LO) ^ neg) + (neg & LANE_ONE);
+    return ((absdiff + bias) >> 8) & LANE_ONE;
+}
+
+uint32_t motion_block_diff(const uint8_t *cur, const uint8_t *bg,
+                           size_t stride, uint16_t block_w, uint16_t block_h,
+                           uint8_t threshold) {
+    if (((uintptr_t)cur | (uintptr_t)bg | stride | block_w) & 3)
+        return motion_block_diff_ref(cur, bg, stride, block_w, block_h,
+                                     threshold);
+
+    // Lanes count at most one per pixel pair, so 16 bits cannot overflow for
+    // blocks up to MOTION_MAX_BLOCK_SIZE squared
+    uint32_t bias = (uint32_t)(255 - threshold) * LANE_ONE;
+    uint32_t acc = 0;
+    for (uint16_t y = 0; y < block_h; y++) {
+        const uint32_t *c = (const uint32_t *)cur;
+        const uint32_t *b = (const uint32_t *)bg;
+        for (uint16_t x = 0; x < block_w / 4; x++) {
+            uint32_t cw = c[x];
+            uint32_t bw = b[x];
+            acc += lane_changed(cw & LANE_LO, bw & LANE_LO, bias);
+            acc += lane_changed((cw >> 8) & LANE_LO, (bw >> 8) & LANE_LO,
+                                bias);
+        }
+        cur += stride;
+        bg += stride;
+    }
+    return (acc & 0xFFFF) + (acc >> 16);
+}
+
+// Approximate median: step each background pixel one level towards the
+// current frame. Slow enough that a standing animal is not absorbed within a
+// few frames, cheap enough to run on every frame.
+static void update_block(uint8_t *bg, const uint8_t *cur, size_t stride,
+                         uint16_t block_w, uint16_t block_h) {
+    for (uint16_t y = 0; y < block_h; y++) {
+        for (uint16_t x = 0; x < block_w; x++)
+            bg[x] += (cur[x] > bg[x]) - (cur[x] < bg[x]);
+        cur += stride;
+        bg += stride;
+    }
+}
+
+esp_err_t motion_init(motion_detector_t *md, const motion_config_t *config) {
+    if (config->width == 0 || config->width > MOTION_MAX_WIDTH ||
+        config->height == 0 || config->height > MOTION_MAX_HEIGHT ||
+        config->block_size == 0 ||
+        config->block_size > MOTION_MAX_BLOCK_SIZE)
+        return ESP_ERR_INVALID_ARG;
+
+    md->config = *config;
+    md->frames = 0;
+    md->scratch = NULL;
+    md->scratch_size = 0;
+    // malloc is word aligned, so rows of a width divisible by 4 are too
+    md->background = malloc((size_t)config->width * config->height);
+    if (!md->background)
+        return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+void motion_deinit(motion_detector_t *md) {
+    free(md->background);
+    md->background = NULL;
+    free(md->scratch);
+    md->scratch = NULL;
+    md->scratch_size = 0;
+}
+
+void motion_reset(motion_detector_t *md) { md->frames = 0; }
+
+esp_err_t motion_process(motion_detector_t *md, const uint8_t *gray,
+                         motion_result_t *result) {
+    const motion_config_t *cfg = &md->config;
+    size_t stride = cfg->width;
+    memset(result, 0, sizeof(*result));
+
+    if (!md->background)
+        return ESP_ERR_INVALID_STATE;
+
+    if (md->frames == 0) {
+        memcpy(md->background, gray, stride * cfg->height);
+        md->frames++;
+        return ESP_OK;
+    }
+
+    uint16_t blocks_x = (cfg->width + cfg->block_size - 1) / cfg->block_size;
+    uint16_t blocks_y = (cfg->height + cfg->block_size - 1) / cfg->block_size;
+    uint16_t min_bx = UINT16_MAX, min_by = UINT16_MAX;
+    uint16_t max_bx = 0, max_by = 0;
+    uint32_t changed_pixels = 0;
+    bool warming_up = md->frames < MOTION_WARMUP_FRAMES;
+
+    for (uint16_t by = 0; by < blocks_y; by++) {
+        uint16_t y = by * cfg->block_size;
+        uint16_t bh = cfg->height - y < cfg->block_size ? cfg->height - y
+                                                        : cfg->block_size;
+        for (uint16_t bx = 0; bx < blocks_x; bx++) {
+            uint16_t x = bx * cfg->block_size;
+            uint16_t bw = cfg->width - x < cfg->block_size ? cfg->width - x
+                                                           : cfg->block_size;
+            size_t offset = (size_t)y * stride + x;
+            uint8_t *bg = md->background + offset;
+            const uint8_t *cur = gray + offset;
+
+            uint32_t count = motion_block_diff(cur, bg, stride, bw, bh,
+                                               cfg->pixel_threshold);
+            // Scale the threshold down for partial edge blocks
+            uint32_t threshold = (uint32_t)cfg->block_threshold * bw * bh /
+                                 (cfg->block_size * cfg->block_size);
+            bool changed = !warming_up && count >= threshold && count > 0;
+            if (changed) {
+                result->changed_blocks++;
+                changed_pixels += count;
+                if (bx < min_bx)
+                    min_bx = bx;
+                if (by < min_by)
+                    min_by = by;
+                if (bx > max_bx)
+                    max_bx = bx;
+                if (by > max_by)
+                    max_by = by;
+            }
+            // Blocks with motion keep their background, apart from a slow
+            // drift so that objects that stay put are eventually absorbed
+            if (!changed || md->frames % MOTION_ABSORB_INTERVAL == 0)
+                update_block(bg, cur, stride, bw, bh);
+        }
+    }
+    md->frames++;
+
+    uint32_t total_blocks = (uint32_t)blocks_x * blocks_y;
+    if (result->changed_blocks * 100 >
+        total_blocks * MOTION_GLOBAL_CHANGE_PCT) {
+        // Exposure or lighting jump, restart from the new frame
+        memcpy(md->background, gray, stride * cfg->height);
+        md->frames = 1;
+        memset(result, 0, sizeof(*result));
+        return ESP_OK;
+    }
+
+    if (result->changed_blocks == 0)
+        return ESP_OK;
+
+    result->score =
+        changed_pixels * 1000 / ((uint32_t)cfg->width * cfg->height);
+    result->detected = result->changed_blocks >= cfg->min_blocks;
+    result->x = min_bx * cfg->block_size;
+    result->y = min_by * cfg->block_size;
+    uint16_t x_end = (max_bx + 1) * cfg->block_size;
+    uint16_t y_end = (max_by + 1) * cfg->block_size;
+    result->w = (x_end > cfg->width ? cfg->width : x_end) - result->x;
+    result->h = (y_end > cfg->height ? cfg->height : y_end) - result->y;
+    return ESP_OK;
+}
+
+void motion_downscale(const uint8_t *src, uint16_t width, uint16_t height,
+                      uint8_t factor, uint8_t *dst) {
+    uint16_t out_w = width / factor;
+    uint16_t out_h = height / factor;
+    uint32_t area = (uint32_t)factor * factor;
+
+    for (uint16_t oy = 0; oy < out_h; oy++) {
+        for (uint16_t ox = 0; ox < out_w; ox++) {
+            const uint8_t *p = src + (size_t)oy * factor * width + ox * factor;
+            uint32_t sum = 0;
+            for (uint8_t y = 0; y < factor; y++) {
+                for (uint8_t x = 0; x < factor; x++)
+                    sum += p[x];
+                p += width;
+            }
+            *dst++ = (sum + area / 2) / area;
+        }
+    }
+}
+
+esp_err_t motion_process_jpeg(motion_detector_t *md, const uint8_t *jpeg,
+                              size_t len, motion_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    if (!md->background)
+        return ESP_ERR_INVALID_STATE;
+
+    uint16_t luma_w, luma_h;
+    esp_err_t err = jpeg_dc_get_size(jpeg, len, &luma_w, &luma_h);
+    if (err != ESP_OK)
+        return err;
+    uint8_t factor = 1;
+    while (luma_w / factor > MOTION_MAX_WIDTH ||
+           luma_h / factor > MOTION_MAX_HEIGHT)
+        factor++;
+    uint16_t width = luma_w / factor;
+    uint16_t height = luma_h / factor;
+
+    // The downscaled copy starts word aligned for motion_block_diff
+    size_t luma_size = (size_t)luma_w * luma_h;
+    size_t frame_offset = factor > 1 ? (luma_size + 3) & ~(size_t)3 : 0;
+    size_t needed = frame_offset + (size_t)width * height;
+    if (needed > md->scratch_size) {
+        uint8_t *grown = realloc(md->scratch, needed);
+        if (!grown)
+            return ESP_ERR_NO_MEM;
+        md->scratch = grown;
+        md->scratch_size = needed;
+    }
+    if (width != md->config.width || height != md->config.height) {
+        uint8_t *bg = malloc((size_t)width * height);
+        if (!bg)
+            return ESP_ERR_NO_MEM;
+        free(md->background);
+        md->background = bg;
+        md->config.width = width;
+        md->config.height = height;
+        md->frames = 0;
+    }
+
+    err = jpeg_dc_luma(jpeg, len, md->scratch, luma_size, &luma_w, &luma_h);
+    if (err != ESP_OK)
+        return err;
+    if (factor > 1)
+        motion_downscale(md->scratch, luma_w, luma_h, factor,
+                         md->scratch + frame_offset);
+    return motion_process(md, md->scratch + frame_offset, result);
+}
@@ -0,0 +1,76 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MOTION_MAX_WIDTH 160
+#define MOTION_MAX_HEIGHT 120
+#define MOTION_MAX_BLOCK_SIZE 16
+
+#define MOTION_DEFAULT_BLOCK_SIZE 8
+#define MOTION_DEFAULT_PIXEL_THRESHOLD 24
+#define MOTION_DEFAULT_BLOCK_THRESHOLD 16
+#define MOTION_DEFAULT_MIN_BLOCKS 2
+#define MOTION_WARMUP_FRAMES 4
+#define MOTION_ABSORB_INTERVAL 16
+// More changed blocks than this share of the frame is treated as a global
+// exposure change rather than motion
+#define MOTION_GLOBAL_CHANGE_PCT 75
+
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint8_t block_size;       // Pixels per block side
+    uint8_t pixel_threshold;  // Min background difference of a changed pixel
+    uint16_t block_threshold; // Changed pixels that mark a block as changed
+    uint16_t min_blocks;      // Changed blocks that count as motion
+} motion_config_t;
+
+typedef struct {
+    bool detected;
+    uint16_t changed_blocks;
+    uint32_t score; // Changed pixels per thousand
+    uint16_t x;     // Bounding box of the changed blocks, in pixels
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} motion_result_t;
+
+typedef struct {
+    motion_config_t config;
+    uint8_t *background;
+    uint32_t frames;
+    uint8_t *scratch; // DC luma of the last JPEG, then its downscaled copy
+    size_t scratch_size;
+} motion_detector_t;
+
+esp_err_t motion_init(motion_detector_t *md, const motion_config_t *config);
+void motion_deinit(motion_detector_t *md);
+void motion_reset(motion_detector_t *md);
+// gray is a width x height 8-bit luma frame; 4-byte aligned frames with a
+// width divisible by 4 take the word-at-a-time path.
+esp_err_t motion_process(motion_detector_t *md, const uint8_t *gray,
+                         motion_result_t *result);
+// Runs the detector on the DC luma of a baseline JPEG (see jpeg_dc.h),
+// box-averaged down until it fits MOTION_MAX_WIDTH x MOTION_MAX_HEIGHT.
+// Width and height come from the frames: the model restarts whenever the
+// frame size changes, so the config passed to motion_init only sets the
+// thresholds and any valid size will do.
+esp_err_t motion_process_jpeg(motion_detector_t *md, const uint8_t *jpeg,
+                              size_t len, motion_result_t *result);
+// Box-averages a grayscale frame down by factor into dst
+void motion_downscale(const uint8_t *src, uint16_t width, uint16_t height,
+                      uint8_t factor, uint8_t *dst);
+
+// Changed-pixel count of one block, word-at-a-time and scalar reference
+uint32_t motion_block_diff(const uint8_t *cur, const uint8_t *bg,
+                           size_t stride, uint16_t block_w, uint16_t block_h,
+                           uint8_t threshold);
+uint32_t motion_block_diff_ref(const uint8_t *cur, const uint8_t *bg,
+                               size_t stride, uint16_t block_w,
+                               uint16_t block_h, uint8_t threshold);
+
+#endif
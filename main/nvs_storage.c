@@ -2,6 +2,7 @@
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include <inttypes.h>
+#include <string.h>
 
 static const char *TAG = "nvs_storage";
 static bool is_initialized = false;
@@ -141,6 +142,86 @@ esp_err_t nvs_storage_read_u32(const char *namespace, const char *key,
     return err;
 }
 
+void nvs_storage_batch_begin(nvs_storage_batch_t *batch,
+                             const char *namespace) {
+    *batch = (nvs_storage_batch_t){.namespace = namespace,
+                                   .err = is_initialized
+                                              ? ESP_OK
+                                              : ESP_ERR_INVALID_STATE};
+}
+
+static bool batch_open(nvs_storage_batch_t *batch) {
+    if (batch->err != ESP_OK)
+        return false;
+    if (batch->open)
+        return true;
+    batch->err = nvs_open(batch->namespace, NVS_READWRITE, &batch->handle);
+    if (batch->err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open namespace %s: %s", batch->namespace,
+                 esp_err_to_name(batch->err));
+        return false;
+    }
+    batch->open = true;
+    return true;
+}
+
+void nvs_storage_batch_set_u32(nvs_storage_batch_t *batch, const char *key,
+                               uint32_t value) {
+    uint32_t stored;
+    if (!batch_open(batch) ||
+        (nvs_get_u32(batch->handle, key, &stored) == ESP_OK &&
+         stored == value))
+        return;
+
+    batch->err = nvs_set_u32(batch->handle, key, value);
+    if (batch->err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write u32 %s in %s: %s", key,
+                 batch->namespace, esp_err_to_name(batch->err));
+        return;
+    }
+    batch->changed++;
+    ESP_LOGI(TAG, "Set u32 %s = %" PRIu32 " in %s", key, value,
+             batch->namespace);
+}
+
+void nvs_storage_batch_set_string(nvs_storage_batch_t *batch,
+                                  const char *key, const char *value) {
+    char stored[128];
+    size_t len = sizeof(stored);
+    if (!batch_open(batch) ||
+        (nvs_get_str(batch->handle, key, stored, &len) == ESP_OK &&
+         strcmp(stored, value) == 0))
+        return;
+
+    batch->err = nvs_set_str(batch->handle, key, value);
+    if (batch->err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write string %s in %s: %s", key,
+                 batch->namespace, esp_err_to_name(batch->err));
+        return;
+    }
+    batch->changed++;
+    // Values may be secrets, only the key is logged
+    ESP_LOGI(TAG, "Set string %s in %s", key, batch->namespace);
+}
+
+esp_err_t nvs_storage_batch_end(nvs_storage_batch_t *batch) {
+    if (!batch->open)
+        return batch->err;
+
+    if (batch->err == ESP_OK && batch->changed) {
+        batch->err = nvs_commit(batch->handle);
+        if (batch->err == ESP_OK)
+            ESP_LOGI(TAG, "Committed %" PRIu32 " keys in %s", batch->changed,
+                     batch->namespace);
+        else
+            ESP_LOGE(TAG, "Failed to commit %s: %s", batch->namespace,
+                     esp_err_to_name(batch->err));
+    }
+    nvs_close(batch->handle);
+    batch->open = false;
+    return batch->err;
+}
+
 esp_err_t nvs_storage_erase_key(const char *namespace, const char *key) {
     if (!is_initialized)
         return ESP_ERR_INVALID_STATE;
@@ -2,10 +2,13 @@
 #define NVS_STORAGE_H
 
 #include "esp_err.h"
+#include "nvs.h"
+#include <stdbool.h>
 #include <stdint.h>
 
 #define NVS_CAMERA_NAMESPACE "camera"
 #define NVS_WIFI_NAMESPACE "wifi"
+#define NVS_SD_NAMESPACE "sd_card"
 
 #define NVS_KEY_PIXEL_FORMAT "pixel_format"
 #define NVS_KEY_FRAME_SIZE "frame_size"
@@ -15,6 +18,8 @@
 #define NVS_KEY_SSID "ssid"
 #define NVS_KEY_PASSWORD "password"
 
+#define NVS_KEY_NEXT_IMAGE "next_image"
+
 esp_err_t nvs_storage_init(void);
 esp_err_t nvs_storage_write_string(const char *namespace, const char *key,
                                    const char *value);
@@ -24,6 +29,26 @@ esp_err_t nvs_storage_write_u32(const char *namespace, const char *key,
                                 uint32_t value);
 esp_err_t nvs_storage_read_u32(const char *namespace, const char *key,
                                uint32_t *value);
+// Writes to one namespace through a single handle with a single commit.
+// Values equal to the stored ones are not written, and a batch where
+// nothing changed is never committed. Errors stick to the batch and are
+// reported by end.
+typedef struct {
+    const char *namespace;
+    nvs_handle_t handle;
+    bool open;
+    uint32_t changed;
+    esp_err_t err;
+} nvs_storage_batch_t;
+
+void nvs_storage_batch_begin(nvs_storage_batch_t *batch,
+                             const char *namespace);
+void nvs_storage_batch_set_u32(nvs_storage_batch_t *batch, const char *key,
+                               uint32_t value);
+void nvs_storage_batch_set_string(nvs_storage_batch_t *batch,
+                                  const char *key, const char *value);
+// Commits if anything changed and closes the handle
+esp_err_t nvs_storage_batch_end(nvs_storage_batch_t *batch);
 esp_err_t nvs_storage_erase_key(const char *namespace, const char *key);
 esp_err_t nvs_storage_erase_all(const char *namespace);
 
@@ -0,0 +1,236 @@
+#include "pretrigger.h"
+#include "camera.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sd_card.h"
+#include <inttypes.h>
+#include <string.h>
+
+// The ring is only ever written by the pretrigger task. A slot handed to the
+// SD writer is marked busy and the writer's completion callback clears it;
+// the task skips busy slots instead of waiting on them.
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    volatile bool busy;
+} ring_slot_t;
+
+static const char *TAG = "pretrigger";
+static pretrigger_config_t pt_config = {0};
+static pretrigger_stats_t pt_stats = {0};
+static uint8_t *ring_arena = NULL;
+static ring_slot_t ring[PRETRIGGER_MAX_SLOTS];
+static uint32_t ring_head = 0;  // Next slot to fill
+static uint32_t ring_count = 0; // Valid frames in the ring
+static TaskHandle_t pt_task = NULL;
+static SemaphoreHandle_t pt_done = NULL;
+static volatile bool pt_running = false;
+static motion_detector_t detector;
+static bool motion_enabled = false;
+
+static void slot_saved(const uint8_t *data, size_t len, esp_err_t result,
+                       void *ctx) {
+    ((ring_slot_t *)ctx)->busy = false;
+}
+
+static void post_frame_saved(const uint8_t *data, size_t len,
+                             esp_err_t result, void *ctx) {
+    esp_camera_fb_return((camera_fb_t *)ctx);
+}
+
+static void ring_store(const camera_fb_t *fb) {
+    ring_slot_t *slot = &ring[ring_head];
+    if (slot->busy || fb->len > PRETRIGGER_SLOT_SIZE) {
+        pt_stats.skipped++;
+        return;
+    }
+
+    memcpy(slot->buf, fb->buf, fb->len);
+    slot->len = fb->len;
+    ring_head = (ring_head + 1) % pt_config.pre_frames;
+    if (ring_count < pt_config.pre_frames)
+        ring_count++;
+}
+
+// Queues the buffered history oldest first and empties the ring
+static void ring_dump(void) {
+    uint32_t start =
+        (ring_head + pt_config.pre_frames - ring_count) % pt_config.pre_frames;
+    for (uint32_t i = 0; i < ring_count; i++) {
+        ring_slot_t *slot = &ring[(start + i) % pt_config.pre_frames];
+        slot->busy = true;
+        if (sd_card_queue_image(slot->buf, slot->len, slot_saved, slot,
+                                1000) != ESP_OK) {
+            slot->busy = false;
+            continue;
+        }
+        pt_stats.pre_saved++;
+    }
+    ring_count = 0;
+}
+
+// Only armed frames are checked, so recording never retriggers itself
+static bool detect_motion(const camera_fb_t *fb) {
+    motion_result_t result;
+    esp_err_t err = fb->format == PIXFORMAT_JPEG
+                        ? motion_process_jpeg(&detector, fb->buf, fb->len,
+                                              &result)
+                        : ESP_ERR_NOT_SUPPORTED;
+    if (err != ESP_OK) {
+        ESP_LOGD(TAG, "Motion detection skipped: %s", esp_err_to_name(err));
+        return false;
+    }
+    if (result.detected)
+        ESP_LOGI(TAG, "Motion at %u,%u size %ux%u, score %" PRIu32, result.x,
+                 result.y, result.w, result.h, result.score);
+    return result.detected;
+}
+
+static void pretrigger_task_fn(void *arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+    uint32_t post_remaining = 0;
+    bool motion_seen = false;
+
+    while (pt_running) {
+        bool notified = ulTaskNotifyTake(pdTRUE, 0) > 0;
+        if (notified || motion_seen) {
+            pt_stats.triggers++;
+            if (!notified)
+                pt_stats.motion_triggers++;
+            motion_seen = false;
+            ESP_LOGI(TAG, "Triggered, saving %" PRIu32 " buffered frames",
+                     ring_count);
+            ring_dump();
+            post_remaining = pt_config.post_frames;
+        }
+
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+            ESP_LOGW(TAG, "Capture failed");
+            continue;
+        }
+
+        if (post_remaining > 0) {
+            // Straight from the driver buffer, no copy into the ring
+            if (sd_card_queue_image(fb->buf, fb->len, post_frame_saved, fb,
+                                    1000) == ESP_OK) {
+                pt_stats.post_saved++;
+            } else {
+                esp_camera_fb_return(fb);
+            }
+            post_remaining--;
+            continue;
+        }
+
+        if (motion_enabled)
+            motion_seen = detect_motion(fb);
+        ring_store(fb);
+        esp_camera_fb_return(fb);
+        // On motion the trigger is handled straight away
+        if (pt_config.interval_ms && !motion_seen)
+            xTaskDelayUntil(&last_wake, pdMS_TO_TICKS(pt_config.interval_ms));
+    }
+
+    if (motion_enabled)
+        motion_deinit(&detector);
+    camera_release(CAMERA_OWNER_PRETRIGGER);
+    xSemaphoreGive(pt_done);
+    vTaskDelete(NULL);
+}
+
+esp_err_t pretrigger_start(const pretrigger_config_t *config) {
+    if (pt_running) {
+        ESP_LOGW(TAG, "Pre-trigger capture already running");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (config->pre_frames == 0 || config->pre_frames > PRETRIGGER_MAX_SLOTS)
+        return ESP_ERR_INVALID_ARG;
+
+    if (ring_arena == NULL) {
+        pt_done = xSemaphoreCreateBinary();
+        ring_arena = heap_caps_malloc(
+            PRETRIGGER_MAX_SLOTS * PRETRIGGER_SLOT_SIZE, MALLOC_CAP_SPIRAM);
+        if (!ring_arena || !pt_done) {
+            ESP_LOGE(TAG, "Failed to allocate ring");
+            heap_caps_free(ring_arena);
+            ring_arena = NULL;
+            return ESP_ERR_NO_MEM;
+        }
+        for (int i = 0; i < PRETRIGGER_MAX_SLOTS; i++)
+            ring[i].buf = ring_arena + i * PRETRIGGER_SLOT_SIZE;
+    }
+
+    motion_enabled = config->motion != NULL;
+    esp_err_t err =
+        motion_enabled ? motion_init(&detector, config->motion) : ESP_OK;
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start motion detector: %s",
+                 esp_err_to_name(err));
+        return err;
+    }
+
+    err = camera_claim(CAMERA_OWNER_PRETRIGGER);
+    if (err != ESP_OK) {
+        if (motion_enabled)
+            motion_deinit(&detector);
+        return err;
+    }
+
+    pt_config = *config;
+    pt_config.motion = NULL; // Needed by motion_init only
+    pt_stats = (pretrigger_stats_t){0};
+    ring_head = 0;
+    ring_count = 0;
+    pt_running = true;
+
+    if (xTaskCreatePinnedToCore(pretrigger_task_fn, "pretrigger",
+                                PRETRIGGER_STACK_SIZE, NULL,
+                                PRETRIGGER_PRIORITY, &pt_task,
+                                PRETRIGGER_CORE) != pdPASS) {
+        pt_running = false;
+        pt_task = NULL;
+        if (motion_enabled)
+            motion_deinit(&detector);
+        camera_release(CAMERA_OWNER_PRETRIGGER);
+        ESP_LOGE(TAG, "Failed to create pretrigger task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Armed with %" PRIu32 " pre and %" PRIu32 " post frames",
+             config->pre_frames, config->post_frames);
+    return ESP_OK;
+}
+
+esp_err_t pretrigger_stop(void) {
+    if (pt_task == NULL)
+        return ESP_OK;
+
+    pt_running = false;
+    if (xSemaphoreTake(pt_done, pdMS_TO_TICKS(5000)) != pdTRUE) {
+        ESP_LOGE(TAG, "Pretrigger task did not stop");
+        return ESP_ERR_TIMEOUT;
+    }
+    pt_task = NULL;
+
+    // Ring slots and driver buffers stay owned by the writer until written
+    return sd_card_flush(5000);
+}
+
+bool pretrigger_running(void) { return pt_running; }
+
+void pretrigger_trigger(void) {
+    if (pt_task)
+        xTaskNotifyGive(pt_task);
+}
+
+void pretrigger_trigger_from_isr(void) {
+    BaseType_t woken = pdFALSE;
+    if (pt_task)
+        vTaskNotifyGiveFromISR(pt_task, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+void pretrigger_get_stats(pretrigger_stats_t *stats) { *stats = pt_stats; }
@@ -0,0 +1,46 @@
+#ifndef PRETRIGGER_H
+#define PRETRIGGER_H
+
+#include "esp_err.h"
+#include "motion.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PRETRIGGER_MAX_SLOTS 8
+#define PRETRIGGER_SLOT_SIZE (128 * 1024)
+#define PRETRIGGER_STACK_SIZE 4096
+#define PRETRIGGER_PRIORITY 5
+#define PRETRIGGER_CORE 0
+
+// Arms motion-triggered capture from app_main. It holds the sensor while
+// armed, so /stream only gets frames with this set to 0.
+#define PRETRIGGER_AT_BOOT 1
+#define PRETRIGGER_DEFAULT_PRE_FRAMES 4
+#define PRETRIGGER_DEFAULT_POST_FRAMES 8
+#define PRETRIGGER_DEFAULT_INTERVAL_MS 200
+
+typedef struct {
+    uint32_t pre_frames;  // Frames kept from before the trigger
+    uint32_t post_frames; // Frames recorded after the trigger
+    uint32_t interval_ms; // Capture period while armed
+    // Triggers on motion in the armed frames, which must be JPEG. NULL
+    // leaves triggering to pretrigger_trigger.
+    const motion_config_t *motion;
+} pretrigger_config_t;
+
+typedef struct {
+    uint32_t triggers;
+    uint32_t motion_triggers; // Of triggers, those raised by the detector
+    uint32_t pre_saved;
+    uint32_t post_saved;
+    uint32_t skipped; // Frames not kept because a slot was still being saved
+} pretrigger_stats_t;
+
+esp_err_t pretrigger_start(const pretrigger_config_t *config);
+esp_err_t pretrigger_stop(void);
+bool pretrigger_running(void);
+void pretrigger_trigger(void);
+void pretrigger_trigger_from_isr(void);
+void pretrigger_get_stats(pretrigger_stats_t *stats);
+
+#endif
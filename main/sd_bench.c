@@ -0,0 +1,413 @@
+#include "sd_bench.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_vfs_fat.h"
+#include "image_catalog.h"
+#include "sd_bounce.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *TAG = "sd_bench";
+
+#define SEQ_PATH SD_CARD_MOUNT_POINT "/BENCH.BIN"
+#define SMALL_DIR SD_CARD_MOUNT_POINT "/BENCH"
+#define SEQ_CHUNKS (SD_BENCH_SEQ_SIZE_MB * 1024 * 1024 / SD_BENCH_CHUNK_SIZE)
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t va = *(const uint32_t *)a;
+    uint32_t vb = *(const uint32_t *)b;
+    return va < vb ? -1 : va > vb;
+}
+
+static void summarize(uint32_t *lat, uint32_t ops, uint64_t bytes,
+                      int64_t total_us, sd_bench_stat_t *stat) {
+    qsort(lat, ops, sizeof(lat[0]), compare_u32);
+    stat->ops = ops;
+    stat->ops_per_s = total_us > 0 ? ops * 1e6f / total_us : 0;
+    stat->mb_per_s = total_us > 0 ? (float)bytes / total_us : 0;
+    stat->p50_us = ops ? lat[ops / 2] : 0;
+    stat->p99_us = ops ? lat[(ops * 99) / 100] : 0;
+}
+
+static esp_err_t bench_seq_write(const uint8_t *buf, uint32_t *lat,
+                                 sd_bench_stat_t *stat) {
+    int64_t start = esp_timer_get_time();
+    FILE *f = fopen(SEQ_PATH, "wb");
+    if (!f)
+        return ESP_FAIL;
+
+    uint32_t ops = 0;
+    for (; ops < SEQ_CHUNKS; ops++) {
+        int64_t t = esp_timer_get_time();
+        if (fwrite(buf, 1, SD_BENCH_CHUNK_SIZE, f) != SD_BENCH_CHUNK_SIZE)
+            break;
+        lat[ops] = esp_timer_get_time() - t;
+    }
+    fsync(fileno(f));
+    fclose(f);
+    if (ops != SEQ_CHUNKS)
+        return ESP_FAIL;
+
+    summarize(lat, ops, (uint64_t)ops * SD_BENCH_CHUNK_SIZE,
+              esp_timer_get_time() - start, stat);
+    return ESP_OK;
+}
+
+static esp_err_t bench_seq_read(uint8_t *buf, uint32_t *lat,
+                                sd_bench_stat_t *stat) {
+    int64_t start = esp_timer_get_time();
+    FILE *f = fopen(SEQ_PATH, "rb");
+    if (!f)
+        return ESP_FAIL;
+
+    uint32_t ops = 0;
+    for (; ops < SEQ_CHUNKS; ops++) {
+        int64_t t = esp_timer_get_time();
+        if (fread(buf, 1, SD_BENCH_CHUNK_SIZE, f) != SD_BENCH_CHUNK_SIZE)
+            break;
+        lat[ops] = esp_timer_get_time() - t;
+    }
+    fclose(f);
+    if (ops != SEQ_CHUNKS)
+        return ESP_FAIL;
+
+    summarize(lat, ops, (uint64_t)ops * SD_BENCH_CHUNK_SIZE,
+              esp_timer_get_time() - start, stat);
+    return ESP_OK;
+}
+
+// Plain stdio, the way images were saved before bounce buffers
+static bool write_file_direct(const char *path, const uint8_t *buf) {
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return false;
+    size_t left = SD_BENCH_SMALL_FILE_SIZE;
+    while (left > 0) {
+        size_t n = left < SD_BENCH_CHUNK_SIZE ? left : SD_BENCH_CHUNK_SIZE;
+        if (fwrite(buf, 1, n, f) != n)
+            break;
+        left -= n;
+    }
+    fclose(f);
+    return left == 0;
+}
+
+// Same steps as the files engine: preallocate, then stage through the
+// internal bounce buffers
+static bool write_file_staged(const char *path, const uint8_t *buf) {
+    int fd = -1;
+    if (esp_vfs_fat_create_contiguous_file(SD_CARD_MOUNT_POINT, path,
+                                           SD_BENCH_SMALL_FILE_SIZE,
+                                           true) == ESP_OK)
+        fd = open(path, O_WRONLY);
+    if (fd < 0)
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+    if (fd < 0)
+        return false;
+    size_t left = SD_BENCH_SMALL_FILE_SIZE;
+    while (left > 0) {
+        size_t n = left < SD_BENCH_CHUNK_SIZE ? left : SD_BENCH_CHUNK_SIZE;
+        if (sd_bounce_write(fd, NULL, 0, buf, n) != ESP_OK)
+            break;
+        left -= n;
+    }
+    close(fd);
+    return left == 0;
+}
+
+// Same pattern as an image save: a fresh file written in one go
+static esp_err_t bench_small_files(const uint8_t *buf, uint32_t *lat,
+                                   bool staged, sd_bench_stat_t *stat) {
+    if (mkdir(SMALL_DIR, 0775) != 0 && errno != EEXIST)
+        return ESP_FAIL;
+
+    char path[SD_CARD_PATH_MAX];
+    int64_t start = esp_timer_get_time();
+    uint32_t ops = 0;
+    for (; ops < SD_BENCH_SMALL_FILE_COUNT; ops++) {
+        snprintf(path, sizeof(path), SMALL_DIR "/%" PRIu32 ".BIN", ops);
+        int64_t t = esp_timer_get_time();
+        bool ok = staged ? write_file_staged(path, buf)
+                         : write_file_direct(path, buf);
+        if (!ok)
+            break;
+        lat[ops] = esp_timer_get_time() - t;
+    }
+    int64_t total_us = esp_timer_get_time() - start;
+
+    for (uint32_t i = 0; i < SD_BENCH_SMALL_FILE_COUNT; i++) {
+        snprintf(path, sizeof(path), SMALL_DIR "/%" PRIu32 ".BIN", i);
+        unlink(path);
+    }
+    rmdir(SMALL_DIR);
+    if (ops != SD_BENCH_SMALL_FILE_COUNT)
+        return ESP_FAIL;
+
+    summarize(lat, ops, (uint64_t)ops * SD_BENCH_SMALL_FILE_SIZE, total_us,
+              stat);
+    return ESP_OK;
+}
+
+static void log_stat(const char *name, const sd_bench_stat_t *stat) {
+    ESP_LOGI(TAG,
+             "  %-12s %6.2f MB/s %8.1f ops/s  p50 %7" PRIu32
+             " us  p99 %7" PRIu32 " us  (%" PRIu32 " ops)",
+             name, stat->mb_per_s, stat->ops_per_s, stat->p50_us,
+             stat->p99_us, stat->ops);
+}
+
+esp_err_t sd_bench_run(sd_bench_result_t *result) {
+    // Frames come from PSRAM, so the benchmark writes from there too
+    uint8_t *buf = heap_caps_malloc(SD_BENCH_CHUNK_SIZE, MALLOC_CAP_SPIRAM);
+    uint32_t max_ops = SEQ_CHUNKS > SD_BENCH_SMALL_FILE_COUNT
+                           ? SEQ_CHUNKS
+                           : SD_BENCH_SMALL_FILE_COUNT;
+    uint32_t *lat = malloc(max_ops * sizeof(uint32_t));
+    if (!buf || !lat) {
+        heap_caps_free(buf);
+        free(lat);
+        return ESP_ERR_NO_MEM;
+    }
+    for (uint32_t i = 0; i < SD_BENCH_CHUNK_SIZE; i++)
+        buf[i] = i * 31;
+
+    esp_err_t err = bench_seq_write(buf, lat, &result->seq_write);
+    if (err == ESP_OK)
+        err = bench_seq_read(buf, lat, &result->seq_read);
+    unlink(SEQ_PATH);
+    if (err == ESP_OK)
+        err = bench_small_files(buf, lat, false, &result->small_files);
+    if (err == ESP_OK)
+        err = bench_small_files(buf, lat, true, &result->staged_files);
+
+    heap_caps_free(buf);
+    free(lat);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Benchmark failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    log_stat("seq write", &result->seq_write);
+    log_stat("small files", &result->small_files);
+    log_stat("staged files", &result->staged_files);
+    log_stat("seq read", &result->seq_read);
+    return ESP_OK;
+}
+
+typedef struct {
+    uint32_t *lat;
+    uint32_t done;
+    uint32_t failed;
+    int64_t last_us;
+} save_progress_t;
+
+// Runs on the writer task; the gap between completions is the time the
+// writer spent on each image
+static void save_done(const uint8_t *data, size_t len, esp_err_t result,
+                      void *ctx) {
+    save_progress_t *progress = ctx;
+    int64_t now = esp_timer_get_time();
+    if (result != ESP_OK)
+        progress->failed++;
+    progress->lat[progress->done++] = now - progress->last_us;
+    progress->last_us = now;
+}
+
+static esp_err_t bench_save(const uint8_t *image, uint32_t count,
+                            uint32_t *lat, uint32_t *first,
+                            sd_bench_stat_t *stat) {
+    *first = sd_card_next_image_number();
+
+    save_progress_t progress = {.lat = lat,
+                                .last_us = esp_timer_get_time()};
+    int64_t start = progress.last_us;
+    esp_err_t err = ESP_OK;
+    for (uint32_t i = 0; i < count; i++) {
+        if (sd_card_queue_image(image, SD_BENCH_SMALL_FILE_SIZE, save_done,
+                                &progress, 10000) != ESP_OK) {
+            err = ESP_ERR_TIMEOUT;
+            break;
+        }
+    }
+    // progress is on this stack, so every queued save has to be through the
+    // writer before returning, however long the card takes
+    while (sd_card_flush(30000) != ESP_OK)
+        err = ESP_ERR_TIMEOUT;
+    if (err != ESP_OK)
+        return err;
+    if (progress.failed)
+        return ESP_FAIL;
+
+    summarize(lat, progress.done, (uint64_t)count * SD_BENCH_SMALL_FILE_SIZE,
+              esp_timer_get_time() - start, stat);
+    return ESP_OK;
+}
+
+static esp_err_t bench_mount(const sd_card_config_t *config,
+                             sd_bench_stat_t *stat) {
+    int64_t start = esp_timer_get_time();
+    sd_card_deinit();
+    esp_err_t err = sd_card_init(config);
+    // The catalog is built by the writer ahead of the flush marker
+    if (err == ESP_OK)
+        err = sd_card_flush(60000);
+    if (err != ESP_OK)
+        return err;
+
+    uint32_t lat = esp_timer_get_time() - start;
+    summarize(&lat, 1, 0, lat, stat);
+    return ESP_OK;
+}
+
+static esp_err_t bench_list(uint32_t *lat, uint32_t max_ops,
+                            sd_bench_stat_t *stat) {
+    image_catalog_entry_t batch[SD_BENCH_LIST_BATCH];
+    uint32_t before = 0;
+    uint32_t ops = 0;
+    int64_t start = esp_timer_get_time();
+    while (ops < max_ops) {
+        int64_t t = esp_timer_get_time();
+        size_t n = image_catalog_newest(before, batch, SD_BENCH_LIST_BATCH);
+        lat[ops++] = esp_timer_get_time() - t;
+        if (n < SD_BENCH_LIST_BATCH)
+            break;
+        before = batch[n - 1].number;
+    }
+    summarize(lat, ops, 0, esp_timer_get_time() - start, stat);
+    return ESP_OK;
+}
+
+static esp_err_t bench_read(uint32_t first, uint32_t count, uint8_t *buf,
+                            uint32_t *lat, sd_bench_stat_t *stat) {
+    uint32_t reads =
+        count < SD_BENCH_STORAGE_READS ? count : SD_BENCH_STORAGE_READS;
+    uint64_t bytes = 0;
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < reads; i++) {
+        uint32_t number = first + (uint32_t)rand() % count;
+        int64_t t = esp_timer_get_time();
+        sd_card_reader_t reader;
+        if (sd_card_open_image(number, &reader) != ESP_OK)
+            return ESP_ERR_NOT_FOUND;
+        size_t n;
+        while ((n = sd_card_read_image(&reader, buf, SD_BENCH_CHUNK_SIZE)) >
+               0)
+            bytes += n;
+        sd_card_close_image(&reader);
+        lat[i] = esp_timer_get_time() - t;
+    }
+    summarize(lat, reads, bytes,
+              esp_timer_get_time() - start, stat);
+    return ESP_OK;
+}
+
+static esp_err_t bench_remove(uint32_t first, uint32_t count, uint32_t *lat,
+                              sd_bench_stat_t *stat) {
+    esp_err_t err = ESP_OK;
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < count; i++) {
+        int64_t t = esp_timer_get_time();
+        if (sd_card_delete_image(first + i) != ESP_OK)
+            err = ESP_FAIL;
+        lat[i] = esp_timer_get_time() - t;
+    }
+    summarize(lat, count, 0, esp_timer_get_time() - start, stat);
+    return err;
+}
+
+esp_err_t sd_bench_storage(const sd_card_config_t *config, uint32_t count,
+                           sd_bench_storage_result_t *result) {
+    // Waits out a catalog build still running from the last mount
+    if (count == 0 || sd_card_flush(60000) != ESP_OK ||
+        !image_catalog_ready())
+        return ESP_ERR_INVALID_STATE;
+
+    // A minimal JPEG frame around filler, from PSRAM like a camera frame
+    uint8_t *image =
+        heap_caps_malloc(SD_BENCH_SMALL_FILE_SIZE, MALLOC_CAP_SPIRAM);
+    uint8_t *buf = heap_caps_malloc(SD_BENCH_CHUNK_SIZE, MALLOC_CAP_SPIRAM);
+    uint32_t *lat = heap_caps_malloc(count * sizeof(uint32_t),
+                                     MALLOC_CAP_SPIRAM);
+    if (!image || !buf || !lat) {
+        heap_caps_free(image);
+        heap_caps_free(buf);
+        heap_caps_free(lat);
+        return ESP_ERR_NO_MEM;
+    }
+    for (uint32_t i = 0; i < SD_BENCH_SMALL_FILE_SIZE; i++)
+        image[i] = i * 31;
+    image[0] = 0xFF;
+    image[1] = 0xD8;
+    image[SD_BENCH_SMALL_FILE_SIZE - 2] = 0xFF;
+    image[SD_BENCH_SMALL_FILE_SIZE - 1] = 0xD9;
+
+    uint32_t first = 0;
+    ESP_LOGI(TAG, "Storage benchmark, %" PRIu32 " images:", count);
+    esp_err_t err = bench_save(image, count, lat, &first, &result->save);
+    if (err == ESP_OK)
+        log_stat("save", &result->save);
+    if (err == ESP_OK && (err = bench_mount(config, &result->mount)) ==
+                             ESP_OK)
+        log_stat("mount", &result->mount);
+    if (err == ESP_OK &&
+        (err = bench_list(lat, count, &result->list)) == ESP_OK)
+        log_stat("list", &result->list);
+    if (err == ESP_OK &&
+        (err = bench_read(first, count, buf, lat, &result->read)) == ESP_OK)
+        log_stat("read", &result->read);
+    if (first != 0 &&
+        bench_remove(first, count, lat, &result->remove) == ESP_OK)
+        log_stat("remove", &result->remove);
+
+    heap_caps_free(image);
+    heap_caps_free(buf);
+    heap_caps_free(lat);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Storage benchmark failed: %s", esp_err_to_name(err));
+    return err;
+}
+
+esp_err_t sd_bench_sweep(const sd_card_config_t *config) {
+    static const struct {
+        uint8_t width;
+        uint32_t freq_khz;
+    } settings[] = {
+        {1, SDMMC_FREQ_DEFAULT},
+        {1, SDMMC_FREQ_HIGHSPEED},
+        {4, SDMMC_FREQ_DEFAULT},
+        {4, SDMMC_FREQ_HIGHSPEED},
+    };
+    uint8_t max_width = config->bus_width ? config->bus_width : 1;
+
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+        if (settings[i].width > max_width)
+            continue;
+
+        sd_card_config_t trial = *config;
+        trial.bus_width = settings[i].width;
+        trial.freq_khz = settings[i].freq_khz;
+        sd_card_deinit();
+        esp_err_t err = sd_card_init(&trial);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "%u-bit at %" PRIu32 " kHz: mount failed",
+                     trial.bus_width, trial.freq_khz);
+            continue;
+        }
+
+        // Let the catalog build finish so it does not skew the numbers
+        sd_card_flush(30000);
+        ESP_LOGI(TAG, "%u-bit at %" PRIu32 " kHz:", trial.bus_width,
+                 trial.freq_khz);
+        sd_bench_result_t result;
+        sd_bench_run(&result);
+    }
+
+    sd_card_deinit();
+    return sd_card_init(config);
+}
@@ -0,0 +1,57 @@
+#ifndef SD_BENCH_H
+#define SD_BENCH_H
+
+#include "esp_err.h"
+#include "sd_card.h"
+#include <stdint.h>
+
+// Set to 1 to sweep the bus settings at boot before anything else runs
+#define SD_BENCH_AT_BOOT 0
+
+#define SD_BENCH_SEQ_SIZE_MB 8
+#define SD_BENCH_CHUNK_SIZE (32 * 1024)
+#define SD_BENCH_SMALL_FILE_COUNT 50
+#define SD_BENCH_SMALL_FILE_SIZE (64 * 1024) // About one UXGA JPEG
+// Images saved by the storage benchmark, and how many of them are read back
+#define SD_BENCH_STORAGE_IMAGES 2000
+#define SD_BENCH_STORAGE_READS 100
+#define SD_BENCH_LIST_BATCH 32
+
+typedef struct {
+    uint32_t ops;
+    float ops_per_s;
+    float mb_per_s;
+    uint32_t p50_us; // Per chunk, or per file for small files
+    uint32_t p99_us;
+} sd_bench_stat_t;
+
+typedef struct {
+    sd_bench_stat_t seq_write;
+    sd_bench_stat_t small_files;  // fopen, fwrite, fclose per file
+    sd_bench_stat_t staged_files; // Preallocated, through bounce buffers
+    sd_bench_stat_t seq_read;
+} sd_bench_result_t;
+
+// End to end through the sd_card API, at the scale a card reaches in the
+// field
+typedef struct {
+    sd_bench_stat_t save;   // Queued frames, per image write time
+    sd_bench_stat_t mount;  // Remount plus catalog rebuild, one op
+    sd_bench_stat_t list;   // Catalog pages of SD_BENCH_LIST_BATCH
+    sd_bench_stat_t read;   // Open, read and close of random images
+    sd_bench_stat_t remove; // sd_card_delete_image
+} sd_bench_storage_result_t;
+
+// Runs against the card as currently mounted. Leaves no files behind.
+esp_err_t sd_bench_run(sd_bench_result_t *result);
+// Saves count images through the writer, remounts to rebuild the
+// catalog, lists, reads back and finally deletes them all. Consumes count
+// image numbers.
+esp_err_t sd_bench_storage(const sd_card_config_t *config, uint32_t count,
+                           sd_bench_storage_result_t *result);
+// Remounts with every bus width and clock the config allows, runs the
+// benchmark under each and logs a summary. The card is left mounted with
+// the original config.
+esp_err_t sd_bench_sweep(const sd_card_config_t *config);
+
+#endif
@@ -0,0 +1,94 @@
+#include "sd_bounce.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_memory_utils.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include <string.h>
+#include <unistd.h>
+
+static const char *TAG = "sd_bounce";
+static QueueHandle_t free_buffers = NULL;
+static uint8_t *buffers[SD_BOUNCE_BUFFER_COUNT];
+
+esp_err_t sd_bounce_init(void) {
+    if (free_buffers != NULL)
+        return ESP_OK;
+
+    free_buffers = xQueueCreate(SD_BOUNCE_BUFFER_COUNT, sizeof(uint8_t *));
+    if (!free_buffers)
+        return ESP_ERR_NO_MEM;
+
+    for (int i = 0; i < SD_BOUNCE_BUFFER_COUNT; i++) {
+        buffers[i] = heap_caps_aligned_alloc(
+            4, SD_BOUNCE_BUFFER_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (!buffers[i]) {
+            ESP_LOGE(TAG, "Failed to allocate bounce buffer %d", i);
+            sd_bounce_deinit();
+            return ESP_ERR_NO_MEM;
+        }
+        xQueueSend(free_buffers, &buffers[i], 0);
+    }
+    return ESP_OK;
+}
+
+// Only safe while no write is in progress
+void sd_bounce_deinit(void) {
+    if (free_buffers == NULL)
+        return;
+    for (int i = 0; i < SD_BOUNCE_BUFFER_COUNT; i++) {
+        heap_caps_free(buffers[i]);
+        buffers[i] = NULL;
+    }
+    vQueueDelete(free_buffers);
+    free_buffers = NULL;
+}
+
+static esp_err_t write_all(int fd, const void *buf, size_t len) {
+    if (len && write(fd, buf, len) != (ssize_t)len)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+esp_err_t sd_bounce_write(int fd, const void *head, size_t head_len,
+                          const uint8_t *data, size_t len) {
+    uint8_t *buf = NULL;
+    if (free_buffers != NULL && esp_ptr_external_ram(data) &&
+        xQueueReceive(free_buffers, &buf, pdMS_TO_TICKS(SD_BOUNCE_WAIT_MS)) !=
+            pdTRUE)
+        buf = NULL;
+
+    if (!buf) {
+        if (write_all(fd, head, head_len) != ESP_OK ||
+            write_all(fd, data, len) != ESP_OK)
+            return ESP_FAIL;
+        return ESP_OK;
+    }
+
+    // The head rides along in the first chunk so it costs no extra transfer
+    esp_err_t err = ESP_OK;
+    size_t fill = head_len < SD_BOUNCE_BUFFER_SIZE ? head_len : 0;
+    if (fill)
+        memcpy(buf, head, fill);
+    else
+        err = write_all(fd, head, head_len);
+
+    while (err == ESP_OK && len > 0) {
+        size_t n = SD_BOUNCE_BUFFER_SIZE - fill;
+        if (n > len)
+            n = len;
+        memcpy(buf + fill, data, n);
+        fill += n;
+        data += n;
+        len -= n;
+        if (fill == SD_BOUNCE_BUFFER_SIZE || len == 0) {
+            err = write_all(fd, buf, fill);
+            fill = 0;
+        }
+    }
+    if (err == ESP_OK && fill)
+        err = write_all(fd, buf, fill);
+
+    xQueueSend(free_buffers, &buf, 0);
+    return err;
+}
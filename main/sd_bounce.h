@@ -0,0 +1,23 @@
+#ifndef SD_BOUNCE_H
+#define SD_BOUNCE_H
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// One FAT allocation unit, so every full chunk is one multi-block transfer
+#define SD_BOUNCE_BUFFER_SIZE (16 * 1024)
+#define SD_BOUNCE_BUFFER_COUNT 2
+#define SD_BOUNCE_WAIT_MS 100
+
+esp_err_t sd_bounce_init(void);
+void sd_bounce_deinit(void);
+// Writes head (may be NULL) then data at the current position of fd. Data
+// outside internal RAM is staged through a DMA-capable buffer in full
+// SD_BOUNCE_BUFFER_SIZE chunks, since the SDMMC driver would otherwise
+// move it one sector per transfer. Falls back to plain writes when no
+// buffer is free.
+esp_err_t sd_bounce_write(int fd, const void *head, size_t head_len,
+                          const uint8_t *data, size_t len);
+
+#endif
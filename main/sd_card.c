@@ -1,20 +1,100 @@
 #include "sd_card.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_vfs_fat.h"
+#include "ff.h"
+#include "diskio_sdmmc.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "image_catalog.h"
+#include "nvs_storage.h"
+#include "sd_bounce.h"
+#include "sd_log.h"
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
 
 static const char *TAG = "sd_card";
 static SemaphoreHandle_t sd_mutex = NULL;
+static SemaphoreHandle_t reader_slots = NULL; // Counts SD_CARD_MAX_READERS
 static bool is_mounted = false;
-static const char *mount_point = "/sdcard";
+static const char *mount_point = SD_CARD_MOUNT_POINT;
+static sd_card_layout_t layout = SD_CARD_LAYOUT_FLAT;
+static sd_card_engine_t engine = SD_CARD_ENGINE_FILES;
+static sd_card_capture_info_t capture_info = {0};
+static uint32_t current_shard = UINT32_MAX; // Last shard directory created
 static sdmmc_card_t *card = NULL;
 static uint32_t image_counter = 0;
+static uint32_t min_free_mb = 0;
+static uint32_t max_images = 0;
+static uint32_t checkpoint_every = SD_CARD_DEFAULT_CHECKPOINT_EVERY;
+static uint32_t checkpoint_interval_ms =
+    SD_CARD_DEFAULT_CHECKPOINT_INTERVAL_MS;
+static uint32_t since_checkpoint = 0; // Saves since the last checkpoint
+static TickType_t first_since_checkpoint = 0; // When the oldest was saved
+
+typedef enum {
+    SD_JOB_WRITE,
+    SD_JOB_FLUSH,   // Marker job, records its seq and signals flush_done
+    SD_JOB_CATALOG, // Builds the image catalog before any queued write
+} sd_job_type_t;
+
+typedef struct {
+    sd_job_type_t type;
+    const uint8_t *data;
+    size_t len;
+    sd_card_write_cb_t done_cb;
+    void *ctx;
+    uint32_t seq; // Flush markers only
+} sd_write_job_t;
+
+static QueueHandle_t write_queue = NULL;
+static TaskHandle_t writer_task = NULL;
+static TaskHandle_t retention_task = NULL;
+static SemaphoreHandle_t flush_mutex = NULL;
+static SemaphoreHandle_t flush_done = NULL;
+static uint32_t flush_seq = 0;           // Last marker queued
+static volatile uint32_t flushed_seq = 0; // Last marker the writer reached
+
+static void writer_task_fn(void *arg);
+static void retention_task_fn(void *arg);
+static void thumb_tmp_path(char *path, size_t len);
+
+static esp_err_t writer_start(void) {
+    if (writer_task != NULL)
+        return ESP_OK;
+
+    write_queue = xQueueCreate(SD_CARD_WRITE_QUEUE_LEN, sizeof(sd_write_job_t));
+    flush_mutex = xSemaphoreCreateMutex();
+    flush_done = xSemaphoreCreateBinary();
+    if (!write_queue || !flush_mutex || !flush_done) {
+        ESP_LOGE(TAG, "Failed to create writer queue");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(writer_task_fn, "sd_writer", SD_CARD_WRITER_STACK_SIZE,
+                    NULL, SD_CARD_WRITER_PRIORITY, &writer_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create writer task");
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(retention_task_fn, "sd_retention",
+                    SD_CARD_RETENTION_STACK_SIZE, NULL,
+                    SD_CARD_RETENTION_PRIORITY,
+                    &retention_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create retention task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
 
 esp_err_t sd_card_init(const sd_card_config_t *config) {
     esp_err_t err;
@@ -26,39 +106,455 @@ esp_err_t sd_card_init(const sd_card_config_t *config) {
             return ESP_ERR_NO_MEM;
         }
     }
+    if (reader_slots == NULL) {
+        reader_slots = xSemaphoreCreateCounting(SD_CARD_MAX_READERS,
+                                                SD_CARD_MAX_READERS);
+        if (reader_slots == NULL) {
+            ESP_LOGE(TAG, "Failed to create semaphore");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    err = writer_start();
+    if (err != ESP_OK)
+        return err;
+    err = image_catalog_init();
+    if (err != ESP_OK)
+        return err;
+
+    layout = config->layout;
+    engine = config->engine;
+    min_free_mb = config->min_free_mb;
+    max_images = config->max_images;
+    checkpoint_every = config->checkpoint_every
+                           ? config->checkpoint_every
+                           : SD_CARD_DEFAULT_CHECKPOINT_EVERY;
+    checkpoint_interval_ms = config->checkpoint_interval_ms
+                                 ? config->checkpoint_interval_ms
+                                 : SD_CARD_DEFAULT_CHECKPOINT_INTERVAL_MS;
+    current_shard = UINT32_MAX;
 
     if (is_mounted) {
         ESP_LOGW(TAG, "SD card already mounted");
         return ESP_OK;
     }
 
+    if (config->bus_width != 0 && config->bus_width != 1 &&
+        config->bus_width != 4) {
+        ESP_LOGE(TAG, "Unsupported bus width %u", config->bus_width);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (config->direct_writes) {
+        sd_bounce_deinit();
+    } else if (sd_bounce_init() != ESP_OK) {
+        ESP_LOGW(TAG, "No bounce buffers, writing frames directly");
+    }
+
+    bool wide = config->bus_width == 4;
+
     sdmmc_host_t host = SDMMC_HOST_DEFAULT();
-    host.flags = SDMMC_HOST_FLAG_1BIT;
-    host.max_freq_khz = SDMMC_FREQ_DEFAULT;
+    host.flags = wide ? SDMMC_HOST_FLAG_4BIT : SDMMC_HOST_FLAG_1BIT;
+    host.max_freq_khz =
+        config->freq_khz ? config->freq_khz : SDMMC_FREQ_DEFAULT;
 
     sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
     slot_config.clk = config->clk_gpio;
     slot_config.cmd = config->cmd_gpio;
     slot_config.d0 = config->d0_gpio;
-    slot_config.width = 1;
+    if (wide) {
+        slot_config.d1 = config->d1_gpio;
+        slot_config.d2 = config->d2_gpio;
+        slot_config.d3 = config->d3_gpio;
+    }
+    slot_config.width = wide ? 4 : 1;
 
     esp_vfs_fat_sdmmc_mount_config_t mount_config = {
         .format_if_mount_failed = true,
-        .max_files = 5,
+        .max_files = SD_CARD_MAX_FILES,
         .allocation_unit_size = 16 * 1024};
 
     err = esp_vfs_fat_sdmmc_mount(mount_point, &host, &slot_config,
                                   &mount_config, &card);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to mount SD card: %s", esp_err_to_name(err));
+        sd_bounce_deinit();
         return err;
     }
 
     is_mounted = true;
-    ESP_LOGI(TAG, "SD card mounted successfully");
+    // The card may negotiate a lower clock than requested
+    ESP_LOGI(TAG, "SD card mounted, %d-bit bus at %d kHz",
+             1 << card->log_bus_width, card->real_freq_khz);
+
+    // Left by a thumbnail store cut short
+    char thumb_tmp[SD_CARD_PATH_MAX];
+    thumb_tmp_path(thumb_tmp, sizeof(thumb_tmp));
+    unlink(thumb_tmp);
+
+    if (engine == SD_CARD_ENGINE_LOG) {
+        char path[SD_CARD_PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", mount_point, SD_LOG_FILE_NAME);
+        err = sd_log_open(path,
+                          config->log_size_mb ? config->log_size_mb
+                                              : SD_CARD_DEFAULT_LOG_SIZE_MB,
+                          &image_counter);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to open image container: %s",
+                     esp_err_to_name(err));
+            esp_vfs_fat_sdcard_unmount(mount_point, card);
+            is_mounted = false;
+            card = NULL;
+            sd_bounce_deinit();
+            return err;
+        }
+    } else {
+        uint32_t last_number;
+        if (sd_card_scan_last_image_number(&last_number) != ESP_OK)
+            ESP_LOGW(TAG, "Failed to restore image counter");
+    }
+
+    // Built by the writer so mount returns at once and no save can slip
+    // in between the scan and the catalog going live
+    image_catalog_reset();
+    sd_write_job_t job = {.type = SD_JOB_CATALOG};
+    xQueueSend(write_queue, &job, portMAX_DELAY);
+    return ESP_OK;
+}
+
+void sd_card_image_path(uint32_t number, char *path, size_t len) {
+    if (layout == SD_CARD_LAYOUT_SHARDED) {
+        snprintf(path, len, "%s/%05" PRIu32 "/%" PRIu32 ".JPG", mount_point,
+                 number / SD_CARD_SHARD_SIZE, number);
+    } else {
+        snprintf(path, len, "%s/%" PRIu32 ".JPG", mount_point, number);
+    }
+}
+
+static bool parse_image_name(const char *name, uint32_t *number) {
+    return strstr(name, ".JPG") &&
+           sscanf(name, "%" PRIu32 ".JPG", number) == 1;
+}
+
+static bool parse_shard_name(const char *name, uint32_t *shard) {
+    return name[0] != '\0' && strspn(name, "0123456789") == strlen(name) &&
+           sscanf(name, "%" PRIu32, shard) == 1;
+}
+
+static esp_err_t ensure_shard_dir(uint32_t number) {
+    uint32_t shard = number / SD_CARD_SHARD_SIZE;
+    if (layout != SD_CARD_LAYOUT_SHARDED || shard == current_shard)
+        return ESP_OK;
+
+    char path[SD_CARD_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%05" PRIu32, mount_point, shard);
+    if (mkdir(path, 0775) != 0 && errno != EEXIST) {
+        ESP_LOGE(TAG, "Failed to create directory %s", path);
+        return ESP_FAIL;
+    }
+    current_shard = shard;
+    return ESP_OK;
+}
+
+// Thumbnails live in their own sharded tree for both engines, so image
+// scans never see them
+static void thumb_dir_path(uint32_t number, char *path, size_t len) {
+    snprintf(path, len, "%s/" SD_CARD_THUMB_DIR "/%05" PRIu32, mount_point,
+             number / SD_CARD_SHARD_SIZE);
+}
+
+static void thumb_path(uint32_t number, char *path, size_t len) {
+    thumb_dir_path(number, path, len);
+    size_t n = strlen(path);
+    snprintf(path + n, len - n, "/%" PRIu32 ".THM", number);
+}
+
+// Thumbnails are stored one at a time under sd_mutex, so they all share
+// one temporary name and mount has a single leftover to clear
+static void thumb_tmp_path(char *path, size_t len) {
+    snprintf(path, len, "%s/" SD_CARD_THUMB_DIR "/NEW.TMP", mount_point);
+}
+
+// Images are written under this name and renamed once complete
+static void image_tmp_path(uint32_t number, char *path, size_t len) {
+    sd_card_image_path(number, path, len);
+    size_t n = strlen(path);
+    memcpy(path + n - 3, "TMP", 3);
+}
+
+static bool image_exists(uint32_t number) {
+    char path[SD_CARD_PATH_MAX];
+    struct stat st;
+    sd_card_image_path(number, path, sizeof(path));
+    return stat(path, &st) == 0;
+}
+
+// Trusts the persisted counter only if the image before it exists and it
+// has not been written yet. Saves that landed after the last persisted
+// value, up to one checkpoint batch of them, are found by probing ahead.
+static esp_err_t load_image_counter(uint32_t *next) {
+    uint32_t stored;
+    if (nvs_storage_read_u32(NVS_SD_NAMESPACE, NVS_KEY_NEXT_IMAGE, &stored) !=
+        ESP_OK)
+        return ESP_ERR_NOT_FOUND;
+
+    if (stored == 0 || (stored > 1 && !image_exists(stored - 1))) {
+        ESP_LOGW(TAG, "Stored image counter %" PRIu32 " is stale", stored);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (uint32_t i = 0;
+         i <= checkpoint_every + SD_CARD_COUNTER_PROBE_LIMIT; i++) {
+        if (!image_exists(stored + i)) {
+            *next = stored + i;
+            return ESP_OK;
+        }
+    }
+    ESP_LOGW(TAG, "Stored image counter %" PRIu32 " is too far behind",
+             stored);
+    return ESP_ERR_INVALID_STATE;
+}
+
+static void persist_image_counter(void) {
+    nvs_storage_write_u32(NVS_SD_NAMESPACE, NVS_KEY_NEXT_IMAGE,
+                          image_counter);
+}
+
+static uint32_t max_image_in_dir(DIR *dir, uint32_t *max_shard) {
+    uint32_t max_number = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        uint32_t num = 0;
+        if (entry->d_type == DT_REG) {
+            if (parse_image_name(entry->d_name, &num) && num > max_number)
+                max_number = num;
+        } else if (entry->d_type == DT_DIR && max_shard) {
+            if (parse_shard_name(entry->d_name, &num) &&
+                (*max_shard == UINT32_MAX || num > *max_shard))
+                *max_shard = num;
+        }
+    }
+    return max_number;
+}
+
+// Only the root and the highest shard are read, never every shard
+static esp_err_t scan_image_counter(uint32_t *next) {
+    DIR *dir = opendir(mount_point);
+    if (!dir) {
+        ESP_LOGE(TAG, "Failed to open directory %s", mount_point);
+        return ESP_FAIL;
+    }
+
+    uint32_t max_shard = UINT32_MAX;
+    uint32_t max_number = max_image_in_dir(dir, &max_shard);
+    closedir(dir);
+
+    if (max_shard != UINT32_MAX) {
+        char path[SD_CARD_PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%05" PRIu32, mount_point, max_shard);
+        dir = opendir(path);
+        if (dir) {
+            uint32_t num = max_image_in_dir(dir, NULL);
+            closedir(dir);
+            if (num > max_number)
+                max_number = num;
+        }
+    }
+
+    *next = max_number + 1;
+    return ESP_OK;
+}
+
+static uint32_t fat_timestamp(WORD fdate, WORD ftime) {
+    struct tm tm = {.tm_year = (fdate >> 9) + 80,
+                    .tm_mon = ((fdate >> 5) & 0x0F) - 1,
+                    .tm_mday = fdate & 0x1F,
+                    .tm_hour = ftime >> 11,
+                    .tm_min = (ftime >> 5) & 0x3F,
+                    .tm_sec = (ftime & 0x1F) * 2,
+                    .tm_isdst = -1};
+    return (uint32_t)mktime(&tm);
+}
+
+// Goes through FatFs directly: one f_readdir per entry already carries
+// size and date, where readdir() would need a stat() per image
+static void catalog_scan_dir(const char *dir_path, bool recurse) {
+    FF_DIR dir;
+    FILINFO info;
+    if (f_opendir(&dir, dir_path) != FR_OK)
+        return;
+
+    while (f_readdir(&dir, &info) == FR_OK && info.fname[0] != '\0') {
+        uint32_t num;
+        if (info.fattrib & AM_DIR) {
+            if (recurse && parse_shard_name(info.fname, &num)) {
+                char sub_path[SD_CARD_PATH_MAX];
+                snprintf(sub_path, sizeof(sub_path), "%s%s/", dir_path,
+                         info.fname);
+                catalog_scan_dir(sub_path, false);
+            }
+        } else if (strstr(info.fname, ".TMP")) {
+            // Left by a save that never completed
+            char tmp_path[SD_CARD_PATH_MAX];
+            snprintf(tmp_path, sizeof(tmp_path), "%s%s", dir_path,
+                     info.fname);
+            f_unlink(tmp_path);
+        } else if (parse_image_name(info.fname, &num)) {
+            image_catalog_entry_t entry = {
+                .number = num,
+                .size = info.fsize,
+                .timestamp = fat_timestamp(info.fdate, info.ftime),
+                .flags = recurse ? IMAGE_CATALOG_FLAG_FLAT : 0};
+            if (image_catalog_add(&entry) != ESP_OK)
+                break;
+        }
+    }
+    f_closedir(&dir);
+}
+
+static bool catalog_add_log_entry(const sd_log_entry_t *log_entry,
+                                  void *ctx) {
+    image_catalog_entry_t entry = {.number = log_entry->number,
+                                   .size = log_entry->len,
+                                   .timestamp = log_entry->timestamp,
+                                   .location = log_entry->offset};
+    return image_catalog_add(&entry) == ESP_OK;
+}
+
+static void build_catalog(void) {
+    int64_t start = esp_timer_get_time();
+    xSemaphoreTake(sd_mutex, portMAX_DELAY);
+    if (engine == SD_CARD_ENGINE_LOG) {
+        sd_log_for_each(catalog_add_log_entry, NULL);
+    } else {
+        char root[8];
+        snprintf(root, sizeof(root), "%u:/", ff_diskio_get_pdrv_card(card));
+        catalog_scan_dir(root, true);
+    }
+    image_catalog_finish_build();
+    xSemaphoreGive(sd_mutex);
+    ESP_LOGI(TAG, "Catalog built in %lld ms",
+             (long long)(esp_timer_get_time() - start) / 1000);
+}
+
+void sd_card_set_capture_info(const sd_card_capture_info_t *info) {
+    capture_info = *info;
+}
+
+static esp_err_t take_reader_slot(void) {
+    if (xSemaphoreTake(reader_slots, pdMS_TO_TICKS(SD_CARD_READER_WAIT_MS)) !=
+        pdTRUE) {
+        ESP_LOGW(TAG, "All %d readers in use", SD_CARD_MAX_READERS);
+        return ESP_ERR_TIMEOUT;
+    }
     return ESP_OK;
 }
 
+static esp_err_t open_image(uint32_t number, sd_card_reader_t *reader) {
+    image_catalog_entry_t cached;
+    esp_err_t err = image_catalog_lookup(number, &cached);
+    if (err == ESP_ERR_NOT_FOUND)
+        return err;
+    bool have_entry = err == ESP_OK;
+
+    if (engine == SD_CARD_ENGINE_LOG) {
+        sd_log_entry_t entry;
+        if (have_entry) {
+            entry.offset = cached.location;
+            entry.len = cached.size;
+        } else {
+            err = sd_log_lookup(number, &entry);
+            if (err != ESP_OK)
+                return err;
+        }
+        reader->f = fopen(sd_log_path(), "rb");
+        if (!reader->f)
+            return ESP_FAIL;
+        setvbuf(reader->f, NULL, _IONBF, 0);
+        if (fseek(reader->f, entry.offset + SD_LOG_RECORD_HEADER_SIZE,
+                  SEEK_SET) != 0) {
+            fclose(reader->f);
+            return ESP_FAIL;
+        }
+        reader->size = entry.len;
+        reader->remaining = entry.len;
+        return ESP_OK;
+    }
+
+    char path[SD_CARD_PATH_MAX];
+    if (have_entry) {
+        if (cached.flags & IMAGE_CATALOG_FLAG_FLAT)
+            snprintf(path, sizeof(path), "%s/%" PRIu32 ".JPG", mount_point,
+                     number);
+        else
+            sd_card_image_path(number, path, sizeof(path));
+        reader->f = fopen(path, "rb");
+        if (!reader->f)
+            return ESP_FAIL;
+        setvbuf(reader->f, NULL, _IONBF, 0);
+        reader->size = cached.size;
+        reader->remaining = cached.size;
+        return ESP_OK;
+    }
+
+    // Catalog still being built
+    struct stat st;
+    sd_card_image_path(number, path, sizeof(path));
+    if (stat(path, &st) != 0) {
+        // Images saved before switching to the sharded layout
+        snprintf(path, sizeof(path), "%s/%" PRIu32 ".JPG", mount_point,
+                 number);
+        if (stat(path, &st) != 0)
+            return ESP_ERR_NOT_FOUND;
+    }
+    reader->f = fopen(path, "rb");
+    if (!reader->f)
+        return ESP_FAIL;
+    setvbuf(reader->f, NULL, _IONBF, 0);
+    reader->size = st.st_size;
+    reader->remaining = st.st_size;
+    return ESP_OK;
+}
+
+esp_err_t sd_card_open_image(uint32_t number, sd_card_reader_t *reader) {
+    if (!is_mounted)
+        return ESP_ERR_INVALID_STATE;
+
+    esp_err_t err = take_reader_slot();
+    if (err != ESP_OK)
+        return err;
+    err = open_image(number, reader);
+    if (err != ESP_OK)
+        xSemaphoreGive(reader_slots);
+    return err;
+}
+
+esp_err_t sd_card_seek_image(sd_card_reader_t *reader, size_t offset) {
+    if (offset > reader->size)
+        return ESP_ERR_INVALID_ARG;
+    long delta = (long)offset - (long)(reader->size - reader->remaining);
+    if (fseek(reader->f, delta, SEEK_CUR) != 0)
+        return ESP_FAIL;
+    reader->remaining = reader->size - offset;
+    return ESP_OK;
+}
+
+size_t sd_card_read_image(sd_card_reader_t *reader, void *buf, size_t len) {
+    if (len > reader->remaining)
+        len = reader->remaining;
+    size_t n = fread(buf, 1, len, reader->f);
+    reader->remaining -= n;
+    return n;
+}
+
+void sd_card_close_image(sd_card_reader_t *reader) {
+    if (reader->f) {
+        fclose(reader->f);
+        xSemaphoreGive(reader_slots);
+    }
+    reader->f = NULL;
+}
+
 esp_err_t sd_card_scan_last_image_number(uint32_t *last_number) {
     if (!is_mounted) {
         ESP_LOGE(TAG, "SD card not mounted");
@@ -70,40 +566,177 @@ esp_err_t sd_card_scan_last_image_number(uint32_t *last_number) {
         return ESP_ERR_TIMEOUT;
     }
 
-    DIR *dir = opendir(mount_point);
-    if (!dir) {
-        ESP_LOGE(TAG, "Failed to open directory %s", mount_point);
+    if (engine == SD_CARD_ENGINE_LOG) {
+        // The container tracks its own numbering
+        *last_number = image_counter - 1;
         xSemaphoreGive(sd_mutex);
-        return ESP_FAIL;
+        return ESP_OK;
     }
 
-    uint32_t max_number = 0;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) {
-            const char *name = entry->d_name;
-            if (strstr(name, ".JPG")) {
-                uint32_t num = 0;
-                if (sscanf(name, "%" PRIu32 ".JPG", &num) == 1) {
-                    if (num > max_number) {
-                        max_number = num;
-                    }
-                }
-            }
+    uint32_t next;
+    esp_err_t err = load_image_counter(&next);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Rebuilding image counter from directory scan");
+        err = scan_image_counter(&next);
+        if (err != ESP_OK) {
+            xSemaphoreGive(sd_mutex);
+            return err;
         }
     }
 
-    closedir(dir);
-    *last_number = max_number;
-    image_counter = max_number + 1;
+    image_counter = next;
+    persist_image_counter();
+    *last_number = next - 1;
+
+    // Only the save in flight at power loss can have left a partial file
+    char tmp_path[SD_CARD_PATH_MAX];
+    image_tmp_path(next, tmp_path, sizeof(tmp_path));
+    if (unlink(tmp_path) == 0)
+        ESP_LOGW(TAG, "Removed partial image %s", tmp_path);
     ESP_LOGI(TAG, "Last image number found: %" PRIu32 ", next will be %" PRIu32,
-             max_number, image_counter);
+             *last_number, image_counter);
 
     xSemaphoreGive(sd_mutex);
     return ESP_OK;
 }
 
-esp_err_t sd_card_save_image(const uint8_t *data, size_t len) {
+// Caller holds sd_mutex
+static esp_err_t delete_image_locked(uint32_t number) {
+    esp_err_t err;
+    if (engine == SD_CARD_ENGINE_LOG) {
+        err = sd_log_delete(number);
+    } else {
+        image_catalog_entry_t entry;
+        char path[SD_CARD_PATH_MAX];
+        if (image_catalog_lookup(number, &entry) == ESP_OK &&
+            (entry.flags & IMAGE_CATALOG_FLAG_FLAT))
+            snprintf(path, sizeof(path), "%s/%" PRIu32 ".JPG", mount_point,
+                     number);
+        else
+            sd_card_image_path(number, path, sizeof(path));
+        err = unlink(path) == 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+
+        // Eviction empties shards oldest first, drop each as it goes
+        uint32_t shard = number / SD_CARD_SHARD_SIZE;
+        if (layout == SD_CARD_LAYOUT_SHARDED &&
+            (number + 1) % SD_CARD_SHARD_SIZE == 0 && shard != current_shard) {
+            snprintf(path, sizeof(path), "%s/%05" PRIu32, mount_point, shard);
+            rmdir(path);
+        }
+    }
+
+    // Most images never had a thumbnail made, a miss is expected
+    if (err == ESP_OK || err == ESP_ERR_NOT_FOUND) {
+        char path[SD_CARD_PATH_MAX];
+        thumb_path(number, path, sizeof(path));
+        unlink(path);
+        if ((number + 1) % SD_CARD_SHARD_SIZE == 0) {
+            thumb_dir_path(number, path, sizeof(path));
+            rmdir(path);
+        }
+    }
+    // Also drops entries for images that vanished from the card
+    if (err == ESP_OK || err == ESP_ERR_NOT_FOUND)
+        image_catalog_remove(number);
+    return err;
+}
+
+// The catalog head is the oldest image, no directory scan needed
+static esp_err_t evict_oldest_locked(void) {
+    image_catalog_entry_t oldest;
+    esp_err_t err = image_catalog_oldest(&oldest);
+    if (err != ESP_OK)
+        return err;
+    err = delete_image_locked(oldest.number);
+    if (err == ESP_ERR_NOT_FOUND)
+        err = ESP_OK;
+    if (err == ESP_OK)
+        ESP_LOGD(TAG, "Evicted image %" PRIu32, oldest.number);
+    return err;
+}
+
+// Caller holds sd_mutex. Returns ESP_ERR_NO_MEM when the card or the
+// container has no room left.
+static esp_err_t store_image_locked(const uint8_t *data, size_t len) {
+    if (engine == SD_CARD_ENGINE_LOG) {
+        sd_log_entry_t added;
+        esp_err_t err =
+            sd_log_append(image_counter, data, len, &capture_info, &added);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "Appended image %" PRIu32 ", size: %zu bytes",
+                     image_counter, len);
+            image_catalog_entry_t entry = {.number = added.number,
+                                           .size = added.len,
+                                           .timestamp = added.timestamp,
+                                           .location = added.offset};
+            image_catalog_add(&entry);
+            image_counter++;
+        }
+        return err;
+    }
+
+    if (ensure_shard_dir(image_counter) != ESP_OK)
+        return errno == ENOSPC ? ESP_ERR_NO_MEM : ESP_FAIL;
+
+    char filename[SD_CARD_PATH_MAX];
+    char tmp_path[SD_CARD_PATH_MAX];
+    sd_card_image_path(image_counter, filename, sizeof(filename));
+    image_tmp_path(image_counter, tmp_path, sizeof(tmp_path));
+
+    // Allocating the whole cluster chain up front keeps the image in one
+    // contiguous run and the FAT updated once. A fragmented card falls back
+    // to growing the file as it is written.
+    int fd = -1;
+    if (esp_vfs_fat_create_contiguous_file(mount_point, tmp_path, len,
+                                           true) == ESP_OK)
+        fd = open(tmp_path, O_WRONLY);
+    if (fd < 0)
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to open file %s for writing", tmp_path);
+        return errno == ENOSPC ? ESP_ERR_NO_MEM : ESP_FAIL;
+    }
+
+    esp_err_t err = sd_bounce_write(fd, NULL, 0, data, len);
+    int write_errno = errno;
+    // FatFs commits data and size on close, so the rename below only ever
+    // exposes a complete image
+    if (close(fd) != 0 && err == ESP_OK) {
+        err = ESP_FAIL;
+        write_errno = errno;
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write full image to %s (%zu bytes)",
+                 tmp_path, len);
+        unlink(tmp_path);
+        return write_errno == ENOSPC ? ESP_ERR_NO_MEM : ESP_FAIL;
+    }
+    if (rename(tmp_path, filename) != 0) {
+        ESP_LOGE(TAG, "Failed to commit %s", filename);
+        unlink(tmp_path);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Saved image to %s, size: %zu bytes", filename, len);
+    image_catalog_entry_t entry = {
+        .number = image_counter,
+        .size = len,
+        .timestamp = (uint32_t)time(NULL),
+        .flags = layout == SD_CARD_LAYOUT_FLAT ? IMAGE_CATALOG_FLAG_FLAT : 0};
+    image_catalog_add(&entry);
+    image_counter++;
+    return ESP_OK;
+}
+
+// The log container is a ring and always needs its oldest records evicted
+static bool retention_enabled(void) {
+    return engine == SD_CARD_ENGINE_LOG || min_free_mb || max_images;
+}
+
+uint32_t sd_card_next_image_number(void) { return image_counter; }
+
+static esp_err_t write_image_file(const uint8_t *data, size_t len) {
     if (!is_mounted) {
         ESP_LOGE(TAG, "SD card not mounted");
         return ESP_ERR_INVALID_STATE;
@@ -114,44 +747,304 @@ esp_err_t sd_card_save_image(const uint8_t *data, size_t len) {
         return ESP_ERR_TIMEOUT;
     }
 
-    char filename[32];
-    snprintf(filename, sizeof(filename), "%s/%" PRIu32 ".JPG", mount_point,
-             image_counter);
+    esp_err_t err = store_image_locked(data, len);
+    for (int i = 0; err == ESP_ERR_NO_MEM && retention_enabled() &&
+                    i < SD_CARD_EVICT_RETRY_LIMIT;
+         i++) {
+        ESP_LOGW(TAG, "Out of space, evicting inline");
+        if (evict_oldest_locked() != ESP_OK)
+            break;
+        err = store_image_locked(data, len);
+    }
 
-    FILE *f = fopen(filename, "wb");
-    if (!f) {
-        ESP_LOGE(TAG, "Failed to open file %s for writing", filename);
-        xSemaphoreGive(sd_mutex);
-        return ESP_FAIL;
+    xSemaphoreGive(sd_mutex);
+    return err;
+}
+
+static void checkpoint_saves(void) {
+    if (since_checkpoint == 0)
+        return;
+
+    xSemaphoreTake(sd_mutex, portMAX_DELAY);
+    if (is_mounted) {
+        if (engine == SD_CARD_ENGINE_LOG)
+            sd_log_sync();
+        else
+            persist_image_counter();
     }
+    xSemaphoreGive(sd_mutex);
+    since_checkpoint = 0;
+}
 
-    size_t written = fwrite(data, 1, len, f);
-    fclose(f);
+static void writer_task_fn(void *arg) {
+    sd_write_job_t job;
+    while (true) {
+        TickType_t wait = portMAX_DELAY;
+        if (since_checkpoint > 0) {
+            TickType_t age = xTaskGetTickCount() - first_since_checkpoint;
+            TickType_t interval =
+                pdMS_TO_TICKS(checkpoint_interval_ms);
+            wait = age < interval ? interval - age : 0;
+        }
+        if (xQueueReceive(write_queue, &job, wait) != pdTRUE) {
+            // Went quiet with saves still pending
+            checkpoint_saves();
+            continue;
+        }
+
+        if (job.type == SD_JOB_FLUSH) {
+            checkpoint_saves();
+            flushed_seq = job.seq;
+            xSemaphoreGive(flush_done);
+            continue;
+        }
+        if (job.type == SD_JOB_CATALOG) {
+            build_catalog();
+            // The card may already be past its limits
+            if (retention_enabled())
+                xTaskNotifyGive(retention_task);
+            continue;
+        }
+
+        esp_err_t err = write_image_file(job.data, job.len);
+        if (job.done_cb)
+            job.done_cb(job.data, job.len, err, job.ctx);
+        if (err == ESP_OK && retention_enabled())
+            xTaskNotifyGive(retention_task);
+
+        // Bursts share one checkpoint instead of paying for it per frame
+        if (err == ESP_OK) {
+            if (since_checkpoint++ == 0)
+                first_since_checkpoint = xTaskGetTickCount();
+            if (since_checkpoint >= checkpoint_every)
+                checkpoint_saves();
+        }
+    }
+}
 
-    if (written != len) {
-        ESP_LOGE(TAG,
-                 "Failed to write full image to %s (wrote %zu of %zu bytes)",
-                 filename, written, len);
+esp_err_t sd_card_queue_image(const uint8_t *data, size_t len,
+                              sd_card_write_cb_t done_cb, void *ctx,
+                              uint32_t timeout_ms) {
+    if (!is_mounted || write_queue == NULL) {
+        ESP_LOGE(TAG, "SD card not mounted");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    sd_write_job_t job = {.type = SD_JOB_WRITE,
+                          .data = data,
+                          .len = len,
+                          .done_cb = done_cb,
+                          .ctx = ctx};
+    if (xQueueSend(write_queue, &job, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+        ESP_LOGW(TAG, "Write queue full, dropping frame");
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+uint32_t sd_card_pending_writes(void) {
+    return write_queue ? uxQueueMessagesWaiting(write_queue) : 0;
+}
+
+static void free_copied_frame(const uint8_t *data, size_t len,
+                              esp_err_t result, void *ctx) {
+    heap_caps_free((void *)data);
+}
+
+esp_err_t sd_card_save_image(const uint8_t *data, size_t len) {
+    uint8_t *copy = heap_caps_malloc(len, MALLOC_CAP_SPIRAM);
+    if (!copy) {
+        ESP_LOGE(TAG, "Failed to allocate %zu bytes for frame copy", len);
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(copy, data, len);
+
+    esp_err_t err = sd_card_queue_image(copy, len, free_copied_frame, NULL, 0);
+    if (err != ESP_OK)
+        heap_caps_free(copy);
+    return err;
+}
+
+esp_err_t sd_card_delete_image(uint32_t number) {
+    if (!is_mounted)
+        return ESP_ERR_INVALID_STATE;
+
+    if (xSemaphoreTake(sd_mutex, pdMS_TO_TICKS(1000)) != pdTRUE) {
+        ESP_LOGE(TAG, "Failed to take semaphore");
+        return ESP_ERR_TIMEOUT;
+    }
+    esp_err_t err = delete_image_locked(number);
+    if (err == ESP_OK)
+        ESP_LOGI(TAG, "Deleted image %" PRIu32, number);
+    xSemaphoreGive(sd_mutex);
+    return err;
+}
+
+esp_err_t sd_card_store_thumb(uint32_t number, const uint8_t *data,
+                              size_t len) {
+    if (!is_mounted)
+        return ESP_ERR_INVALID_STATE;
+    if (xSemaphoreTake(sd_mutex, pdMS_TO_TICKS(1000)) != pdTRUE) {
+        ESP_LOGE(TAG, "Failed to take semaphore");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    // Under the lock so a delete cannot slip in and orphan the thumbnail
+    image_catalog_entry_t entry;
+    if (image_catalog_ready() &&
+        image_catalog_lookup(number, &entry) != ESP_OK) {
         xSemaphoreGive(sd_mutex);
-        return ESP_FAIL;
+        return ESP_ERR_NOT_FOUND;
     }
 
-    ESP_LOGI(TAG, "Saved image to %s, size: %zu bytes", filename, len);
-    image_counter++;
+    char path[SD_CARD_PATH_MAX];
+    char tmp_path[SD_CARD_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" SD_CARD_THUMB_DIR, mount_point);
+    mkdir(path, 0775);
+    thumb_dir_path(number, path, sizeof(path));
+    mkdir(path, 0775);
+    thumb_path(number, path, sizeof(path));
+    thumb_tmp_path(tmp_path, sizeof(tmp_path));
 
+    // Renamed into place so a torn write is never served, since clients
+    // cache thumbnails for good
+    esp_err_t err = ESP_FAIL;
+    FILE *f = fopen(tmp_path, "wb");
+    if (f) {
+        bool written = fwrite(data, 1, len, f) == len;
+        if (fclose(f) == 0 && written && rename(tmp_path, path) == 0)
+            err = ESP_OK;
+        else
+            unlink(tmp_path);
+    }
     xSemaphoreGive(sd_mutex);
+    if (err != ESP_OK)
+        ESP_LOGW(TAG, "Failed to store thumbnail %s", path);
+    return err;
+}
+
+esp_err_t sd_card_open_thumb(uint32_t number, sd_card_reader_t *reader) {
+    if (!is_mounted)
+        return ESP_ERR_INVALID_STATE;
+
+    char path[SD_CARD_PATH_MAX];
+    struct stat st;
+    thumb_path(number, path, sizeof(path));
+    if (stat(path, &st) != 0)
+        return ESP_ERR_NOT_FOUND;
+    esp_err_t err = take_reader_slot();
+    if (err != ESP_OK)
+        return err;
+    reader->f = fopen(path, "rb");
+    if (!reader->f) {
+        xSemaphoreGive(reader_slots);
+        return ESP_FAIL;
+    }
+    setvbuf(reader->f, NULL, _IONBF, 0);
+    reader->size = st.st_size;
+    reader->remaining = st.st_size;
     return ESP_OK;
 }
 
+static uint64_t free_bytes(void) {
+    if (engine == SD_CARD_ENGINE_LOG)
+        return sd_log_free_bytes();
+
+    uint64_t total, free;
+    if (esp_vfs_fat_info(mount_point, &total, &free) != ESP_OK)
+        return UINT64_MAX;
+    return free;
+}
+
+// Caller holds sd_mutex
+static bool over_retention_limit(uint64_t min_free) {
+    // Keep the container index from wrapping onto live records
+    uint32_t limit = max_images;
+    uint32_t index_limit = SD_LOG_MAX_RECORDS - SD_LOG_INDEX_FLUSH_INTERVAL;
+    if (engine == SD_CARD_ENGINE_LOG && (limit == 0 || limit > index_limit))
+        limit = index_limit;
+
+    if (limit && image_catalog_count() > limit)
+        return true;
+    return min_free && free_bytes() < min_free;
+}
+
+static void retention_task_fn(void *arg) {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!image_catalog_ready())
+            continue;
+
+        uint64_t low = (uint64_t)min_free_mb * 1024 * 1024;
+        uint64_t high =
+            low ? low + (uint64_t)SD_CARD_RETENTION_HYSTERESIS_MB * 1024 * 1024
+                : 0;
+        uint32_t evicted = 0;
+        while (true) {
+            // One image per lock so queued saves get in between deletes
+            xSemaphoreTake(sd_mutex, portMAX_DELAY);
+            bool over = is_mounted && over_retention_limit(evicted ? high
+                                                                   : low);
+            esp_err_t err = over ? evict_oldest_locked() : ESP_OK;
+            xSemaphoreGive(sd_mutex);
+            if (!over || err != ESP_OK)
+                break;
+            evicted++;
+        }
+        if (evicted)
+            ESP_LOGI(TAG, "Evicted %" PRIu32 " oldest images", evicted);
+    }
+}
+
+esp_err_t sd_card_flush(uint32_t timeout_ms) {
+    if (writer_task == NULL)
+        return ESP_OK;
+
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+    if (xSemaphoreTake(flush_mutex, timeout) != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+
+    // Markers left queued by flushes that timed out still signal
+    // flush_done, so wait until the writer reaches this one
+    esp_err_t err = ESP_OK;
+    sd_write_job_t marker = {.type = SD_JOB_FLUSH, .seq = ++flush_seq};
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= timeout ||
+        xQueueSend(write_queue, &marker, timeout - elapsed) != pdTRUE) {
+        err = ESP_ERR_TIMEOUT;
+    } else {
+        while ((int32_t)(flushed_seq - marker.seq) < 0) {
+            elapsed = xTaskGetTickCount() - start;
+            if (elapsed >= timeout ||
+                xSemaphoreTake(flush_done, timeout - elapsed) != pdTRUE) {
+                err = ESP_ERR_TIMEOUT;
+                break;
+            }
+        }
+    }
+
+    xSemaphoreGive(flush_mutex);
+    if (err != ESP_OK)
+        ESP_LOGW(TAG, "Timed out waiting for pending writes");
+    return err;
+}
+
 void sd_card_deinit(void) {
     if (!is_mounted)
         return;
 
+    sd_card_flush(5000);
+
     if (xSemaphoreTake(sd_mutex, pdMS_TO_TICKS(1000)) != pdTRUE) {
         ESP_LOGE(TAG, "Failed to take semaphore for deinit");
         return;
     }
 
+    if (engine == SD_CARD_ENGINE_LOG)
+        sd_log_close();
+    image_catalog_reset();
+    sd_bounce_deinit();
     esp_vfs_fat_sdcard_unmount(mount_point, card);
     is_mounted = false;
     card = NULL;
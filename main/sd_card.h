@@ -3,21 +3,133 @@
 
 #include "driver/sdmmc_host.h"
 #include "esp_err.h"
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define SDMMC_CLK_GPIO 39
 #define SDMMC_CMD_GPIO 38
 #define SDMMC_D0_GPIO 40
 
+#define SD_CARD_MOUNT_POINT "/sdcard"
+#define SD_CARD_PATH_MAX 40
+#define SD_CARD_THUMB_DIR "THM"
+#define SD_CARD_SHARD_SIZE 1000
+#define SD_CARD_DEFAULT_LOG_SIZE_MB 1024
+
+#define SD_CARD_WRITE_QUEUE_LEN 4
+#define SD_CARD_WRITER_STACK_SIZE 4096
+#define SD_CARD_WRITER_PRIORITY 5
+// Images past the persisted counter probed before falling back to a scan
+#define SD_CARD_COUNTER_PROBE_LIMIT 8
+
+#define SD_CARD_RETENTION_STACK_SIZE 3072
+#define SD_CARD_RETENTION_PRIORITY 2 // Below the writer, saves come first
+// Once triggered, eviction runs until this much more than min_free_mb is free
+#define SD_CARD_RETENTION_HYSTERESIS_MB 16
+// Images the writer evicts itself when retention has fallen behind
+#define SD_CARD_EVICT_RETRY_LIMIT 8
+
+// Images and thumbnails open for reading at once, one per HTTP worker plus
+// the httpd task. Further opens wait up to SD_CARD_READER_WAIT_MS for one
+// to close, so the files the writer needs are always free.
+#define SD_CARD_MAX_READERS 8
+#define SD_CARD_READER_WAIT_MS 2000
+// The log container plus one file opened under the card lock: an image or
+// thumbnail being written, or the handle an index read goes through
+#define SD_CARD_MAX_FILES (SD_CARD_MAX_READERS + 2)
+
+#define SD_CARD_DEFAULT_CHECKPOINT_EVERY 8
+#define SD_CARD_DEFAULT_CHECKPOINT_INTERVAL_MS 2000
+
+typedef enum {
+    SD_CARD_LAYOUT_FLAT,    // /sdcard/N.JPG
+    SD_CARD_LAYOUT_SHARDED, // /sdcard/<N / SD_CARD_SHARD_SIZE>/N.JPG
+} sd_card_layout_t;
+
+typedef enum {
+    SD_CARD_ENGINE_FILES, // One FAT file per image
+    SD_CARD_ENGINE_LOG,   // Records appended to one preallocated container
+} sd_card_engine_t;
+
 typedef struct {
     uint32_t clk_gpio;
     uint32_t cmd_gpio;
     uint32_t d0_gpio;
+    uint32_t d1_gpio; // d1-d3 are only used with a 4-bit bus
+    uint32_t d2_gpio;
+    uint32_t d3_gpio;
+    uint8_t bus_width; // 1 or 4, 0 for 1
+    uint32_t freq_khz; // e.g. SDMMC_FREQ_HIGHSPEED, 0 for SDMMC_FREQ_DEFAULT
+    sd_card_layout_t layout;
+    sd_card_engine_t engine;
+    uint32_t log_size_mb; // Container size, 0 for the default
+    uint32_t min_free_mb; // Evict the oldest images below this, 0 disables
+    uint32_t max_images;  // Evict the oldest images above this, 0 disables
+    bool direct_writes;   // Skip the internal bounce buffers, for comparison
+    // A checkpoint is taken once checkpoint_every saves are past the last
+    // one or the oldest of them is checkpoint_interval_ms old; 0 picks the
+    // defaults. With the log engine it is the container's only fsync, so
+    // data syncs are batched. The files engine commits, and so syncs, every
+    // image on its own close; there a checkpoint only persists the image
+    // counter, and checkpoint_every bounds how far boot probes past it.
+    uint32_t checkpoint_every;
+    uint32_t checkpoint_interval_ms;
 } sd_card_config_t;
 
+// Capture settings recorded with each image by the log engine
+typedef struct {
+    uint8_t frame_size;
+    uint8_t jpeg_quality;
+    uint8_t pixel_format;
+} sd_card_capture_info_t;
+
+typedef struct {
+    FILE *f;
+    size_t size;
+    size_t remaining;
+} sd_card_reader_t;
+
+// Called from the writer task once a queued frame has been written (or has
+// failed to). The callee owns the buffer again from this point on.
+typedef void (*sd_card_write_cb_t)(const uint8_t *data, size_t len,
+                                   esp_err_t result, void *ctx);
+
 esp_err_t sd_card_init(const sd_card_config_t *config);
 esp_err_t sd_card_scan_last_image_number(uint32_t *last_number);
+// Number the next saved image will get
+uint32_t sd_card_next_image_number(void);
+// Copies the frame and queues it for the writer task. Returns ESP_ERR_TIMEOUT
+// without queueing anything when the write queue is full.
 esp_err_t sd_card_save_image(const uint8_t *data, size_t len);
+// Zero-copy variant: data must stay valid until done_cb is called. Waits up
+// to timeout_ms for room in the write queue.
+esp_err_t sd_card_queue_image(const uint8_t *data, size_t len,
+                              sd_card_write_cb_t done_cb, void *ctx,
+                              uint32_t timeout_ms);
+// Jobs waiting for the writer, not counting the one being written
+uint32_t sd_card_pending_writes(void);
+// Blocks until every frame queued before the call has been written and
+// synced.
+esp_err_t sd_card_flush(uint32_t timeout_ms);
+// Where image number is stored under the configured layout
+void sd_card_image_path(uint32_t number, char *path, size_t len);
+// Removes the image from the card and from the image catalog
+esp_err_t sd_card_delete_image(uint32_t number);
+void sd_card_set_capture_info(const sd_card_capture_info_t *info);
+// Readers work the same for both engines. They are unbuffered, so reads
+// of several sectors go straight from the card into the caller's buffer.
+// Opening fails with ESP_ERR_TIMEOUT while SD_CARD_MAX_READERS are open.
+esp_err_t sd_card_open_image(uint32_t number, sd_card_reader_t *reader);
+esp_err_t sd_card_seek_image(sd_card_reader_t *reader, size_t offset);
+size_t sd_card_read_image(sd_card_reader_t *reader, void *buf, size_t len);
+void sd_card_close_image(sd_card_reader_t *reader);
+// Thumbnails are cached under SD_CARD_THUMB_DIR and removed along with
+// their image. Storing fails with ESP_ERR_NOT_FOUND once the image is gone.
+// Open thumbnails are read and closed with the image reader calls.
+esp_err_t sd_card_store_thumb(uint32_t number, const uint8_t *data,
+                              size_t len);
+esp_err_t sd_card_open_thumb(uint32_t number, sd_card_reader_t *reader);
 void sd_card_deinit(void);
 
 #endif
@@ -0,0 +1,525 @@
+#include "sd_log.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "sd_bounce.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Container layout: superblock, then a fixed index with one entry per
+// record slot (number % max_records), then the record data area. Records
+// are a header followed by the image, each starting on an SD_LOG_ALIGN
+// boundary. The file is preallocated so appends never touch the FAT chain
+// or directory entry size. The data area is a ring: a record that does not
+// fit before data_end starts over at data_offset, and space is given back
+// by deleting the oldest record, which moves the tail.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_records;
+    uint32_t index_offset;
+    uint32_t data_offset;
+    uint32_t data_end;
+    uint32_t next_number;  // First number not yet in the on-card index
+    uint32_t write_offset; // Where record next_number starts
+    uint32_t tail_number;  // Oldest record still holding space
+    uint32_t tail_offset;
+    uint32_t crc;
+} sd_log_super_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t number;
+    uint32_t len;
+    uint32_t timestamp;
+    uint32_t data_crc;
+    uint8_t frame_size;
+    uint8_t jpeg_quality;
+    uint8_t pixel_format;
+    uint8_t flags;
+    uint32_t reserved;
+    uint32_t header_crc;
+} sd_log_record_t;
+
+_Static_assert(sizeof(sd_log_record_t) == SD_LOG_RECORD_HEADER_SIZE,
+               "record header size");
+
+static const char *TAG = "sd_log";
+static char log_path[SD_CARD_PATH_MAX];
+static int log_fd = -1;
+static sd_log_super_t super;
+// Guards pending and the superblock against readers. Appends themselves are
+// serialized by the caller.
+static SemaphoreHandle_t pending_lock = NULL;
+// Appended since the last index flush, newest last
+static sd_log_entry_t pending[SD_LOG_INDEX_FLUSH_INTERVAL];
+static uint32_t pending_count = 0;
+static uint32_t next_number = 1;
+static uint32_t write_offset = 0;
+static uint32_t tail_number = 1;
+static uint32_t tail_offset = 0;
+static bool tail_dirty = false;
+
+static uint32_t align_up(uint32_t v, uint32_t align) {
+    return (v + align - 1) & ~(align - 1);
+}
+
+static uint32_t super_crc(const sd_log_super_t *s) {
+    return esp_rom_crc32_le(0, (const uint8_t *)s,
+                            offsetof(sd_log_super_t, crc));
+}
+
+static uint32_t record_crc(const sd_log_record_t *r) {
+    return esp_rom_crc32_le(0, (const uint8_t *)r,
+                            offsetof(sd_log_record_t, header_crc));
+}
+
+static esp_err_t pwrite_all(const void *buf, size_t len, uint32_t offset) {
+    if (lseek(log_fd, offset, SEEK_SET) < 0 ||
+        write(log_fd, buf, len) != (ssize_t)len)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+static esp_err_t pread_all(void *buf, size_t len, uint32_t offset) {
+    if (lseek(log_fd, offset, SEEK_SET) < 0 ||
+        read(log_fd, buf, len) != (ssize_t)len)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+static esp_err_t create_container(uint32_t size_mb) {
+    uint32_t index_size = SD_LOG_MAX_RECORDS * sizeof(sd_log_entry_t);
+    super = (sd_log_super_t){
+        .magic = SD_LOG_MAGIC,
+        .version = SD_LOG_VERSION,
+        .max_records = SD_LOG_MAX_RECORDS,
+        .index_offset = SD_LOG_SUPER_SIZE,
+        .data_offset = align_up(SD_LOG_SUPER_SIZE + index_size, 4096),
+        .data_end = size_mb * 1024 * 1024,
+        .next_number = 1,
+        .tail_number = 1};
+    super.write_offset = super.data_offset;
+    super.tail_offset = super.data_offset;
+    super.crc = super_crc(&super);
+    if (super.data_end <= super.data_offset)
+        return ESP_ERR_INVALID_SIZE;
+
+    ESP_LOGI(TAG, "Creating %" PRIu32 " MB container %s", size_mb, log_path);
+    uint8_t *zero = calloc(1, SD_LOG_SUPER_SIZE);
+    if (!zero)
+        return ESP_ERR_NO_MEM;
+
+    esp_err_t err = pwrite_all(&super, sizeof(super), 0);
+    for (uint32_t off = super.index_offset;
+         err == ESP_OK && off < super.data_offset; off += SD_LOG_SUPER_SIZE)
+        err = pwrite_all(zero, SD_LOG_SUPER_SIZE, off);
+    free(zero);
+
+    // Seeking past the end allocates the whole cluster chain up front
+    uint8_t last = 0;
+    if (err == ESP_OK)
+        err = pwrite_all(&last, 1, super.data_end - 1);
+    if (err == ESP_OK && fsync(log_fd) != 0)
+        err = ESP_FAIL;
+    return err;
+}
+
+static bool read_record(uint32_t offset, uint32_t number,
+                        sd_log_record_t *rec) {
+    if (offset + sizeof(*rec) > super.data_end ||
+        pread_all(rec, sizeof(*rec), offset) != ESP_OK)
+        return false;
+    return rec->magic == SD_LOG_RECORD_MAGIC && rec->number == number &&
+           rec->header_crc == record_crc(rec) &&
+           offset + sizeof(*rec) + rec->len <= super.data_end;
+}
+
+static bool verify_record_data(uint32_t offset, const sd_log_record_t *rec) {
+    uint8_t buf[512];
+    uint32_t crc = 0;
+    uint32_t pos = offset + sizeof(*rec);
+    for (uint32_t left = rec->len; left > 0;) {
+        uint32_t n = left < sizeof(buf) ? left : sizeof(buf);
+        if (pread_all(buf, n, pos) != ESP_OK)
+            return false;
+        crc = esp_rom_crc32_le(crc, buf, n);
+        pos += n;
+        left -= n;
+    }
+    return crc == rec->data_crc;
+}
+
+static esp_err_t flush_index(void) {
+    if (pending_count == 0 && !tail_dirty)
+        return ESP_OK;
+
+    for (uint32_t i = 0; i < pending_count; i++) {
+        uint32_t slot = pending[i].number % super.max_records;
+        esp_err_t err = pwrite_all(&pending[i], sizeof(pending[i]),
+                                   super.index_offset +
+                                       slot * sizeof(sd_log_entry_t));
+        if (err != ESP_OK)
+            return err;
+    }
+
+    sd_log_super_t updated = super;
+    updated.next_number = next_number;
+    updated.write_offset = write_offset;
+    updated.tail_number = tail_number;
+    updated.tail_offset = tail_offset;
+    updated.crc = super_crc(&updated);
+    if (pwrite_all(&updated, sizeof(updated), 0) != ESP_OK ||
+        fsync(log_fd) != 0)
+        return ESP_FAIL;
+
+    xSemaphoreTake(pending_lock, portMAX_DELAY);
+    super = updated;
+    pending_count = 0;
+    xSemaphoreGive(pending_lock);
+    tail_dirty = false;
+    return ESP_OK;
+}
+
+// Records wrap to data_offset when they do not fit before data_end
+static bool read_record_wrapped(uint32_t *offset, uint32_t number,
+                                sd_log_record_t *rec) {
+    if (read_record(*offset, number, rec))
+        return true;
+    if (*offset != super.data_offset &&
+        read_record(super.data_offset, number, rec)) {
+        *offset = super.data_offset;
+        return true;
+    }
+    return false;
+}
+
+static bool ring_empty(void) { return tail_number == next_number; }
+
+// True when the writer has wrapped and is filling space behind the tail
+static bool ring_wrapped(void) {
+    return write_offset < tail_offset ||
+           (write_offset == tail_offset && !ring_empty());
+}
+
+// Moves the tail past records that were deleted, stopping at the first
+// one still listed in the index
+static void advance_tail(void) {
+    sd_log_entry_t entry;
+    sd_log_record_t rec;
+    while (!ring_empty() && sd_log_lookup(tail_number, &entry) ==
+                                ESP_ERR_NOT_FOUND) {
+        uint32_t offset = tail_offset;
+        if (!read_record_wrapped(&offset, tail_number, &rec)) {
+            // Lost track of the record boundaries, nothing left to free
+            ESP_LOGW(TAG, "Record %" PRIu32 " missing, resetting tail",
+                     tail_number);
+            tail_number = next_number;
+            tail_offset = write_offset;
+            tail_dirty = true;
+            return;
+        }
+        tail_offset = align_up(offset + sizeof(rec) + rec.len, SD_LOG_ALIGN);
+        tail_number++;
+        tail_dirty = true;
+    }
+    if (ring_empty())
+        tail_offset = write_offset;
+}
+
+// Picks up records that were written but not yet indexed when the device
+// last went down. Stops at the first torn or missing record.
+static void recover(void) {
+    sd_log_record_t rec;
+    uint32_t recovered = 0;
+    uint32_t offset = write_offset;
+    while (read_record_wrapped(&offset, next_number, &rec) &&
+           verify_record_data(offset, &rec)) {
+        // Leaves the rest to be found again on the next open
+        if (pending_count == SD_LOG_INDEX_FLUSH_INTERVAL &&
+            flush_index() != ESP_OK)
+            break;
+        pending[pending_count++] =
+            (sd_log_entry_t){.number = rec.number,
+                             .offset = offset,
+                             .len = rec.len,
+                             .timestamp = rec.timestamp};
+        offset = align_up(offset + sizeof(rec) + rec.len, SD_LOG_ALIGN);
+        write_offset = offset;
+        next_number++;
+        recovered++;
+    }
+    if (recovered) {
+        ESP_LOGI(TAG, "Recovered %" PRIu32 " unindexed records", recovered);
+        flush_index();
+    }
+}
+
+esp_err_t sd_log_open(const char *path, uint32_t size_mb,
+                      uint32_t *next_number_out) {
+    if (log_fd >= 0)
+        return ESP_ERR_INVALID_STATE;
+
+    if (pending_lock == NULL) {
+        pending_lock = xSemaphoreCreateMutex();
+        if (pending_lock == NULL)
+            return ESP_ERR_NO_MEM;
+    }
+
+    snprintf(log_path, sizeof(log_path), "%s", path);
+    struct stat st;
+    bool exists = stat(log_path, &st) == 0;
+    log_fd = open(log_path, O_RDWR | O_CREAT, 0664);
+    if (log_fd < 0) {
+        ESP_LOGE(TAG, "Failed to open %s", log_path);
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = ESP_OK;
+    if (!exists) {
+        err = create_container(size_mb);
+    } else if (pread_all(&super, sizeof(super), 0) != ESP_OK ||
+               super.magic != SD_LOG_MAGIC ||
+               super.version != SD_LOG_VERSION ||
+               super.crc != super_crc(&super)) {
+        ESP_LOGE(TAG, "%s is not a valid image container", log_path);
+        err = ESP_ERR_INVALID_CRC;
+    }
+    if (err != ESP_OK) {
+        close(log_fd);
+        log_fd = -1;
+        return err;
+    }
+
+    pending_count = 0;
+    next_number = super.next_number;
+    write_offset = super.write_offset;
+    tail_number = super.tail_number;
+    tail_offset = super.tail_offset;
+    tail_dirty = false;
+    recover();
+    // Deletes that happened after the last superblock write
+    advance_tail();
+    flush_index();
+
+    *next_number_out = next_number;
+    ESP_LOGI(TAG, "Container open, next record %" PRIu32 " at offset %" PRIu32,
+             next_number, write_offset);
+    return ESP_OK;
+}
+
+void sd_log_close(void) {
+    if (log_fd < 0)
+        return;
+    flush_index();
+    close(log_fd);
+    log_fd = -1;
+}
+
+esp_err_t sd_log_append(uint32_t number, const uint8_t *data, size_t len,
+                        const sd_card_capture_info_t *info,
+                        sd_log_entry_t *entry) {
+    if (log_fd < 0)
+        return ESP_ERR_INVALID_STATE;
+    if (number != next_number)
+        return ESP_ERR_INVALID_ARG;
+    // The last flush failed with the batch full; no room to add another
+    if (pending_count == SD_LOG_INDEX_FLUSH_INTERVAL &&
+        flush_index() != ESP_OK)
+        return ESP_FAIL;
+
+    uint64_t need = sizeof(sd_log_record_t) + (uint64_t)len;
+    uint32_t offset = write_offset;
+    bool wrapped = ring_wrapped();
+    if (!wrapped && offset + need > super.data_end) {
+        offset = super.data_offset;
+        wrapped = true;
+    }
+    if (offset + need > (wrapped ? tail_offset : super.data_end)) {
+        ESP_LOGW(TAG, "Container full");
+        return ESP_ERR_NO_MEM;
+    }
+
+    sd_log_record_t rec = {.magic = SD_LOG_RECORD_MAGIC,
+                           .number = number,
+                           .len = len,
+                           .timestamp = (uint32_t)time(NULL),
+                           .data_crc = esp_rom_crc32_le(0, data, len),
+                           .frame_size = info->frame_size,
+                           .jpeg_quality = info->jpeg_quality,
+                           .pixel_format = info->pixel_format};
+    rec.header_crc = record_crc(&rec);
+
+    // Header and image land back to back in one sequential run
+    if (lseek(log_fd, offset, SEEK_SET) < 0 ||
+        sd_bounce_write(log_fd, &rec, sizeof(rec), data, len) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to append record %" PRIu32, number);
+        return ESP_FAIL;
+    }
+
+    sd_log_entry_t added = {.number = number,
+                            .offset = offset,
+                            .len = len,
+                            .timestamp = rec.timestamp};
+    xSemaphoreTake(pending_lock, portMAX_DELAY);
+    pending[pending_count++] = added;
+    xSemaphoreGive(pending_lock);
+    if (entry)
+        *entry = added;
+    write_offset = align_up(offset + sizeof(rec) + len, SD_LOG_ALIGN);
+    next_number++;
+
+    if (pending_count == SD_LOG_INDEX_FLUSH_INTERVAL)
+        return flush_index();
+    return ESP_OK;
+}
+
+esp_err_t sd_log_sync(void) {
+    if (log_fd < 0)
+        return ESP_ERR_INVALID_STATE;
+    return fsync(log_fd) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t sd_log_delete(uint32_t number) {
+    if (log_fd < 0)
+        return ESP_ERR_INVALID_STATE;
+
+    // Not indexed yet, leaving it out of the pending batch is enough
+    bool was_pending = false;
+    xSemaphoreTake(pending_lock, portMAX_DELAY);
+    for (uint32_t i = 0; i < pending_count; i++) {
+        if (pending[i].number == number) {
+            memmove(&pending[i], &pending[i + 1],
+                    (pending_count - i - 1) * sizeof(pending[0]));
+            pending_count--;
+            was_pending = true;
+            break;
+        }
+    }
+    xSemaphoreGive(pending_lock);
+
+    esp_err_t err = ESP_OK;
+    if (!was_pending) {
+        sd_log_entry_t entry;
+        err = sd_log_lookup(number, &entry);
+        if (err != ESP_OK)
+            return err;
+
+        sd_log_entry_t cleared = {0};
+        uint32_t slot = number % super.max_records;
+        err = pwrite_all(&cleared, sizeof(cleared),
+                         super.index_offset + slot * sizeof(sd_log_entry_t));
+    }
+    if (err == ESP_OK && number == tail_number)
+        advance_tail();
+    return err;
+}
+
+uint32_t sd_log_free_bytes(void) {
+    if (log_fd < 0)
+        return 0;
+    if (ring_empty())
+        return super.data_end - super.data_offset;
+    if (ring_wrapped())
+        return tail_offset - write_offset;
+    return (super.data_end - write_offset) +
+           (tail_offset - super.data_offset);
+}
+
+esp_err_t sd_log_lookup(uint32_t number, sd_log_entry_t *entry) {
+    if (log_fd < 0)
+        return ESP_ERR_INVALID_STATE;
+    if (number == 0 || number < tail_number)
+        return ESP_ERR_NOT_FOUND;
+
+    xSemaphoreTake(pending_lock, portMAX_DELAY);
+    bool found = false;
+    for (uint32_t i = 0; i < pending_count; i++) {
+        if (pending[i].number == number) {
+            *entry = pending[i];
+            found = true;
+        }
+    }
+    uint32_t max_records = super.max_records;
+    uint32_t index_offset = super.index_offset;
+    uint32_t indexed_end = super.next_number;
+    xSemaphoreGive(pending_lock);
+    if (found)
+        return ESP_OK;
+    if (number >= indexed_end || number + max_records < indexed_end)
+        return ESP_ERR_NOT_FOUND;
+
+    // Separate handle so the lookup does not move the writer's position
+    FILE *f = fopen(log_path, "rb");
+    if (!f)
+        return ESP_FAIL;
+    uint32_t slot = number % max_records;
+    bool ok = fseek(f, index_offset + slot * sizeof(sd_log_entry_t),
+                    SEEK_SET) == 0 &&
+              fread(entry, sizeof(*entry), 1, f) == 1;
+    fclose(f);
+    if (!ok)
+        return ESP_FAIL;
+    return entry->number == number ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t sd_log_for_each(sd_log_entry_cb_t cb, void *ctx) {
+    if (log_fd < 0)
+        return ESP_ERR_INVALID_STATE;
+
+    // Snapshot what is not on the card yet; the index itself is read
+    // through a separate handle so the writer's position is untouched
+    sd_log_entry_t recent[SD_LOG_INDEX_FLUSH_INTERVAL];
+    xSemaphoreTake(pending_lock, portMAX_DELAY);
+    uint32_t recent_count = pending_count;
+    memcpy(recent, pending, recent_count * sizeof(recent[0]));
+    uint32_t max_records = super.max_records;
+    uint32_t index_offset = super.index_offset;
+    uint32_t indexed_end = super.next_number;
+    xSemaphoreGive(pending_lock);
+
+    FILE *f = fopen(log_path, "rb");
+    if (!f)
+        return ESP_FAIL;
+
+    sd_log_entry_t chunk[32];
+    uint32_t first = indexed_end > max_records ? indexed_end - max_records : 1;
+    if (first < tail_number)
+        first = tail_number;
+    bool keep_going = true;
+    for (uint32_t number = first; keep_going && number < indexed_end;) {
+        uint32_t slot = number % max_records;
+        uint32_t n = sizeof(chunk) / sizeof(chunk[0]);
+        if (n > max_records - slot)
+            n = max_records - slot;
+        if (n > indexed_end - number)
+            n = indexed_end - number;
+
+        if (fseek(f, index_offset + slot * sizeof(sd_log_entry_t),
+                  SEEK_SET) != 0 ||
+            fread(chunk, sizeof(chunk[0]), n, f) != n)
+            break;
+        for (uint32_t i = 0; keep_going && i < n; i++) {
+            if (chunk[i].number == number + i)
+                keep_going = cb(&chunk[i], ctx);
+        }
+        number += n;
+    }
+    fclose(f);
+
+    for (uint32_t i = 0; keep_going && i < recent_count; i++) {
+        if (recent[i].number >= indexed_end)
+            keep_going = cb(&recent[i], ctx);
+    }
+    return ESP_OK;
+}
+
+const char *sd_log_path(void) { return log_path; }
@@ -0,0 +1,48 @@
+#ifndef SD_LOG_H
+#define SD_LOG_H
+
+#include "esp_err.h"
+#include "sd_card.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SD_LOG_FILE_NAME "IMAGES.LOG"
+#define SD_LOG_MAGIC 0x474C4354        // "TCLG"
+#define SD_LOG_RECORD_MAGIC 0x4D494354 // "TCIM"
+#define SD_LOG_VERSION 2
+#define SD_LOG_SUPER_SIZE 4096
+#define SD_LOG_RECORD_HEADER_SIZE 32
+#define SD_LOG_ALIGN 512
+#define SD_LOG_MAX_RECORDS 32768
+#define SD_LOG_INDEX_FLUSH_INTERVAL 16
+
+typedef struct {
+    uint32_t number;
+    uint32_t offset; // Of the record header
+    uint32_t len;    // Image bytes following the header
+    uint32_t timestamp;
+} sd_log_entry_t;
+
+typedef bool (*sd_log_entry_cb_t)(const sd_log_entry_t *entry, void *ctx);
+
+// Opens or creates and preallocates the container, then recovers records
+// appended after the last index flush. next_number is the number the next
+// append must use.
+esp_err_t sd_log_open(const char *path, uint32_t size_mb,
+                      uint32_t *next_number);
+void sd_log_close(void);
+// entry, when not NULL, receives the index entry of the new record
+esp_err_t sd_log_append(uint32_t number, const uint8_t *data, size_t len,
+                        const sd_card_capture_info_t *info,
+                        sd_log_entry_t *entry);
+// Drops the record from the index. Its space goes back to the ring once
+// every older record has been deleted as well.
+esp_err_t sd_log_delete(uint32_t number);
+// Bytes left in the data ring, not counting padding lost at a wrap
+uint32_t sd_log_free_bytes(void);
+esp_err_t sd_log_sync(void);
+esp_err_t sd_log_lookup(uint32_t number, sd_log_entry_t *entry);
+esp_err_t sd_log_for_each(sd_log_entry_cb_t cb, void *ctx);
+const char *sd_log_path(void);
+
+#endif
@@ -0,0 +1,104 @@
+#include "thumbnail.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "img_converters.h"
+#include "jpeg_dc.h"
+#include <inttypes.h>
+#include <stdlib.h>
+
+static const char *TAG = "thumbnail";
+// One image decode at a time, each holds a full JPEG in PSRAM
+static SemaphoreHandle_t thumb_mutex = NULL;
+
+esp_err_t thumbnail_init(void) {
+    if (thumb_mutex == NULL) {
+        thumb_mutex = xSemaphoreCreateMutex();
+        if (thumb_mutex == NULL)
+            return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t read_image(uint32_t number, uint8_t **data, size_t *len) {
+    sd_card_reader_t reader;
+    esp_err_t err = sd_card_open_image(number, &reader);
+    if (err != ESP_OK)
+        return err;
+    if (reader.size == 0 || reader.size > THUMBNAIL_MAX_IMAGE_SIZE) {
+        sd_card_close_image(&reader);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    *data = heap_caps_malloc(reader.size, MALLOC_CAP_SPIRAM);
+    if (!*data) {
+        sd_card_close_image(&reader);
+        return ESP_ERR_NO_MEM;
+    }
+    *len = sd_card_read_image(&reader, *data, reader.size);
+    err = *len == reader.size ? ESP_OK : ESP_FAIL;
+    sd_card_close_image(&reader);
+    if (err != ESP_OK)
+        heap_caps_free(*data);
+    return err;
+}
+
+static esp_err_t make_thumbnail(uint32_t number) {
+    uint8_t *jpeg;
+    size_t jpeg_len;
+    esp_err_t err = read_image(number, &jpeg, &jpeg_len);
+    if (err != ESP_OK)
+        return err;
+
+    uint16_t width, height;
+    uint8_t *luma = NULL;
+    err = jpeg_dc_get_size(jpeg, jpeg_len, &width, &height);
+    if (err == ESP_OK) {
+        luma = heap_caps_malloc((size_t)width * height, MALLOC_CAP_SPIRAM);
+        err = luma ? ESP_OK : ESP_ERR_NO_MEM;
+    }
+    if (err == ESP_OK)
+        err = jpeg_dc_luma(jpeg, jpeg_len, luma, (size_t)width * height,
+                           &width, &height);
+    heap_caps_free(jpeg);
+
+    uint8_t *thumb = NULL;
+    size_t thumb_len = 0;
+    if (err == ESP_OK &&
+        !fmt2jpg(luma, (size_t)width * height, width, height,
+                 PIXFORMAT_GRAYSCALE, THUMBNAIL_QUALITY, &thumb, &thumb_len))
+        err = ESP_FAIL;
+    heap_caps_free(luma);
+
+    if (err == ESP_OK && thumb_len > THUMBNAIL_MAX_SIZE)
+        err = ESP_ERR_INVALID_SIZE;
+    if (err == ESP_OK)
+        err = sd_card_store_thumb(number, thumb, thumb_len);
+    free(thumb);
+    if (err == ESP_OK)
+        ESP_LOGI(TAG, "Made %ux%u thumbnail for image %" PRIu32 ", %zu bytes",
+                 width, height, number, thumb_len);
+    else
+        ESP_LOGW(TAG, "No thumbnail for image %" PRIu32 ": %s", number,
+                 esp_err_to_name(err));
+    return err;
+}
+
+esp_err_t thumbnail_open(uint32_t number, sd_card_reader_t *reader) {
+    esp_err_t err = sd_card_open_thumb(number, reader);
+    if (err != ESP_ERR_NOT_FOUND)
+        return err;
+
+    if (xSemaphoreTake(thumb_mutex, pdMS_TO_TICKS(1000)) != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+    // Another request may have made it while we waited
+    err = sd_card_open_thumb(number, reader);
+    if (err == ESP_ERR_NOT_FOUND) {
+        err = make_thumbnail(number);
+        if (err == ESP_OK)
+            err = sd_card_open_thumb(number, reader);
+    }
+    xSemaphoreGive(thumb_mutex);
+    return err;
+}
@@ -0,0 +1,21 @@
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+#include "esp_err.h"
+#include "sd_card.h"
+#include <stdint.h>
+
+#define THUMBNAIL_QUALITY 60
+// Larger images are not decoded, their thumbnail is reported as missing
+#define THUMBNAIL_MAX_IMAGE_SIZE (1024 * 1024)
+#define THUMBNAIL_MAX_SIZE (32 * 1024)
+
+esp_err_t thumbnail_init(void);
+// Opens the cached thumbnail of an image, making it first if there is none.
+// Thumbnails are the 1/8 scale grayscale picture decoded from the DC
+// coefficients, so making one costs no IDCT, but it still reads the whole
+// image: keep it off the httpd task. Read and close the reader with
+// sd_card_read_image and sd_card_close_image.
+esp_err_t thumbnail_open(uint32_t number, sd_card_reader_t *reader);
+
+#endif
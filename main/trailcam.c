@@ -3,11 +3,16 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "nvs_storage.h"
+#include "pretrigger.h"
+#include "sd_bench.h"
 #include "sd_card.h"
+#include "webserver/archive.h"
 #include "webserver/config_manager.h"
 #include "webserver/file_browser.h"
 #include "webserver/root_handler.h"
+#include "webserver/stream.h"
 #include "webserver/webserver.h"
+#include "webserver/worker_pool.h"
 #include "wifi.h"
 
 static const char *TAG = "main";
@@ -18,8 +23,36 @@ void app_main(void) {
 
     sd_card_config_t sd_config = {.clk_gpio = SDMMC_CLK_GPIO,
                                   .cmd_gpio = SDMMC_CMD_GPIO,
-                                  .d0_gpio = SDMMC_D0_GPIO};
+                                  .d0_gpio = SDMMC_D0_GPIO,
+                                  .layout = SD_CARD_LAYOUT_SHARDED,
+                                  .min_free_mb = 64};
     ESP_ERROR_CHECK(sd_card_init(&sd_config));
+#if SD_BENCH_AT_BOOT
+    ESP_ERROR_CHECK(sd_bench_sweep(&sd_config));
+    sd_bench_storage_result_t storage_result;
+    sd_bench_storage(&sd_config, SD_BENCH_STORAGE_IMAGES, &storage_result);
+#endif
+    // The file browser still works without a camera, so carry on
+    bool have_camera = camera_init() == ESP_OK;
+#if PRETRIGGER_AT_BOOT
+    if (have_camera) {
+        // Only read while starting, the detector keeps its own copy
+        motion_config_t motion_config = {
+            .width = MOTION_MAX_WIDTH,
+            .height = MOTION_MAX_HEIGHT,
+            .block_size = MOTION_DEFAULT_BLOCK_SIZE,
+            .pixel_threshold = MOTION_DEFAULT_PIXEL_THRESHOLD,
+            .block_threshold = MOTION_DEFAULT_BLOCK_THRESHOLD,
+            .min_blocks = MOTION_DEFAULT_MIN_BLOCKS};
+        pretrigger_config_t pretrigger_config = {
+            .pre_frames = PRETRIGGER_DEFAULT_PRE_FRAMES,
+            .post_frames = PRETRIGGER_DEFAULT_POST_FRAMES,
+            .interval_ms = PRETRIGGER_DEFAULT_INTERVAL_MS,
+            .motion = &motion_config};
+        if (pretrigger_start(&pretrigger_config) != ESP_OK)
+            ESP_LOGW(TAG, "Motion-triggered capture not armed");
+    }
+#endif
 
     ESP_ERROR_CHECK(wifi_initialize());
     ESP_ERROR_CHECK(wifi_connect());
@@ -27,7 +60,19 @@ void app_main(void) {
     // Initialize webserver modules
     ESP_ERROR_CHECK(root_handler_init());
     ESP_ERROR_CHECK(file_browser_init());
+    ESP_ERROR_CHECK(archive_init());
+    if (have_camera) {
+        stream_config_t stream_config = {
+            .interval_ms = STREAM_DEFAULT_INTERVAL_MS,
+            .max_pending_writes = STREAM_DEFAULT_MAX_PENDING_WRITES};
+        ESP_ERROR_CHECK(stream_init(&stream_config));
+    } else {
+        ESP_LOGW(TAG, "No camera, /stream not served");
+    }
     ESP_ERROR_CHECK(config_manager_init());
+    worker_pool_config_t worker_config = {
+        .workers = WORKER_POOL_DEFAULT_WORKERS};
+    ESP_ERROR_CHECK(worker_pool_init(&worker_config));
     ESP_ERROR_CHECK(webserver_start());
 
     ESP_LOGI(TAG, "Webserver running, keeping WiFi active");
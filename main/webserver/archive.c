@@ -0,0 +1,508 @@
+#include "archive.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "image_catalog.h"
+#include "sd_card.h"
+#include "webserver/webserver.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *TAG = "webserver_archive";
+
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_DESCRIPTOR_SIZE 16
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_SIZE 22
+#define ZIP_VERSION 20
+#define ZIP_FLAG_DESCRIPTOR 0x0008
+#define TAR_BLOCK 512
+
+typedef enum {
+    ARCHIVE_ZIP,
+    ARCHIVE_TAR,
+} archive_format_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    bool last; // Final buffer, also sent when the reader gives up
+    esp_err_t err;
+} archive_chunk_t;
+
+// The reader task builds the archive into one buffer while the worker
+// sends the other, so the card and the link are busy at the same time
+typedef struct {
+    archive_format_t format;
+    // All of them for ZIP, one page of ARCHIVE_TAR_PAGE at a time for TAR
+    image_catalog_entry_t *entries;
+    uint32_t *crcs; // ZIP only, needed again for the central directory
+    uint32_t count;
+    uint32_t first; // Numbers of the first and last image selected
+    uint32_t last;
+    uint64_t size;
+    QueueHandle_t empty;
+    QueueHandle_t full;
+    TaskHandle_t sender;
+    volatile bool cancel; // Client went away, stop reading
+    archive_chunk_t current;
+} archive_job_t;
+
+static const uint8_t zero_block[TAR_BLOCK];
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static size_t entry_name(const image_catalog_entry_t *entry, char *name,
+                         size_t len) {
+    return snprintf(name, len, "%" PRIu32 ".JPG", entry->number);
+}
+
+static esp_err_t push_buffer(archive_job_t *job) {
+    xQueueSend(job->full, &job->current, portMAX_DELAY);
+    job->current = (archive_chunk_t){0};
+    xQueueReceive(job->empty, &job->current.data, portMAX_DELAY);
+    return job->cancel ? ESP_FAIL : ESP_OK;
+}
+
+static esp_err_t emit(archive_job_t *job, const void *src, size_t n) {
+    const uint8_t *p = src;
+    while (n > 0) {
+        if (job->current.len == ARCHIVE_BUFFER_SIZE &&
+            push_buffer(job) != ESP_OK)
+            return ESP_FAIL;
+        size_t take = ARCHIVE_BUFFER_SIZE - job->current.len;
+        if (take > n)
+            take = n;
+        memcpy(job->current.data + job->current.len, p, take);
+        job->current.len += take;
+        p += take;
+        n -= take;
+    }
+    return ESP_OK;
+}
+
+// Reads the image straight into the outgoing buffers
+static esp_err_t emit_image(archive_job_t *job,
+                            const image_catalog_entry_t *entry,
+                            uint32_t *crc) {
+    sd_card_reader_t reader;
+    if (sd_card_open_image(entry->number, &reader) != ESP_OK)
+        return ESP_ERR_NOT_FOUND;
+    // The announced Content-Length depends on the size staying put
+    if (reader.size != entry->size) {
+        sd_card_close_image(&reader);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t err = ESP_OK;
+    *crc = 0;
+    while (reader.remaining > 0) {
+        if (job->current.len == ARCHIVE_BUFFER_SIZE &&
+            (err = push_buffer(job)) != ESP_OK)
+            break;
+        uint8_t *dst = job->current.data + job->current.len;
+        size_t n = sd_card_read_image(&reader, dst,
+                                      ARCHIVE_BUFFER_SIZE - job->current.len);
+        if (n == 0) {
+            err = ESP_FAIL;
+            break;
+        }
+        *crc = esp_rom_crc32_le(*crc, dst, n);
+        job->current.len += n;
+    }
+    sd_card_close_image(&reader);
+    return err;
+}
+
+static void dos_time(uint32_t timestamp, uint16_t *time_out,
+                     uint16_t *date_out) {
+    time_t t = timestamp;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    if (tm.tm_year < 80) {
+        // Clock never set, DOS dates start in 1980
+        *time_out = 0;
+        *date_out = (1 << 5) | 1;
+        return;
+    }
+    *time_out = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+    *date_out = (tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday;
+}
+
+// Stored entries with data descriptors: the CRC is only known once the
+// image has gone out, so it follows the data
+static esp_err_t write_zip(archive_job_t *job) {
+    uint8_t h[ZIP_CENTRAL_HEADER_SIZE];
+    char name[16];
+    uint16_t mod_time, mod_date;
+
+    for (uint32_t i = 0; i < job->count; i++) {
+        const image_catalog_entry_t *entry = &job->entries[i];
+        size_t name_len = entry_name(entry, name, sizeof(name));
+        dos_time(entry->timestamp, &mod_time, &mod_date);
+
+        memset(h, 0, ZIP_LOCAL_HEADER_SIZE);
+        put32(h, 0x04034b50);
+        put16(h + 4, ZIP_VERSION);
+        put16(h + 6, ZIP_FLAG_DESCRIPTOR);
+        put16(h + 10, mod_time);
+        put16(h + 12, mod_date);
+        put16(h + 26, name_len);
+        esp_err_t err = emit(job, h, ZIP_LOCAL_HEADER_SIZE);
+        if (err == ESP_OK)
+            err = emit(job, name, name_len);
+        if (err == ESP_OK)
+            err = emit_image(job, entry, &job->crcs[i]);
+        if (err != ESP_OK)
+            return err;
+
+        put32(h, 0x08074b50);
+        put32(h + 4, job->crcs[i]);
+        put32(h + 8, entry->size);
+        put32(h + 12, entry->size);
+        if (emit(job, h, ZIP_DESCRIPTOR_SIZE) != ESP_OK)
+            return ESP_FAIL;
+    }
+
+    uint32_t offset = 0;
+    uint32_t central_size = 0;
+    for (uint32_t i = 0; i < job->count; i++) {
+        const image_catalog_entry_t *entry = &job->entries[i];
+        size_t name_len = entry_name(entry, name, sizeof(name));
+        dos_time(entry->timestamp, &mod_time, &mod_date);
+
+        memset(h, 0, ZIP_CENTRAL_HEADER_SIZE);
+        put32(h, 0x02014b50);
+        put16(h + 4, ZIP_VERSION);
+        put16(h + 6, ZIP_VERSION);
+        put16(h + 8, ZIP_FLAG_DESCRIPTOR);
+        put16(h + 12, mod_time);
+        put16(h + 14, mod_date);
+        put32(h + 16, job->crcs[i]);
+        put32(h + 20, entry->size);
+        put32(h + 24, entry->size);
+        put16(h + 28, name_len);
+        put32(h + 42, offset);
+        if (emit(job, h, ZIP_CENTRAL_HEADER_SIZE) != ESP_OK ||
+            emit(job, name, name_len) != ESP_OK)
+            return ESP_FAIL;
+        offset += ZIP_LOCAL_HEADER_SIZE + name_len + entry->size +
+                  ZIP_DESCRIPTOR_SIZE;
+        central_size += ZIP_CENTRAL_HEADER_SIZE + name_len;
+    }
+
+    memset(h, 0, ZIP_END_SIZE);
+    put32(h, 0x06054b50);
+    put16(h + 8, job->count);
+    put16(h + 10, job->count);
+    put32(h + 12, central_size);
+    put32(h + 16, offset);
+    return emit(job, h, ZIP_END_SIZE);
+}
+
+// Copies the catalog entries numbered first..last so the archive does not
+// shift under a save or an eviction
+static uint32_t select_entries(uint32_t first, uint32_t last,
+                               image_catalog_entry_t *entries,
+                               uint32_t max) {
+    uint32_t count = 0;
+    while (count < max) {
+        size_t n = image_catalog_from(first, entries + count, max - count);
+        size_t keep = 0;
+        while (keep < n && entries[count + keep].number <= last)
+            keep++;
+        count += keep;
+        if (keep < n || n == 0)
+            break;
+        first = entries[count - 1].number + 1;
+    }
+    return count;
+}
+
+static void tar_header(const image_catalog_entry_t *entry, uint8_t *h) {
+    memset(h, 0, TAR_BLOCK);
+    entry_name(entry, (char *)h, 100);
+    memcpy(h + 100, "0000644", 8);
+    memcpy(h + 108, "0000000", 8);
+    memcpy(h + 116, "0000000", 8);
+    snprintf((char *)h + 124, 12, "%011" PRIo32, entry->size);
+    snprintf((char *)h + 136, 12, "%011" PRIo32, entry->timestamp);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    // Checksum is taken with its own field filled with spaces
+    memset(h + 148, ' ', 8);
+    uint32_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += h[i];
+    snprintf((char *)h + 148, 8, "%06" PRIo32, sum);
+    h[155] = ' ';
+}
+
+static esp_err_t write_tar(archive_job_t *job) {
+    uint8_t h[TAR_BLOCK];
+    uint32_t crc;
+    uint32_t next = job->first;
+    uint32_t sent = 0;
+    while (sent < job->count) {
+        uint32_t n = select_entries(next, job->last, job->entries,
+                                    ARCHIVE_TAR_PAGE);
+        if (n == 0)
+            break;
+        if (n > job->count - sent)
+            n = job->count - sent;
+        for (uint32_t i = 0; i < n; i++) {
+            const image_catalog_entry_t *entry = &job->entries[i];
+            tar_header(entry, h);
+            esp_err_t err = emit(job, h, TAR_BLOCK);
+            if (err == ESP_OK)
+                err = emit_image(job, entry, &crc);
+            size_t pad = (TAR_BLOCK - entry->size % TAR_BLOCK) % TAR_BLOCK;
+            if (err == ESP_OK)
+                err = emit(job, zero_block, pad);
+            if (err != ESP_OK)
+                return err;
+        }
+        sent += n;
+        next = job->entries[n - 1].number + 1;
+    }
+    // Images deleted since they were counted would leave the body short
+    if (sent != job->count)
+        return ESP_ERR_NOT_FOUND;
+    if (emit(job, zero_block, TAR_BLOCK) != ESP_OK)
+        return ESP_FAIL;
+    return emit(job, zero_block, TAR_BLOCK);
+}
+
+static void archive_reader_task(void *arg) {
+    archive_job_t *job = arg;
+    TaskHandle_t sender = job->sender;
+
+    xQueueReceive(job->empty, &job->current.data, portMAX_DELAY);
+    esp_err_t err =
+        job->format == ARCHIVE_ZIP ? write_zip(job) : write_tar(job);
+    if (err != ESP_OK && !job->cancel)
+        ESP_LOGE(TAG, "Archive aborted: %s", esp_err_to_name(err));
+    job->current.last = true;
+    job->current.err = err;
+    xQueueSend(job->full, &job->current, portMAX_DELAY);
+
+    // job belongs to the sender from here on
+    xTaskNotifyGive(sender);
+    vTaskDelete(NULL);
+}
+
+static uint64_t zip_size(const archive_job_t *job) {
+    uint64_t size = ZIP_END_SIZE;
+    char name[16];
+    for (uint32_t i = 0; i < job->count; i++) {
+        const image_catalog_entry_t *entry = &job->entries[i];
+        size_t name_len = entry_name(entry, name, sizeof(name));
+        size += ZIP_LOCAL_HEADER_SIZE + ZIP_DESCRIPTOR_SIZE +
+                ZIP_CENTRAL_HEADER_SIZE + 2 * name_len + entry->size;
+    }
+    return size;
+}
+
+// Walks the catalog between first and last without copying all of it,
+// filling in count, first, last and the TAR size of the selection
+static void count_entries(uint32_t first, uint32_t last,
+                          archive_job_t *job) {
+    image_catalog_entry_t batch[32];
+    job->count = 0;
+    job->size = 2 * TAR_BLOCK;
+    while (true) {
+        size_t n = image_catalog_from(first, batch, 32);
+        size_t i = 0;
+        for (; i < n && batch[i].number <= last; i++) {
+            if (job->count++ == 0)
+                job->first = batch[i].number;
+            job->last = batch[i].number;
+            job->size += TAR_BLOCK + (batch[i].size + TAR_BLOCK - 1) /
+                                         TAR_BLOCK * TAR_BLOCK;
+        }
+        if (i < n || n == 0)
+            break;
+        first = batch[n - 1].number + 1;
+    }
+}
+
+static esp_err_t send_archive(httpd_req_t *req, archive_job_t *job) {
+    uint8_t *buffers[ARCHIVE_BUFFER_COUNT] = {0};
+    job->empty = xQueueCreate(ARCHIVE_BUFFER_COUNT, sizeof(uint8_t *));
+    job->full = xQueueCreate(ARCHIVE_BUFFER_COUNT, sizeof(archive_chunk_t));
+    bool ok = job->empty && job->full;
+    for (int i = 0; ok && i < ARCHIVE_BUFFER_COUNT; i++) {
+        // Internal RAM so the card can DMA straight into it
+        buffers[i] = heap_caps_malloc(ARCHIVE_BUFFER_SIZE,
+                                      MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        ok = buffers[i] != NULL;
+        if (ok)
+            xQueueSend(job->empty, &buffers[i], 0);
+    }
+    job->sender = xTaskGetCurrentTaskHandle();
+    ok = ok && xTaskCreate(archive_reader_task, "archive_reader",
+                           ARCHIVE_READER_STACK_SIZE, job,
+                           ARCHIVE_READER_PRIORITY, NULL) == pdPASS;
+    if (!ok) {
+        for (int i = 0; i < ARCHIVE_BUFFER_COUNT; i++)
+            heap_caps_free(buffers[i]);
+        if (job->empty)
+            vQueueDelete(job->empty);
+        if (job->full)
+            vQueueDelete(job->full);
+        httpd_resp_send_500(req);
+        return ESP_ERR_NO_MEM;
+    }
+
+    const char *ext = job->format == ARCHIVE_ZIP ? "zip" : "tar";
+    char head[256];
+    int head_len = snprintf(
+        head, sizeof(head),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/%s\r\n"
+        "Content-Length: %" PRIu64 "\r\n"
+        "Content-Disposition: attachment; filename=\"IMG_%" PRIu32
+        "-%" PRIu32 ".%s\"\r\n\r\n",
+        job->format == ARCHIVE_ZIP ? "zip" : "x-tar", job->size, job->first,
+        job->last, ext);
+    bool sending = webserver_send_all(req, head, head_len) == ESP_OK;
+    job->cancel = !sending;
+
+    archive_chunk_t chunk;
+    do {
+        xQueueReceive(job->full, &chunk, portMAX_DELAY);
+        if (sending && chunk.len &&
+            webserver_send_all(req, (const char *)chunk.data, chunk.len) !=
+                ESP_OK) {
+            sending = false;
+            job->cancel = true;
+        }
+        if (!chunk.last)
+            xQueueSend(job->empty, &chunk.data, 0);
+    } while (!chunk.last);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    for (int i = 0; i < ARCHIVE_BUFFER_COUNT; i++)
+        heap_caps_free(buffers[i]);
+    vQueueDelete(job->empty);
+    vQueueDelete(job->full);
+    // A short body is the only way left to tell the client it failed
+    return sending && chunk.err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t archive_handler(httpd_req_t *req) {
+    if (!image_catalog_ready()) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "2");
+        return httpd_resp_sendstr(req, "Indexing SD card");
+    }
+
+    char query[96];
+    const char *q = httpd_req_get_url_query_str(req, query, sizeof(query)) ==
+                            ESP_OK
+                        ? query
+                        : NULL;
+    uint32_t first = webserver_query_u32(q, "from", 1);
+    uint32_t last = webserver_query_u32(q, "to", UINT32_MAX);
+    char format[8] = "zip";
+    if (q)
+        httpd_query_key_value(q, "format", format, sizeof(format));
+    if (last < first ||
+        (strcmp(format, "zip") != 0 && strcmp(format, "tar") != 0)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                            "Expected from<=to and format=zip|tar");
+        return ESP_OK;
+    }
+
+    archive_job_t *job = calloc(1, sizeof(*job));
+    if (!job) {
+        httpd_resp_send_500(req);
+        return ESP_ERR_NO_MEM;
+    }
+    job->format = format[0] == 'z' ? ARCHIVE_ZIP : ARCHIVE_TAR;
+    count_entries(first, last, job);
+    if (job->count == 0) {
+        free(job);
+        return httpd_resp_send_404(req);
+    }
+    if (job->format == ARCHIVE_ZIP && job->count > ARCHIVE_MAX_ENTRIES) {
+        free(job);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                            "Too many images for ZIP, use format=tar");
+        return ESP_OK;
+    }
+
+    // ZIP needs every entry again for the central directory; TAR pages
+    uint32_t slots =
+        job->format == ARCHIVE_ZIP ? job->count : ARCHIVE_TAR_PAGE;
+    job->entries =
+        heap_caps_malloc(slots * sizeof(job->entries[0]), MALLOC_CAP_SPIRAM);
+    if (job->format == ARCHIVE_ZIP)
+        job->crcs = heap_caps_malloc(slots * sizeof(job->crcs[0]),
+                                     MALLOC_CAP_SPIRAM);
+    if (!job->entries || (job->format == ARCHIVE_ZIP && !job->crcs)) {
+        heap_caps_free(job->entries);
+        heap_caps_free(job->crcs);
+        free(job);
+        httpd_resp_send_500(req);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = ESP_OK;
+    if (job->format == ARCHIVE_ZIP) {
+        job->count =
+            select_entries(job->first, job->last, job->entries, slots);
+        if (job->count) {
+            job->first = job->entries[0].number;
+            job->last = job->entries[job->count - 1].number;
+        }
+        job->size = zip_size(job);
+    }
+    if (job->count == 0) {
+        httpd_resp_send_404(req);
+    } else if (job->format == ARCHIVE_ZIP && job->size > UINT32_MAX) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                            "Selection too large for ZIP, use format=tar");
+    } else {
+        ESP_LOGI(TAG, "Sending %" PRIu32 " images as %s", job->count,
+                 format);
+        err = send_archive(req, job);
+    }
+
+    heap_caps_free(job->entries);
+    heap_caps_free(job->crcs);
+    free(job);
+    return err;
+}
+
+static const httpd_uri_t archive_uri = {.uri = "/files/archive",
+                                        .method = HTTP_GET,
+                                        .handler = archive_handler,
+                                        .user_ctx = NULL};
+
+esp_err_t archive_init(void) {
+    esp_err_t err = webserver_add_worker_handler(&archive_uri);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Archive handler registered");
+    }
+    return err;
+}
@@ -0,0 +1,18 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "esp_err.h"
+
+// ZIP without zip64 is limited to this many entries and 4 GB
+#define ARCHIVE_MAX_ENTRIES 65535
+// TAR has no such limit and reads the catalog this many entries at a time
+#define ARCHIVE_TAR_PAGE 256
+#define ARCHIVE_BUFFER_SIZE (16 * 1024)
+#define ARCHIVE_BUFFER_COUNT 2
+#define ARCHIVE_READER_STACK_SIZE 4096
+#define ARCHIVE_READER_PRIORITY 4 // Below the SD writer
+
+// GET /files/archive?from=A&to=B&format=zip|tar
+esp_err_t archive_init(void);
+
+#endif
@@ -0,0 +1,385 @@
+#include "body_parser.h"
+#include "esp_log.h"
+#include <ctype.h>
+#include <string.h>
+
+static const char *TAG = "webserver_body_parser";
+
+void body_json_init(body_json_parser_t *parser, body_field_cb_t cb,
+                    void *ctx) {
+    *parser = (body_json_parser_t){.state = JSON_START,
+                                   .unicode_digits = -1,
+                                   .cb = cb,
+                                   .ctx = ctx};
+}
+
+static void start_string(body_json_parser_t *p, char *buf, size_t max,
+                         json_state_t state, json_state_t next) {
+    p->string = buf;
+    p->string_max = max;
+    p->len = 0;
+    p->escape = false;
+    p->unicode_digits = -1;
+    p->state = state;
+    p->string_return = next;
+}
+
+static esp_err_t put_char(body_json_parser_t *p, char c) {
+    if (p->len + 1 >= p->string_max)
+        return ESP_ERR_INVALID_SIZE;
+    p->string[p->len++] = c;
+    return ESP_OK;
+}
+
+// \u escapes outside the BMP come as surrogate pairs, which only a text
+// field would ever see; they are kept as two 3-byte sequences
+static esp_err_t put_unicode(body_json_parser_t *p, uint32_t cp) {
+    esp_err_t err;
+    if (cp < 0x80)
+        return put_char(p, cp);
+    if (cp < 0x800) {
+        if ((err = put_char(p, 0xC0 | (cp >> 6))) != ESP_OK)
+            return err;
+        return put_char(p, 0x80 | (cp & 0x3F));
+    }
+    if ((err = put_char(p, 0xE0 | (cp >> 12))) != ESP_OK ||
+        (err = put_char(p, 0x80 | ((cp >> 6) & 0x3F))) != ESP_OK)
+        return err;
+    return put_char(p, 0x80 | (cp & 0x3F));
+}
+
+static esp_err_t string_char(body_json_parser_t *p, char c) {
+    if (p->unicode_digits >= 0) {
+        if (!isxdigit((unsigned char)c))
+            return ESP_ERR_INVALID_ARG;
+        p->unicode = p->unicode << 4 |
+                     (isdigit((unsigned char)c) ? c - '0'
+                                                : (tolower(c) - 'a' + 10));
+        if (--p->unicode_digits == 0) {
+            p->unicode_digits = -1;
+            return put_unicode(p, p->unicode);
+        }
+        return ESP_OK;
+    }
+
+    if (p->escape) {
+        p->escape = false;
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            return put_char(p, c);
+        case 'b':
+            return put_char(p, '\b');
+        case 'f':
+            return put_char(p, '\f');
+        case 'n':
+            return put_char(p, '\n');
+        case 'r':
+            return put_char(p, '\r');
+        case 't':
+            return put_char(p, '\t');
+        case 'u':
+            p->unicode = 0;
+            p->unicode_digits = 4;
+            return ESP_OK;
+        default:
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    if (c == '\\') {
+        p->escape = true;
+        return ESP_OK;
+    }
+    if (c == '"') {
+        p->string[p->len] = '\0';
+        p->state = p->string_return;
+        if (p->string == p->value)
+            return p->cb(p->key, p->value, BODY_VALUE_STRING, p->ctx);
+        return ESP_OK;
+    }
+    if ((unsigned char)c < 0x20)
+        return ESP_ERR_INVALID_ARG;
+    return put_char(p, c);
+}
+
+static esp_err_t emit_scalar(body_json_parser_t *p) {
+    p->value[p->len] = '\0';
+    body_value_type_t type;
+    if (strcmp(p->value, "true") == 0 || strcmp(p->value, "false") == 0)
+        type = BODY_VALUE_BOOL;
+    else if (strcmp(p->value, "null") == 0)
+        type = BODY_VALUE_NULL;
+    else if (strspn(p->value, "0123456789+-.eE") == p->len &&
+             (isdigit((unsigned char)p->value[0]) || p->value[0] == '-'))
+        type = BODY_VALUE_NUMBER;
+    else
+        return ESP_ERR_INVALID_ARG;
+    p->state = JSON_AFTER_VALUE;
+    return p->cb(p->key, p->value, type, p->ctx);
+}
+
+static esp_err_t feed_char(body_json_parser_t *p, char c) {
+    bool space = c == ' ' || c == '\t' || c == '\n' || c == '\r';
+
+    switch (p->state) {
+    case JSON_START:
+        if (space)
+            return ESP_OK;
+        if (c != '{')
+            return ESP_ERR_INVALID_ARG;
+        p->state = JSON_KEY_OR_END;
+        return ESP_OK;
+
+    case JSON_KEY_OR_END:
+    case JSON_NEXT_KEY:
+        if (space)
+            return ESP_OK;
+        if (c == '}' && p->state == JSON_KEY_OR_END) {
+            p->state = JSON_DONE;
+            return ESP_OK;
+        }
+        if (c != '"')
+            return ESP_ERR_INVALID_ARG;
+        start_string(p, p->key, sizeof(p->key), JSON_KEY, JSON_COLON);
+        return ESP_OK;
+
+    case JSON_KEY:
+    case JSON_STRING:
+        return string_char(p, c);
+
+    case JSON_COLON:
+        if (space)
+            return ESP_OK;
+        if (c != ':')
+            return ESP_ERR_INVALID_ARG;
+        p->state = JSON_VALUE;
+        return ESP_OK;
+
+    case JSON_VALUE:
+        if (space)
+            return ESP_OK;
+        if (c == '"') {
+            start_string(p, p->value, sizeof(p->value), JSON_STRING,
+                         JSON_AFTER_VALUE);
+            return ESP_OK;
+        }
+        if (c == '{' || c == '[') {
+            p->depth = 1;
+            p->state = JSON_SKIP;
+            return ESP_OK;
+        }
+        p->len = 0;
+        p->state = JSON_SCALAR;
+        p->value[p->len++] = c;
+        return ESP_OK;
+
+    case JSON_SCALAR:
+        if (space || c == ',' || c == '}') {
+            esp_err_t err = emit_scalar(p);
+            if (err != ESP_OK || space)
+                return err;
+            return feed_char(p, c);
+        }
+        if (p->len + 1 >= sizeof(p->value))
+            return ESP_ERR_INVALID_SIZE;
+        p->value[p->len++] = c;
+        return ESP_OK;
+
+    case JSON_AFTER_VALUE:
+        if (space)
+            return ESP_OK;
+        if (c == ',') {
+            p->state = JSON_NEXT_KEY;
+            return ESP_OK;
+        }
+        if (c == '}') {
+            p->state = JSON_DONE;
+            return ESP_OK;
+        }
+        return ESP_ERR_INVALID_ARG;
+
+    case JSON_SKIP:
+        if (c == '"') {
+            p->escape = false;
+            p->state = JSON_SKIP_STRING;
+        } else if (c == '{' || c == '[') {
+            if (++p->depth > BODY_PARSER_MAX_DEPTH)
+                return ESP_ERR_INVALID_SIZE;
+        } else if (c == '}' || c == ']') {
+            if (--p->depth == 0)
+                p->state = JSON_AFTER_VALUE;
+        }
+        return ESP_OK;
+
+    case JSON_SKIP_STRING:
+        if (p->escape)
+            p->escape = false;
+        else if (c == '\\')
+            p->escape = true;
+        else if (c == '"')
+            p->state = JSON_SKIP;
+        return ESP_OK;
+
+    case JSON_DONE:
+        return space ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+    return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t body_json_feed(body_json_parser_t *parser, const char *buf,
+                         size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        esp_err_t err = feed_char(parser, buf[i]);
+        if (err != ESP_OK)
+            return err;
+    }
+    return ESP_OK;
+}
+
+esp_err_t body_json_finish(body_json_parser_t *parser) {
+    return parser->state == JSON_DONE ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+void body_form_init(body_form_parser_t *parser, body_field_cb_t cb,
+                    void *ctx) {
+    *parser = (body_form_parser_t){.cb = cb, .ctx = ctx};
+}
+
+static int hex_value(char c) {
+    if (!isxdigit((unsigned char)c))
+        return -1;
+    return isdigit((unsigned char)c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+static esp_err_t form_put(body_form_parser_t *p, char c) {
+    size_t max = p->in_value ? sizeof(p->value) : sizeof(p->key);
+    if (c == '\0')
+        return ESP_ERR_INVALID_ARG;
+    if (p->len + 1 >= max)
+        return ESP_ERR_INVALID_SIZE;
+    (p->in_value ? p->value : p->key)[p->len++] = c;
+    return ESP_OK;
+}
+
+static esp_err_t form_end_field(body_form_parser_t *p) {
+    if (p->percent_digits > 0)
+        return ESP_ERR_INVALID_ARG;
+    if (p->in_value) {
+        p->value[p->len] = '\0';
+    } else {
+        p->key[p->len] = '\0';
+        p->value[0] = '\0';
+    }
+
+    esp_err_t err = ESP_OK;
+    // "a&&b" has an empty pair between the separators, not a field
+    if (p->in_value || p->len > 0)
+        err = p->cb(p->key, p->value, BODY_VALUE_STRING, p->ctx);
+    p->in_value = false;
+    p->len = 0;
+    return err;
+}
+
+static esp_err_t form_feed_char(body_form_parser_t *p, char c) {
+    if (p->percent_digits > 0) {
+        int digit = hex_value(c);
+        if (digit < 0)
+            return ESP_ERR_INVALID_ARG;
+        p->percent = p->percent << 4 | digit;
+        if (--p->percent_digits > 0)
+            return ESP_OK;
+        return form_put(p, p->percent);
+    }
+
+    switch (c) {
+    case '&':
+        return form_end_field(p);
+    case '=':
+        if (p->in_value)
+            return form_put(p, c);
+        p->key[p->len] = '\0';
+        p->in_value = true;
+        p->len = 0;
+        return ESP_OK;
+    case '+':
+        return form_put(p, ' ');
+    case '%':
+        p->percent = 0;
+        p->percent_digits = 2;
+        return ESP_OK;
+    default:
+        return form_put(p, c);
+    }
+}
+
+esp_err_t body_form_feed(body_form_parser_t *parser, const char *buf,
+                         size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        esp_err_t err = form_feed_char(parser, buf[i]);
+        if (err != ESP_OK)
+            return err;
+    }
+    return ESP_OK;
+}
+
+esp_err_t body_form_finish(body_form_parser_t *parser) {
+    return form_end_field(parser);
+}
+
+typedef esp_err_t (*body_feed_fn_t)(void *parser, const char *buf,
+                                    size_t len);
+
+static esp_err_t receive_body(httpd_req_t *req, body_feed_fn_t feed,
+                              void *parser) {
+    if (req->content_len > BODY_PARSER_MAX_BODY)
+        return ESP_ERR_INVALID_SIZE;
+
+    char chunk[BODY_PARSER_CHUNK_SIZE];
+    size_t left = req->content_len;
+    int timeouts = 0;
+    while (left > 0) {
+        int n = httpd_req_recv(req, chunk,
+                               left < sizeof(chunk) ? left : sizeof(chunk));
+        if (n == HTTPD_SOCK_ERR_TIMEOUT &&
+            ++timeouts < BODY_PARSER_RECV_RETRIES)
+            continue;
+        if (n <= 0) {
+            ESP_LOGW(TAG, "Body cut short with %zu bytes to go", left);
+            return ESP_FAIL;
+        }
+        esp_err_t err = feed(parser, chunk, n);
+        if (err != ESP_OK)
+            return err;
+        left -= n;
+        timeouts = 0;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t json_feed(void *parser, const char *buf, size_t len) {
+    return body_json_feed(parser, buf, len);
+}
+
+static esp_err_t form_feed(void *parser, const char *buf, size_t len) {
+    return body_form_feed(parser, buf, len);
+}
+
+esp_err_t body_parse_json(httpd_req_t *req, body_field_cb_t cb, void *ctx) {
+    body_json_parser_t parser;
+    body_json_init(&parser, cb, ctx);
+    esp_err_t err = receive_body(req, json_feed, &parser);
+    if (err != ESP_OK)
+        return err;
+    return body_json_finish(&parser);
+}
+
+esp_err_t body_parse_form(httpd_req_t *req, body_field_cb_t cb, void *ctx) {
+    body_form_parser_t parser;
+    body_form_init(&parser, cb, ctx);
+    esp_err_t err = receive_body(req, form_feed, &parser);
+    if (err != ESP_OK)
+        return err;
+    return body_form_finish(&parser);
+}
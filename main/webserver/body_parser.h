@@ -0,0 +1,99 @@
+#ifndef BODY_PARSER_H
+#define BODY_PARSER_H
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+// Bodies are read in pieces this big, never as a whole
+#define BODY_PARSER_CHUNK_SIZE 128
+#define BODY_PARSER_KEY_MAX 32
+#define BODY_PARSER_VALUE_MAX 96
+#define BODY_PARSER_MAX_BODY 4096
+#define BODY_PARSER_MAX_DEPTH 8
+// Receive timeouts tolerated in a row on a slow upload
+#define BODY_PARSER_RECV_RETRIES 3
+
+typedef enum {
+    BODY_VALUE_STRING,
+    BODY_VALUE_NUMBER,
+    BODY_VALUE_BOOL,
+    BODY_VALUE_NULL,
+} body_value_type_t;
+
+// Called once per top-level field as soon as its value is complete. value
+// is unescaped or URL-decoded, and NUL terminated. Anything but ESP_OK
+// stops the parse and is returned by the parser.
+typedef esp_err_t (*body_field_cb_t)(const char *key, const char *value,
+                                     body_value_type_t type, void *ctx);
+
+typedef enum {
+    JSON_START,
+    JSON_KEY_OR_END,
+    JSON_NEXT_KEY, // After a comma, where '}' is not allowed
+    JSON_KEY,
+    JSON_COLON,
+    JSON_VALUE,
+    JSON_STRING,
+    JSON_SCALAR,
+    JSON_AFTER_VALUE,
+    JSON_SKIP,
+    JSON_SKIP_STRING,
+    JSON_DONE,
+} json_state_t;
+
+// Parser state, kept between chunks. Only a flat object is handed to the
+// callback; nested objects and arrays are skipped whole.
+typedef struct {
+    json_state_t state;
+    json_state_t string_return; // State to resume after a string
+    char *string;               // key or value, whichever is collected
+    size_t string_max;
+    size_t len;
+    bool escape;
+    int unicode_digits; // Hex digits of a \u escape still to come, or -1
+    uint32_t unicode;
+    int depth; // Nesting while skipping
+    char key[BODY_PARSER_KEY_MAX];
+    char value[BODY_PARSER_VALUE_MAX];
+    body_field_cb_t cb;
+    void *ctx;
+} body_json_parser_t;
+
+void body_json_init(body_json_parser_t *parser, body_field_cb_t cb,
+                    void *ctx);
+// Feeds the next piece of the document. Returns ESP_ERR_INVALID_ARG on
+// malformed JSON and ESP_ERR_INVALID_SIZE when a key or value is too long.
+esp_err_t body_json_feed(body_json_parser_t *parser, const char *buf,
+                         size_t len);
+// ESP_OK only if a complete object was seen
+esp_err_t body_json_finish(body_json_parser_t *parser);
+
+// application/x-www-form-urlencoded state. Every value is handed over as
+// BODY_VALUE_STRING.
+typedef struct {
+    bool in_value;
+    int percent_digits; // Hex digits of a %XX escape still to come
+    uint8_t percent;
+    size_t len;
+    char key[BODY_PARSER_KEY_MAX];
+    char value[BODY_PARSER_VALUE_MAX];
+    body_field_cb_t cb;
+    void *ctx;
+} body_form_parser_t;
+
+void body_form_init(body_form_parser_t *parser, body_field_cb_t cb,
+                    void *ctx);
+// Same errors as body_json_feed
+esp_err_t body_form_feed(body_form_parser_t *parser, const char *buf,
+                         size_t len);
+// Hands over the last field, which has no '&' after it
+esp_err_t body_form_finish(body_form_parser_t *parser);
+
+// Receive the request body chunk by chunk and parse it as it arrives, so
+// memory use is the same whatever the client sends. Bodies over
+// BODY_PARSER_MAX_BODY give ESP_ERR_INVALID_SIZE, a dropped connection
+// ESP_FAIL.
+esp_err_t body_parse_json(httpd_req_t *req, body_field_cb_t cb, void *ctx);
+esp_err_t body_parse_form(httpd_req_t *req, body_field_cb_t cb, void *ctx);
+
+#endif
@@ -1,6 +1,7 @@
 #include "config_manager.h"
 #include "camera.h"
 #include "esp_log.h"
+#include "webserver/body_parser.h"
 #include "webserver/webserver.h"
 #include "wifi.h"
 #include <stdlib.h>
@@ -20,177 +21,257 @@ static const char *framesize_str[] = {
     [FRAMESIZE_SVGA] = "SVGA",   [FRAMESIZE_XGA] = "XGA",
     [FRAMESIZE_SXGA] = "SXGA",   [FRAMESIZE_UXGA] = "UXGA"};
 
+extern const uint8_t config_html_gz_start[] asm(
+    "_binary_config_html_gz_start");
+extern const uint8_t config_html_gz_end[] asm("_binary_config_html_gz_end");
+
 static esp_err_t config_get_handler(httpd_req_t *req) {
-    httpd_resp_set_type(req, "text/html");
+    return webserver_send_asset(req, "text/html", config_html_gz_start,
+                                config_html_gz_end);
+}
 
-    camera_settings_t cam_settings;
-    esp_err_t err = camera_load_settings(&cam_settings);
-    if (err != ESP_OK)
-        cam_settings = (camera_settings_t){.pixel_format = DEFAULT_PIXEL_FORMAT,
-                                           .frame_size = DEFAULT_FRAME_SIZE,
-                                           .jpeg_quality = DEFAULT_JPEG_QUALITY,
-                                           .fb_count = DEFAULT_FB_COUNT};
-
-    wifi_credentials_t wifi_creds = {0};
-    wifi_load_credentials(
-        &wifi_creds); // Ignore errors, use empty strings if not found
-
-    httpd_resp_sendstr_chunk(req, "<html><body><h1>Configuration</h1>"
-                                  "<form action=\"/config\" method=\"post\">"
-                                  "<h2>Camera Settings</h2>");
-
-    // Pixel Format
-    httpd_resp_sendstr_chunk(
-        req, "<label>Pixel Format: <select name=\"pixel_format\">");
-    for (int i = 0; i < sizeof(pixformat_str) / sizeof(pixformat_str[0]); i++) {
-        if (pixformat_str[i]) {
-            char option[128];
-            snprintf(option, sizeof(option),
-                     "<option value=\"%s\" %s>%s</option>", pixformat_str[i],
-                     (i == cam_settings.pixel_format) ? "selected" : "",
-                     pixformat_str[i]);
-            httpd_resp_sendstr_chunk(req, option);
-        }
+static void load_camera_settings(camera_settings_t *settings) {
+    if (camera_load_settings(settings) != ESP_OK)
+        *settings = (camera_settings_t){.pixel_format = DEFAULT_PIXEL_FORMAT,
+                                        .frame_size = DEFAULT_FRAME_SIZE,
+                                        .jpeg_quality = DEFAULT_JPEG_QUALITY,
+                                        .fb_count = DEFAULT_FB_COUNT};
+}
+
+static void json_escape(const char *s, char *out, size_t len) {
+    size_t n = 0;
+    for (; *s && n + 7 < len; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            n += snprintf(out + n, len - n, "\\%c", c);
+        else if (c < 0x20)
+            n += snprintf(out + n, len - n, "\\u%04x", c);
+        else
+            out[n++] = c;
     }
-    httpd_resp_sendstr_chunk(req, "</select></label><br>");
-
-    // Frame Size
-    httpd_resp_sendstr_chunk(req,
-                             "<label>Frame Size: <select name=\"frame_size\">");
-    for (int i = 0; i < sizeof(framesize_str) / sizeof(framesize_str[0]); i++) {
-        if (framesize_str[i]) {
-            char option[128];
-            snprintf(option, sizeof(option),
-                     "<option value=\"%s\" %s>%s</option>", framesize_str[i],
-                     (i == cam_settings.frame_size) ? "selected" : "",
-                     framesize_str[i]);
-            httpd_resp_sendstr_chunk(req, option);
-        }
+    out[n] = '\0';
+}
+
+static int json_names(char *out, size_t len, const char *const *names,
+                      size_t count) {
+    int n = snprintf(out, len, "[");
+    for (size_t i = 0; i < count; i++) {
+        if (!names[i])
+            continue;
+        n += snprintf(out + n, len > n ? len - n : 0, "%s\"%s\"",
+                      n > 1 ? "," : "", names[i]);
     }
-    httpd_resp_sendstr_chunk(req, "</select></label><br>");
-
-    // JPEG Quality
-    char quality_str[128];
-    snprintf(
-        quality_str, sizeof(quality_str),
-        "<label>JPEG Quality: <input type=\"number\" name=\"jpeg_quality\" "
-        "value=\"%d\" min=\"0\" max=\"63\"></label><br>",
-        cam_settings.jpeg_quality);
-    httpd_resp_sendstr_chunk(req, quality_str);
-
-    // FB Count
-    char fb_count_str[128];
-    snprintf(fb_count_str, sizeof(fb_count_str),
-             "<label>FB Count: <input type=\"number\" name=\"fb_count\" "
-             "value=\"%d\" min=\"1\" max=\"2\"></label><br>",
-             cam_settings.fb_count);
-    httpd_resp_sendstr_chunk(req, fb_count_str);
-
-    // WiFi Credentials
-    httpd_resp_sendstr_chunk(req, "<h2>WiFi Credentials</h2>");
-    char ssid_str[128];
-    snprintf(ssid_str, sizeof(ssid_str),
-             "<label>SSID: <input type=\"text\" name=\"ssid\" value=\"%s\" "
-             "maxlength=\"31\"></label><br>",
-             wifi_creds.ssid);
-    httpd_resp_sendstr_chunk(req, ssid_str);
-
-    char pass_str[256];
-    snprintf(pass_str, sizeof(pass_str),
-             "<label>Password: <input type=\"password\" name=\"password\" "
-             "value=\"%s\" maxlength=\"63\"></label><br>",
-             wifi_creds.password);
-    httpd_resp_sendstr_chunk(req, pass_str);
-
-    httpd_resp_sendstr_chunk(req, "<input type=\"submit\" value=\"Save\">"
-                                  "</form></body></html>");
-    httpd_resp_sendstr_chunk(req, NULL);
-    return ESP_OK;
+    n += snprintf(out + n, len > n ? len - n : 0, "]");
+    return n;
 }
 
-static esp_err_t parse_form_field(const char *buf, size_t len, const char *key,
-                                  char *value, size_t value_len) {
-    char *pos = strstr(buf, key);
-    if (!pos)
-        return ESP_ERR_NOT_FOUND;
+static const char *enum_name(const char *const *names, size_t count,
+                             int value) {
+    return value >= 0 && value < count && names[value] ? names[value] : "";
+}
+
+#define PIXFORMAT_COUNT (sizeof(pixformat_str) / sizeof(pixformat_str[0]))
+#define FRAMESIZE_COUNT (sizeof(framesize_str) / sizeof(framesize_str[0]))
+#define JPEG_QUALITY_MAX 63
 
-    pos += strlen(key) + 1; // Skip key and "="
-    size_t i = 0;
-    while (i < value_len - 1 && pos < buf + len && *pos != '&') {
-        value[i++] = *pos++;
+// Everything the config page edits, across both NVS namespaces
+typedef struct {
+    camera_settings_t camera;
+    wifi_credentials_t wifi;
+} config_values_t;
+
+static void load_config(config_values_t *cfg) {
+    load_camera_settings(&cfg->camera);
+    memset(&cfg->wifi, 0, sizeof(cfg->wifi));
+    wifi_load_credentials(&cfg->wifi);
+}
+
+static int enum_value(const char *const *names, size_t count,
+                      const char *value) {
+    for (size_t i = 0; i < count; i++) {
+        if (names[i] && strcmp(value, names[i]) == 0)
+            return i;
     }
-    value[i] = '\0';
+    return -1;
+}
+
+static esp_err_t parse_int(const char *value, int min, int max, int *out) {
+    char *end;
+    long parsed = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || parsed < min || parsed > max)
+        return ESP_ERR_INVALID_ARG;
+    *out = parsed;
     return ESP_OK;
 }
 
-static esp_err_t config_post_handler(httpd_req_t *req) {
-    char *buf = malloc(req->content_len + 1);
-    if (!buf) {
-        httpd_resp_send_500(req);
-        return ESP_ERR_NO_MEM;
+// Applies one submitted field to cfg. Unknown keys give ESP_ERR_NOT_FOUND,
+// bad values ESP_ERR_INVALID_ARG or ESP_ERR_INVALID_SIZE.
+static esp_err_t apply_field(config_values_t *cfg, const char *key,
+                             const char *value) {
+    if (strcmp(key, "pixel_format") == 0) {
+        int i = enum_value(pixformat_str, PIXFORMAT_COUNT, value);
+        if (i < 0)
+            return ESP_ERR_INVALID_ARG;
+        cfg->camera.pixel_format = i;
+        return ESP_OK;
+    }
+    if (strcmp(key, "frame_size") == 0) {
+        int i = enum_value(framesize_str, FRAMESIZE_COUNT, value);
+        if (i < 0)
+            return ESP_ERR_INVALID_ARG;
+        cfg->camera.frame_size = i;
+        return ESP_OK;
+    }
+    if (strcmp(key, "jpeg_quality") == 0)
+        return parse_int(value, 0, JPEG_QUALITY_MAX,
+                         &cfg->camera.jpeg_quality);
+    if (strcmp(key, "fb_count") == 0)
+        return parse_int(value, 1, CAMERA_MAX_FB_COUNT,
+                         &cfg->camera.fb_count);
+    if (strcmp(key, "ssid") == 0) {
+        if (strlen(value) >= sizeof(cfg->wifi.ssid))
+            return ESP_ERR_INVALID_SIZE;
+        strcpy(cfg->wifi.ssid, value);
+        return ESP_OK;
     }
+    if (strcmp(key, "password") == 0) {
+        // The page never gets the stored password back, so an empty field
+        // leaves it as it is
+        if (value[0] == '\0')
+            return ESP_OK;
+        if (strlen(value) >= sizeof(cfg->wifi.password))
+            return ESP_ERR_INVALID_SIZE;
+        strcpy(cfg->wifi.password, value);
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
 
-    int ret = httpd_req_recv(req, buf, req->content_len);
-    if (ret <= 0) {
-        free(buf);
+// Writes only the namespaces whose values moved; within one, the batch
+// skips keys already stored and commits once
+static esp_err_t save_config(const config_values_t *old,
+                             const config_values_t *cfg) {
+    esp_err_t err = ESP_OK;
+    if (cfg->camera.pixel_format != old->camera.pixel_format ||
+        cfg->camera.frame_size != old->camera.frame_size ||
+        cfg->camera.jpeg_quality != old->camera.jpeg_quality ||
+        cfg->camera.fb_count != old->camera.fb_count)
+        err = camera_save_settings(&cfg->camera);
+    if (err != ESP_OK)
+        return err;
+    if (strcmp(cfg->wifi.ssid, old->wifi.ssid) != 0 ||
+        strcmp(cfg->wifi.password, old->wifi.password) != 0)
+        err = wifi_save_credentials(&cfg->wifi);
+    return err;
+}
+
+// The current values behind the static config page. The WiFi password is
+// never sent back.
+static esp_err_t send_config(httpd_req_t *req, const config_values_t *cfg) {
+    char ssid[WIFI_MAX_SSID_LEN * 6];
+    json_escape(cfg->wifi.ssid, ssid, sizeof(ssid));
+
+    char pixformats[128];
+    char framesizes[128];
+    json_names(pixformats, sizeof(pixformats), pixformat_str,
+               PIXFORMAT_COUNT);
+    json_names(framesizes, sizeof(framesizes), framesize_str,
+               FRAMESIZE_COUNT);
+
+    char json[640];
+    int n = snprintf(
+        json, sizeof(json),
+        "{\"pixel_format\":\"%s\",\"frame_size\":\"%s\","
+        "\"jpeg_quality\":%d,\"fb_count\":%d,\"ssid\":\"%s\","
+        "\"options\":{\"pixel_format\":%s,\"frame_size\":%s,"
+        "\"fb_count_max\":%d}}",
+        enum_name(pixformat_str, PIXFORMAT_COUNT, cfg->camera.pixel_format),
+        enum_name(framesize_str, FRAMESIZE_COUNT, cfg->camera.frame_size),
+        cfg->camera.jpeg_quality, cfg->camera.fb_count, ssid, pixformats,
+        framesizes, CAMERA_MAX_FB_COUNT);
+    if (n >= sizeof(json)) {
         httpd_resp_send_500(req);
         return ESP_FAIL;
     }
-    buf[ret] = '\0';
 
-    camera_settings_t cam_settings;
-    esp_err_t err = camera_load_settings(&cam_settings);
-    if (err != ESP_OK)
-        cam_settings = (camera_settings_t){.pixel_format = DEFAULT_PIXEL_FORMAT,
-                                           .frame_size = DEFAULT_FRAME_SIZE,
-                                           .jpeg_quality = DEFAULT_JPEG_QUALITY,
-                                           .fb_count = DEFAULT_FB_COUNT};
-
-    wifi_credentials_t wifi_creds = {0};
-    wifi_load_credentials(&wifi_creds);
-
-    char value[64];
-    if (parse_form_field(buf, ret, "pixel_format", value, sizeof(value)) ==
-        ESP_OK) {
-        for (int i = 0; i < sizeof(pixformat_str) / sizeof(pixformat_str[0]);
-             i++) {
-            if (pixformat_str[i] && strcmp(value, pixformat_str[i]) == 0) {
-                cam_settings.pixel_format = i;
-                break;
-            }
-        }
-    }
-    if (parse_form_field(buf, ret, "frame_size", value, sizeof(value)) ==
-        ESP_OK) {
-        for (int i = 0; i < sizeof(framesize_str) / sizeof(framesize_str[0]);
-             i++) {
-            if (framesize_str[i] && strcmp(value, framesize_str[i]) == 0) {
-                cam_settings.frame_size = i;
-                break;
-            }
-        }
-    }
-    if (parse_form_field(buf, ret, "jpeg_quality", value, sizeof(value)) ==
-        ESP_OK) {
-        cam_settings.jpeg_quality = atoi(value);
-    }
-    if (parse_form_field(buf, ret, "fb_count", value, sizeof(value)) ==
-        ESP_OK) {
-        cam_settings.fb_count = atoi(value);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, json, n);
+}
+
+static esp_err_t api_config_get_handler(httpd_req_t *req) {
+    config_values_t cfg;
+    load_config(&cfg);
+    return send_config(req, &cfg);
+}
+
+static esp_err_t send_field_error(httpd_req_t *req, esp_err_t err) {
+    const char *msg = "Malformed request body";
+    if (err == ESP_ERR_NOT_FOUND)
+        msg = "Unknown configuration field";
+    else if (err == ESP_ERR_INVALID_SIZE)
+        msg = "Value or body too long";
+    else if (err == ESP_FAIL)
+        msg = "Request body cut short";
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, msg);
+}
+
+static esp_err_t json_field(const char *key, const char *value,
+                            body_value_type_t type, void *ctx) {
+    if (type != BODY_VALUE_STRING && type != BODY_VALUE_NUMBER)
+        return ESP_ERR_INVALID_ARG;
+    return apply_field(ctx, key, value);
+}
+
+// PATCH /api/config with a flat JSON object of the fields to change. The
+// body is parsed as it arrives and nothing is written unless all of it
+// is valid.
+static esp_err_t api_config_patch_handler(httpd_req_t *req) {
+    config_values_t old;
+    load_config(&old);
+    config_values_t cfg = old;
+
+    esp_err_t err = body_parse_json(req, json_field, &cfg);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Rejected config update: %s", esp_err_to_name(err));
+        send_field_error(req, err);
+        return ESP_OK;
     }
-    if (parse_form_field(buf, ret, "ssid", wifi_creds.ssid,
-                         sizeof(wifi_creds.ssid)) != ESP_OK) {
-        wifi_creds.ssid[0] = '\0'; // Keep old value if not provided
+
+    err = save_config(&old, &cfg);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save config: %s", esp_err_to_name(err));
+        httpd_resp_send_500(req);
+        return err;
     }
-    if (parse_form_field(buf, ret, "password", wifi_creds.password,
-                         sizeof(wifi_creds.password)) != ESP_OK) {
-        wifi_creds.password[0] = '\0'; // Keep old value if not provided
+    return send_config(req, &cfg);
+}
+
+// The page may post fields of its own, such as a submit button
+static esp_err_t form_field(const char *key, const char *value,
+                            body_value_type_t type, void *ctx) {
+    esp_err_t err = apply_field(ctx, key, value);
+    return err == ESP_ERR_NOT_FOUND ? ESP_OK : err;
+}
+
+static esp_err_t config_post_handler(httpd_req_t *req) {
+    config_values_t old;
+    load_config(&old);
+    config_values_t cfg = old;
+
+    esp_err_t err = body_parse_form(req, form_field, &cfg);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Rejected config form: %s", esp_err_to_name(err));
+        send_field_error(req, err);
+        return ESP_OK;
     }
 
-    camera_save_settings(&cam_settings);
-    wifi_save_credentials(&wifi_creds);
+    err = save_config(&old, &cfg);
+    if (err != ESP_OK) {
+        httpd_resp_send_500(req);
+        return err;
+    }
 
-    free(buf);
     httpd_resp_set_status(req, "303 See Other");
     httpd_resp_set_hdr(req, "Location", "/config");
     httpd_resp_send(req, NULL, 0);
@@ -207,8 +288,26 @@ static const httpd_uri_t config_post_uri = {.uri = "/config",
                                             .handler = config_post_handler,
                                             .user_ctx = NULL};
 
+static const httpd_uri_t api_config_get_uri = {
+    .uri = "/api/config",
+    .method = HTTP_GET,
+    .handler = api_config_get_handler,
+    .user_ctx = NULL};
+
+static const httpd_uri_t api_config_patch_uri = {
+    .uri = "/api/config",
+    .method = HTTP_PATCH,
+    .handler = api_config_patch_handler,
+    .user_ctx = NULL};
+
 esp_err_t config_manager_init(void) {
     esp_err_t err = webserver_add_handler(&config_get_uri);
+    if (err != ESP_OK)
+        return err;
+    err = webserver_add_handler(&api_config_get_uri);
+    if (err != ESP_OK)
+        return err;
+    err = webserver_add_handler(&api_config_patch_uri);
     if (err != ESP_OK)
         return err;
     err = webserver_add_handler(&config_post_uri);
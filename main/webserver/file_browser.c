@@ -1,73 +1,393 @@
 #include "file_browser.h"
-#include "dirent.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "image_catalog.h"
+#include "sd_card.h"
+#include "thumbnail.h"
 #include "webserver/webserver.h"
+#include "webserver/worker_pool.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static const char *TAG = "webserver_file_browser";
-static const char *mount_point = "/sdcard";
+
+#define FILE_LIST_DEFAULT_LIMIT 50
+#define FILE_LIST_MAX_LIMIT 200
+#define FILE_LIST_BATCH 32
+
+// The page itself is static, see main/www/files.html
+extern const uint8_t files_html_gz_start[] asm("_binary_files_html_gz_start");
+extern const uint8_t files_html_gz_end[] asm("_binary_files_html_gz_end");
 
 static esp_err_t file_list_handler(httpd_req_t *req) {
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_sendstr_chunk(req, "<html><body><h1>File Browser</h1><ul>");
-
-    DIR *dir = opendir(mount_point);
-    if (!dir) {
-        httpd_resp_sendstr_chunk(req, "<li>Error: Could not open SD card</li>");
-        httpd_resp_sendstr_chunk(req, "</ul></body></html>");
-        httpd_resp_sendstr_chunk(req, NULL);
-        ESP_LOGE(TAG, "Failed to open directory %s", mount_point);
-        return ESP_OK;
+    return webserver_send_asset(req, "text/html", files_html_gz_start,
+                                files_html_gz_end);
+}
+
+// Collects small JSON pieces into one chunk per send
+typedef struct {
+    httpd_req_t *req;
+    char buf[1024];
+    size_t len;
+    esp_err_t err;
+} chunk_writer_t;
+
+static void chunk_flush(chunk_writer_t *w) {
+    if (w->len && w->err == ESP_OK)
+        w->err = httpd_resp_send_chunk(w->req, w->buf, w->len);
+    w->len = 0;
+}
+
+static void chunk_printf(chunk_writer_t *w, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(w->buf + w->len, sizeof(w->buf) - w->len, fmt, args);
+    va_end(args);
+    if (n >= 0 && (size_t)n >= sizeof(w->buf) - w->len) {
+        chunk_flush(w);
+        va_start(args, fmt);
+        n = vsnprintf(w->buf, sizeof(w->buf), fmt, args);
+        va_end(args);
+    }
+    if (n > 0)
+        w->len += n;
+}
+
+// GET /api/files?cursor=N&limit=L&fields=size,time
+// Newest first. cursor is the "next" value of the previous page; images
+// numbered below it are returned.
+static esp_err_t api_files_handler(httpd_req_t *req) {
+    httpd_resp_set_type(req, "application/json");
+    if (!image_catalog_ready()) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "2");
+        return httpd_resp_sendstr(req, "{\"error\":\"indexing\"}");
     }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) {
-            char link[1028];
-            snprintf(link, sizeof(link),
-                     "<li><a href=\"/files/download?file=%s\">%s</a></li>",
-                     entry->d_name, entry->d_name);
-            httpd_resp_sendstr_chunk(req, link);
+    char query[96];
+    bool has_query = httpd_req_get_url_query_str(req, query, sizeof(query)) ==
+                     ESP_OK;
+    const char *q = has_query ? query : NULL;
+    uint32_t cursor = webserver_query_u32(q, "cursor", 0);
+    uint32_t limit = webserver_query_u32(q, "limit", FILE_LIST_DEFAULT_LIMIT);
+    if (limit == 0 || limit > FILE_LIST_MAX_LIMIT)
+        limit = FILE_LIST_MAX_LIMIT;
+    char fields[32] = "";
+    if (q)
+        httpd_query_key_value(q, "fields", fields, sizeof(fields));
+    bool with_size = strstr(fields, "size") != NULL;
+    bool with_time = strstr(fields, "time") != NULL;
+
+    chunk_writer_t *w = malloc(sizeof(*w));
+    if (!w) {
+        httpd_resp_send_500(req);
+        return ESP_ERR_NO_MEM;
+    }
+    *w = (chunk_writer_t){.req = req};
+    chunk_printf(w, "{\"total\":%" PRIu32 ",\"images\":[",
+                 image_catalog_count());
+
+    // One entry past the limit tells whether another page exists
+    image_catalog_entry_t batch[FILE_LIST_BATCH];
+    uint32_t sent = 0;
+    uint32_t before = cursor;
+    bool more = false;
+    while (sent < limit && w->err == ESP_OK) {
+        size_t want = limit - sent + 1;
+        if (want > FILE_LIST_BATCH)
+            want = FILE_LIST_BATCH;
+        size_t n = image_catalog_newest(before, batch, want);
+        size_t i = 0;
+        for (; i < n && sent < limit; i++, sent++) {
+            chunk_printf(w, "%s{\"n\":%" PRIu32, sent ? "," : "",
+                         batch[i].number);
+            if (with_size)
+                chunk_printf(w, ",\"size\":%" PRIu32, batch[i].size);
+            if (with_time)
+                chunk_printf(w, ",\"time\":%" PRIu32, batch[i].timestamp);
+            chunk_printf(w, "}");
+            before = batch[i].number;
+        }
+        if (i < n) {
+            more = true;
+            break;
         }
+        if (n < want)
+            break;
     }
-    closedir(dir);
+    if (more)
+        chunk_printf(w, "],\"next\":%" PRIu32 "}", before);
+    else
+        chunk_printf(w, "],\"next\":null}");
+    chunk_flush(w);
 
-    httpd_resp_sendstr_chunk(req, "</ul></body></html>");
-    httpd_resp_sendstr_chunk(req, NULL);
-    return ESP_OK;
+    esp_err_t err = w->err;
+    free(w);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Client went away during listing");
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static bool parse_image_param(httpd_req_t *req, uint32_t *number) {
+    char query[64];
+    char file_param[32];
+    return httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+           httpd_query_key_value(query, "file", file_param,
+                                 sizeof(file_param)) == ESP_OK &&
+           sscanf(file_param, "%" SCNu32, number) == 1;
+}
+
+static void format_http_date(uint32_t timestamp, char *buf, size_t len) {
+    time_t t = timestamp;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// Images never change once written, so a matching validator means the
+// client's copy is current. Dates are compared as the exact string we sent.
+static bool header_matches(httpd_req_t *req, const char *field,
+                           const char *value) {
+    char header[64];
+    if (value[0] == '\0' ||
+        httpd_req_get_hdr_value_str(req, field, header, sizeof(header)) !=
+            ESP_OK)
+        return false;
+    return strstr(header, value) != NULL || strcmp(header, "*") == 0;
+}
+
+// Single range only. Returns 1 for a usable range, 0 to send the whole
+// image and -1 when the range cannot be satisfied.
+static int parse_range(const char *range, size_t size, size_t *start,
+                       size_t *end) {
+    unsigned long first, last;
+    if (strncmp(range, "bytes=", 6) != 0 || strchr(range, ','))
+        return 0;
+    range += 6;
+
+    if (range[0] == '-') {
+        if (sscanf(range + 1, "%lu", &last) != 1)
+            return 0;
+        if (last == 0)
+            return -1;
+        *start = last < size ? size - last : 0;
+        *end = size - 1;
+        return 1;
+    }
+
+    int n = sscanf(range, "%lu-%lu", &first, &last);
+    if (n < 1)
+        return 0;
+    if (first >= size)
+        return -1;
+    if (n == 1 || last >= size)
+        last = size - 1;
+    if (last < first)
+        return 0;
+    *start = first;
+    *end = last;
+    return 1;
+}
+
+// httpd only knows chunked streaming, so the head of a response with a
+// Content-Length is written by hand
+static esp_err_t send_download_head(httpd_req_t *req, uint32_t number,
+                                    bool partial, size_t start, size_t end,
+                                    size_t size, const char *etag,
+                                    const char *last_modified) {
+    char head[512];
+    int len = snprintf(
+        head, sizeof(head),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: image/jpeg\r\n"
+        "Content-Disposition: attachment; filename=\"%" PRIu32 ".JPG\"\r\n"
+        "Content-Length: %zu\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "Cache-Control: no-cache\r\n",
+        partial ? "206 Partial Content" : "200 OK", number,
+        size ? end - start + 1 : 0);
+    if (partial)
+        len += snprintf(head + len, sizeof(head) - len,
+                        "Content-Range: bytes %zu-%zu/%zu\r\n", start, end,
+                        size);
+    if (etag[0])
+        len += snprintf(head + len, sizeof(head) - len,
+                        "ETag: %s\r\nLast-Modified: %s\r\n", etag,
+                        last_modified);
+    len += snprintf(head + len, sizeof(head) - len, "\r\n");
+    return webserver_send_all(req, head, len);
 }
 
 static esp_err_t file_download_handler(httpd_req_t *req) {
-    char file_param[64];
-    if (httpd_query_key_value(req->uri, "file", file_param,
-                              sizeof(file_param)) != ESP_OK) {
+    uint32_t number;
+    sd_card_reader_t reader;
+    if (!parse_image_param(req, &number) ||
+        sd_card_open_image(number, &reader) != ESP_OK) {
         httpd_resp_send_404(req);
         return ESP_OK;
     }
 
-    char file_path[128];
-    snprintf(file_path, sizeof(file_path), "%s/%s", mount_point, file_param);
+    char etag[40] = "";
+    char last_modified[32] = "";
+    image_catalog_entry_t entry;
+    if (image_catalog_lookup(number, &entry) == ESP_OK) {
+        snprintf(etag, sizeof(etag), "\"%" PRIx32 "-%" PRIx32 "-%" PRIx32 "\"",
+                 number, entry.size, entry.timestamp);
+        format_http_date(entry.timestamp, last_modified,
+                         sizeof(last_modified));
+    }
+
+    bool has_inm = httpd_req_get_hdr_value_len(req, "If-None-Match") > 0;
+    if (has_inm ? header_matches(req, "If-None-Match", etag)
+                : header_matches(req, "If-Modified-Since", last_modified)) {
+        sd_card_close_image(&reader);
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_set_hdr(req, "ETag", etag);
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    size_t size = reader.size;
+    size_t start = 0;
+    size_t end = size ? size - 1 : 0;
+    bool partial = false;
+    char range[64];
+    bool if_range_ok = httpd_req_get_hdr_value_len(req, "If-Range") == 0 ||
+                       header_matches(req, "If-Range", etag) ||
+                       header_matches(req, "If-Range", last_modified);
+    if (size && if_range_ok &&
+        httpd_req_get_hdr_value_str(req, "Range", range, sizeof(range)) ==
+            ESP_OK) {
+        int result = parse_range(range, size, &start, &end);
+        if (result < 0) {
+            sd_card_close_image(&reader);
+            char content_range[32];
+            snprintf(content_range, sizeof(content_range), "bytes */%zu",
+                     size);
+            httpd_resp_set_status(req, "416 Range Not Satisfiable");
+            httpd_resp_set_hdr(req, "Content-Range", content_range);
+            return httpd_resp_send(req, NULL, 0);
+        }
+        partial = result > 0;
+    }
+
+    // Internal RAM so the card can DMA straight into it
+    uint8_t *buf = heap_caps_malloc(FILE_BROWSER_READ_BUFFER_SIZE,
+                                    MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+    if (!buf)
+        buf = malloc(FILE_BROWSER_READ_BUFFER_SIZE);
+    if (!buf || (start && sd_card_seek_image(&reader, start) != ESP_OK)) {
+        heap_caps_free(buf);
+        sd_card_close_image(&reader);
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
 
-    FILE *f = fopen(file_path, "r");
-    if (!f) {
+    esp_err_t err = send_download_head(req, number, partial, start, end,
+                                       size, etag, last_modified);
+    size_t left = size ? end - start + 1 : 0;
+    while (err == ESP_OK && left > 0) {
+        size_t want = left < FILE_BROWSER_READ_BUFFER_SIZE
+                          ? left
+                          : FILE_BROWSER_READ_BUFFER_SIZE;
+        size_t n = sd_card_read_image(&reader, buf, want);
+        if (n == 0) {
+            err = ESP_FAIL;
+            break;
+        }
+        err = webserver_send_all(req, (const char *)buf, n);
+        left -= n;
+    }
+    heap_caps_free(buf);
+    sd_card_close_image(&reader);
+    if (err != ESP_OK)
+        ESP_LOGW(TAG, "Download of image %" PRIu32 " cut short", number);
+    return err;
+}
+
+// Numbers start over after an NVS reset or on another card, so the grid
+// asks for thumbnails with v=<size>-<time> of the image in the URL. Only a
+// URL whose version matches is cached for good; anything else is kept but
+// revalidated against the ETag. Cached thumbnails are sent from the httpd
+// task; making a missing one reads and decodes the whole image, so that
+// runs on a worker.
+static esp_err_t send_thumb(httpd_req_t *req, bool on_worker);
+
+static esp_err_t make_thumb_handler(httpd_req_t *req) {
+    return send_thumb(req, true);
+}
+
+static esp_err_t file_thumb_handler(httpd_req_t *req) {
+    return send_thumb(req, false);
+}
+
+static esp_err_t send_thumb(httpd_req_t *req, bool on_worker) {
+    uint32_t number;
+    image_catalog_entry_t entry;
+    char etag[40] = "";
+    char version[24] = "";
+    char query[64];
+    char requested[24] = "";
+    if (!parse_image_param(req, &number)) {
         httpd_resp_send_404(req);
         return ESP_OK;
     }
+    if (image_catalog_lookup(number, &entry) == ESP_OK) {
+        snprintf(etag, sizeof(etag),
+                 "\"t%" PRIx32 "-%" PRIx32 "-%" PRIx32 "\"", number,
+                 entry.size, entry.timestamp);
+        snprintf(version, sizeof(version), "%" PRIx32 "-%" PRIx32,
+                 entry.size, entry.timestamp);
+    }
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+        httpd_query_key_value(query, "v", requested, sizeof(requested));
+    bool immutable = version[0] && strcmp(requested, version) == 0;
+    if (header_matches(req, "If-None-Match", etag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_set_hdr(req, "ETag", etag);
+        return httpd_resp_send(req, NULL, 0);
+    }
 
-    httpd_resp_set_type(req, "application/octet-stream");
-    char disp[128];
-    snprintf(disp, sizeof(disp), "attachment; filename=\"%s\"", file_param);
-    httpd_resp_set_hdr(req, "Content-Disposition", disp);
-
-    char buf[1024];
-    size_t len;
-    while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
-        httpd_resp_send_chunk(req, buf, len);
+    sd_card_reader_t reader;
+    esp_err_t err = on_worker ? thumbnail_open(number, &reader)
+                              : sd_card_open_thumb(number, &reader);
+    if (err == ESP_ERR_NOT_FOUND && !on_worker)
+        return worker_pool_submit(req, make_thumb_handler);
+    if (err == ESP_ERR_TIMEOUT) {
+        // Readers or the decoder busy, the grid asks again
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", WORKER_POOL_RETRY_AFTER_S);
+        return httpd_resp_sendstr(req, "Server busy");
+    }
+    if (err != ESP_OK) {
+        httpd_resp_send_404(req);
+        return ESP_OK;
+    }
+    char *buf = NULL;
+    if (reader.size <= THUMBNAIL_MAX_SIZE)
+        buf = malloc(reader.size ? reader.size : 1);
+    size_t len = buf ? sd_card_read_image(&reader, buf, reader.size) : 0;
+    bool complete = buf && len == reader.size;
+    sd_card_close_image(&reader);
+    if (!complete) {
+        free(buf);
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
     }
-    fclose(f);
-    httpd_resp_send_chunk(req, NULL, 0);
 
-    return ESP_OK;
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Cache-Control",
+                       immutable ? "public, max-age=31536000, immutable"
+                                 : "no-cache");
+    if (etag[0])
+        httpd_resp_set_hdr(req, "ETag", etag);
+    err = httpd_resp_send(req, buf, len);
+    free(buf);
+    return err;
 }
 
 static const httpd_uri_t list_uri = {.uri = "/files",
@@ -75,16 +395,35 @@ static const httpd_uri_t list_uri = {.uri = "/files",
                                      .handler = file_list_handler,
                                      .user_ctx = NULL};
 
+static const httpd_uri_t api_files_uri = {.uri = "/api/files",
+                                          .method = HTTP_GET,
+                                          .handler = api_files_handler,
+                                          .user_ctx = NULL};
+
 static const httpd_uri_t download_uri = {.uri = "/files/download",
                                          .method = HTTP_GET,
                                          .handler = file_download_handler,
                                          .user_ctx = NULL};
 
+static const httpd_uri_t thumb_uri = {.uri = "/files/thumb",
+                                      .method = HTTP_GET,
+                                      .handler = file_thumb_handler,
+                                      .user_ctx = NULL};
+
 esp_err_t file_browser_init(void) {
-    esp_err_t err = webserver_add_handler(&list_uri);
+    esp_err_t err = thumbnail_init();
+    if (err != ESP_OK)
+        return err;
+    err = webserver_add_handler(&list_uri);
+    if (err != ESP_OK)
+        return err;
+    err = webserver_add_handler(&api_files_uri);
+    if (err != ESP_OK)
+        return err;
+    err = webserver_add_worker_handler(&download_uri);
     if (err != ESP_OK)
         return err;
-    err = webserver_add_handler(&download_uri);
+    err = webserver_add_handler(&thumb_uri);
     if (err == ESP_OK) {
         ESP_LOGI(TAG, "File browser handlers registered");
     }
@@ -3,6 +3,9 @@
 
 #include "esp_err.h"
 
+// Bytes read from the card per send while downloading
+#define FILE_BROWSER_READ_BUFFER_SIZE (16 * 1024)
+
 esp_err_t file_browser_init(void);
 
 #endif
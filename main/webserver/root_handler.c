@@ -1,18 +1,75 @@
 #include "root_handler.h"
 #include "esp_log.h"
+#include "image_catalog.h"
+#include "sd_card.h"
 #include "webserver/webserver.h"
+#include "webserver/worker_pool.h"
+#include <inttypes.h>
+#include <stdio.h>
 
 static const char *TAG = "webserver_root_handler";
 
+extern const uint8_t index_html_gz_start[] asm("_binary_index_html_gz_start");
+extern const uint8_t index_html_gz_end[] asm("_binary_index_html_gz_end");
+
 static esp_err_t root_get_handler(httpd_req_t *req) {
-    httpd_resp_set_type(req, "text/html");
-    const char *html = "<html><body>"
-                       "<h1>Trailcam Web Interface</h1>"
-                       "<p><a href=\"/files\">File Browser</a></p>"
-                       "<p><a href=\"/config\">Configuration</a></p>"
-                       "</body></html>";
-    httpd_resp_send(req, html, HTTPD_RESP_USE_STRLEN);
-    return ESP_OK;
+    return webserver_send_asset(req, "text/html", index_html_gz_start,
+                                index_html_gz_end);
+}
+
+static esp_err_t status_get_handler(httpd_req_t *req) {
+    char json[96];
+    snprintf(json, sizeof(json),
+             "{\"indexing\":%s,\"images\":%" PRIu32
+             ",\"next_image\":%" PRIu32 "}",
+             image_catalog_ready() ? "false" : "true", image_catalog_count(),
+             sd_card_next_image_number());
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_sendstr(req, json);
+}
+
+// Per-route counters, to see which endpoints hold the httpd task. Entry
+// i of latency_ms counts requests whose handler ran under 2^i ms, the last
+// entry those that ran longer. Worker routes only hold it for the
+// hand-off.
+static esp_err_t routes_get_handler(httpd_req_t *req) {
+    worker_pool_stats_t workers;
+    worker_pool_get_stats(&workers);
+    char json[512];
+    int n = snprintf(json, sizeof(json),
+                     "{\"workers\":{\"size\":%" PRIu32 ",\"busy\":%" PRIu32
+                     ",\"started\":%" PRIu32 ",\"rejected\":%" PRIu32
+                     "},\"routes\":[",
+                     workers.workers, workers.busy, workers.started,
+                     workers.rejected);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    if (httpd_resp_send_chunk(req, json, n) != ESP_OK)
+        return ESP_FAIL;
+
+    webserver_route_info_t info;
+    for (size_t i = 0; webserver_get_route(i, &info) == ESP_OK; i++) {
+        n = snprintf(json, sizeof(json),
+                     "%s{\"uri\":\"%s\",\"method\":\"%s\",\"worker\":%s,"
+                     "\"requests\":%" PRIu32 ",\"errors\":%" PRIu32
+                     ",\"bytes_sent\":%" PRIu64 ",\"busy_ms\":%" PRIu64
+                     ",\"latency_ms\":[",
+                     i ? "," : "", info.uri, http_method_str(info.method),
+                     info.on_worker ? "true" : "false", info.stats.requests,
+                     info.stats.errors, info.stats.bytes_sent,
+                     info.stats.busy_us / 1000);
+        for (int b = 0; b < WEBSERVER_LATENCY_BUCKETS; b++)
+            n += snprintf(json + n, sizeof(json) - n, "%s%" PRIu32,
+                          b ? "," : "", info.stats.latency[b]);
+        n += snprintf(json + n, sizeof(json) - n, "]}");
+        if (httpd_resp_send_chunk(req, json, n) != ESP_OK)
+            return ESP_FAIL;
+    }
+
+    if (httpd_resp_sendstr_chunk(req, "]}") != ESP_OK)
+        return ESP_FAIL;
+    return httpd_resp_send_chunk(req, NULL, 0);
 }
 
 static const httpd_uri_t root_uri = {.uri = "/",
@@ -20,8 +77,24 @@ static const httpd_uri_t root_uri = {.uri = "/",
                                      .handler = root_get_handler,
                                      .user_ctx = NULL};
 
+static const httpd_uri_t status_uri = {.uri = "/api/status",
+                                       .method = HTTP_GET,
+                                       .handler = status_get_handler,
+                                       .user_ctx = NULL};
+
+static const httpd_uri_t routes_uri = {.uri = "/api/routes",
+                                       .method = HTTP_GET,
+                                       .handler = routes_get_handler,
+                                       .user_ctx = NULL};
+
 esp_err_t root_handler_init(void) {
     esp_err_t err = webserver_add_handler(&root_uri);
+    if (err != ESP_OK)
+        return err;
+    err = webserver_add_handler(&status_uri);
+    if (err != ESP_OK)
+        return err;
+    err = webserver_add_handler(&routes_uri);
     if (err == ESP_OK) {
         ESP_LOGI(TAG, "Root handler registered");
     }
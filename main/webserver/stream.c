@@ -0,0 +1,304 @@
+#include "stream.h"
+#include "camera.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sd_card.h"
+#include "webserver/webserver.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+// Each frame is captured once into a slot and sent to every viewer from
+// there. A slot is referenced by each viewer sending it, and once more
+// while it is the latest frame; it is reused when the count drops to zero.
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    int64_t timestamp_us;
+    uint32_t seq;
+    uint32_t refs;
+} stream_slot_t;
+
+typedef struct {
+    bool used;
+    TaskHandle_t task; // Worker serving the viewer, woken for each frame
+} stream_viewer_t;
+
+static const char *TAG = "webserver_stream";
+static stream_config_t stream_config = {
+    .interval_ms = STREAM_DEFAULT_INTERVAL_MS,
+    .max_pending_writes = STREAM_DEFAULT_MAX_PENDING_WRITES};
+// Updated by the capture task and every viewer's worker
+static stream_stats_t stream_stats = {0};
+static portMUX_TYPE stream_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t *slot_arena = NULL;
+static stream_slot_t slots[STREAM_SLOT_COUNT];
+static stream_slot_t *latest = NULL;
+static stream_viewer_t viewers[STREAM_MAX_CLIENTS];
+static uint32_t viewer_count = 0;
+// Viewers start on different workers, so the first one claims this under
+// the lock before creating the capture task
+static bool capture_running = false;
+
+static void slot_release(stream_slot_t *slot) {
+    portENTER_CRITICAL(&stream_lock);
+    slot->refs--;
+    portEXIT_CRITICAL(&stream_lock);
+}
+
+static stream_slot_t *slot_claim(void) {
+    stream_slot_t *slot = NULL;
+    portENTER_CRITICAL(&stream_lock);
+    for (int i = 0; i < STREAM_SLOT_COUNT && !slot; i++) {
+        if (slots[i].refs == 0) {
+            slot = &slots[i];
+            slot->refs = 1;
+        }
+    }
+    portEXIT_CRITICAL(&stream_lock);
+    return slot;
+}
+
+// Makes slot the latest frame and wakes every viewer. Viewers still busy
+// with an older frame pick up whatever is latest when they are done.
+static void slot_publish(stream_slot_t *slot) {
+    TaskHandle_t wake[STREAM_MAX_CLIENTS];
+    int n = 0;
+
+    portENTER_CRITICAL(&stream_lock);
+    stream_slot_t *old = latest;
+    slot->seq = old ? old->seq + 1 : 1;
+    latest = slot;
+    if (old)
+        old->refs--;
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (viewers[i].used && viewers[i].task)
+            wake[n++] = viewers[i].task;
+    }
+    portEXIT_CRITICAL(&stream_lock);
+
+    for (int i = 0; i < n; i++)
+        xTaskNotifyGive(wake[i]);
+}
+
+static void capture_task_fn(void *arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (true) {
+        portENTER_CRITICAL(&stream_lock);
+        bool done = viewer_count == 0;
+        if (done)
+            capture_running = false;
+        portEXIT_CRITICAL(&stream_lock);
+        if (done)
+            break;
+
+        if (stream_config.interval_ms)
+            xTaskDelayUntil(&last_wake,
+                            pdMS_TO_TICKS(stream_config.interval_ms));
+        // Saved frames come first. The sensor is claimed for this one
+        // grab, so other capture modes can take it between frames and no
+        // reinit can pull the driver from under the grab.
+        if (sd_card_pending_writes() > stream_config.max_pending_writes ||
+            camera_claim(CAMERA_OWNER_STREAM) != ESP_OK) {
+            portENTER_CRITICAL(&stream_lock);
+            stream_stats.throttled++;
+            portEXIT_CRITICAL(&stream_lock);
+            vTaskDelay(pdMS_TO_TICKS(STREAM_BACKOFF_MS));
+            last_wake = xTaskGetTickCount();
+            continue;
+        }
+
+        stream_slot_t *slot = slot_claim();
+        if (!slot) {
+            camera_release(CAMERA_OWNER_STREAM);
+            vTaskDelay(pdMS_TO_TICKS(STREAM_BACKOFF_MS));
+            continue;
+        }
+
+        camera_fb_t *fb;
+        if (camera_capture(&fb) != ESP_OK) {
+            camera_release(CAMERA_OWNER_STREAM);
+            slot_release(slot);
+            vTaskDelay(pdMS_TO_TICKS(STREAM_BACKOFF_MS));
+            continue;
+        }
+        // Copied out once so the driver buffer goes straight back to the
+        // sensor, however long the viewers take
+        bool usable =
+            fb->format == PIXFORMAT_JPEG && fb->len <= STREAM_SLOT_SIZE;
+        if (usable) {
+            memcpy(slot->buf, fb->buf, fb->len);
+            slot->len = fb->len;
+            slot->timestamp_us = (int64_t)fb->timestamp.tv_sec * 1000000 +
+                                 fb->timestamp.tv_usec;
+        } else {
+            ESP_LOGW(TAG, "Frame not streamable (format %d, %zu bytes)",
+                     fb->format, fb->len);
+        }
+        esp_camera_fb_return(fb);
+        camera_release(CAMERA_OWNER_STREAM);
+
+        if (!usable) {
+            slot_release(slot);
+            vTaskDelay(pdMS_TO_TICKS(STREAM_BACKOFF_MS));
+            continue;
+        }
+        portENTER_CRITICAL(&stream_lock);
+        stream_stats.captured++;
+        portEXIT_CRITICAL(&stream_lock);
+        slot_publish(slot);
+    }
+
+    // Nobody is watching, free the latest frame for the next session
+    portENTER_CRITICAL(&stream_lock);
+    if (latest)
+        latest->refs--;
+    latest = NULL;
+    portEXIT_CRITICAL(&stream_lock);
+    ESP_LOGI(TAG, "Stream capture stopped");
+    vTaskDelete(NULL);
+}
+
+static esp_err_t send_frame(httpd_req_t *req, const stream_slot_t *slot) {
+    char head[160];
+    int len = snprintf(head, sizeof(head),
+                       "--" STREAM_BOUNDARY "\r\n"
+                       "Content-Type: image/jpeg\r\n"
+                       "Content-Length: %zu\r\n"
+                       "X-Timestamp: %" PRId64 "\r\n\r\n",
+                       slot->len, slot->timestamp_us);
+    if (webserver_send_all(req, head, len) != ESP_OK ||
+        webserver_send_all(req, (const char *)slot->buf, slot->len) !=
+            ESP_OK ||
+        webserver_send_all(req, "\r\n", 2) != ESP_OK)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+// Runs on a worker for as long as the viewer stays connected
+static esp_err_t stream_handler(httpd_req_t *req) {
+    static const char head[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: multipart/x-mixed-replace;boundary=" STREAM_BOUNDARY
+        "\r\n"
+        "Cache-Control: no-store\r\n\r\n";
+
+    stream_viewer_t *viewer = NULL;
+    bool start_capture = false;
+    portENTER_CRITICAL(&stream_lock);
+    for (int i = 0; i < STREAM_MAX_CLIENTS && !viewer; i++) {
+        if (!viewers[i].used) {
+            viewer = &viewers[i];
+            viewer->used = true;
+            viewer->task = xTaskGetCurrentTaskHandle();
+            viewer_count++;
+            start_capture = !capture_running;
+            capture_running = true;
+        }
+    }
+    portEXIT_CRITICAL(&stream_lock);
+    if (!viewer) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "5");
+        return httpd_resp_sendstr(req, "Too many viewers");
+    }
+
+    if (start_capture &&
+        xTaskCreate(capture_task_fn, "stream_capture",
+                    STREAM_CAPTURE_STACK_SIZE, NULL, STREAM_CAPTURE_PRIORITY,
+                    NULL) != pdPASS) {
+        portENTER_CRITICAL(&stream_lock);
+        capture_running = false;
+        portEXIT_CRITICAL(&stream_lock);
+        ESP_LOGE(TAG, "Failed to create stream capture task");
+    }
+    ESP_LOGI(TAG, "Viewer connected");
+
+    esp_err_t err = webserver_send_all(req, head, sizeof(head) - 1);
+    uint32_t last_seq = 0;
+    bool first = true;
+    while (err == ESP_OK) {
+        // The latest frame goes out at once, without waiting a capture
+        // interval. A wake-up left over from an earlier viewer on this
+        // worker finds nothing new and waits again.
+        bool idle = false;
+        if (!first)
+            idle = ulTaskNotifyTake(pdTRUE,
+                                    pdMS_TO_TICKS(STREAM_KEEPALIVE_MS)) == 0;
+        first = false;
+
+        portENTER_CRITICAL(&stream_lock);
+        stream_slot_t *slot = latest;
+        if (slot && (slot->seq != last_seq || idle))
+            slot->refs++;
+        else
+            slot = NULL;
+        portEXIT_CRITICAL(&stream_lock);
+        if (!slot) {
+            // Nothing captured yet. Clients skip a blank line between
+            // parts, but sending it still fails on a dead socket.
+            if (idle)
+                err = webserver_send_all(req, "\r\n", 2);
+            continue;
+        }
+
+        uint32_t skipped =
+            last_seq && slot->seq - last_seq > 1 ? slot->seq - last_seq - 1
+                                                 : 0;
+        last_seq = slot->seq;
+        err = send_frame(req, slot);
+        slot_release(slot);
+        portENTER_CRITICAL(&stream_lock);
+        stream_stats.dropped += skipped;
+        if (err == ESP_OK)
+            stream_stats.sent++;
+        portEXIT_CRITICAL(&stream_lock);
+    }
+
+    portENTER_CRITICAL(&stream_lock);
+    viewer->used = false;
+    viewer->task = NULL;
+    viewer_count--;
+    portEXIT_CRITICAL(&stream_lock);
+    ESP_LOGI(TAG, "Viewer disconnected");
+    return err;
+}
+
+static const httpd_uri_t stream_uri = {.uri = "/stream",
+                                       .method = HTTP_GET,
+                                       .handler = stream_handler,
+                                       .user_ctx = NULL};
+
+esp_err_t stream_init(const stream_config_t *config) {
+    if (slot_arena == NULL) {
+        slot_arena = heap_caps_malloc(STREAM_SLOT_COUNT * STREAM_SLOT_SIZE,
+                                      MALLOC_CAP_SPIRAM);
+        if (!slot_arena) {
+            ESP_LOGE(TAG, "Failed to allocate stream slots");
+            return ESP_ERR_NO_MEM;
+        }
+        for (int i = 0; i < STREAM_SLOT_COUNT; i++)
+            slots[i].buf = slot_arena + i * STREAM_SLOT_SIZE;
+    }
+    if (config)
+        stream_set_config(config);
+
+    esp_err_t err = webserver_add_worker_handler(&stream_uri);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Stream handler registered");
+    }
+    return err;
+}
+
+void stream_set_config(const stream_config_t *config) {
+    stream_config = *config;
+}
+
+void stream_get_stats(stream_stats_t *stats) {
+    portENTER_CRITICAL(&stream_lock);
+    *stats = stream_stats;
+    portEXIT_CRITICAL(&stream_lock);
+}
@@ -0,0 +1,43 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "esp_err.h"
+#include <stdint.h>
+
+// Each viewer holds a worker from the pool for as long as it watches
+#define STREAM_MAX_CLIENTS 3
+// Every viewer holds at most one frame, plus the latest and the one being
+// captured
+#define STREAM_SLOT_COUNT (STREAM_MAX_CLIENTS + 2)
+#define STREAM_SLOT_SIZE (128 * 1024)
+#define STREAM_CAPTURE_STACK_SIZE 4096
+#define STREAM_CAPTURE_PRIORITY 3 // Below the SD writer
+#define STREAM_BACKOFF_MS 100
+// With no new frame for this long the last one is sent again, so a viewer
+// whose client is gone gives its worker back even while capture is held off
+#define STREAM_KEEPALIVE_MS 3000
+#define STREAM_BOUNDARY "trailcamframe"
+
+#define STREAM_DEFAULT_INTERVAL_MS 100
+#define STREAM_DEFAULT_MAX_PENDING_WRITES 0
+
+typedef struct {
+    uint32_t interval_ms; // Minimum time between captures
+    // Captures are skipped while the SD writer has more jobs than this
+    // waiting, so aiming the camera never delays saved images
+    uint32_t max_pending_writes;
+} stream_config_t;
+
+typedef struct {
+    uint32_t captured;
+    uint32_t throttled; // Captures skipped for the SD writer or another mode
+    uint32_t sent;      // Frames sent, summed over viewers
+    uint32_t dropped;   // Frames a viewer was too slow to receive
+} stream_stats_t;
+
+// GET /stream, multipart MJPEG
+esp_err_t stream_init(const stream_config_t *config);
+void stream_set_config(const stream_config_t *config);
+void stream_get_stats(stream_stats_t *stats);
+
+#endif
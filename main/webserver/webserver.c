@@ -1,22 +1,383 @@
 #include "webserver.h"
 #include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "worker_pool.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 
-#define MAX_HANDLERS 10
+// Bytes sent for a route, counted on every socket send. Kept apart from
+// the table, which moves when it grows, and shared with each session
+// whose last request went to the route, so a send never looks it up.
+typedef struct {
+    uint64_t bytes_sent;
+    uint32_t refs; // The route's own, plus one per session holding it
+} route_counter_t;
+
+// httpd dispatches every request of a method to one catch-all handler,
+// which finds the route here. Routes are referred to by id from outside
+// the lock, since the table moves when it grows.
+typedef struct {
+    uint32_t id;
+    char uri[WEBSERVER_URI_MAX];
+    httpd_method_t method;
+    esp_err_t (*handler)(httpd_req_t *req);
+    void *user_ctx;
+    bool on_worker;
+    webserver_route_stats_t stats; // bytes_sent is in counter
+    route_counter_t *counter;
+} webserver_route_t;
 
 static const char *TAG = "webserver";
 static httpd_handle_t server = NULL;
-static const httpd_uri_t *handlers[MAX_HANDLERS];
-static size_t num_handlers = 0;
+static SemaphoreHandle_t route_mutex = NULL;
+static webserver_route_t *routes = NULL;
+static size_t num_routes = 0;
+static size_t route_capacity = 0;
+static uint32_t next_route_id = 1;
+static uint64_t dispatched_methods = 0; // Bit per method known to httpd
+static portMUX_TYPE counter_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_err_t dispatch(httpd_req_t *req);
+
+static route_counter_t *counter_get(route_counter_t *counter) {
+    portENTER_CRITICAL(&counter_lock);
+    counter->refs++;
+    portEXIT_CRITICAL(&counter_lock);
+    return counter;
+}
+
+// Also the free function of the session context
+static void counter_put(void *ctx) {
+    route_counter_t *counter = ctx;
+    if (!counter)
+        return;
+    portENTER_CRITICAL(&counter_lock);
+    bool last = --counter->refs == 0;
+    portEXIT_CRITICAL(&counter_lock);
+    if (last)
+        free(counter);
+}
+
+static esp_err_t register_dispatch(httpd_method_t method) {
+    if (dispatched_methods & (1ULL << method))
+        return ESP_OK;
+    httpd_uri_t uri = {.uri = "/*",
+                       .method = method,
+                       .handler = dispatch,
+                       .user_ctx = NULL};
+    esp_err_t err = httpd_register_uri_handler(server, &uri);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register %s dispatch: %s",
+                 http_method_str(method), esp_err_to_name(err));
+        return err;
+    }
+    dispatched_methods |= 1ULL << method;
+    return ESP_OK;
+}
+
+static webserver_route_t *route_by_id(uint32_t id) {
+    for (size_t i = 0; i < num_routes; i++) {
+        if (routes[i].id == id)
+            return &routes[i];
+    }
+    return NULL;
+}
+
+static webserver_route_t *route_by_uri(const char *uri,
+                                       httpd_method_t method) {
+    for (size_t i = 0; i < num_routes; i++) {
+        if (routes[i].method == method && strcmp(routes[i].uri, uri) == 0)
+            return &routes[i];
+    }
+    return NULL;
+}
+
+static esp_err_t add_route(const httpd_uri_t *uri_handler, bool on_worker) {
+    if (uri_handler->uri[0] != '/' ||
+        strlen(uri_handler->uri) >= WEBSERVER_URI_MAX ||
+        uri_handler->method >= sizeof(dispatched_methods) * 8)
+        return ESP_ERR_INVALID_ARG;
+    if (route_mutex == NULL) {
+        route_mutex = xSemaphoreCreateMutex();
+        if (route_mutex == NULL)
+            return ESP_ERR_NO_MEM;
+    }
+    if (xSemaphoreTake(route_mutex, pdMS_TO_TICKS(1000)) != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+
+    esp_err_t err = ESP_OK;
+    if (route_by_uri(uri_handler->uri, uri_handler->method)) {
+        err = ESP_ERR_HTTPD_HANDLER_EXISTS;
+        goto out;
+    }
+    if (num_routes == route_capacity) {
+        size_t capacity =
+            route_capacity ? route_capacity * 2 : WEBSERVER_ROUTES_INITIAL;
+        webserver_route_t *grown =
+            realloc(routes, capacity * sizeof(webserver_route_t));
+        if (!grown) {
+            err = ESP_ERR_NO_MEM;
+            goto out;
+        }
+        routes = grown;
+        route_capacity = capacity;
+    }
+    route_counter_t *counter = calloc(1, sizeof(route_counter_t));
+    if (!counter) {
+        err = ESP_ERR_NO_MEM;
+        goto out;
+    }
+    counter->refs = 1;
+    if (server) {
+        err = register_dispatch(uri_handler->method);
+        if (err != ESP_OK) {
+            free(counter);
+            goto out;
+        }
+    }
+
+    webserver_route_t *route = &routes[num_routes++];
+    *route = (webserver_route_t){.id = next_route_id++,
+                                 .method = uri_handler->method,
+                                 .handler = uri_handler->handler,
+                                 .user_ctx = uri_handler->user_ctx,
+                                 .on_worker = on_worker,
+                                 .counter = counter};
+    strcpy(route->uri, uri_handler->uri);
+    ESP_LOGD(TAG, "Route %s %s added", http_method_str(route->method),
+             route->uri);
+
+out:
+    xSemaphoreGive(route_mutex);
+    return err;
+}
 
 esp_err_t webserver_add_handler(const httpd_uri_t *uri_handler) {
-    if (num_handlers >= MAX_HANDLERS) {
-        ESP_LOGE(TAG, "Maximum number of handlers reached");
-        return ESP_ERR_NO_MEM;
+    return add_route(uri_handler, false);
+}
+
+esp_err_t webserver_add_worker_handler(const httpd_uri_t *uri_handler) {
+    return add_route(uri_handler, true);
+}
+
+esp_err_t webserver_remove_handler(const char *uri, httpd_method_t method) {
+    if (route_mutex == NULL)
+        return ESP_ERR_NOT_FOUND;
+    if (xSemaphoreTake(route_mutex, pdMS_TO_TICKS(1000)) != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+
+    // The method's catch-all stays with httpd and answers 404 from now on
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    webserver_route_t *route = route_by_uri(uri, method);
+    if (route) {
+        // Sessions still holding the counter keep it alive
+        counter_put(route->counter);
+        size_t index = route - routes;
+        memmove(route, route + 1,
+                (num_routes - index - 1) * sizeof(webserver_route_t));
+        num_routes--;
+        err = ESP_OK;
+    }
+    xSemaphoreGive(route_mutex);
+    return err;
+}
+
+esp_err_t webserver_get_route(size_t index, webserver_route_info_t *info) {
+    if (route_mutex == NULL)
+        return ESP_ERR_NOT_FOUND;
+    if (xSemaphoreTake(route_mutex, pdMS_TO_TICKS(1000)) != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    if (index < num_routes) {
+        strcpy(info->uri, routes[index].uri);
+        info->method = routes[index].method;
+        info->on_worker = routes[index].on_worker;
+        info->stats = routes[index].stats;
+        portENTER_CRITICAL(&counter_lock);
+        info->stats.bytes_sent = routes[index].counter->bytes_sent;
+        portEXIT_CRITICAL(&counter_lock);
+        err = ESP_OK;
+    }
+    xSemaphoreGive(route_mutex);
+    return err;
+}
+
+static int counting_send(httpd_handle_t hd, int sockfd, const char *buf,
+                         size_t buf_len, int flags) {
+    if (buf == NULL)
+        return HTTPD_SOCK_ERR_INVALID;
+    int sent = send(sockfd, buf, buf_len, flags);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return HTTPD_SOCK_ERR_TIMEOUT;
+        return errno == EINVAL ? HTTPD_SOCK_ERR_INVALID : HTTPD_SOCK_ERR_FAIL;
+    }
+
+    route_counter_t *counter = httpd_sess_get_transport_ctx(hd, sockfd);
+    if (counter) {
+        portENTER_CRITICAL(&counter_lock);
+        counter->bytes_sent += sent;
+        portEXIT_CRITICAL(&counter_lock);
+    }
+    return sent;
+}
+
+static esp_err_t dispatch(httpd_req_t *req) {
+    size_t len = strcspn(req->uri, "?");
+    uint32_t id = 0;
+    size_t best_len = 0;
+    bool other_method = false;
+    bool on_worker = false;
+    esp_err_t (*handler)(httpd_req_t *req) = NULL;
+    void *user_ctx = NULL;
+    route_counter_t *counter = NULL;
+
+    if (xSemaphoreTake(route_mutex, pdMS_TO_TICKS(1000)) != pdTRUE)
+        return httpd_resp_send_500(req);
+    for (size_t i = 0; i < num_routes; i++) {
+        webserver_route_t *route = &routes[i];
+        if (!httpd_uri_match_wildcard(route->uri, req->uri, len))
+            continue;
+        if (route->method != req->method) {
+            other_method = true;
+            continue;
+        }
+        size_t uri_len = strlen(route->uri);
+        bool exact = uri_len == len && strncmp(route->uri, req->uri, len) == 0;
+        if (exact || uri_len > best_len) {
+            id = route->id;
+            handler = route->handler;
+            user_ctx = route->user_ctx;
+            on_worker = route->on_worker;
+            counter = route->counter;
+            best_len = uri_len;
+        }
+        if (exact)
+            break;
+    }
+    if (counter)
+        counter_get(counter);
+    xSemaphoreGive(route_mutex);
+
+    if (!handler) {
+        if (other_method)
+            return httpd_resp_send_err(req, HTTPD_405_METHOD_NOT_ALLOWED,
+                                       NULL);
+        return httpd_resp_send_404(req);
+    }
+
+    req->user_ctx = user_ctx;
+    // The session counts its sends to this route, async handlers included,
+    // until its next request; httpd drops the last reference on close
+    int sockfd = httpd_req_to_sockfd(req);
+    counter_put(httpd_sess_get_transport_ctx(req->handle, sockfd));
+    httpd_sess_set_transport_ctx(req->handle, sockfd, counter, counter_put);
+    httpd_sess_set_send_override(req->handle, sockfd, counting_send);
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t err =
+        on_worker ? worker_pool_submit(req, handler) : handler(req);
+    int64_t busy_us = esp_timer_get_time() - start;
+
+    int bucket = 0;
+    while (bucket < WEBSERVER_LATENCY_BUCKETS - 1 &&
+           busy_us >= (1000LL << bucket))
+        bucket++;
+    if (xSemaphoreTake(route_mutex, pdMS_TO_TICKS(1000)) == pdTRUE) {
+        webserver_route_t *route = route_by_id(id);
+        if (route) {
+            route->stats.requests++;
+            route->stats.errors += err != ESP_OK;
+            route->stats.busy_us += busy_us;
+            route->stats.latency[bucket]++;
+        }
+        xSemaphoreGive(route_mutex);
+    }
+    return err;
+}
+
+esp_err_t webserver_send_all(httpd_req_t *req, const char *buf, size_t len) {
+    int timeouts = 0;
+    while (len > 0) {
+        int sent = httpd_send(req, buf, len);
+        if (sent < 0) {
+            // A weak link gets a few send timeouts before we give up
+            if (sent == HTTPD_SOCK_ERR_TIMEOUT &&
+                ++timeouts < WEBSERVER_SEND_RETRIES)
+                continue;
+            return ESP_FAIL;
+        }
+        timeouts = 0;
+        buf += sent;
+        len -= sent;
     }
-    handlers[num_handlers++] = uri_handler;
     return ESP_OK;
 }
 
+esp_err_t webserver_send_asset(httpd_req_t *req, const char *type,
+                               const uint8_t *start, const uint8_t *end) {
+    size_t len = end - start;
+    char etag[12];
+    char cache_control[32];
+    snprintf(etag, sizeof(etag), "\"%08" PRIx32 "\"",
+             esp_rom_crc32_le(0, start, len));
+    snprintf(cache_control, sizeof(cache_control), "public, max-age=%d",
+             WEBSERVER_ASSET_MAX_AGE_S);
+
+    char header[64];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", header,
+                                    sizeof(header)) == ESP_OK &&
+        strstr(header, etag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_set_hdr(req, "ETag", etag);
+        httpd_resp_set_hdr(req, "Cache-Control", cache_control);
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    // Head and body go out in one write, so a small page fits in one
+    // segment and Nagle never holds the body back waiting for an ACK
+    char head[256];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 200 OK\r\n"
+                            "Content-Type: %s\r\n"
+                            "Content-Encoding: gzip\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Cache-Control: %s\r\n"
+                            "ETag: %s\r\n"
+                            "Vary: Accept-Encoding\r\n\r\n",
+                            type, len, cache_control, etag);
+    char *buf = malloc(head_len + len);
+    if (!buf) {
+        if (webserver_send_all(req, head, head_len) != ESP_OK)
+            return ESP_FAIL;
+        return webserver_send_all(req, (const char *)start, len);
+    }
+    memcpy(buf, head, head_len);
+    memcpy(buf + head_len, start, len);
+    esp_err_t err = webserver_send_all(req, buf, head_len + len);
+    free(buf);
+    return err;
+}
+
+uint32_t webserver_query_u32(const char *query, const char *key,
+                             uint32_t fallback) {
+    char value[16];
+    uint32_t parsed;
+    if (query && httpd_query_key_value(query, key, value, sizeof(value)) ==
+                     ESP_OK &&
+        sscanf(value, "%" SCNu32, &parsed) == 1)
+        return parsed;
+    return fallback;
+}
+
 esp_err_t webserver_start(void) {
     if (server != NULL) {
         ESP_LOGW(TAG, "Webserver already started");
@@ -24,7 +385,8 @@ esp_err_t webserver_start(void) {
     }
 
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_uri_handlers = MAX_HANDLERS;
+    config.max_uri_handlers = WEBSERVER_MAX_METHODS;
+    config.uri_match_fn = httpd_uri_match_wildcard;
 
     esp_err_t err = httpd_start(&server, &config);
     if (err != ESP_OK) {
@@ -32,14 +394,13 @@ esp_err_t webserver_start(void) {
         return err;
     }
 
-    for (size_t i = 0; i < num_handlers; i++) {
-        err = httpd_register_uri_handler(server, handlers[i]);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to register handler for %s: %s",
-                     handlers[i]->uri, esp_err_to_name(err));
-        }
+    if (route_mutex &&
+        xSemaphoreTake(route_mutex, pdMS_TO_TICKS(1000)) == pdTRUE) {
+        for (size_t i = 0; i < num_routes; i++)
+            register_dispatch(routes[i].method);
+        xSemaphoreGive(route_mutex);
     }
-    ESP_LOGI(TAG, "Webserver started");
+    ESP_LOGI(TAG, "Webserver started with %zu routes", num_routes);
     return ESP_OK;
 }
 
@@ -53,6 +414,7 @@ esp_err_t webserver_stop(void) {
         ESP_LOGE(TAG, "Failed to stop webserver: %s", esp_err_to_name(err));
     } else {
         server = NULL;
+        dispatched_methods = 0;
         ESP_LOGI(TAG, "Webserver stopped");
     }
     return err;
@@ -3,11 +3,66 @@
 
 #include "esp_err.h"
 #include "esp_http_server.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Send timeouts tolerated in a row before a raw send gives up
+#define WEBSERVER_SEND_RETRIES 3
+// Embedded pages only change with the firmware, and the ETag catches that
+// once the age runs out
+#define WEBSERVER_ASSET_MAX_AGE_S (7 * 24 * 3600)
+
+// The route table starts this big and doubles when full
+#define WEBSERVER_ROUTES_INITIAL 8
+#define WEBSERVER_URI_MAX 48
+// httpd only sees one catch-all handler per method in use
+#define WEBSERVER_MAX_METHODS 8
+// Bucket i counts handler times under 2^i ms, the last one everything else
+#define WEBSERVER_LATENCY_BUCKETS 12
+
+typedef struct {
+    uint32_t requests;
+    uint32_t errors; // Handler returned other than ESP_OK
+    uint64_t bytes_sent;
+    uint64_t busy_us; // Time the handler held the httpd task
+    uint32_t latency[WEBSERVER_LATENCY_BUCKETS];
+} webserver_route_stats_t;
+
+typedef struct {
+    char uri[WEBSERVER_URI_MAX];
+    httpd_method_t method;
+    bool on_worker;
+    webserver_route_stats_t stats;
+} webserver_route_info_t;
 
 esp_err_t webserver_start(void);
 
 esp_err_t webserver_stop(void);
 
+// Routes can be added and removed before or after webserver_start. The uri
+// may end in '*' to match a prefix, as with httpd_uri_match_wildcard; an
+// exact route wins over a wildcard, and a longer wildcard over a shorter.
+// The handler is copied, uri_handler need not outlive the call.
 esp_err_t webserver_add_handler(const httpd_uri_t *uri_handler);
+// For handlers that may run for seconds, such as downloads and streams.
+// They run on the worker pool, and busy_us only counts the hand-off.
+esp_err_t webserver_add_worker_handler(const httpd_uri_t *uri_handler);
+esp_err_t webserver_remove_handler(const char *uri, httpd_method_t method);
+// Route at index with its stats so far, ESP_ERR_NOT_FOUND past the end
+esp_err_t webserver_get_route(size_t index, webserver_route_info_t *info);
+
+// For handlers that write their own response head, e.g. to stream a body
+// with a known Content-Length
+esp_err_t webserver_send_all(httpd_req_t *req, const char *buf, size_t len);
+
+// Sends a gzipped asset embedded at build time, or 304 when the client's
+// copy is current. Every browser takes gzip, so Accept-Encoding is not
+// checked.
+esp_err_t webserver_send_asset(httpd_req_t *req, const char *type,
+                               const uint8_t *start, const uint8_t *end);
+
+// Unsigned query parameter, or fallback when query is NULL or lacks it
+uint32_t webserver_query_u32(const char *query, const char *key,
+                             uint32_t fallback);
 
 #endif
@@ -0,0 +1,115 @@
+#include "worker_pool.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include <inttypes.h>
+#include <stdio.h>
+
+typedef struct {
+    httpd_req_t *req;
+    esp_err_t (*handler)(httpd_req_t *req);
+} worker_job_t;
+
+static const char *TAG = "webserver_workers";
+static QueueHandle_t job_queue = NULL;
+static worker_pool_stats_t pool_stats = {0};
+static portMUX_TYPE pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void worker_task_fn(void *arg) {
+    worker_job_t job;
+    while (true) {
+        xQueueReceive(job_queue, &job, portMAX_DELAY);
+
+        esp_err_t err = job.handler(job.req);
+        // What httpd does when a handler run by itself fails
+        if (err != ESP_OK)
+            httpd_sess_trigger_close(job.req->handle,
+                                     httpd_req_to_sockfd(job.req));
+        httpd_req_async_handler_complete(job.req);
+
+        portENTER_CRITICAL(&pool_lock);
+        pool_stats.busy--;
+        portEXIT_CRITICAL(&pool_lock);
+    }
+}
+
+esp_err_t worker_pool_init(const worker_pool_config_t *config) {
+    if (job_queue != NULL)
+        return ESP_OK;
+
+    uint32_t workers = config->workers;
+    if (workers == 0 || workers > WORKER_POOL_MAX_WORKERS) {
+        ESP_LOGE(TAG, "Worker count must be 1 to %d",
+                 WORKER_POOL_MAX_WORKERS);
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Never more jobs than idle workers, so a send never blocks
+    job_queue = xQueueCreate(workers, sizeof(worker_job_t));
+    if (job_queue == NULL)
+        return ESP_ERR_NO_MEM;
+
+    for (uint32_t i = 0; i < workers; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "http_worker%" PRIu32, i);
+        if (xTaskCreatePinnedToCore(worker_task_fn, name,
+                                    WORKER_POOL_STACK_SIZE, NULL,
+                                    WORKER_POOL_PRIORITY, NULL,
+                                    WORKER_POOL_CORE) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to create worker %" PRIu32, i);
+            break;
+        }
+        pool_stats.workers++;
+    }
+    if (pool_stats.workers == 0)
+        return ESP_ERR_NO_MEM;
+
+    ESP_LOGI(TAG, "%" PRIu32 " HTTP workers on core %d", pool_stats.workers,
+             WORKER_POOL_CORE);
+    return ESP_OK;
+}
+
+esp_err_t worker_pool_submit(httpd_req_t *req,
+                             esp_err_t (*handler)(httpd_req_t *req)) {
+    if (job_queue == NULL)
+        return handler(req);
+
+    portENTER_CRITICAL(&pool_lock);
+    bool idle = pool_stats.busy < pool_stats.workers;
+    if (idle) {
+        pool_stats.busy++;
+        pool_stats.started++;
+    } else {
+        pool_stats.rejected++;
+    }
+    portEXIT_CRITICAL(&pool_lock);
+    if (!idle) {
+        ESP_LOGW(TAG, "All workers busy, turning away %s", req->uri);
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", WORKER_POOL_RETRY_AFTER_S);
+        return httpd_resp_sendstr(req, "Server busy");
+    }
+
+    worker_job_t job = {.handler = handler};
+    esp_err_t err = httpd_req_async_handler_begin(req, &job.req);
+    if (err == ESP_OK && xQueueSend(job_queue, &job, 0) != pdTRUE) {
+        httpd_req_async_handler_complete(job.req);
+        err = ESP_FAIL;
+    }
+    if (err != ESP_OK) {
+        portENTER_CRITICAL(&pool_lock);
+        pool_stats.busy--;
+        portEXIT_CRITICAL(&pool_lock);
+        ESP_LOGE(TAG, "Failed to hand off %s: %s", req->uri,
+                 esp_err_to_name(err));
+        httpd_resp_send_500(req);
+        return err;
+    }
+    return ESP_OK;
+}
+
+void worker_pool_get_stats(worker_pool_stats_t *stats) {
+    portENTER_CRITICAL(&pool_lock);
+    *stats = pool_stats;
+    portEXIT_CRITICAL(&pool_lock);
+}
@@ -0,0 +1,38 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include <stdint.h>
+
+#define WORKER_POOL_MAX_WORKERS 6
+#define WORKER_POOL_STACK_SIZE 6144
+// Below the SD writer and the httpd task, so pages are answered first
+#define WORKER_POOL_PRIORITY 3
+// The camera pipeline and pre-trigger capture run on core 0
+#define WORKER_POOL_CORE 1
+#define WORKER_POOL_RETRY_AFTER_S "5"
+
+#define WORKER_POOL_DEFAULT_WORKERS 4
+
+typedef struct {
+    // Long requests served at once; the next one gets 503 until a worker
+    // is free
+    uint32_t workers;
+} worker_pool_config_t;
+
+typedef struct {
+    uint32_t workers;
+    uint32_t busy;
+    uint32_t started;
+    uint32_t rejected; // Answered 503 with every worker busy
+} worker_pool_stats_t;
+
+esp_err_t worker_pool_init(const worker_pool_config_t *config);
+// Runs handler on a worker with an async copy of req, leaving the httpd
+// task free for other requests. Before worker_pool_init it runs inline.
+esp_err_t worker_pool_submit(httpd_req_t *req,
+                             esp_err_t (*handler)(httpd_req_t *req));
+void worker_pool_get_stats(worker_pool_stats_t *stats);
+
+#endif
@@ -191,16 +191,12 @@ void wifi_deinitialize(void) {
 }
 
 esp_err_t wifi_save_credentials(const wifi_credentials_t *credentials) {
-    esp_err_t err;
-
-    err = nvs_storage_write_string(NVS_WIFI_NAMESPACE, NVS_KEY_SSID,
-                                   credentials->ssid);
-    if (err != ESP_OK) {
-        return err;
-    }
-
-    err = nvs_storage_write_string(NVS_WIFI_NAMESPACE, NVS_KEY_PASSWORD,
-                                   credentials->password);
+    nvs_storage_batch_t batch;
+    nvs_storage_batch_begin(&batch, NVS_WIFI_NAMESPACE);
+    nvs_storage_batch_set_string(&batch, NVS_KEY_SSID, credentials->ssid);
+    nvs_storage_batch_set_string(&batch, NVS_KEY_PASSWORD,
+                                 credentials->password);
+    esp_err_t err = nvs_storage_batch_end(&batch);
     if (err != ESP_OK) {
         return err;
     }
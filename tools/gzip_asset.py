@@ -0,0 +1,23 @@
+#!/usr/bin/env python3
+"""Gzips a web asset for embedding in the firmware.
+
+The timestamp and file name are left out of the gzip header so the output,
+and with it the ETag the firmware serves, only changes with the content.
+"""
+import gzip
+import sys
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: gzip_asset.py <input> <output>")
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+    with open(sys.argv[2], "wb") as out:
+        with gzip.GzipFile(filename="", mode="wb", fileobj=out, mtime=0,
+                           compresslevel=9) as gz:
+            gz.write(data)
+
+
+if __name__ == "__main__":
+    main()